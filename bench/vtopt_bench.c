@@ -0,0 +1,190 @@
+// Benchmark for the --compact output rewriter: how much smaller it makes
+// terminal output and how fast it gets through it.
+//
+// Usage: vtopt-bench [-c CHUNK] [-s COLSxROWS] [-n ROUNDS] [-o OUT] [FILE...]
+//
+// FILEs hold raw output as a tmux client writes it, for instance
+// recorded with script(1). Without them a made-up mix of full-screen
+// redraws, coloured listings and scrolling is used. OUT receives the
+// rewritten stream of the first round, to replay and compare.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "vtopt.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    uint8_t *data;
+    size_t len, cap;
+} buf_t;
+
+static void buf_add(buf_t *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+        if (!b->data) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void buf_printf(buf_t *b, const char *fmt, ...) {
+    char line[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n > (int)sizeof(line) - 1) n = sizeof(line) - 1;
+    if (n > 0) buf_add(b, line, n);
+}
+
+static int read_file(buf_t *b, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) buf_add(b, chunk, n);
+    fclose(f);
+    return 0;
+}
+
+// Pad s with spaces to width, as tmux redraws a line
+static void padded(buf_t *b, const char *s, int width) {
+    int len = (int)strlen(s);
+    buf_add(b, s, len);
+    for (; len < width; len++) buf_add(b, " ", 1);
+}
+
+// Output shaped like tmux's: it positions every redrawn line, resets
+// attributes with "ESC ( B ESC [ m" and writes blank cells as spaces
+static void synthesize(buf_t *b, int cols, int rows) {
+    char line[512];
+    unsigned seed = 1;
+
+    buf_printf(b, "\033[?1049h\033[1;%dr\033[H\033[2J", rows);
+    for (int frame = 0; frame < 200; frame++) {
+        // A process monitor redrawing the whole screen
+        buf_printf(b, "\033[1;1H\033(B\033[mtop - 12:%02d:%02d up 3 days,  load average: 0.%02u",
+                   frame / 60, frame % 60, (seed = seed * 1103515245 + 12345) % 100);
+        buf_add(b, "\033[K", 3);
+        buf_printf(b, "\033[3;1H\033[7m%-*s\033(B\033[m", cols, "    PID USER      PR  NI    VIRT    RES  %CPU COMMAND");
+        for (int r = 4; r <= rows; r++) {
+            seed = seed * 1103515245 + 12345;
+            snprintf(line, sizeof(line), "%7u root      20   0  %6u  %5u  %4.1f %s",
+                     seed % 90000, seed % 500000, seed % 90000, (seed % 1000) / 10.0,
+                     r % 3 ? "kworker/u16:2" : "sshd");
+            buf_printf(b, "\033[%d;1H", r);
+            if (r == 4) buf_add(b, "\033[1m", 4);
+            padded(b, line, cols);
+            if (r == 4) buf_add(b, "\033(B\033[m", 6);
+        }
+        buf_printf(b, "\033[%d;1H", rows);
+
+        // A coloured listing scrolling in
+        for (int r = 0; r < 10; r++) {
+            buf_printf(b, "\033[%d;1H\033[1m\033[34mdir%d\033(B\033[m  file%d.c  \033[1m\033[32mrun%d\033(B\033[m",
+                       rows, r, r, r);
+            buf_add(b, "\033[K\r\n", 5);
+        }
+
+        // Counting lines
+        for (int r = 0; r < 20; r++) buf_printf(b, "%d\033[K\r\n", frame * 20 + r);
+    }
+    buf_add(b, "\033[?1049l", 8);
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t chunk = 4096;
+    int cols = 120, rows = 40, rounds = 50;
+    const char *out_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:n:o:")) != -1) {
+        switch (opt) {
+            case 'c': chunk = strtoul(optarg, NULL, 10); break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &cols, &rows) != 2) cols = 0;
+                break;
+            case 'n': rounds = atoi(optarg); break;
+            case 'o': out_path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-c CHUNK] [-s COLSxROWS] [-n ROUNDS] [-o OUT] [FILE...]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (chunk == 0 || cols <= 0 || rows <= 0 || rounds <= 0) {
+        fprintf(stderr, "Bad chunk size, screen size or rounds\n");
+        return 1;
+    }
+
+    buf_t input = {0};
+    for (int i = optind; i < argc; i++) {
+        if (read_file(&input, argv[i]) < 0) return 1;
+    }
+    if (optind == argc) synthesize(&input, cols, rows);
+    if (input.len == 0) {
+        fprintf(stderr, "No input\n");
+        return 1;
+    }
+
+    uint8_t *out = malloc(chunk + VTOPT_SLACK);
+    if (!out) {
+        perror("malloc");
+        return 1;
+    }
+
+    FILE *save = NULL;
+    if (out_path && !(save = fopen(out_path, "wb"))) {
+        perror(out_path);
+        return 1;
+    }
+
+    size_t written = 0;
+    double start = now_s();
+    for (int round = 0; round < rounds; round++) {
+        vtopt_t *vt = vtopt_new(cols, rows);
+        if (!vt) {
+            perror("vtopt_new");
+            return 1;
+        }
+        for (size_t off = 0; off < input.len; off += chunk) {
+            size_t len = input.len - off < chunk ? input.len - off : chunk;
+            size_t n = vtopt_rewrite(vt, input.data + off, len, out);
+            if (round == 0) {
+                written += n;
+                if (save) fwrite(out, 1, n, save);
+            }
+        }
+        vtopt_free(vt);
+    }
+    double elapsed = now_s() - start;
+    if (save) fclose(save);
+
+    printf("input       %zu bytes in %zu-byte chunks, %dx%d\n", input.len, chunk, cols, rows);
+    printf("output      %zu bytes (%.1f%% of input, %.1f%% saved)\n", written,
+           100.0 * written / input.len, 100.0 - 100.0 * written / input.len);
+    printf("throughput  %.1f MB/s over %d rounds\n",
+           input.len * (double)rounds / elapsed / 1e6, rounds);
+
+    free(out);
+    free(input.data);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "worker.h"
+
+#define ARCHIVE_CHUNK_SIZE 65536   // Bytes of lines per compressed chunk
+#define ARCHIVE_SPILL_FACTOR 16    // Spill file holds up to this many memory limits
+#define ARCHIVE_READ_MAX 1048576   // Most bytes served by one request
+
+// Scrollback of one tmux session kept on the server: the lines its
+// output wrote (see lines.h), each ending in a newline, addressed by
+// byte offset into everything archived since the session was first
+// viewed. Lines fill chunks that are compressed with zlib's fastest
+// level once full. When the compressed chunks outgrow the memory limit
+// the oldest move to a spill file, if there is one, and are dropped
+// otherwise. All functions are thread-safe.
+typedef struct archive archive_t;
+
+// Create an empty archive keeping up to limit bytes of compressed
+// chunks in memory; with a spill_dir, older chunks go to an unnamed
+// file there
+// Returns NULL on error
+archive_t *archive_open(size_t limit, const char *spill_dir);
+
+// Record terminal output. Only one source (a tmux client) records at a
+// time, as for history_record()
+void archive_record(archive_t *archive, const void *source, const uint8_t *data, size_t len);
+
+// Let another source record
+void archive_release(archive_t *archive, const void *source);
+
+// Oldest byte still kept, and the offset the next line will have
+void archive_bounds(archive_t *archive, uint64_t *first, uint64_t *end);
+
+// Copy up to size bytes from offset on into out. An offset older than
+// what is kept is moved up to the oldest byte kept.
+// Returns the bytes copied, or -1 on error
+ssize_t archive_read(archive_t *archive, uint64_t *offset, uint8_t *out, size_t size);
+
+// A read for the reader thread: from offset on, up to size bytes into
+// out; once done, offset is where it started and copied what
+// archive_read() returned
+typedef struct {
+    uint64_t offset;
+    uint8_t *out;
+    size_t size;
+    ssize_t copied;
+} archive_request_t;
+
+// Run archive_read() on the reader thread, which takes one read at a
+// time; then post done(worker, arg) to the worker. The archive and req
+// must stay until done runs.
+// Returns 0 on success, -1 on error
+int archive_read_post(archive_t *archive, archive_request_t *req, worker_t *worker,
+                      void (*done)(worker_t *worker, void *arg), void *arg);
+
+// Stop the reader thread; reads still queued are posted unread, with
+// copied -1
+void archive_read_stop(void);
+
+void archive_close(archive_t *archive);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include "client.h"
+
+// Channels of a multiplexed connection (/mux): each is a client_t with
+// a terminal of its own whose output goes out on its parent connection,
+// tagged with its id.
+
+// Handle the frames of a multiplexed connection: binary frames carry a
+// channel id and input for it, text frames are JSON about a channel
+// Returns the bytes consumed, or -1 once the client has been closed
+ssize_t process_mux_frames(client_t *client, uint8_t *data, size_t len);
+
+// Take a channel off its connection, telling the browser unless the
+// connection is closing too
+void channel_unlink(client_t *channel);
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include "server.h"
+#include "worker.h"
+#include "pool.h"
+#include "terminal.h"
+#include "hub.h"
+#include "listener.h"
+#include "trace.h"
+#include "warm.h"
+#include "vtopt.h"
+#include "websocket.h"
+
+#define BUFFER_SIZE 65536
+#define RESIZE_QUIET_MS 100   // A resize waits until the size settles this long
+#define LISTENER_SLOTS (MAX_LISTENERS + 1)  // Listen addresses plus the control socket
+#define OUTPUT_CHUNK (POOL_BUF_CAPACITY - WS_MAX_HEADER)  // Output frame payload
+#define CHANNEL_CHUNK (OUTPUT_CHUNK - 1)  // Channel output frame payload, after the id
+#define IDLE_TIMEOUT_MS 60000  // An upload or a response may stall this long
+
+// Connections to the server and the per-worker state they live in. A
+// connection belongs to the worker that accepted it (or adopted it on
+// upgrade), and all of these functions run on that worker. Requests are
+// parsed and dispatched in server.c, which also has the socket and
+// terminal event handlers declared last; shared terminals are in feed.c,
+// the HTTP endpoints in endpoints.c and files.c, channels of a
+// multiplexed connection in channels.c and the handover on upgrade in
+// upgrade.c.
+
+// A configured listen address. TCP listeners get a socket per worker;
+// a Unix socket is shared and polled with EPOLLEXCLUSIVE
+typedef struct {
+    listen_addr_t addr;
+    int port;                         // TCP port in use
+    int shared_fd;                    // Unix socket, -1 for TCP
+    int control;                      // Takes file offers from helpers (--transfer)
+} server_listener_t;
+
+// Per-worker server state; the worker must stay the first member
+typedef struct {
+    worker_t worker;
+    int listen_fds[LISTENER_SLOTS];   // Indexed like listeners[]
+    watcher_t accept_watchers[LISTENER_SLOTS];
+    struct client *clients;           // Connections owned by this worker
+    slab_t client_slab;               // client_t objects
+    slab_t ref_slab;                  // Queue entries referring to shared frames
+    struct feed *feeds;               // Shared terminals homed on this worker
+    struct orphan *orphans;           // Hung-up tmux clients yet to exit
+    uint64_t last_serial;             // Last serial given to a waiting client
+    warm_pool_t *warm;                // Spare tmux clients (--warm), NULL if off
+    buf_pool_t buffers;               // I/O buffers lent to connections
+    char read_buf[BUFFER_SIZE];       // Scratch space for socket and terminal reads
+    uint8_t vt_buf[BUFFER_SIZE + VTOPT_SLACK];  // Rewritten output (--compact)
+} server_worker_t;
+
+// Input the terminal has not taken yet, in pool buffers of the worker
+// that writes it
+typedef struct {
+    pool_buf_t *head, *tail;
+    size_t bytes;
+} pty_queue_t;
+
+typedef enum {
+    CLIENT_HTTP,        // Waiting for the request headers
+    CLIENT_WEBSOCKET,   // Streaming a terminal
+    CLIENT_UPLOAD,      // Writing a request body to a file (--transfer)
+    CLIENT_WAITING,     // Waiting for another thread's answer to reply with
+    CLIENT_CLOSING      // Closing once queued output is written
+} client_state_t;
+
+// A file on its way to or from the browser (--transfer)
+typedef struct {
+    int fd;
+    off_t pos, end;            // Next byte to send or write, and where to stop
+    char *partial;             // Upload's file, removed if the upload is cut short
+} file_transfer_t;
+
+// Client connection state
+typedef struct client {
+    watcher_t sock;            // Socket, registered with the owning worker
+    watcher_t pty;             // Terminal master, same worker
+    watcher_t child;           // Terminal's pidfd, same worker
+    watcher_t probe_out;       // Answer of the echo mode probe, same worker
+    wheel_timer_t timer;       // Next handshake, idle or liveness check
+    server_worker_t *owner;
+    struct client *prev, *next;
+    client_state_t state;
+    uint64_t serial;           // Finds the client again after waiting, 0 until it needed one
+    int socket_fd;
+    terminal_t terminal;
+    int websocket_ready;
+    hub_t *hub;                // Holds a reference, NULL until attached
+    const char *session_name;
+    char *session_copy;        // session_name when the client owns it, else NULL
+    char client_ip[INET6_ADDRSTRLEN];
+    int local;                 // Came in over a Unix socket, e.g. from a proxy
+    int routed;                // Came over a gateway link (--agent)
+    int control;               // Came in on the control socket (--transfer)
+    file_transfer_t *transfer; // Download or upload in progress, NULL if none
+    uint64_t heard_ms;         // When the socket last had data
+    uint64_t ping_ms;          // When the last ping went out, 0 if none did
+    size_t stalled_backlog;    // Bytes left to deliver at the last check while closing
+    uint8_t *in_data;          // Unprocessed input, NULL while there is none
+    size_t in_len;
+    size_t in_cap;
+    pool_buf_t *in_pooled;     // Pool buffer behind in_data, NULL if on the heap
+    pty_queue_t input;         // Input waiting for the terminal to take it
+    int input_paused;          // Not reading the socket until the terminal catches up
+    uint32_t input_seq;        // Input frames written to the terminal
+    uint32_t echo_seq;         // Last input sequence reported to the client
+    int predict;               // Prediction mode last sent to the client
+    uint64_t predict_checked;  // When the echo mode was last checked (ms)
+    echo_probe_t probe;        // Echo mode check under way, if probe.pid is set
+    pool_buf_t *out_head;      // Output waiting for the socket, oldest first
+    pool_buf_t *out_tail;
+    pool_buf_t *out_raw;       // Buffer holding non-frame bytes, if queued
+    size_t out_bytes;          // Bytes queued and not yet written
+    int splice_pipe[2];        // Output on its way to the socket (--splice), -1 if unused
+    uint8_t splice_header[WS_MAX_HEADER];  // Unsent part of the spliced frame's header
+    size_t splice_header_len;
+    size_t splice_pending;     // Payload of the spliced frame still in the pipe
+    uint32_t pace_limit;       // Unsent bytes the kernel may hold, 0 until measured
+    uint64_t pace_checked;     // When the link was last measured (ms)
+    uint64_t pace_acked;       // Bytes the peer had acknowledged by then
+    int pace_off;              // Not paced: not TCP, or the kernel can't
+    int cols, rows;            // Terminal size reported by the browser
+    int resize_pending;        // Size not yet passed to the terminal
+    uint64_t resize_seen;      // When the browser last reported a size
+    int resyncing;             // Redraw requested, backlog not yet drained
+    int dirty;                 // Output dropped while resyncing or hidden
+    int hidden;                // Browser reports the page hidden
+    vtopt_t *vt;               // Output rewriter (--compact), NULL if off
+    uint32_t trace_id;         // Connection id in traces (--trace), 0 until first used
+    uint32_t trace_seq;        // Input whose output frame is being written
+    size_t trace_unsent;       // Bytes to write before that frame is out
+    int mux;                   // Carries channels (/mux) instead of one terminal
+    struct client *channels;   // Its open channels, newest first
+    int channel_count;
+    struct client *parent;     // Connection carrying this channel, NULL if not one
+    struct client *sibling;    // Next channel on the same connection
+    int channel;               // Id of this channel on its connection
+    size_t unacked;            // Output the browser has not acknowledged drawing
+    int acking;                // Browser acknowledges output it has drawn
+} client_t;
+
+// A tmux client that was hung up and has not exited yet
+typedef struct orphan {
+    watcher_t child;           // pidfd, registered with the worker that closed it
+    terminal_t terminal;
+    struct orphan *prev, *next;
+} orphan_t;
+
+// Server state (server.c); set up before the workers start
+extern const server_config_t *server_config;
+extern server_listener_t listeners[LISTENER_SLOTS];
+extern int listener_count;
+extern server_worker_t *workers;
+extern int worker_count;
+
+// Set once a terminal has no pidfd; its exit is then found by checking
+// on SIGCHLD
+extern atomic_int reap_on_sigchld;
+
+// Queue bytes that are not WebSocket frames (HTTP responses)
+int client_queue_raw(client_t *client, const void *data, size_t len);
+
+// Queue a WebSocket frame for the client; len is at most OUTPUT_CHUNK,
+// or CHANNEL_CHUNK for output of a channel
+int client_send_frame(client_t *client, uint8_t opcode, const uint8_t *data, size_t len);
+int client_send_text(client_t *client, const char *text, size_t len);
+
+// Queue a frame shared with other viewers without copying it
+int client_queue_shared(client_t *client, shared_buf_t *frame);
+
+// Bytes queued and not yet handed to the socket
+size_t client_pending(client_t *client);
+
+// Output the client hasn't received yet, ours and the kernel's; for a
+// channel, what the browser has not yet acknowledged drawing
+size_t client_backlog(client_t *client);
+
+// Take bytes the browser reports drawn off the output it owes us
+void client_ack(client_t *client, size_t bytes);
+
+// Nobody is looking: the page, or the tiled page holding the channel,
+// is in a background tab
+int client_hidden(client_t *client);
+
+// Backlog allowed before the client is resynced: one screenful
+size_t client_flood_limit(client_t *client);
+
+// Decide whether len more bytes of output go to the client, resyncing
+// it if it fell too far behind
+// Returns 1 to queue the output, 0 to drop it
+int client_admit_output(client_t *client, size_t len);
+
+// Queue terminal output, dropping it for clients that fell too far
+// behind; with --compact it is rewritten shorter first
+int client_send_output(client_t *client, const uint8_t *data, size_t len);
+
+// Write as much queued output as the socket should take without
+// blocking, paced to the link
+// Returns 0 on success, -1 on error
+int client_flush(client_t *client);
+
+// Send what the socket takes now and wait for writability if needed;
+// a channel's go out on its connection
+int client_send_pending(client_t *client);
+
+// Finish a resync once the redraw has mostly reached the client, and
+// redraw again if output was dropped in the meantime
+void client_check_resync(client_t *client);
+
+// The browser hid or showed the page; once shown, whatever was dropped
+// meanwhile is redrawn
+void client_set_hidden(client_t *client, int hidden);
+
+// Record a stage of the client's input seq (--trace)
+void client_trace(client_t *client, trace_type_t type, uint32_t seq);
+
+// Output reflecting input seq is queued; it is out once everything
+// queued so far is
+void client_trace_queued(client_t *client, uint32_t seq);
+
+// Stop an echo mode check still under way
+void client_probe_cancel(client_t *client);
+
+// Write queued input until the terminal is full
+// Returns 0 on success, -1 if the terminal is gone
+int pty_queue_flush(pty_queue_t *q, buf_pool_t *pool, terminal_t *term);
+
+// Give input to the terminal, queueing what it can't take now behind
+// what is already waiting
+// Returns 0 on success, -1 if the terminal is gone or out of memory
+int pty_queue_write(pty_queue_t *q, buf_pool_t *pool, terminal_t *term,
+                    const uint8_t *data, size_t len);
+void pty_queue_clear(pty_queue_t *q, buf_pool_t *pool);
+
+// Wait for room in the terminal while input is queued
+void pty_queue_watch(pty_queue_t *q, watcher_t *pty);
+
+// Write keyboard input to the terminal, the input of all frames from
+// one read at once. Input the terminal can't take yet waits for it;
+// once too much waits, the socket is not read until it catches up
+void client_input(client_t *client, const uint8_t *data, size_t len);
+
+// Events to watch the socket for; any channel behind on input holds up
+// the whole connection
+uint32_t client_sock_events(client_t *client);
+
+// Pass the browser's size on to the terminal
+void client_apply_size(client_t *client);
+
+// The browser reported its size; see RESIZE_QUIET_MS
+void client_resize(client_t *client, int cols, int rows);
+
+// Drop the unprocessed input and its buffer
+void client_in_release(client_t *client);
+
+// Make room for need bytes of input (plus a terminating NUL), borrowing
+// a pool buffer, or a heap block for oversized frames
+int client_in_reserve(client_t *client, size_t need);
+
+// Queue an HTTP response with extra header lines, each ending in CRLF,
+// and close once it is written
+void send_http_reply(client_t *client, int status_code, const char *status_text,
+                     const char *content_type, const char *headers,
+                     const char *body, size_t body_len);
+
+// Queue an HTTP response and close once it is written
+void send_http_response(client_t *client, int status_code, const char *status_text,
+                        const char *content_type, const char *body, size_t body_len);
+
+// Queue the WebSocket upgrade response
+int send_ws_upgrade_response(client_t *client, const char *accept_key);
+
+// Copy s into out, decoding %XX escapes; in a query value, + is a
+// space and & ends it
+void url_decode(const char *s, int query, char *out, size_t size);
+
+// Copy the URL-decoded value of a query string parameter into out
+// Returns 0 if it is there, -1 if not
+int query_param(const char *query, const char *name, char *out, size_t size);
+
+// Park a client until another thread's answer comes back, for up to
+// IDLE_TIMEOUT_MS
+// Returns the serial the answer finds it by
+uint64_t client_wait(client_t *client);
+
+// The serial another thread's answer finds the client by, without
+// parking it
+uint64_t client_serial(client_t *client);
+
+// The client of the worker with serial, or NULL if it is gone
+client_t *client_find(server_worker_t *sw, uint64_t serial);
+
+// The client of the worker still waiting under serial, ready to reply,
+// or NULL if it is gone
+client_t *client_resume(server_worker_t *sw, uint64_t serial);
+
+// Write what a resumed client queued, and close it if it is all out
+void client_resumed(client_t *client);
+
+// Watch a terminal's pidfd, or fall back to checking on SIGCHLD
+void watch_child(server_worker_t *sw, watcher_t *child, terminal_t *term, watcher_cb cb);
+
+// Hang up a terminal (the caller has stopped watching it) and reap its
+// tmux client once it exits, so none is left a zombie
+void release_terminal(server_worker_t *sw, terminal_t *term);
+void on_orphan_exit(watcher_t *watcher, uint32_t events);
+void orphan_free(server_worker_t *sw, orphan_t *orphan);
+
+// Keep spares for the served session from the start (--warm)
+void warm_start(server_worker_t *sw);
+
+// Start checking on a connection, first for its request headers
+void client_start_timer(client_t *client);
+
+// Close a connection and everything it holds; channels close with it
+void client_close(client_t *client);
+
+// Attach a client that switched to WebSocket to its session: join the
+// hub of the shared terminal, or start a tmux client of its own
+// Returns 0 on success, -1 on error
+int client_attach(client_t *client);
+void on_client_socket(watcher_t *watcher, uint32_t events);
+void on_client_pty(watcher_t *watcher, uint32_t events);
+
+// The tmux client exited
+void on_client_child(watcher_t *watcher, uint32_t events);
+
+// Periodic housekeeping for the worker's clients
+void worker_tick(worker_t *worker);
+
+// Open the worker's own TCP sockets where it has none yet, and watch
+// all listeners
+// Returns 0 on success, -1 on error
+int watch_listeners(server_worker_t *sw);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef ENDPOINTS_H
+#define ENDPOINTS_H
+
+#include "client.h"
+
+// HTTP endpoints beside the terminal itself; each queues its response
+// and closes the client once it is written, or parks the client with
+// client_wait() while another thread works on the answer.
+
+// Report connection and buffer memory summed over all workers
+void send_stats(client_t *client);
+
+// Search the session's output history: q is the text to find, limit
+// the number of matches (newest first) and before a time in ms to page
+// back from. The search thread reads only the chunks whose trigrams can
+// match, and the client waits for it off the event loop.
+void send_search(client_t *client, const char *query);
+
+// Latency of recent keystrokes, stage by stage, as Chrome trace-event
+// JSON for chrome://tracing or Perfetto
+void send_trace(client_t *client);
+
+// The screen of a session (s, else the one served) as text, ANSI or
+// HTML (format). The ETag is the snapshot's version, so a client that
+// has the current screen gets a 304 without anything being copied.
+void send_snapshot(client_t *client, const char *request, const char *query);
+
+// A session's scrollback (s, else the one served), as lines of text.
+// Offsets count from the first line archived, so a page scrolling up
+// asks for the bytes before the oldest it has; what is no longer kept
+// is skipped. Without a range, the newest lines come back.
+void send_archive(client_t *client, const char *request, const char *query);
+
+// Agents connected to this gateway
+void send_hosts(client_t *client);
+
+// The one range of a body of size bytes the request asks for:
+// "bytes=A-B", "bytes=A-" or the last N, "bytes=-N". A list of ranges
+// counts as none.
+// Returns 1 with the range in start and last, 0 for the whole body, or
+// -1 if the range lies past the end
+int request_range(const char *request, long long size, long long *start,
+                  long long *last);
+
+#endif
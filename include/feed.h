@@ -0,0 +1,43 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include "client.h"
+
+// A tmux client shared by every viewer of a session (--shared). It lives
+// on the hub's home worker; its output is framed once and each viewer
+// queues a reference to the same frame.
+typedef struct feed {
+    watcher_t pty;             // Terminal master, home worker
+    watcher_t child;           // Terminal's pidfd, home worker
+    terminal_t terminal;
+    pty_queue_t input;         // Viewers' input waiting for the terminal
+    vtopt_t *vt;               // Output rewriter (--compact), NULL if off
+    wheel_timer_t redraw;      // Redraw held back, home worker
+    uint64_t redraw_ms;        // When tmux was last asked to redraw
+    hub_t *hub;                // Holds a reference
+    struct feed *prev, *next;  // Feeds on the home worker
+} feed_t;
+
+// Viewer count changed, on the hub's home worker: the first viewer
+// attaches the shared tmux client, a newcomer gets a full redraw, and
+// the last one to leave detaches it
+void on_hub_change(hub_t *hub, int delta);
+
+// Hand a viewer's input, size or redraw request to the hub's home
+// worker; callable from any worker. Redraws repaint every viewer, so
+// they come at most every FEED_REDRAW_MS.
+void feed_input(hub_t *hub, const uint8_t *data, size_t len);
+void feed_resize(hub_t *hub, int cols, int rows);
+void feed_redraw(hub_t *hub);
+
+// Watchers of the shared tmux client, for adopting it on upgrade
+void on_feed_pty(watcher_t *watcher, uint32_t events);
+void on_feed_child(watcher_t *watcher, uint32_t events);
+
+// The shared tmux client went away; so do its viewers
+void feed_end(feed_t *feed);
+
+// Detach the shared tmux client and free the feed, on its home worker
+void feed_close(feed_t *feed);
+
+#endif
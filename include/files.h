@@ -0,0 +1,21 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include "client.h"
+
+// File transfer to and from the browser (--transfer), for offers made
+// with transfer_offer().
+
+// A helper in a session offers a file to download, or a place to upload
+// one to (/offer?kind=send|receive&path=PATH&session=NAME, on the
+// control socket). The session's viewers hear of it
+void send_offer(client_t *client, const char *query);
+
+// /files/TOKEN[/NAME]: fetch an offered file, or upload one
+void serve_files(client_t *client, const char *request, const char *path);
+
+// Write body bytes of an upload, and reply once all are there
+// Returns the bytes taken
+size_t client_upload(client_t *client, const uint8_t *data, size_t len);
+
+#endif
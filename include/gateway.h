@@ -0,0 +1,66 @@
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "worker.h"
+
+#define GATEWAY_WINDOW 262144       // Bytes a stream may have in flight each way
+#define GATEWAY_MUX_OUT_MAX 1048576 // Queued on a link before its streams stop reading
+#define GATEWAY_RETRY_MS 2000       // Agent redial interval
+#define GATEWAY_NAME_MAX 64         // Longest agent name, terminator included
+#define GATEWAY_TOKEN_ENV "OATMUX_GATEWAY_TOKEN"  // Shared secret, if set
+#define GATEWAY_TOKEN_MAX 256       // Longest token, terminator included
+
+// Gateway mode (--gateway): agents (--agent) dial in and carry every
+// connection to them as a stream over one link, with per-stream credit
+// so a slow viewer only stalls itself. The gateway routes requests for
+// /HOST/SESSION/... to agent HOST and relays the bytes untouched; the
+// agent hands each stream to its server as a local connection that
+// names SESSION in an X-Oatmux-Session header.
+//
+// Links and streams live on one worker each; the functions below are
+// thread-safe unless noted.
+
+// Called on a worker with the local end of a new stream, to be served
+// like an accepted Unix socket connection
+typedef void (*gateway_accept_cb)(worker_t *worker, int fd);
+
+// Use these workers, whose ids are their indexes, for links; accept
+// serves streams arriving at an agent. Call before anything else.
+void gateway_setup(worker_t **workers, int count, gateway_accept_cb accept);
+
+// Accept agents on a listen spec (see listen_addr_parse()), watched by
+// worker. Without a token only a loopback address or Unix socket is
+// accepted, as anyone who can connect could take over an agent's name.
+// Not thread-safe
+// Returns 0 on success, -1 on error
+int gateway_listen(worker_t *worker, const char *spec);
+
+// Dial a gateway at HOST:PORT or unix:/path as agent name from worker,
+// redialling whenever the link drops; the address is resolved now.
+// Not thread-safe
+// Returns 0 on success, -1 on error
+int gateway_agent_start(worker_t *worker, const char *addr, const char *name);
+
+// Hand a browser connection to agent host, forwarding head, the request
+// as the agent should see it, first. Once handed over, the fd belongs to
+// the link, which closes it if it drops before the stream opens.
+// Returns 0 on success, -1 if no such agent is connected (fd untouched)
+int gateway_route(const char *host, int fd, const uint8_t *head, size_t len);
+
+// Connected agents as {"hosts":[...]}, malloc'd; *len gets its length
+// Returns NULL on allocation failure
+char *gateway_hosts(size_t *len);
+
+// Redial lost links; call from the worker's tick
+void gateway_tick(worker_t *worker);
+
+// Close the worker's links and streams; call on the worker before it stops
+void gateway_shutdown(worker_t *worker);
+
+// Stop listening for agents and free what gateway_setup() allocated,
+// once the workers have stopped
+void gateway_cleanup(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HANDOFF_ENV "OATMUX_HANDOFF_FD"  // Tells a successor where its predecessor is
+#define HANDOFF_MAX_FDS 4                // Descriptors per message
+
+// Start exe with argv as our successor, connected by a socket whose
+// number it finds in HANDOFF_ENV; *pid gets the successor's pid
+// Returns our end of the socket, or -1 on error
+int handoff_spawn(const char *exe, char *const argv[], pid_t *pid);
+
+// The socket to the process that started us, or -1 if there is none
+int handoff_inherited(void);
+
+// Wait up to timeout_ms for a message to arrive
+// Returns 1 if one is ready, 0 on timeout, -1 on error
+int handoff_wait(int sock, int timeout_ms);
+
+// Send one message with up to HANDOFF_MAX_FDS descriptors attached
+// Returns 0 on success, -1 on error
+int handoff_send(int sock, const void *data, size_t len, const int *fds, int fd_count);
+
+// Receive one message of at most size bytes and the descriptors sent
+// with it; *fd_count is set to their number
+// Returns the message length, or -1 on error or if the peer is gone
+ssize_t handoff_recv(int sock, void *data, size_t size, int *fds, int *fd_count);
+
+// Send or receive a block of bytes of any length as a series of messages
+// Returns 0 on success, -1 on error
+int handoff_send_bytes(int sock, const void *data, size_t len);
+int handoff_recv_bytes(int sock, void *data, size_t len);
+
+#endif
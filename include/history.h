@@ -0,0 +1,59 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "worker.h"
+
+#define HISTORY_CHUNK_SIZE 131072  // Bytes of history per indexed chunk
+#define HISTORY_BLOOM_BITS 65536   // Trigram filter bits per chunk
+
+// Output history of one tmux session, kept as plain text lines in
+// DIR/<session>.history, one "<ms>\t<text>" per line. The file is cut
+// into chunks of whole lines, each with a filter of the trigrams it
+// holds, so a search only reads the chunks that can match. All
+// functions are thread-safe.
+typedef struct history history_t;
+
+// Open or create the history of a session, indexing what it holds
+// Returns NULL on error
+history_t *history_open(const char *dir, const char *session);
+
+// Record terminal output, parsed into lines as lines.h describes. Only
+// one source (a tmux client) records at a time: the first to send
+// output after the previous one released it.
+void history_record(history_t *history, const void *source, const uint8_t *data, size_t len);
+
+// Let another source record
+void history_release(history_t *history, const void *source);
+
+// Called for each match, newest first; return nonzero to stop
+typedef int (*history_match_cb)(uint64_t ms, const char *line, size_t len, void *arg);
+
+// Find lines older than before_ms (0 for any) containing query, ignoring
+// ASCII case
+// Returns the number of matches reported
+size_t history_search(history_t *history, const char *query, uint64_t before_ms,
+                      history_match_cb cb, void *arg);
+
+// Run history_search() on the search thread, which takes one search at
+// a time, calling cb there; then post done(worker, arg) to the worker.
+// The history must stay open until done runs.
+// Returns 0 on success, -1 on error
+int history_search_post(history_t *history, const char *query, uint64_t before_ms,
+                        history_match_cb cb, worker_t *worker,
+                        void (*done)(worker_t *worker, void *arg), void *arg);
+
+// Stop the search thread; searches still queued are posted unsearched
+void history_search_stop(void);
+
+// Lines and bytes of history held
+void history_size(history_t *history, uint64_t *lines, uint64_t *bytes);
+
+// Write out pending lines, e.g. before another process takes over
+void history_flush(history_t *history);
+
+// Flush and free
+void history_close(history_t *history);
+
+#endif
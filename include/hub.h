@@ -0,0 +1,73 @@
+#ifndef HUB_H
+#define HUB_H
+
+#include "worker.h"
+#include "history.h"
+#include "archive.h"
+#include "snapshot.h"
+
+// Per-session state shared by all viewers of a tmux session. A hub lives
+// on its home worker; other workers hand it work with worker_post()
+// instead of touching it directly. Whoever keeps a hub, a viewer or a
+// task posted with it, holds a reference; one nobody has held for a
+// while is freed.
+typedef struct hub {
+    char *name;          // tmux session name
+    worker_t *home;      // Worker that owns the hub's state
+    int viewers;         // Connected viewers (home worker only)
+    int *worker_viewers; // Viewers per worker, indexed by worker id (home only)
+    void *feed;          // Owner's shared per-session state (home only)
+    history_t *history;  // Output history, NULL if not kept (thread-safe)
+    archive_t *archive;  // Scrollback, NULL if not kept (thread-safe)
+    snapshot_t *snapshot; // Screen served at /snapshot (thread-safe)
+    atomic_size_t input_queued;  // Input waiting for the shared terminal
+    int refs;            // References held, under the hubs' lock
+    uint64_t idle_ms;    // When the last reference went, 0 while held
+    struct hub *next;
+} hub_t;
+
+// Called on the home worker once a viewer joined (delta 1) or left (-1)
+typedef void (*hub_change_cb)(hub_t *hub, int delta);
+
+// Spread hubs over these workers, whose ids are their indexes; call
+// before hub_get(). on_change may be NULL; with a history_dir, each
+// session keeps its output history there, and with an archive_limit
+// its scrollback (see archive_open())
+void hub_setup(worker_t **workers, int count, hub_change_cb on_change,
+               const char *history_dir, size_t archive_limit, const char *archive_dir);
+
+// Find or create the hub for a session and take a reference to it
+// (thread-safe). Only for sessions tmux has: each hub keeps a snapshot,
+// and the session's history and scrollback if they are kept.
+// Returns NULL on allocation failure
+hub_t *hub_get(const char *name);
+
+// Find the hub of a session, without creating one, and take a reference
+// to it (thread-safe)
+// Returns NULL if the session has none
+hub_t *hub_find(const char *name);
+
+// Take another reference, e.g. for a task posted with the hub
+// (thread-safe)
+void hub_ref(hub_t *hub);
+
+// Drop a reference, freeing hubs nobody has held for a while and
+// writing out their history (thread-safe)
+void hub_put(hub_t *hub);
+
+// Announce a viewer on worker from joining or leaving; the hub is kept
+// until the announcement is handled (thread-safe)
+void hub_join(hub_t *hub, worker_t *from, const char *client_ip);
+void hub_leave(hub_t *hub, worker_t *from, const char *client_ip);
+
+// Count a viewer taken over from a previous server process, without
+// announcing it (thread-safe)
+void hub_adopt(hub_t *hub, worker_t *from);
+
+// Write out every session's pending history
+void hub_flush(void);
+
+// Free all hubs, referenced or not, once the workers have stopped
+void hub_cleanup(void);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef LINES_H
+#define LINES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINES_MAX_LEN 1024   // Longer lines are cut
+#define LINES_RECENT 256     // Recent lines a repeat is ignored against
+#define LINES_ROWS 4096      // Rows followed at most; a screen's bottom past it is unknown
+
+// Called with each line of text the output finished, without escapes
+// or a newline
+typedef void (*lines_cb)(const char *text, size_t len, void *arg);
+
+// Turns a tmux client's output back into the lines it wrote. Escape
+// sequences are stripped and cursor movement to another line ends the
+// current one. Blank lines are left out, and so are repeats of lines
+// seen recently: with dedupe, any of them; without, only those drawn
+// while tmux repaints the screen, from the cursor going home until the
+// screen scrolls or a line not seen recently turns up. Not thread-safe.
+typedef struct {
+    lines_cb cb;
+    void *arg;
+    int dedupe;
+    int state;
+    unsigned csi_param[2];        // First two CSI parameters, 0 if left out
+    int csi_count;                // Parameters begun
+    int csi_private;              // Sequence has a private marker (?, >, =, <)
+    char line[LINES_MAX_LEN];
+    size_t line_len, col;
+    unsigned row;                 // Cursor row, 0-based
+    unsigned top, bottom;         // Scroll region
+    int repaint;                  // Redrawing what is on screen already
+    uint32_t recent[LINES_RECENT];
+    size_t recent_next;
+} lines_t;
+
+void lines_init(lines_t *lines, lines_cb cb, void *arg, int dedupe);
+
+// Start over on output from another source, mid-line and mid-sequence
+// state dropped
+void lines_reset(lines_t *lines);
+
+// Parse output, calling back for each line it finishes
+void lines_feed(lines_t *lines, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// An address to accept connections on
+typedef struct {
+    int family;                       // AF_INET, AF_INET6 or AF_UNIX
+    struct sockaddr_storage addr;     // Port left at 0 for TCP
+    socklen_t addr_len;
+    int port;                         // Port from the spec, 0 to use the default
+    int v6only;                       // Refuse IPv4-mapped connections on ::
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} listen_addr_t;
+
+// Parse a listen spec: "ADDR", "ADDR:PORT", "[V6ADDR]:PORT", a bare IPv6
+// address, or "unix:/path". Returns 0 on success, -1 if invalid
+int listen_addr_parse(const char *spec, listen_addr_t *la);
+
+// Whether la is the IPv4 or IPv6 wildcard address
+int listen_addr_is_any(const listen_addr_t *la);
+
+// Whether only this machine can connect to la: a loopback address or a
+// Unix socket
+int listen_addr_is_local(const listen_addr_t *la);
+
+// Bind and listen on a TCP address; SO_REUSEPORT is set so each worker
+// can open its own socket on the same port
+// Returns the socket, or -1 with errno set
+int listen_tcp(const listen_addr_t *la, int port, int backlog);
+
+// Bind and listen on a Unix socket, replacing a stale socket file. The
+// file gets the given mode unless mode < 0, and group unless group is NULL
+// Returns the socket, or -1 on error
+int listen_unix(const listen_addr_t *la, int backlog, int mode, const char *group);
+
+// Describe a listener for the banner, e.g. "http://[::1]:8080"
+void listen_addr_format(const listen_addr_t *la, int port, char *out, size_t size);
+
+// Format a peer address for logs; IPv4-mapped addresses print as IPv4
+void peer_addr_format(const struct sockaddr_storage *addr, char *out, size_t size);
+
+#endif
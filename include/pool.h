@@ -0,0 +1,96 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define POOL_BUF_SIZE 16384   // Bytes per pooled I/O buffer, header included
+#define POOL_MAX_IDLE 64      // Idle buffers a pool keeps for reuse
+#define SLAB_PAGE_SIZE 16384  // Bytes per slab page
+
+// Immutable, reference-counted bytes shared by several queues, e.g. a
+// frame encoded once for every viewer of a session
+typedef struct {
+    atomic_uint refs;
+    uint32_t len;
+    uint8_t data[];
+} shared_buf_t;
+
+// Fixed-size I/O buffer; the bytes at [start, end) are unconsumed. A
+// buffer with shared set carries no data of its own and refers to the
+// shared bytes instead.
+typedef struct pool_buf {
+    struct pool_buf *next;
+    uint32_t start;
+    uint32_t end;
+    shared_buf_t *shared;
+    uint8_t data[];
+} pool_buf_t;
+
+#define POOL_BUF_CAPACITY (POOL_BUF_SIZE - sizeof(pool_buf_t))
+
+// Where a buffer's bytes live
+static inline uint8_t *pool_buf_bytes(pool_buf_t *buf) {
+    return buf->shared ? buf->shared->data : buf->data;
+}
+
+// Buffers shared by the connections of one worker. Not thread-safe,
+// except for reading the counters.
+typedef struct {
+    pool_buf_t *idle;
+    size_t idle_count;
+    atomic_size_t allocated;  // Buffers currently held, idle or in use
+    atomic_size_t in_use;     // Buffers lent out
+} buf_pool_t;
+
+// Borrow a buffer (empty); returns NULL on allocation failure
+pool_buf_t *buf_get(buf_pool_t *pool);
+
+// Return a buffer to the pool
+void buf_put(buf_pool_t *pool, pool_buf_t *buf);
+
+// Free the pool's idle buffers
+void buf_pool_destroy(buf_pool_t *pool);
+
+// Memory held by the pool, idle buffers included (thread-safe)
+size_t buf_pool_bytes(buf_pool_t *pool);
+
+// Allocate len bytes holding one reference; returns NULL on failure
+shared_buf_t *shared_buf_new(size_t len);
+
+// Take another reference (thread-safe)
+static inline shared_buf_t *shared_buf_ref(shared_buf_t *buf) {
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    return buf;
+}
+
+// Drop a reference, freeing the bytes with the last one (thread-safe)
+void shared_buf_unref(shared_buf_t *buf);
+
+// Allocator for objects of one size, carved out of SLAB_PAGE_SIZE pages
+// and recycled through a free list. Not thread-safe, except for reading
+// the counters.
+typedef struct {
+    size_t object_size;
+    size_t per_page;
+    void *free_list;
+    void *pages;              // Singly linked through the first word
+    atomic_size_t page_count;
+    atomic_size_t in_use;     // Objects handed out
+} slab_t;
+
+void slab_init(slab_t *slab, size_t object_size);
+
+// Allocate a zeroed object; returns NULL on allocation failure
+void *slab_alloc(slab_t *slab);
+
+void slab_free(slab_t *slab, void *object);
+
+// Release all pages; every object must have been freed
+void slab_destroy(slab_t *slab);
+
+// Memory held by the slab's pages (thread-safe)
+size_t slab_bytes(slab_t *slab);
+
+#endif
@@ -3,11 +3,31 @@
 
 #include <netinet/in.h>
 
+#define MAX_LISTENERS 8
+
 // Server configuration
 typedef struct {
     int port;
     char *tmux_session;
-    char *bind_addr;
+    char *bind_addrs[MAX_LISTENERS];  // Listen specs, see listen_addr_parse()
+    int bind_count;                   // 0 = all IPv4 interfaces
+    int socket_mode;                  // Unix socket permissions (-1 = from umask)
+    char *socket_group;               // Unix socket group (NULL = unchanged)
+    size_t flood_limit;  // Queued output per client before resync (0 = one screenful)
+    int threads;         // I/O worker threads (0 = one per CPU)
+    int shared;          // Viewers of a session share one tmux client
+    int splice;          // Move output to sockets with splice()
+    char *history_dir;   // Keep searchable output history here (NULL = off)
+    int trace;           // Record keystroke latency, exported at /trace
+    char *gateway;       // Accept agents on this listen spec (NULL = off)
+    char *agent;         // Gateway to dial as an agent, HOST:PORT or unix:/path
+    char *agent_name;    // Name to register with the gateway
+    int warm;            // Spare tmux clients per session in use, on each worker (0 = off)
+    int compact;         // Rewrite output into shorter equivalent escape sequences
+    int transfer;        // Take file offers on the control socket, serve them at /files/
+    size_t archive_limit; // Compressed scrollback kept in memory per session (0 = off)
+    char *archive_dir;   // Spill older scrollback to files here (NULL = drop it)
+    char **argv;         // Command line, to start a successor with on upgrade
 } server_config_t;
 
 // Start the server (blocks)
@@ -1,25 +1,34 @@
 #ifndef SESSION_H
 #define SESSION_H
 
-#define MAX_SESSIONS 64
+#include <stddef.h>
+
 #define MAX_SESSION_NAME 256
 
 typedef struct {
-    char name[MAX_SESSION_NAME];
+    char *name;
     int windows;
     int attached;
     char created[32];
 } tmux_session_t;
 
+// Grows to however many sessions tmux has
 typedef struct {
-    tmux_session_t sessions[MAX_SESSIONS];
+    tmux_session_t *sessions;
     int count;
+    int capacity;
 } session_list_t;
 
-// Get list of tmux sessions
-// Returns 0 on success, -1 on error
+// Get list of tmux sessions; free it with session_list_free() either way
+// Returns 0 on success, -1 on error or if there are none
 int session_list_get(session_list_t *list);
 
+void session_list_free(session_list_t *list);
+
+// Name of the tmux session we run in, going by $TMUX
+// Returns 0 on success, -1 if not in tmux or on error
+int session_current(char *name, size_t size);
+
 // Interactive session selector
 // Returns selected session name (must be freed) or NULL on cancel/error
 char *session_select_interactive(void);
@@ -0,0 +1,65 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "worker.h"
+
+#define SNAPSHOT_CHECK_MS 1000  // How often tmux is asked which sessions had output
+#define SNAPSHOT_MIN_MS 250     // Least time between two captures of a session
+#define SNAPSHOT_PENDING 2      // snapshot_get(): nothing captured yet
+#define SNAPSHOT_ATTEMPTS 3     // Helper passes a request waits for at most
+
+typedef enum {
+    SNAPSHOT_TEXT,      // Plain text
+    SNAPSHOT_ANSI,      // Text with SGR escape sequences for colours and attributes
+    SNAPSHOT_HTML,      // A <pre> with styled spans
+    SNAPSHOT_FORMATS
+} snapshot_format_t;
+
+// The screen of a tmux session as capture-pane shows it, kept until the
+// session has output again. Output is noticed as our own tmux clients
+// read it, and for sessions nobody here watches from tmux's activity
+// times, fetched for all sessions at once every SNAPSHOT_CHECK_MS. Each
+// time output is seen a generation counter goes up; a snapshot's
+// version is the generation at which its screen last changed. tmux is
+// asked on a helper thread, so nothing here blocks the caller: what was
+// captured last is served while the helper looks for a newer screen,
+// unless output is known to have come since.
+// All functions are thread-safe.
+typedef struct snapshot snapshot_t;
+
+// Returns NULL on allocation failure
+snapshot_t *snapshot_new(const char *session);
+
+// Note output of the session (lock-free)
+void snapshot_touch(snapshot_t *snapshot);
+
+// Whether tmux had the session when it was last asked
+// Returns 1 if it had, 0 if not, -1 if it wasn't asked lately; the
+// helper then asks
+int snapshot_session_exists(const char *session);
+
+// Have the helper bring the snapshot up to date if it may be stale and,
+// unless *version is already its version, copy what is captured in
+// format to a malloc'd *data of *len bytes and set *version
+// Returns 1 if copied, 0 if *version is current, SNAPSHOT_PENDING if
+// nothing is captured yet, -1 on error
+int snapshot_get(snapshot_t *snapshot, snapshot_format_t format, uint64_t *version,
+                 char **data, size_t *len);
+
+// Whether output is known to have changed the screen since it was
+// captured, and the helper is to capture it again right away
+int snapshot_changed(snapshot_t *snapshot);
+
+// Post fn(worker, arg) to the worker once the helper has done what was
+// asked of it so far
+// Returns 0 on success, -1 if the helper isn't running
+int snapshot_wait(worker_t *worker, void (*fn)(worker_t *worker, void *arg), void *arg);
+
+// Stop the helper; those still waiting are posted
+void snapshot_stop(void);
+
+void snapshot_free(snapshot_t *snapshot);
+
+#endif
@@ -7,29 +7,91 @@
 typedef struct {
     pid_t pid;          // Child process PID
     int master_fd;      // PTY master file descriptor
-    char *session_name; // tmux session name
+    int pid_fd;         // Readable once the child exits (-1 without pidfd support)
+    const char *session_name; // tmux session name (owned by the caller)
+    char tty_name[64];  // PTY slave path (identifies the tmux client)
     int running;        // Is the session running
 } terminal_t;
 
 // Create a new terminal attached to a tmux session
+// session_name must outlive the terminal
 // Returns 0 on success, -1 on error
 int terminal_create(terminal_t *term, const char *session_name);
 
+// Like terminal_create(), but the tmux client attaches with ignore-size
+// so that it leaves window sizes alone until the flag is cleared
+// (tmux 3.2 or later)
+// Returns 0 on success, -1 on error
+int terminal_create_spare(terminal_t *term, const char *session_name);
+
+// Take over a terminal another process created, e.g. across a restart.
+// pid need not be our child; its exit then shows as EOF on master_fd
+void terminal_adopt(terminal_t *term, pid_t pid, int master_fd, const char *session_name);
+
 // Read from terminal (non-blocking if no data)
 // Returns bytes read, 0 if no data, -1 on error/closed
 ssize_t terminal_read(terminal_t *term, char *buf, size_t bufsize);
 
-// Write to terminal
-// Returns bytes written, -1 on error
+// Move up to len bytes of output into a pipe without copying them
+// through userspace (non-blocking)
+// Returns bytes moved, 0 if no data, -1 on error/closed
+ssize_t terminal_splice(terminal_t *term, int pipe_fd, size_t len);
+
+// Write as much as the terminal takes now (non-blocking)
+// Returns bytes written, 0 if it is full, -1 on error
 ssize_t terminal_write(terminal_t *term, const char *buf, size_t len);
 
 // Resize terminal
 int terminal_resize(terminal_t *term, int cols, int rows);
 
-// Close terminal and cleanup
+// Make tmux forget what it believes the client terminal shows and
+// repaint the whole screen from scratch
+int terminal_redraw(terminal_t *term);
+
+// Close the PTY and hang up the tmux client, which exits shortly after;
+// pid and pid_fd stay for terminal_reap()
+void terminal_hangup(terminal_t *term);
+
+// Collect the child's exit status if it has exited; call when pid_fd
+// turns readable, or on SIGCHLD without one. A child adopted from
+// another process is only noticed, its parent reaps it
+// Returns 1 if it has exited (or there is none), 0 if it still runs
+int terminal_reap(terminal_t *term);
+
+// Hang up, reap the client if it is gone already and release everything
 void terminal_close(terminal_t *term);
 
-// Check if terminal is still running
+// Check if terminal is still running, as of the last read or reap
 int terminal_is_running(terminal_t *term);
 
+// tmux being asked about the pane a client looks at
+typedef struct {
+    pid_t pid;          // tmux display-message, 0 if none is running
+    int fd;             // Its output (non-blocking), -1 if none
+    char out[256];      // Answer so far
+    size_t len;
+} echo_probe_t;
+
+// Start asking tmux whether keystrokes are echoed as typed in the
+// attached pane, without waiting for it; watch probe->fd for input and
+// call terminal_echo_read() when it turns readable
+// Returns 0 on success, -1 on error
+int terminal_echo_probe(terminal_t *term, echo_probe_t *probe);
+
+// Take what has arrived of the answer. Once it is complete the probe is
+// over, and *mode is 1 if local echo prediction is safe, 0 if the pane
+// is on the alternate screen, in a tmux mode or at a no-echo prompt,
+// -1 on error. Its tmux is reaped if it has exited; if not, probe->pid
+// stays set (see terminal_echo_orphan())
+// Returns 1 once the probe is over, 0 while more is to come
+int terminal_echo_read(echo_probe_t *probe, int *mode);
+
+// Give up on a probe still running: kill its tmux and reap it if it has
+// exited, else leave probe->pid set as terminal_echo_read() does
+void terminal_echo_cancel(echo_probe_t *probe);
+
+// Hand a probe's tmux that hasn't been reaped to term, which has no PTY,
+// to be reaped once it exits (see release_terminal())
+void terminal_echo_orphan(echo_probe_t *probe, terminal_t *term);
+
 #endif
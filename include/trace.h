@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define TRACE_RING_EVENTS 65536  // Latest events kept per thread
+
+// Stages of one keystroke, in order, and the browser's own report
+typedef enum {
+    TRACE_INPUT,       // Input frame parsed
+    TRACE_PTY_WRITE,   // Input taken by the terminal
+    TRACE_PTY_OUTPUT,  // First terminal output after the input
+    TRACE_QUEUED,      // Output frame queued for the socket
+    TRACE_SENT,        // Output frame fully written to the socket
+    TRACE_BROWSER,     // Round trip and render time seen by the browser (us)
+    TRACE_TYPES
+} trace_type_t;
+
+// Latency tracing (--trace). Each thread records into its own ring of
+// TRACE_RING_EVENTS, so recording takes no lock and never waits; the
+// oldest events are overwritten. While tracing is off, recording costs
+// one relaxed load.
+extern atomic_int trace_enabled;
+
+static inline int trace_on(void) {
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed);
+}
+
+// Start recording
+void trace_start(void);
+
+// A new connection id to record events under
+uint32_t trace_conn_id(void);
+
+// Record a stage of input seq of connection conn; a and b carry
+// TRACE_BROWSER's round trip and render time
+void trace_record(trace_type_t type, uint32_t conn, uint32_t seq, uint32_t a, uint32_t b);
+
+// The events held, as Chrome trace-event JSON: one async track per
+// keystroke with a span per stage. Callable from any thread.
+// Returns a malloc'd string of *len bytes, or NULL on error
+char *trace_export(size_t *len);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stddef.h>
+
+#define TRANSFER_MAX 64                   // Offers open at once; the oldest goes first
+#define TRANSFER_TTL_MS (60 * 60 * 1000)  // How long an offer stays open
+#define TRANSFER_TOKEN_LEN 32             // Hex digits in an offer's token
+
+typedef enum {
+    TRANSFER_DOWNLOAD,  // A file in the session, for the browser to fetch
+    TRANSFER_UPLOAD     // A file or directory in the session, for the browser to fill
+} transfer_kind_t;
+
+// Files moved between sessions and browsers over plain HTTP rather than
+// through the terminal (--transfer). A helper run in a session (oatmux
+// --send or --receive) registers a path on the server's control socket
+// and gets back a random token; /files/TOKEN then serves the file, or
+// takes an upload to it. Downloads can be fetched again until they
+// expire, an upload's token is used up by the upload. The offers are
+// kept in one table for all workers; all functions are thread-safe.
+
+// Register path and write its token, TRANSFER_TOKEN_LEN + 1 bytes
+// Returns 0 on success, -1 on error
+int transfer_offer(transfer_kind_t kind, const char *path, char *token);
+
+// Copy the path offered under token for kind, leaving it open
+// Returns 0 on success, -1 if no such offer is open
+int transfer_peek(const char *token, transfer_kind_t kind, char *path, size_t size);
+
+// Copy the path offered under token for kind, using up an upload
+// Returns 0 on success, -1 if no such offer is open
+int transfer_claim(const char *token, transfer_kind_t kind, char *path, size_t size);
+
+// Drop every offer
+void transfer_cleanup(void);
+
+// The control socket of this user's server: $OATMUX_SOCKET, else
+// transfer.sock in /tmp/oatmux-UID, a directory only we may use, made
+// if missing
+// Returns 0 on success, -1 on error
+int transfer_socket_path(char *out, size_t size);
+
+// Ask the server to offer path (helper side) to the viewers of session,
+// which may be NULL. The server's answer, a line for the user, goes to
+// reply
+// Returns 0 if the server took the offer, -1 if not
+int transfer_request(transfer_kind_t kind, const char *path, const char *session,
+                     char *reply, size_t size);
+
+#endif
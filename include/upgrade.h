@@ -0,0 +1,35 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "client.h"
+
+// Zero-downtime restart (SIGUSR2). We start the new binary and, once it
+// is up, freeze the workers and pass it the listening sockets, every
+// connection's socket and terminal, and the state needed to carry on:
+// queued output and input, prediction and resync state. The new process
+// adopts them and we exit without hanging up any tmux client.
+
+// Remember where our binary is, even once it is replaced
+// Returns the socket to a predecessor handing over to us, or -1
+int upgrade_setup(void);
+
+// Hand everything over to a freshly started copy of ourselves
+// Returns 0 once the successor has taken over; otherwise we keep running
+int server_upgrade(const int *cpus);
+
+// Receive the predecessor's session and listening sockets
+// Returns 0 on success, -1 on error
+int adopt_listeners(server_config_t *config, int sock);
+
+// Receive the predecessor's connections and shared terminals
+// Returns 0 on success, -1 if some were lost
+int adopt_connections(int sock);
+
+// Tell the predecessor whether we took over, and hang up on it
+void adopt_done(int sock, int ok);
+
+// Register a worker's connections and shared terminals with its loop
+// Returns 0 on success, -1 on error
+int watch_connections(server_worker_t *sw);
+
+#endif
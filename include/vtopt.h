@@ -0,0 +1,40 @@
+#ifndef VTOPT_H
+#define VTOPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VTOPT_HELD_MAX 64    // Longest escape sequence held back for its end
+#define VTOPT_SLACK (VTOPT_HELD_MAX + 16)  // Output beyond the input's length
+
+// Rewrites terminal output into an equivalent, shorter byte stream
+// (--compact): drops SGR changes that change nothing and merges the
+// rest, drops cursor moves to where the cursor already is or replaces
+// them with shorter ones, replaces runs of spaces before a cursor move
+// with an erase, and leaves out default parameters. It parses with a
+// table-driven VT state machine and follows the cursor, attributes and
+// modes the terminal has been sent; whatever it doesn't model makes the
+// state unknown, after which only rewrites that need no state apply
+// until the stream establishes it again. Escape sequences split across
+// calls are held back until complete. Not thread-safe.
+typedef struct vtopt vtopt_t;
+
+// A rewriter for a cols x rows terminal in an unknown state
+// Returns NULL on allocation failure
+vtopt_t *vtopt_new(int cols, int rows);
+
+// The terminal was resized; where the cursor is becomes unknown
+void vtopt_resize(vtopt_t *vt, int cols, int rows);
+
+// Some output rewritten so far did not reach the terminal: forget its
+// state. Parsing carries on where it was
+void vtopt_reset(vtopt_t *vt);
+
+// Rewrite len bytes of output into out, which must have room for
+// len + VTOPT_SLACK bytes
+// Returns the number of bytes written to out (0 if all were held back)
+size_t vtopt_rewrite(vtopt_t *vt, const uint8_t *in, size_t len, uint8_t *out);
+
+void vtopt_free(vtopt_t *vt);
+
+#endif
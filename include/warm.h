@@ -0,0 +1,45 @@
+#ifndef WARM_H
+#define WARM_H
+
+#include "terminal.h"
+#include "worker.h"
+
+#define WARM_SESSIONS_MAX 8     // Sessions a worker keeps spares for
+#define WARM_IDLE_MS 300000     // Spares of a session nobody opened for this long go
+#define WARM_RETRY_MS 30000     // Pause after a session's spare exited unused
+
+// Spare tmux clients kept attached to the sessions viewers open (--warm),
+// so a new viewer takes one that is already up instead of waiting for
+// tmux to start and attach. Spares attach with ignore-size so that they
+// don't shrink windows while they wait, and their output is discarded.
+// When one is taken, the flag is cleared in the background and the
+// client redraws its screen at once. Each worker has its own pool, used
+// only on its thread, and refills it from its tick.
+typedef struct warm_pool warm_pool_t;
+
+// Hang up and reap a spare the pool no longer wants (already unwatched)
+typedef void (*warm_release_cb)(worker_t *worker, terminal_t *term);
+
+// Keep size spares for each session in use on worker
+// Returns NULL on allocation failure
+warm_pool_t *warm_pool_new(worker_t *worker, int size, warm_release_cb release);
+
+// Keep spares for session from now on; unless keep is set they are
+// dropped once it goes unused for WARM_IDLE_MS
+void warm_want(warm_pool_t *pool, const char *session, int keep);
+
+// Hand a spare attached to session over to *term, which the caller then
+// watches like a terminal it created, and note the session as wanted.
+// term->session_name is set to session, which must outlive it
+// Returns 0 on success, -1 if no spare is ready
+int warm_take(warm_pool_t *pool, const char *session, terminal_t *term);
+
+// Start spares that are missing and drop unused sessions; call from the
+// worker's tick
+void warm_tick(warm_pool_t *pool);
+
+// Release every spare and free the pool; waits for flags still being
+// cleared
+void warm_pool_free(warm_pool_t *pool);
+
+#endif
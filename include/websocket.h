@@ -12,6 +12,9 @@
 #define WS_OPCODE_PING   0x09
 #define WS_OPCODE_PONG   0x0A
 
+// Largest frame header a server builds (no masking key)
+#define WS_MAX_HEADER    10
+
 // WebSocket frame structure
 typedef struct {
     uint8_t opcode;
@@ -22,8 +25,21 @@ typedef struct {
 // Generate WebSocket accept key from client key
 int ws_generate_accept_key(const char *client_key, char *accept_key, size_t accept_key_size);
 
-// Parse incoming WebSocket frame (handles masking)
-int ws_parse_frame(const uint8_t *data, size_t data_len, ws_frame_t *frame, size_t *consumed);
+// Parse incoming WebSocket frame, unmasking the payload in place
+// frame->payload points into data; returns -1 if more data is needed
+int ws_parse_frame(uint8_t *data, size_t data_len, ws_frame_t *frame, size_t *consumed);
+
+// Build the header for an outgoing frame into out (WS_MAX_HEADER bytes)
+// Returns the header length
+size_t ws_build_header(uint8_t opcode, size_t payload_len, uint8_t *out);
+
+// Total length of the frame starting at data, header included
+// Returns 0 if data_len doesn't cover the header
+size_t ws_frame_size(const uint8_t *data, size_t data_len);
+
+// Payload bytes carried by the frames of the given opcode in data, a
+// run of whole frames
+size_t ws_payload_bytes(const uint8_t *data, size_t data_len, uint8_t opcode);
 
 // Build outgoing WebSocket frame (server frames are not masked)
 int ws_build_frame(uint8_t opcode, const uint8_t *payload, size_t payload_len,
@@ -0,0 +1,45 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_SLOTS 512     // Slots per turn of the wheel, a power of two
+#define WHEEL_TICK_MS 100   // Time one slot covers; a turn is 51.2 s
+
+typedef struct wheel_timer wheel_timer_t;
+
+// Called on the thread that advances the wheel once the timer is due
+typedef void (*wheel_cb)(wheel_timer_t *timer);
+
+// A deadline, embedded in the object it belongs to
+struct wheel_timer {
+    wheel_timer_t *next;
+    wheel_timer_t **pprev;  // Link pointing at this timer, NULL while not pending
+    uint64_t due;           // Tick it expires on
+    wheel_cb cb;
+};
+
+// Hashed timing wheel: a timer waits in the slot of its due tick modulo
+// the wheel size, so starting or stopping one is O(1) and each tick
+// looks at one slot. Deadlines further out than a turn wait through
+// the turns in between. Not thread-safe; each worker has its own.
+typedef struct {
+    wheel_timer_t *slots[WHEEL_SLOTS];
+    uint64_t now;           // Last tick handled
+} timer_wheel_t;
+
+// Start the wheel at now_ms, a monotonic time
+void wheel_init(timer_wheel_t *wheel, uint64_t now_ms);
+
+// Call cb at due_ms, or at the next tick if that has passed; a pending
+// timer is moved
+void wheel_start(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t due_ms, wheel_cb cb);
+
+// Cancel a timer; no-op if it is not pending
+void wheel_stop(wheel_timer_t *timer);
+
+// Fire the timers due by now_ms. Callbacks may start and stop timers,
+// their own included
+void wheel_advance(timer_wheel_t *wheel, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "wheel.h"
+
+#define WORKER_TICK_MS 50  // Interval of the worker's housekeeping tick
+
+typedef struct worker worker_t;
+typedef struct watcher watcher_t;
+
+// Called on the worker's thread with the epoll events that fired
+typedef void (*watcher_cb)(watcher_t *watcher, uint32_t events);
+
+// An fd registered with a worker's event loop, embedded in the object
+// that owns the fd
+struct watcher {
+    int fd;
+    uint32_t events;    // Events currently registered
+    watcher_cb cb;
+    worker_t *worker;
+};
+
+// Work handed to a worker by another thread
+typedef struct task {
+    struct task *_Atomic next;
+    void (*fn)(worker_t *worker, void *arg);
+    void *arg;
+} task_t;
+
+// Lock-free multi-producer single-consumer task queue
+typedef struct {
+    task_t *_Atomic head;   // Producers push here
+    task_t *tail;           // Consumer pops here
+    task_t stub;
+} task_queue_t;
+
+// An I/O thread running its own epoll loop
+struct worker {
+    int id;
+    int cpu;                          // CPU the thread is pinned to, -1 if none
+    int epoll_fd;
+    int event_fd;                     // Wakes the loop when tasks arrive
+    pthread_t thread;
+    int started;                      // Thread was created
+    int running;                      // Only touched on the worker's thread
+    atomic_int wakeup_pending;
+    task_queue_t tasks;
+    task_t *deferred;                 // Run after the current batch of events
+    watcher_t wakeup;
+    timer_wheel_t timers;             // Deadlines of the worker's objects
+    void (*tick)(worker_t *worker);   // Housekeeping, about every WORKER_TICK_MS
+    uint64_t last_tick;
+    void *data;                       // Owner's per-worker state
+};
+
+// Set up a worker; returns 0 on success, -1 on error
+int worker_init(worker_t *worker, int id);
+
+// Start the worker's thread, pinned to cpu unless cpu < 0
+int worker_start(worker_t *worker, int cpu);
+
+// Ask the worker to leave its loop once queued tasks have run (thread-safe)
+int worker_stop(worker_t *worker);
+
+// Wait for a stopped worker's thread, if started, run the tasks posted
+// since on the calling thread, and release its resources
+void worker_destroy(worker_t *worker);
+
+// Register fd with the worker's loop; returns 0 on success, -1 on error
+int worker_watch(worker_t *worker, watcher_t *watcher, int fd, uint32_t events, watcher_cb cb);
+
+// Change the events a watcher waits for; no-op for a removed watcher
+int worker_modify(watcher_t *watcher, uint32_t events);
+
+// Remove a watcher from its loop (does not close the fd)
+void worker_unwatch(watcher_t *watcher);
+
+// Run fn(worker, arg) on the worker's thread (thread-safe)
+// Returns 0 on success, -1 on error
+int worker_post(worker_t *worker, void (*fn)(worker_t *worker, void *arg), void *arg);
+
+// Run fn(worker, arg) once the current batch of events has been handled,
+// e.g. to free an object other pending events may still point into
+// Must be called on the worker's thread
+int worker_defer(worker_t *worker, void (*fn)(worker_t *worker, void *arg), void *arg);
+
+// Monotonic clock in milliseconds
+uint64_t worker_now_ms(void);
+
+#endif
@@ -5,18 +5,19 @@ echo "Installing oatmux dependencies..."
 
 if command -v apt-get &> /dev/null; then
     sudo apt-get update
-    sudo apt-get install -y build-essential cmake libssl-dev
+    sudo apt-get install -y build-essential cmake libssl-dev zlib1g-dev
 elif command -v dnf &> /dev/null; then
-    sudo dnf install -y gcc make cmake openssl-devel
+    sudo dnf install -y gcc make cmake openssl-devel zlib-devel
 elif command -v pacman &> /dev/null; then
-    sudo pacman -S --needed base-devel cmake openssl
+    sudo pacman -S --needed base-devel cmake openssl zlib
 elif command -v apk &> /dev/null; then
-    sudo apk add build-base cmake openssl-dev
+    sudo apk add build-base cmake openssl-dev zlib-dev
 else
     echo "Unknown package manager. Please install manually:"
     echo "  - gcc/build-essential"
     echo "  - cmake"
     echo "  - libssl-dev / openssl-devel"
+    echo "  - zlib1g-dev / zlib-devel"
     exit 1
 fi
 
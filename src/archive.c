@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+
+#include "archive.h"
+#include "lines.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define NO_CHUNK UINT64_MAX
+
+// Whole lines at [offset, offset + len) of the archive, compressed
+typedef struct {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t packed_len;
+    uint8_t *packed;              // NULL once spilled
+    off_t spill_offset;           // Where it is in the spill file
+} archive_chunk_t;
+
+struct archive {
+    pthread_mutex_t lock;
+    size_t limit;                 // Compressed bytes kept in memory
+    int spill_fd;                 // -1 without a spill file
+    off_t spill_len;
+    size_t spilled;               // Bytes of the spill file still in use
+    int spill_failed;
+
+    archive_chunk_t *chunks;      // Kept chunks are [head, count), oldest first
+    size_t head, count, cap;
+    size_t in_memory;             // First chunk not spilled
+    size_t memory;                // Compressed bytes held in memory
+
+    uint8_t *open;                // Lines of the chunk being filled
+    uint32_t open_len;
+    uint64_t open_offset;
+
+    uint8_t *cache;               // Chunk last decompressed for a read
+    uint64_t cache_offset;        // Its offset, NO_CHUNK if none
+
+    const void *source;           // Who is recording
+    lines_t parser;               // Its output parsed into lines
+};
+
+// A read for the reader thread
+typedef struct read_job {
+    archive_t *archive;
+    archive_request_t *req;
+    worker_t *worker;
+    void (*done)(worker_t *worker, void *arg);
+    void *arg;
+    struct read_job *next;
+} read_job_t;
+
+// The reader thread and its queue, oldest first
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reader_thread;
+static int reader_started;
+static int reader_stopping;
+static read_job_t *reader_head, *reader_tail;
+
+static void add_line(const char *text, size_t len, void *arg);
+
+archive_t *archive_open(size_t limit, const char *spill_dir) {
+    archive_t *archive = calloc(1, sizeof(*archive));
+    if (!archive) return NULL;
+    archive->open = malloc(ARCHIVE_CHUNK_SIZE);
+    archive->cache = malloc(ARCHIVE_CHUNK_SIZE);
+    if (!archive->open || !archive->cache) {
+        free(archive->open);
+        free(archive->cache);
+        free(archive);
+        return NULL;
+    }
+
+    // An unnamed file: nothing to clean up after a crash
+    archive->spill_fd = -1;
+    if (spill_dir) {
+        if (mkdir(spill_dir, 0700) < 0 && errno != EEXIST) perror(spill_dir);
+        archive->spill_fd = open(spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (archive->spill_fd < 0) perror(spill_dir);
+    }
+
+    archive->limit = limit;
+    archive->cache_offset = NO_CHUNK;
+    lines_init(&archive->parser, add_line, archive, 0);
+    pthread_mutex_init(&archive->lock, NULL);
+    return archive;
+}
+
+static int add_chunk(archive_t *archive, const archive_chunk_t *chunk) {
+    // Reuse the room of dropped chunks before growing
+    if (archive->count == archive->cap && archive->head > 0) {
+        memmove(archive->chunks, archive->chunks + archive->head,
+                (archive->count - archive->head) * sizeof(*archive->chunks));
+        archive->count -= archive->head;
+        archive->in_memory -= archive->head;
+        archive->head = 0;
+    }
+    if (archive->count == archive->cap) {
+        size_t cap = archive->cap ? archive->cap * 2 : 64;
+        archive_chunk_t *chunks = realloc(archive->chunks, cap * sizeof(*chunks));
+        if (!chunks) return -1;
+        archive->chunks = chunks;
+        archive->cap = cap;
+    }
+    archive->chunks[archive->count++] = *chunk;
+    return 0;
+}
+
+// Forget the oldest chunk (locked)
+static void drop_oldest(archive_t *archive) {
+    archive_chunk_t *chunk = &archive->chunks[archive->head++];
+    if (chunk->packed) {
+        archive->memory -= chunk->packed_len;
+        free(chunk->packed);
+    } else {
+        // The file keeps its size but gives the blocks back
+        archive->spilled -= chunk->packed_len;
+        fallocate(archive->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  chunk->spill_offset, chunk->packed_len);
+    }
+    if (archive->in_memory < archive->head) archive->in_memory = archive->head;
+    if (archive->cache_offset == chunk->offset) archive->cache_offset = NO_CHUNK;
+}
+
+// Move a chunk out of memory into the spill file (locked)
+// Returns 0 on success, -1 on error
+static int spill_chunk(archive_t *archive, archive_chunk_t *chunk) {
+    if (archive->spill_fd < 0) return -1;
+
+    size_t done = 0;
+    while (done < chunk->packed_len) {
+        ssize_t n = pwrite(archive->spill_fd, chunk->packed + done, chunk->packed_len - done,
+                           archive->spill_len + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done < chunk->packed_len) {
+        if (!archive->spill_failed) perror("archive spill");
+        archive->spill_failed = 1;
+        return -1;
+    }
+    archive->spill_failed = 0;
+
+    chunk->spill_offset = archive->spill_len;
+    archive->spill_len += chunk->packed_len;
+    archive->spilled += chunk->packed_len;
+    archive->memory -= chunk->packed_len;
+    free(chunk->packed);
+    chunk->packed = NULL;
+    return 0;
+}
+
+// Spill or drop the oldest chunks until memory and the spill file are
+// within their limits (locked)
+static void enforce_limits(archive_t *archive) {
+    while (archive->memory > archive->limit && archive->in_memory < archive->count) {
+        size_t oldest = archive->in_memory;
+        if (spill_chunk(archive, &archive->chunks[oldest]) == 0) {
+            archive->in_memory++;
+        } else {
+            while (archive->head <= oldest) drop_oldest(archive);
+        }
+    }
+    while (archive->spilled > archive->limit * ARCHIVE_SPILL_FACTOR) drop_oldest(archive);
+}
+
+// Compress the lines gathered so far into a chunk of their own (locked)
+static void seal_chunk(archive_t *archive) {
+    archive_chunk_t chunk = { .offset = archive->open_offset, .len = archive->open_len };
+    uLongf packed_len = compressBound(archive->open_len);
+    uint8_t *packed = malloc(packed_len);
+    if (packed && compress2(packed, &packed_len, archive->open, archive->open_len,
+                            Z_BEST_SPEED) == Z_OK) {
+        uint8_t *fitted = realloc(packed, packed_len);
+        chunk.packed = fitted ? fitted : packed;
+        chunk.packed_len = packed_len;
+    }
+
+    archive->open_offset += archive->open_len;
+    archive->open_len = 0;
+
+    if (!chunk.packed || add_chunk(archive, &chunk) < 0) {
+        // Offsets can't skip a chunk, so the older ones go with it
+        free(chunk.packed ? chunk.packed : packed);
+        while (archive->head < archive->count) drop_oldest(archive);
+        return;
+    }
+    archive->memory += chunk.packed_len;
+    enforce_limits(archive);
+}
+
+// Append a finished line (locked)
+static void add_line(const char *text, size_t len, void *arg) {
+    archive_t *archive = arg;
+    if (archive->open_len + len + 1 > ARCHIVE_CHUNK_SIZE) seal_chunk(archive);
+
+    memcpy(archive->open + archive->open_len, text, len);
+    archive->open[archive->open_len + len] = '\n';
+    archive->open_len += len + 1;
+}
+
+void archive_record(archive_t *archive, const void *source, const uint8_t *data, size_t len) {
+    pthread_mutex_lock(&archive->lock);
+
+    if (!archive->source) {
+        archive->source = source;
+        lines_reset(&archive->parser);
+    }
+    if (archive->source == source) lines_feed(&archive->parser, data, len);
+
+    pthread_mutex_unlock(&archive->lock);
+}
+
+void archive_release(archive_t *archive, const void *source) {
+    pthread_mutex_lock(&archive->lock);
+    if (archive->source == source) archive->source = NULL;
+    pthread_mutex_unlock(&archive->lock);
+}
+
+// Oldest byte kept (locked)
+static uint64_t first_kept(archive_t *archive) {
+    return archive->head < archive->count ? archive->chunks[archive->head].offset :
+                                            archive->open_offset;
+}
+
+void archive_bounds(archive_t *archive, uint64_t *first, uint64_t *end) {
+    pthread_mutex_lock(&archive->lock);
+    *first = first_kept(archive);
+    *end = archive->open_offset + archive->open_len;
+    pthread_mutex_unlock(&archive->lock);
+}
+
+// The lines of a chunk, decompressed into the cache unless they are
+// there already (locked)
+// Returns NULL on error
+static const uint8_t *chunk_lines(archive_t *archive, const archive_chunk_t *chunk) {
+    if (archive->cache_offset == chunk->offset) return archive->cache;
+
+    uint8_t *packed = chunk->packed;
+    if (!packed) {
+        packed = malloc(chunk->packed_len);
+        if (!packed || pread(archive->spill_fd, packed, chunk->packed_len,
+                             chunk->spill_offset) != (ssize_t)chunk->packed_len) {
+            free(packed);
+            return NULL;
+        }
+    }
+
+    uLongf len = ARCHIVE_CHUNK_SIZE;
+    int ok = uncompress(archive->cache, &len, packed, chunk->packed_len) == Z_OK &&
+             len == chunk->len;
+    if (packed != chunk->packed) free(packed);
+
+    archive->cache_offset = ok ? chunk->offset : NO_CHUNK;
+    return ok ? archive->cache : NULL;
+}
+
+ssize_t archive_read(archive_t *archive, uint64_t *offset, uint8_t *out, size_t size) {
+    pthread_mutex_lock(&archive->lock);
+
+    uint64_t first = first_kept(archive);
+    if (*offset < first) *offset = first;
+    uint64_t pos = *offset;
+    size_t copied = 0;
+    int failed = 0;
+
+    // The chunk holding pos, then the ones after it
+    size_t lo = archive->head, hi = archive->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const archive_chunk_t *chunk = &archive->chunks[mid];
+        if (chunk->offset + chunk->len <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i < archive->count && copied < size; i++) {
+        const archive_chunk_t *chunk = &archive->chunks[i];
+        const uint8_t *lines = chunk_lines(archive, chunk);
+        if (!lines) {
+            failed = 1;
+            break;
+        }
+        size_t skip = pos - chunk->offset;
+        size_t n = chunk->len - skip < size - copied ? chunk->len - skip : size - copied;
+        memcpy(out + copied, lines + skip, n);
+        copied += n;
+        pos += n;
+    }
+
+    // Then the chunk still being filled
+    uint64_t open_end = archive->open_offset + archive->open_len;
+    if (!failed && copied < size && pos >= archive->open_offset && pos < open_end) {
+        size_t skip = pos - archive->open_offset;
+        size_t n = archive->open_len - skip < size - copied ? archive->open_len - skip :
+                                                              size - copied;
+        memcpy(out + copied, archive->open + skip, n);
+        copied += n;
+    }
+
+    pthread_mutex_unlock(&archive->lock);
+    return failed && copied == 0 ? -1 : (ssize_t)copied;
+}
+
+static void read_job_done(read_job_t *job) {
+    if (worker_post(job->worker, job->done, job->arg) < 0) perror("archive read");
+    free(job);
+}
+
+// Run queued reads one at a time until stopped
+static void *reader_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&reader_lock);
+    for (;;) {
+        while (!reader_head && !reader_stopping) pthread_cond_wait(&reader_cond, &reader_lock);
+        if (reader_stopping) break;
+        read_job_t *job = reader_head;
+        reader_head = job->next;
+        if (!reader_head) reader_tail = NULL;
+        pthread_mutex_unlock(&reader_lock);
+
+        archive_request_t *req = job->req;
+        req->copied = archive_read(job->archive, &req->offset, req->out, req->size);
+        read_job_done(job);
+
+        pthread_mutex_lock(&reader_lock);
+    }
+    pthread_mutex_unlock(&reader_lock);
+    return NULL;
+}
+
+int archive_read_post(archive_t *archive, archive_request_t *req, worker_t *worker,
+                      void (*done)(worker_t *worker, void *arg), void *arg) {
+    read_job_t *job = calloc(1, sizeof(*job));
+    if (!job) return -1;
+    job->archive = archive;
+    job->req = req;
+    job->worker = worker;
+    job->done = done;
+    job->arg = arg;
+    req->copied = -1;
+
+    pthread_mutex_lock(&reader_lock);
+    if (!reader_started && !reader_stopping) {
+        int err = pthread_create(&reader_thread, NULL, reader_main, NULL);
+        if (err == 0) {
+            reader_started = 1;
+        } else {
+            errno = err;
+            perror("pthread_create archive reader");
+        }
+    }
+    if (!reader_started || reader_stopping) {
+        pthread_mutex_unlock(&reader_lock);
+        free(job);
+        return -1;
+    }
+    if (reader_tail) reader_tail->next = job;
+    else reader_head = job;
+    reader_tail = job;
+    pthread_cond_signal(&reader_cond);
+    pthread_mutex_unlock(&reader_lock);
+    return 0;
+}
+
+void archive_read_stop(void) {
+    pthread_mutex_lock(&reader_lock);
+    reader_stopping = 1;
+    pthread_cond_signal(&reader_cond);
+    int started = reader_started;
+    pthread_mutex_unlock(&reader_lock);
+
+    if (started) pthread_join(reader_thread, NULL);
+
+    // What is left is reported without having been read
+    while (reader_head) {
+        read_job_t *job = reader_head;
+        reader_head = job->next;
+        read_job_done(job);
+    }
+    reader_tail = NULL;
+}
+
+void archive_close(archive_t *archive) {
+    for (size_t i = archive->head; i < archive->count; i++) free(archive->chunks[i].packed);
+    if (archive->spill_fd >= 0) close(archive->spill_fd);
+    pthread_mutex_destroy(&archive->lock);
+    free(archive->chunks);
+    free(archive->open);
+    free(archive->cache);
+    free(archive);
+}
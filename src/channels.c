@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+
+#include "channels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MUX_CHANNELS_MAX 32   // Terminals open at once on one multiplexed connection
+
+// Take a channel off its connection, telling the browser unless the
+// connection is closing too
+void channel_unlink(client_t *channel) {
+    client_t *conn = channel->parent;
+
+    client_t **link = &conn->channels;
+    while (*link != channel) link = &(*link)->sibling;
+    *link = channel->sibling;
+    conn->channel_count--;
+    channel->parent = NULL;
+
+    if (conn->sock.worker) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "{\"type\":\"closed\",\"ch\":%d}", channel->channel);
+        client_send_text(conn, msg, len);
+        worker_modify(&conn->sock, client_sock_events(conn));
+    }
+}
+
+static client_t *channel_find(client_t *conn, int id) {
+    client_t *channel = conn->channels;
+    while (channel && channel->channel != id) channel = channel->sibling;
+    return channel;
+}
+
+// A channel waiting for the helper thread to find out whether tmux has
+// its session (snapshot.h)
+typedef struct {
+    uint64_t serial;           // Connection the channel is for
+    int id, cols, rows;
+    char session[256];
+} channel_request_t;
+
+static void channel_open(client_t *conn, int id, const char *session, int cols, int rows,
+                         int waited);
+
+// The helper has listed the sessions since the channel had to wait
+static void channel_ready_task(worker_t *worker, void *arg) {
+    channel_request_t *req = arg;
+    client_t *conn = client_find((server_worker_t *)worker, req->serial);
+    if (conn && conn->state == CLIENT_WEBSOCKET) {
+        channel_open(conn, req->id, req->session, req->cols, req->rows, 1);
+        if (client_send_pending(conn) < 0) client_close(conn);
+    }
+    free(req);
+}
+
+// Wait for the helper's next pass to open the channel
+// Returns 0 if it waits, -1 if not
+static int channel_defer(client_t *conn, int id, const char *session, int cols, int rows) {
+    channel_request_t *req = malloc(sizeof(*req));
+    if (!req) return -1;
+
+    *req = (channel_request_t){ .serial = client_serial(conn), .id = id, .cols = cols, .rows = rows };
+    snprintf(req->session, sizeof(req->session), "%s", session);
+    if (snapshot_wait(&conn->owner->worker, channel_ready_task, req) < 0) {
+        free(req);
+        return -1;
+    }
+    return 0;
+}
+
+// Open a terminal on a session tmux has as channel id of a multiplexed
+// connection; if that fails the browser is told it closed. While the
+// helper thread finds out whether tmux has the session, the channel
+// waits for it, once.
+static void channel_open(client_t *conn, int id, const char *session, int cols, int rows,
+                         int waited) {
+    server_worker_t *sw = conn->owner;
+    client_t *channel = NULL;
+    char *name = NULL;
+
+    if (id >= 0 && id <= UINT8_MAX && !channel_find(conn, id) &&
+        conn->channel_count < MUX_CHANNELS_MAX) {
+        int exists = snapshot_session_exists(session);
+        if (exists < 0 && !waited && channel_defer(conn, id, session, cols, rows) == 0) return;
+        name = exists > 0 ? strdup(session) : NULL;
+        channel = name ? slab_alloc(&sw->client_slab) : NULL;
+    }
+    if (!channel) {
+        free(name);
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "{\"type\":\"closed\",\"ch\":%d}", id);
+        client_send_text(conn, msg, len);
+        return;
+    }
+
+    channel->owner = sw;
+    channel->socket_fd = -1;
+    channel->state = CLIENT_WEBSOCKET;
+    channel->terminal.master_fd = -1;
+    channel->terminal.pid_fd = -1;
+    channel->splice_pipe[0] = channel->splice_pipe[1] = -1;
+    channel->session_copy = name;
+    channel->session_name = name;
+    channel->predict = -1;
+    channel->cols = cols > 0 ? cols : 80;
+    channel->rows = rows > 0 ? rows : 24;
+    channel->local = conn->local;
+    memcpy(channel->client_ip, conn->client_ip, sizeof(channel->client_ip));
+
+    channel->parent = conn;
+    channel->channel = id;
+    channel->sibling = conn->channels;
+    conn->channels = channel;
+    conn->channel_count++;
+
+    channel->next = sw->clients;
+    sw->clients->prev = channel;
+    sw->clients = channel;
+
+    if (client_attach(channel) < 0) {
+        client_close(channel);
+        return;
+    }
+    client_apply_size(channel);
+}
+
+// Act on a JSON message about a channel. Session names are taken as
+// they are, so ones that need escaping in JSON can't be opened
+static void channel_control(client_t *conn, const uint8_t *payload, size_t len) {
+    char json[384];
+    size_t json_len = len < sizeof(json) - 1 ? len : sizeof(json) - 1;
+    memcpy(json, payload, json_len);
+    json[json_len] = '\0';
+
+    int id, cols, rows;
+    unsigned bytes;
+    char session[256];
+    if (sscanf(json, "{\"type\":\"open\",\"ch\":%d,\"cols\":%d,\"rows\":%d,\"session\":\"%255[^\"]\"}",
+               &id, &cols, &rows, session) == 4) {
+        channel_open(conn, id, session, cols, rows, 0);
+        return;
+    }
+
+    client_t *channel;
+    char hidden[6];
+    if (sscanf(json, "{\"type\":\"visibility\",\"hidden\":%5[a-z]}", hidden) == 1) {
+        client_set_hidden(conn, strcmp(hidden, "true") == 0);
+    } else if (sscanf(json, "{\"type\":\"ack\",\"ch\":%d,\"bytes\":%u}", &id, &bytes) == 2) {
+        // Drawn output makes room for more, and may end a resync
+        if ((channel = channel_find(conn, id))) {
+            client_ack(channel, bytes);
+            client_check_resync(channel);
+        }
+    } else if (sscanf(json, "{\"type\":\"resize\",\"ch\":%d,\"cols\":%d,\"rows\":%d}",
+                      &id, &cols, &rows) == 3) {
+        if ((channel = channel_find(conn, id)) && cols > 0 && rows > 0) {
+            client_resize(channel, cols, rows);
+        }
+    } else if (sscanf(json, "{\"type\":\"close\",\"ch\":%d}", &id) == 1) {
+        if ((channel = channel_find(conn, id))) client_close(channel);
+    }
+}
+
+// Handle the frames of a multiplexed connection: binary frames carry a
+// channel id and input for it, text frames are JSON about a channel
+// Returns the bytes consumed, or -1 once the client has been closed
+ssize_t process_mux_frames(client_t *client, uint8_t *data, size_t len) {
+    size_t offset = 0;
+
+    while (offset < len) {
+        ws_frame_t frame;
+        size_t consumed;
+
+        if (ws_parse_frame(data + offset, len - offset, &frame, &consumed) < 0) {
+            break; // Need more data
+        }
+
+        client_t *channel;
+        switch (frame.opcode) {
+            case WS_OPCODE_BIN:
+                if (frame.payload_len > 1 && (channel = channel_find(client, frame.payload[0]))) {
+                    channel->input_seq++;
+                    client_input(channel, frame.payload + 1, frame.payload_len - 1);
+                }
+                break;
+
+            case WS_OPCODE_TEXT:
+                channel_control(client, frame.payload, frame.payload_len);
+                break;
+
+            case WS_OPCODE_PING:
+                client_send_frame(client, WS_OPCODE_PONG, frame.payload, frame.payload_len);
+                break;
+
+            case WS_OPCODE_CLOSE:
+                client_send_frame(client, WS_OPCODE_CLOSE, NULL, 0);
+                client_flush(client);
+                client_close(client);
+                return -1;
+        }
+
+        offset += consumed;
+    }
+    return offset;
+}
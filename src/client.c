@@ -0,0 +1,1115 @@
+#define _GNU_SOURCE
+
+#include "client.h"
+#include "feed.h"
+#include "channels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+
+#define MAX_IOV 64                 // Buffers handed to one writev()
+#define PREDICT_CHECK_MS 250  // Minimum interval between echo mode checks
+#define FLOOD_CELL_BYTES 8    // Output bytes budgeted per screen cell
+#define FLOOD_MIN_BYTES 16384 // Smallest automatic flood limit
+#define FLOOD_HARD_FACTOR 4   // Queue cap (x limit) while a redraw is in flight
+#define PACE_MIN_BYTES 16384  // Unsent output the kernel may always hold
+#define PACE_MAX_BYTES (4 << 20)  // And at most
+#define PACE_CHECK_MS 100     // How often a connection's link is measured
+#define PTY_INPUT_MAX 262144  // Input queued for a terminal before reading pauses
+#define TRANSFER_CHUNK (1 << 20)  // Largest piece of a download handed to one sendfile()
+#define HANDSHAKE_TIMEOUT_MS 10000  // A request's headers must be in this soon
+#define PING_INTERVAL_MS 30000  // A viewer quiet this long is pinged
+#define PONG_TIMEOUT_MS 15000  // and closed if it stays quiet this much longer
+
+// Clears the screen ahead of a redraw; CAN aborts any escape sequence
+// that was cut off when the backlog was dropped
+static const char RESYNC_PREFIX[] = "\x18\x1b[0m\x1b[H\x1b[2J";
+
+// Buffer for the next queued bytes; frames never share a buffer with
+// raw bytes, and only whole frames go into a buffer
+static pool_buf_t *client_out_room(client_t *client, size_t len, int raw) {
+    pool_buf_t *tail = client->out_tail;
+
+    if (tail && !tail->shared && (tail == client->out_raw) == raw &&
+        POOL_BUF_CAPACITY - tail->end >= len) {
+        return tail;
+    }
+
+    pool_buf_t *buf = buf_get(&client->owner->buffers);
+    if (!buf) return NULL;
+
+    if (tail) tail->next = buf;
+    else client->out_head = buf;
+    client->out_tail = buf;
+    if (raw) client->out_raw = buf;
+    return buf;
+}
+
+// Queue bytes that are not WebSocket frames (HTTP responses)
+int client_queue_raw(client_t *client, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        pool_buf_t *buf = client_out_room(client, 1, 1);
+        if (!buf) return -1;
+
+        size_t chunk = POOL_BUF_CAPACITY - buf->end;
+        if (chunk > len) chunk = len;
+        memcpy(buf->data + buf->end, p, chunk);
+        buf->end += chunk;
+        client->out_bytes += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// A channel's frames go out on its connection, binary ones behind the
+// channel id and JSON messages with a "ch" member in front; the bytes
+// to put before the payload go into tag, which the payload loses its
+// opening brace to
+// Returns the tag's length
+static size_t channel_tag(client_t *channel, uint8_t opcode, const uint8_t **data, size_t *len,
+                          uint8_t *tag, size_t tag_size) {
+    if (opcode == WS_OPCODE_BIN) {
+        tag[0] = (uint8_t)channel->channel;
+        return 1;
+    }
+    if (opcode != WS_OPCODE_TEXT || *len < 2 || (*data)[0] != '{') return 0;
+
+    (*data)++;
+    (*len)--;
+    return snprintf((char *)tag, tag_size, "{\"ch\":%d,", channel->channel);
+}
+
+// Queue a WebSocket frame for the client; len is at most OUTPUT_CHUNK,
+// or CHANNEL_CHUNK for output of a channel
+int client_send_frame(client_t *client, uint8_t opcode, const uint8_t *data, size_t len) {
+    uint8_t tag[16];
+    size_t tag_len = 0;
+    if (opcode == WS_OPCODE_BIN) client->unacked += len;
+    if (client->parent) {
+        tag_len = channel_tag(client, opcode, &data, &len, tag, sizeof(tag));
+        client = client->parent;
+    }
+
+    pool_buf_t *buf = client_out_room(client, WS_MAX_HEADER + tag_len + len, 0);
+    if (!buf) return -1;
+
+    uint8_t *frame = buf->data + buf->end;
+    size_t header_len = ws_build_header(opcode, tag_len + len, frame);
+    memcpy(frame + header_len, tag, tag_len);
+    if (len > 0) memcpy(frame + header_len + tag_len, data, len);
+    buf->end += header_len + tag_len + len;
+    client->out_bytes += header_len + tag_len + len;
+    return 0;
+}
+
+int client_send_text(client_t *client, const char *text, size_t len) {
+    return client_send_frame(client, WS_OPCODE_TEXT, (const uint8_t *)text, len);
+}
+
+// Queue a frame shared with other viewers without copying it
+int client_queue_shared(client_t *client, shared_buf_t *frame) {
+    pool_buf_t *ref = slab_alloc(&client->owner->ref_slab);
+    if (!ref) return -1;
+
+    ref->shared = shared_buf_ref(frame);
+    ref->end = frame->len;
+    client->unacked += ws_payload_bytes(frame->data, frame->len, WS_OPCODE_BIN);
+
+    if (client->out_tail) client->out_tail->next = ref;
+    else client->out_head = ref;
+    client->out_tail = ref;
+    client->out_bytes += frame->len;
+    return 0;
+}
+
+// Release a buffer taken off the output queue
+static void client_out_release(client_t *client, pool_buf_t *buf) {
+    if (client->out_raw == buf) client->out_raw = NULL;
+    client->out_bytes -= buf->end - buf->start;
+
+    if (buf->shared) {
+        shared_buf_unref(buf->shared);
+        slab_free(&client->owner->ref_slab, buf);
+    } else {
+        buf_put(&client->owner->buffers, buf);
+    }
+}
+
+// Give the oldest output buffer back
+static void client_out_pop(client_t *client) {
+    pool_buf_t *buf = client->out_head;
+
+    client->out_head = buf->next;
+    if (!client->out_head) client->out_tail = NULL;
+    client_out_release(client, buf);
+}
+
+size_t client_pending(client_t *client) {
+    size_t pending = client->out_bytes + client->splice_header_len + client->splice_pending;
+    if (client->transfer && client->state == CLIENT_CLOSING) {
+        pending += client->transfer->end - client->transfer->pos;
+    }
+    return pending;
+}
+
+// Record a stage of the client's input seq (--trace)
+void client_trace(client_t *client, trace_type_t type, uint32_t seq) {
+    if (!trace_on() || client->parent) return;
+    if (!client->trace_id) client->trace_id = trace_conn_id();
+    trace_record(type, client->trace_id, seq, 0, 0);
+}
+
+// Output reflecting input seq is queued; it is out once everything
+// queued so far is
+void client_trace_queued(client_t *client, uint32_t seq) {
+    if (!trace_on()) return;
+    client_trace(client, TRACE_QUEUED, seq);
+    client->trace_seq = seq;
+    client->trace_unsent = client_pending(client);
+    if (client->trace_unsent == 0) client_trace(client, TRACE_SENT, seq);
+}
+
+// Count bytes written against the traced frame
+static void client_trace_sent(client_t *client, size_t n) {
+    if (client->trace_unsent == 0) return;
+    if (n < client->trace_unsent) {
+        client->trace_unsent -= n;
+        return;
+    }
+    client->trace_unsent = 0;
+    client_trace(client, TRACE_SENT, client->trace_seq);
+}
+
+// Output the client hasn't received yet, ours and the kernel's; for a
+// channel, what the browser has not yet acknowledged drawing
+size_t client_backlog(client_t *client) {
+    if (client->parent) return client->unacked;
+
+    int unsent = 0;
+    if (ioctl(client->socket_fd, SIOCOUTQ, &unsent) < 0) unsent = 0;
+    size_t backlog = client_pending(client) + (size_t)unsent;
+    // A page that acknowledges what it draws is behind by what it hasn't,
+    // however fast the socket drains into it
+    if (client->acking && client->unacked > backlog) backlog = client->unacked;
+    return backlog;
+}
+
+// Take bytes the browser reports drawn off the output it owes us
+void client_ack(client_t *client, size_t bytes) {
+    client->unacked -= bytes < client->unacked ? bytes : client->unacked;
+}
+
+// Frames from offset on in buf are being dropped and won't be acknowledged
+static void client_out_dropped(client_t *client, pool_buf_t *buf, uint32_t offset) {
+    if (buf == client->out_raw) return;
+    client_ack(client, ws_payload_bytes(pool_buf_bytes(buf) + offset, buf->end - offset,
+                                        WS_OPCODE_BIN));
+}
+
+// Nobody is looking: the page, or the tiled page holding the channel,
+// is in a background tab
+int client_hidden(client_t *client) {
+    return client->hidden || (client->parent && client->parent->hidden);
+}
+
+// Backlog allowed before the client is resynced: one screenful
+size_t client_flood_limit(client_t *client) {
+    if (server_config->flood_limit > 0) return server_config->flood_limit;
+
+    size_t limit = (size_t)client->cols * client->rows * FLOOD_CELL_BYTES;
+    return limit < FLOOD_MIN_BYTES ? FLOOD_MIN_BYTES : limit;
+}
+
+// Drop the output frames in buf from offset on, moving the messages
+// and control frames between them down over the gaps
+static void client_out_compact(client_t *client, pool_buf_t *buf, uint32_t offset) {
+    uint8_t *data = buf->data;
+    uint32_t kept = offset;
+
+    while (offset < buf->end) {
+        uint32_t size = ws_frame_size(data + offset, buf->end - offset);
+        if ((data[offset] & 0x0F) == WS_OPCODE_BIN) {
+            client_ack(client, ws_payload_bytes(data + offset, size, WS_OPCODE_BIN));
+        } else {
+            memmove(data + kept, data + offset, size);
+            kept += size;
+        }
+        offset += size;
+    }
+    client->out_bytes -= buf->end - kept;
+    buf->end = kept;
+}
+
+// Drop the client's backlog and have tmux repaint the whole screen.
+// Only output goes: messages such as a prediction mode, a file offer or
+// a closed channel are sent once and must still arrive
+static void client_resync(client_t *client) {
+    pool_buf_t *prev = NULL;
+    pool_buf_t *buf = client->out_head;
+    while (buf) {
+        pool_buf_t *next = buf->next;
+        int drop = 0;
+
+        if (buf->shared) {
+            // One output frame; it has to be finished once on the wire
+            if (buf->start == 0) {
+                client_out_dropped(client, buf, 0);
+                drop = 1;
+            }
+        } else if (buf != client->out_raw) {
+            // So does the frame partly on the wire
+            uint32_t offset = 0;
+            while (offset < buf->start) {
+                offset += ws_frame_size(buf->data + offset, buf->end - offset);
+            }
+            client_out_compact(client, buf, offset);
+        }
+
+        if (drop || buf->start == buf->end) {
+            if (prev) prev->next = next;
+            else client->out_head = next;
+            client_out_release(client, buf);
+        } else {
+            prev = buf;
+        }
+        buf = next;
+    }
+    client->out_tail = prev;
+
+    client_send_frame(client, WS_OPCODE_BIN, (const uint8_t *)RESYNC_PREFIX,
+                      sizeof(RESYNC_PREFIX) - 1);
+    if (server_config->shared) {
+        feed_redraw(client->hub);
+    } else {
+        terminal_redraw(&client->terminal);
+    }
+    client->resyncing = 1;
+    client->dirty = 0;
+    client->trace_unsent = 0;
+    if (client->vt) vtopt_reset(client->vt);
+    // The output an echo message tagged may be gone: tag the next output
+    // again so predictions still get confirmed
+    if (client->input_seq) client->echo_seq = client->input_seq - 1;
+}
+
+// Decide whether len more bytes of output go to the client, resyncing
+// it if it fell too far behind
+// Returns 1 to queue the output, 0 to drop it
+int client_admit_output(client_t *client, size_t len) {
+    // A hidden page is sent nothing and redrawn when shown again, so
+    // it catches up with one screenful rather than everything it missed
+    if (client_hidden(client)) {
+        client->dirty = 1;
+        if (client->vt) vtopt_reset(client->vt);
+        return 0;
+    }
+
+    size_t limit = client_flood_limit(client);
+    size_t backlog = client_backlog(client);
+
+    if (!client->resyncing && backlog + len > limit) {
+        printf("[WS] %s fell behind, resyncing\n", client->client_ip);
+        client_resync(client);
+        backlog = client_backlog(client);
+    }
+
+    // Until the redraw has gone out, only drop output and remember to
+    // redraw once more, rather than restarting the redraw over and over
+    if (client->resyncing && backlog + len > limit * FLOOD_HARD_FACTOR) {
+        client->dirty = 1;
+        if (client->vt) vtopt_reset(client->vt);
+        return 0;
+    }
+    return 1;
+}
+
+static int client_queue_output(client_t *client, const uint8_t *data, size_t len) {
+    if (!client_admit_output(client, len)) return 0;
+
+    size_t max = client->parent ? CHANNEL_CHUNK : OUTPUT_CHUNK;
+    while (len > 0) {
+        size_t chunk = len < max ? len : max;
+        if (client_send_frame(client, WS_OPCODE_BIN, data, chunk) < 0) return -1;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Queue terminal output, dropping it for clients that fell too far
+// behind; with --compact it is rewritten shorter first
+int client_send_output(client_t *client, const uint8_t *data, size_t len) {
+    if (!client->vt || client_hidden(client)) return client_queue_output(client, data, len);
+
+    uint8_t *out = client->owner->vt_buf;
+    while (len > 0) {
+        size_t chunk = len < BUFFER_SIZE ? len : BUFFER_SIZE;
+        size_t n = vtopt_rewrite(client->vt, data, chunk, out);
+        if (n > 0 && client_queue_output(client, out, n) < 0) return -1;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Keep the kernel's unsent output near one bandwidth-delay product, so
+// that the rest waits in our queue where a resync can still drop it and
+// a keystroke's echo does not queue behind seconds of stale output. The
+// socket reports writable again once the unsent bytes fall below the
+// limit (TCP_NOTSENT_LOWAT).
+static void client_pace_update(client_t *client) {
+    uint64_t now = worker_now_ms();
+    uint64_t elapsed = now - client->pace_checked;
+    client->pace_checked = now;
+
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(client->socket_fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 ||
+        len < offsetof(struct tcp_info, tcpi_bytes_acked) + sizeof(info.tcpi_bytes_acked)) {
+        client->pace_off = 1;
+        return;
+    }
+
+    // What the peer took since the last look, over the round trip time,
+    // capped by what the congestion window lets fly
+    uint64_t acked = info.tcpi_bytes_acked - client->pace_acked;
+    client->pace_acked = info.tcpi_bytes_acked;
+    uint64_t bdp = 0;
+    if (client->pace_limit && elapsed > 0) {
+        bdp = acked * 1000 / elapsed * info.tcpi_rtt / 1000000;
+        uint64_t window = (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+        if (bdp > window) bdp = window;
+    }
+    uint32_t limit = bdp < PACE_MIN_BYTES ? PACE_MIN_BYTES :
+                     bdp > PACE_MAX_BYTES ? PACE_MAX_BYTES : (uint32_t)bdp;
+
+    // Small changes are not worth a system call
+    uint32_t slack = client->pace_limit / 8;
+    if (client->pace_limit && limit + slack >= client->pace_limit &&
+        limit <= client->pace_limit + slack) {
+        return;
+    }
+
+    int lowat = (int)limit;
+    if (setsockopt(client->socket_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0) {
+        client->pace_off = 1;
+        return;
+    }
+    client->pace_limit = limit;
+}
+
+// Bytes the socket should take now
+static size_t client_pace_room(client_t *client) {
+    if (!client->pace_off &&
+        (!client->pace_limit || worker_now_ms() - client->pace_checked >= PACE_CHECK_MS)) {
+        client_pace_update(client);
+    }
+    if (client->pace_off) return SIZE_MAX;
+
+    int unsent = 0;
+    if (ioctl(client->socket_fd, SIOCOUTQNSD, &unsent) < 0) return SIZE_MAX;
+    return (uint32_t)unsent >= client->pace_limit ? 0 : client->pace_limit - unsent;
+}
+
+// Write as much queued output as the socket should take without
+// blocking, paced to the link
+// Returns 0 on success, -1 on error
+int client_flush(client_t *client) {
+    // The frame whose payload sits in the pipe goes out before the queue
+    while (client->splice_header_len > 0) {
+        ssize_t n = send(client->socket_fd, client->splice_header, client->splice_header_len,
+                         MSG_DONTWAIT | MSG_MORE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        client->splice_header_len -= n;
+        client_trace_sent(client, n);
+        memmove(client->splice_header, client->splice_header + n, client->splice_header_len);
+    }
+
+    // Only terminals are paced; a response or download goes at full speed
+    size_t room = client->state == CLIENT_WEBSOCKET ? client_pace_room(client) : SIZE_MAX;
+    while (client->splice_pending > 0 && room > 0) {
+        size_t len = client->splice_pending < room ? client->splice_pending : room;
+        ssize_t n = splice(client->splice_pipe[0], NULL, client->socket_fd, NULL,
+                           len, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return 0;
+        client->splice_pending -= n;
+        room -= n;
+        client_trace_sent(client, n);
+    }
+    if (client->splice_pending > 0) return 0;
+
+    while (client->out_head && room > 0) {
+        struct iovec iov[MAX_IOV];
+        int count = 0;
+        size_t total = 0;
+
+        for (pool_buf_t *buf = client->out_head; buf && count < MAX_IOV && total < room;
+             buf = buf->next) {
+            size_t len = buf->end - buf->start;
+            if (len > room - total) len = room - total;
+            iov[count].iov_base = pool_buf_bytes(buf) + buf->start;
+            iov[count].iov_len = len;
+            total += len;
+            count++;
+        }
+
+        ssize_t n = writev(client->socket_fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        // Release what went out; a partly written buffer stays at the head
+        room -= n;
+        client_trace_sent(client, n);
+        while (n > 0) {
+            pool_buf_t *head = client->out_head;
+            size_t avail = head->end - head->start;
+            if ((size_t)n < avail) {
+                head->start += n;
+                client->out_bytes -= n;
+                break;
+            }
+            n -= avail;
+            client_out_pop(client);
+        }
+    }
+
+    // A download follows its headers straight from the file
+    file_transfer_t *t = client->transfer;
+    while (t && client->state == CLIENT_CLOSING && !client->out_head && t->pos < t->end) {
+        size_t len = t->end - t->pos < TRANSFER_CHUNK ? t->end - t->pos : TRANSFER_CHUNK;
+        ssize_t n = sendfile(client->socket_fd, t->fd, &t->pos, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1;  // The file shrank
+    }
+    return 0;
+}
+
+// Finish a resync once the redraw has mostly reached the client, and
+// redraw again if output was dropped in the meantime
+void client_check_resync(client_t *client) {
+    if (!client->resyncing || client_backlog(client) > client_flood_limit(client)) {
+        return;
+    }
+
+    client->resyncing = 0;
+    if (client->dirty && !client_hidden(client)) client_resync(client);
+}
+
+// The browser hid or showed the page; once shown, whatever was dropped
+// meanwhile is redrawn
+void client_set_hidden(client_t *client, int hidden) {
+    if (client->hidden == hidden) return;
+    client->hidden = hidden;
+    if (hidden) return;
+
+    if (client->mux) {
+        for (client_t *channel = client->channels; channel; channel = channel->sibling) {
+            if (channel->dirty) client_resync(channel);
+        }
+    } else if (client->dirty) {
+        client_resync(client);
+    }
+}
+
+// Tell the client whether local echo prediction is safe right now
+static void client_set_predict(client_t *client, int mode) {
+    if (mode < 0 || mode == client->predict) return;
+    client->predict = mode;
+
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), "{\"type\":\"predict\",\"enabled\":%s}",
+                       mode ? "true" : "false");
+    client_send_text(client, msg, len);
+}
+
+// Reap a probe's tmux that has closed its output but not exited yet
+// once it does, like a released terminal
+static void probe_release(client_t *client) {
+    if (client->probe.pid == 0) return;
+    terminal_t term;
+    terminal_echo_orphan(&client->probe, &term);
+    release_terminal(client->owner, &term);
+}
+
+static void on_client_probe(watcher_t *watcher, uint32_t events) {
+    (void)events;
+    client_t *client = (client_t *)((char *)watcher - offsetof(client_t, probe_out));
+
+    int mode;
+    if (terminal_echo_read(&client->probe, &mode) == 0) return;
+    worker_unwatch(&client->probe_out);
+    probe_release(client);
+    client_set_predict(client, mode);
+    if (client_send_pending(client) < 0) client_close(client);
+}
+
+// Stop a check still under way
+void client_probe_cancel(client_t *client) {
+    if (client->probe.pid == 0) return;
+    worker_unwatch(&client->probe_out);
+    terminal_echo_cancel(&client->probe);
+    probe_release(client);
+}
+
+// Ask tmux about the echo mode in the background, at most every
+// PREDICT_CHECK_MS; the answer updates the client when it comes
+static void update_predict_mode(client_t *client) {
+    uint64_t now = worker_now_ms();
+    if (client->probe.pid || now - client->predict_checked < PREDICT_CHECK_MS) return;
+    client->predict_checked = now;
+
+    if (terminal_echo_probe(&client->terminal, &client->probe) < 0) return;
+    if (worker_watch(&client->owner->worker, &client->probe_out, client->probe.fd, EPOLLIN,
+                     on_client_probe) < 0) {
+        terminal_echo_cancel(&client->probe);
+        probe_release(client);
+    }
+}
+
+// Write queued input until the terminal is full
+// Returns 0 on success, -1 if the terminal is gone
+int pty_queue_flush(pty_queue_t *q, buf_pool_t *pool, terminal_t *term) {
+    while (q->head) {
+        pool_buf_t *head = q->head;
+        ssize_t n = terminal_write(term, (const char *)head->data + head->start,
+                                   head->end - head->start);
+        if (n <= 0) return n < 0 ? -1 : 0;
+
+        head->start += n;
+        q->bytes -= n;
+        if (head->start == head->end) {
+            q->head = head->next;
+            if (!q->head) q->tail = NULL;
+            buf_put(pool, head);
+        }
+    }
+    return 0;
+}
+
+// Give input to the terminal, queueing what it can't take now behind
+// what is already waiting
+// Returns 0 on success, -1 if the terminal is gone or out of memory
+int pty_queue_write(pty_queue_t *q, buf_pool_t *pool, terminal_t *term,
+                    const uint8_t *data, size_t len) {
+    if (!q->head) {
+        ssize_t n = terminal_write(term, (const char *)data, len);
+        if (n < 0) return -1;
+        data += n;
+        len -= n;
+    }
+
+    while (len > 0) {
+        pool_buf_t *tail = q->tail;
+        if (!tail || tail->end == POOL_BUF_CAPACITY) {
+            tail = buf_get(pool);
+            if (!tail) return -1;
+            if (q->tail) q->tail->next = tail;
+            else q->head = tail;
+            q->tail = tail;
+        }
+
+        size_t chunk = POOL_BUF_CAPACITY - tail->end;
+        if (chunk > len) chunk = len;
+        memcpy(tail->data + tail->end, data, chunk);
+        tail->end += chunk;
+        q->bytes += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+void pty_queue_clear(pty_queue_t *q, buf_pool_t *pool) {
+    while (q->head) {
+        pool_buf_t *next = q->head->next;
+        buf_put(pool, q->head);
+        q->head = next;
+    }
+    q->tail = NULL;
+    q->bytes = 0;
+}
+
+// Wait for room in the terminal while input is queued
+void pty_queue_watch(pty_queue_t *q, watcher_t *pty) {
+    worker_modify(pty, q->head ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+// Write keyboard input to the terminal, the input of all frames from
+// one read at once. Input the terminal can't take yet waits for it;
+// once too much waits, the socket is not read until it catches up
+void client_input(client_t *client, const uint8_t *data, size_t len) {
+    if (len == 0) return;
+
+    // Typing into a flood: output queued here beyond what the link
+    // drains in a round trip would only hold up the echo, so it goes
+    // in favour of a redraw, even one already on its way
+    if (!client->parent && !client->mux && client->pace_limit &&
+        client->out_bytes > client->pace_limit) {
+        client_resync(client);
+    }
+
+    // A shared terminal's echo can't be told apart per viewer, so
+    // viewers of one never predict
+    if (server_config->shared) {
+        feed_input(client->hub, data, len);
+        return;
+    }
+
+    if (pty_queue_write(&client->input, &client->owner->buffers, &client->terminal,
+                        data, len) < 0) {
+        pty_queue_clear(&client->input, &client->owner->buffers);
+    }
+    if (!client->input.head) client_trace(client, TRACE_PTY_WRITE, client->input_seq);
+    pty_queue_watch(&client->input, &client->pty);
+
+    // Channels don't predict: a probe per typing channel would be a tmux
+    // started every PREDICT_CHECK_MS for each terminal of a page
+    if (!client->parent) update_predict_mode(client);
+}
+
+// Whether to stop reading the socket: from when PTY_INPUT_MAX bytes of
+// input wait until half of that is taken
+static int client_input_paused(client_t *client) {
+    size_t queued = client->input.bytes;
+    if (server_config->shared) queued = client->hub ? atomic_load(&client->hub->input_queued) : 0;
+
+    if (queued >= PTY_INPUT_MAX) client->input_paused = 1;
+    else if (queued <= PTY_INPUT_MAX / 2) client->input_paused = 0;
+    return client->input_paused;
+}
+
+// Events to watch the socket for; any channel behind on input holds up
+// the whole connection
+uint32_t client_sock_events(client_t *client) {
+    int paused = client_input_paused(client);
+    for (client_t *channel = client->channels; channel; channel = channel->sibling) {
+        paused |= client_input_paused(channel);
+    }
+
+    uint32_t events = paused ? 0 : EPOLLIN;
+    if (client_pending(client) > 0) events |= EPOLLOUT;
+    return events;
+}
+
+// Pass the browser's size on to the terminal
+void client_apply_size(client_t *client) {
+    client->resize_pending = 0;
+    if (server_config->shared) {
+        feed_resize(client->hub, client->cols, client->rows);
+    } else {
+        terminal_resize(&client->terminal, client->cols, client->rows);
+    }
+}
+
+// Each resize makes tmux redraw the screen, and dragging a window edge
+// reports dozens of sizes a second. The first size a connection reports
+// applies at once; later ones wait until the size has stopped changing
+// for RESIZE_QUIET_MS, so a drag costs one redraw.
+void client_resize(client_t *client, int cols, int rows) {
+    int first = client->resize_seen == 0;
+
+    client->cols = cols;
+    client->rows = rows;
+    client->resize_seen = worker_now_ms();
+    if (client->vt) vtopt_resize(client->vt, cols, rows);
+    if (first) {
+        client_apply_size(client);
+    } else {
+        client->resize_pending = 1;
+    }
+}
+
+// Send what the socket takes now and wait for writability if needed;
+// a channel's go out on its connection
+int client_send_pending(client_t *client) {
+    if (client->parent) client = client->parent;
+    if (client_flush(client) < 0) return -1;
+
+    worker_modify(&client->sock, client_sock_events(client));
+    return 0;
+}
+
+// Queue an HTTP response with extra header lines, each ending in CRLF,
+// and close once it is written
+void send_http_reply(client_t *client, int status_code, const char *status_text,
+                     const char *content_type, const char *headers,
+                     const char *body, size_t body_len) {
+    char header[768];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "Connection: close\r\n"
+        "\r\n",
+        status_code, status_text, content_type, body_len, headers);
+
+    client_queue_raw(client, header, header_len);
+    client_queue_raw(client, body, body_len);
+    client->state = CLIENT_CLOSING;
+}
+
+// Queue an HTTP response and close once it is written
+void send_http_response(client_t *client, int status_code, const char *status_text,
+                        const char *content_type, const char *body, size_t body_len) {
+    send_http_reply(client, status_code, status_text, content_type, "", body, body_len);
+}
+
+// Queue the WebSocket upgrade response
+int send_ws_upgrade_response(client_t *client, const char *accept_key) {
+    char response[512];
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "\r\n",
+        accept_key);
+
+    return client_queue_raw(client, response, len);
+}
+
+// Drop the unprocessed input and its buffer
+void client_in_release(client_t *client) {
+    if (client->in_pooled) {
+        buf_put(&client->owner->buffers, client->in_pooled);
+    } else {
+        free(client->in_data);
+    }
+    client->in_pooled = NULL;
+    client->in_data = NULL;
+    client->in_len = 0;
+    client->in_cap = 0;
+}
+
+// Make room for need bytes of input (plus a terminating NUL), borrowing
+// a pool buffer, or a heap block for oversized frames
+int client_in_reserve(client_t *client, size_t need) {
+    if (need + 1 <= client->in_cap) return 0;
+
+    uint8_t *data;
+    pool_buf_t *pooled = NULL;
+
+    if (need + 1 <= POOL_BUF_CAPACITY) {
+        pooled = buf_get(&client->owner->buffers);
+        if (!pooled) return -1;
+        data = pooled->data;
+    } else {
+        data = malloc(need + 1);
+        if (!data) return -1;
+    }
+
+    size_t len = client->in_len;
+    if (len > 0) memcpy(data, client->in_data, len);
+    client_in_release(client);
+
+    client->in_data = data;
+    client->in_pooled = pooled;
+    client->in_len = len;
+    client->in_cap = pooled ? POOL_BUF_CAPACITY : need + 1;
+    return 0;
+}
+
+atomic_int reap_on_sigchld;
+
+void orphan_free(server_worker_t *sw, orphan_t *orphan) {
+    worker_unwatch(&orphan->child);
+    terminal_close(&orphan->terminal);
+
+    if (orphan->prev) orphan->prev->next = orphan->next;
+    else sw->orphans = orphan->next;
+    if (orphan->next) orphan->next->prev = orphan->prev;
+    free(orphan);
+}
+
+void on_orphan_exit(watcher_t *watcher, uint32_t events) {
+    (void)events;
+    orphan_t *orphan = (orphan_t *)watcher;
+    if (terminal_reap(&orphan->terminal)) {
+        orphan_free((server_worker_t *)watcher->worker, orphan);
+    }
+}
+
+// Watch a terminal's pidfd, or fall back to checking on SIGCHLD
+void watch_child(server_worker_t *sw, watcher_t *child, terminal_t *term, watcher_cb cb) {
+    if (term->pid_fd >= 0) {
+        worker_watch(&sw->worker, child, term->pid_fd, EPOLLIN, cb);
+    } else if (term->pid > 0) {
+        atomic_store(&reap_on_sigchld, 1);
+    }
+}
+
+// Hang up a terminal (the caller has stopped watching it) and reap its
+// tmux client once it exits, so none is left a zombie
+void release_terminal(server_worker_t *sw, terminal_t *term) {
+    terminal_hangup(term);
+
+    orphan_t *orphan = terminal_reap(term) ? NULL : malloc(sizeof(*orphan));
+    if (!orphan) {
+        terminal_close(term);
+        return;
+    }
+
+    memset(orphan, 0, sizeof(*orphan));
+    orphan->terminal = *term;
+    orphan->terminal.session_name = NULL;
+    term->pid = 0;
+    term->pid_fd = -1;
+
+    orphan->next = sw->orphans;
+    if (sw->orphans) sw->orphans->prev = orphan;
+    sw->orphans = orphan;
+    watch_child(sw, &orphan->child, &orphan->terminal, on_orphan_exit);
+}
+
+static void warm_release(worker_t *worker, terminal_t *term) {
+    release_terminal((server_worker_t *)worker, term);
+}
+
+// Keep spares for the served session from the start (--warm)
+void warm_start(server_worker_t *sw) {
+    if (server_config->warm <= 0 || server_config->shared) return;
+
+    sw->warm = warm_pool_new(&sw->worker, server_config->warm, warm_release);
+    if (sw->warm && server_config->tmux_session) warm_want(sw->warm, server_config->tmux_session, 1);
+}
+
+static void client_free(worker_t *worker, void *arg) {
+    (void)worker;
+    client_t *client = arg;
+    slab_free(&client->owner->client_slab, client);
+}
+
+void client_close(client_t *client) {
+    // Channels sit ahead of their connection in the worker's list, so
+    // closing a connection while walking the list only removes clients
+    // already passed
+    worker_unwatch(&client->sock);
+    while (client->channels) {
+        client_close(client->channels);
+    }
+    if (client->parent) channel_unlink(client);
+
+    if (client->websocket_ready && client->hub) {
+        hub_leave(client->hub, &client->owner->worker, client->client_ip);
+    }
+    if (client->hub && client->hub->history) history_release(client->hub->history, client);
+    if (client->hub && client->hub->archive) archive_release(client->hub->archive, client);
+
+    worker_unwatch(&client->pty);
+    worker_unwatch(&client->child);
+    client_probe_cancel(client);
+    release_terminal(client->owner, &client->terminal);
+    vtopt_free(client->vt);
+    if (client->transfer) {
+        close(client->transfer->fd);
+        if (client->transfer->partial) unlink(client->transfer->partial);
+        free(client->transfer->partial);
+        free(client->transfer);
+    }
+    if (client->socket_fd >= 0) close(client->socket_fd);
+    if (client->splice_pipe[0] >= 0) {
+        close(client->splice_pipe[0]);
+        close(client->splice_pipe[1]);
+    }
+
+    client_in_release(client);
+    pty_queue_clear(&client->input, &client->owner->buffers);
+    while (client->out_head) {
+        client_out_pop(client);
+    }
+
+    if (client->prev) client->prev->next = client->next;
+    else client->owner->clients = client->next;
+    if (client->next) client->next->prev = client->prev;
+
+    wheel_stop(&client->timer);
+    if (client->hub) hub_put(client->hub);
+    free(client->session_copy);
+
+    // Other events in this batch may still point at the client
+    worker_defer(&client->owner->worker, client_free, client);
+}
+
+// Copy s into out, decoding %XX escapes; in a query value, + is a
+// space and & ends it
+void url_decode(const char *s, int query, char *out, size_t size) {
+    size_t len = 0;
+    while (*s && !(query && *s == '&') && len + 1 < size) {
+        if (s[0] == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            char hex[3] = { s[1], s[2], '\0' };
+            out[len++] = (char)strtol(hex, NULL, 16);
+            s += 3;
+        } else {
+            out[len++] = query && *s == '+' ? ' ' : *s;
+            s++;
+        }
+    }
+    out[len] = '\0';
+}
+
+// Copy the URL-decoded value of a query string parameter into out
+// Returns 0 if it is there, -1 if not
+int query_param(const char *query, const char *name, char *out, size_t size) {
+    size_t name_len = strlen(name);
+
+    for (const char *p = query; p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL) {
+        if (strncmp(p, name, name_len) != 0 || p[name_len] != '=') continue;
+        url_decode(p + name_len + 1, 1, out, size);
+        return 0;
+    }
+    return -1;
+}
+
+// Close a connection whose peer is gone or stuck, with a reset so the
+// kernel drops what it still holds for it instead of trying on
+static void client_abort(client_t *client) {
+    struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+    if (client->socket_fd >= 0) {
+        setsockopt(client->socket_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+    client_close(client);
+}
+
+// A connection's deadline came: its request is late, its upload or
+// response stalled, or a viewer went quiet. Any data from the browser
+// counts as an answer to a ping, so a live one is never closed
+static void on_client_timer(wheel_timer_t *timer) {
+    client_t *client = (client_t *)((char *)timer - offsetof(client_t, timer));
+    uint64_t now = worker_now_ms();
+    uint64_t due;
+
+    switch (client->state) {
+        case CLIENT_HTTP:
+        case CLIENT_WAITING:
+            // Late request, or an answer that never came
+            client_close(client);
+            return;
+
+        case CLIENT_UPLOAD:
+            if (now - client->heard_ms >= IDLE_TIMEOUT_MS) {
+                printf("[Files] %s stalled, upload abandoned\n", client->client_ip);
+                client_abort(client);
+                return;
+            }
+            due = client->heard_ms + IDLE_TIMEOUT_MS;
+            break;
+
+        case CLIENT_CLOSING:
+            // The kernel's queue counts too: it drains between our writes
+            if (client_backlog(client) == client->stalled_backlog) {
+                client_abort(client);
+                return;
+            }
+            client->stalled_backlog = client_backlog(client);
+            due = now + IDLE_TIMEOUT_MS;
+            break;
+
+        case CLIENT_WEBSOCKET:
+        default:
+            if (client->ping_ms > client->heard_ms) {
+                if (now - client->ping_ms >= PONG_TIMEOUT_MS) {
+                    printf("[WS] %s stopped answering pings\n", client->client_ip);
+                    client_abort(client);
+                    return;
+                }
+                due = client->ping_ms + PONG_TIMEOUT_MS;
+            } else if (now - client->heard_ms >= PING_INTERVAL_MS) {
+                client->ping_ms = now;
+                client_send_frame(client, WS_OPCODE_PING, NULL, 0);
+                if (client_send_pending(client) < 0) {
+                    client_close(client);
+                    return;
+                }
+                due = now + PONG_TIMEOUT_MS;
+            } else {
+                due = client->heard_ms + PING_INTERVAL_MS;
+            }
+            break;
+    }
+    wheel_start(&client->owner->worker.timers, &client->timer, due, on_client_timer);
+}
+
+// Start checking on a connection, first for its request headers
+void client_start_timer(client_t *client) {
+    client->heard_ms = worker_now_ms();
+    wheel_start(&client->owner->worker.timers, &client->timer,
+                client->heard_ms + HANDSHAKE_TIMEOUT_MS, on_client_timer);
+}
+
+// Park a client until another thread's answer comes back, for up to
+// IDLE_TIMEOUT_MS
+// Returns the serial the answer finds it by
+uint64_t client_wait(client_t *client) {
+    client->serial = ++client->owner->last_serial;
+    client->state = CLIENT_WAITING;
+    wheel_start(&client->owner->worker.timers, &client->timer,
+                worker_now_ms() + IDLE_TIMEOUT_MS, on_client_timer);
+    return client->serial;
+}
+
+// The serial another thread's answer finds the client by, without
+// parking it
+uint64_t client_serial(client_t *client) {
+    if (!client->serial) client->serial = ++client->owner->last_serial;
+    return client->serial;
+}
+
+// The client of the worker with serial, or NULL if it is gone
+client_t *client_find(server_worker_t *sw, uint64_t serial) {
+    for (client_t *client = sw->clients; client; client = client->next) {
+        if (client->serial == serial) return client;
+    }
+    return NULL;
+}
+
+// The client of the worker still waiting under serial, ready to reply,
+// or NULL if it is gone
+client_t *client_resume(server_worker_t *sw, uint64_t serial) {
+    client_t *client = client_find(sw, serial);
+    if (!client || client->state != CLIENT_WAITING) return NULL;
+    client->state = CLIENT_HTTP;
+    return client;
+}
+
+// Write what a resumed client queued, and close it if it is all out
+void client_resumed(client_t *client) {
+    if (client->state == CLIENT_CLOSING &&
+        (client_send_pending(client) < 0 || client_pending(client) == 0)) {
+        client_close(client);
+    }
+}
+
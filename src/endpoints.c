@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+
+#include "endpoints.h"
+#include "gateway.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#define SEARCH_LIMIT 100       // Matches per search unless asked otherwise
+#define SEARCH_LIMIT_MAX 1000
+
+// Report connection and buffer memory summed over all workers
+void send_stats(client_t *client) {
+    size_t connections = 0, client_bytes = 0, buffer_bytes = 0, buffers_in_use = 0;
+
+    for (int i = 0; i < worker_count; i++) {
+        connections += atomic_load(&workers[i].client_slab.in_use);
+        client_bytes += slab_bytes(&workers[i].client_slab);
+        buffer_bytes += buf_pool_bytes(&workers[i].buffers) + slab_bytes(&workers[i].ref_slab);
+        buffers_in_use += atomic_load(&workers[i].buffers.in_use);
+    }
+    size_t scratch_bytes = (size_t)worker_count * (BUFFER_SIZE + sizeof(workers[0].vt_buf));
+
+    char body[512];
+    int len = snprintf(body, sizeof(body),
+        "{\"workers\":%d,\"connections\":%zu,\"client_bytes\":%zu,"
+        "\"buffer_bytes\":%zu,\"buffers_in_use\":%zu,\"scratch_bytes\":%zu,"
+        "\"total_bytes\":%zu}\n",
+        worker_count, connections, client_bytes, buffer_bytes, buffers_in_use,
+        scratch_bytes, client_bytes + buffer_bytes + scratch_bytes);
+    send_http_response(client, 200, "OK", "application/json", body, len);
+}
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+    size_t limit, count;
+    int more;
+    int failed;
+    hub_t *hub;                // Holds a reference; its history is searched on the search thread
+    uint64_t serial;           // Client waiting for the result
+} search_out_t;
+
+static void search_append(search_out_t *out, const char *text, size_t len) {
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 16384;
+        while (cap < out->len + len) cap *= 2;
+        char *data = realloc(out->data, cap);
+        if (!data) {
+            out->failed = 1;
+            return;
+        }
+        out->data = data;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, text, len);
+    out->len += len;
+}
+
+// Append text as the inside of a JSON string
+static void search_append_escaped(search_out_t *out, const char *text, size_t len) {
+    size_t start = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        if (c != '"' && c != '\\' && c >= 0x20) continue;
+
+        char escape[8];
+        int escape_len = c == '"' || c == '\\' ? snprintf(escape, sizeof(escape), "\\%c", c) :
+                                                 snprintf(escape, sizeof(escape), "\\u%04x", c);
+        search_append(out, text + start, i - start);
+        search_append(out, escape, escape_len);
+        start = i + 1;
+    }
+    search_append(out, text + start, len - start);
+}
+
+static int on_search_match(uint64_t ms, const char *line, size_t len, void *arg) {
+    search_out_t *out = arg;
+    if (out->count == out->limit) {
+        out->more = 1;
+        return 1;
+    }
+
+    char prefix[64];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s{\"time\":%llu,\"line\":\"",
+                              out->count > 0 ? "," : "", (unsigned long long)ms);
+    search_append(out, prefix, prefix_len);
+    search_append_escaped(out, line, len);
+    search_append(out, "\"}", 2);
+    out->count++;
+    return out->failed;
+}
+
+// The search thread is done: reply to the client if it is still there
+static void search_done_task(worker_t *worker, void *arg) {
+    search_out_t *out = arg;
+    client_t *client = client_resume((server_worker_t *)worker, out->serial);
+    if (client) {
+        uint64_t lines, bytes;
+        history_size(out->hub->history, &lines, &bytes);
+        char tail[128];
+        int tail_len = snprintf(tail, sizeof(tail), "],\"more\":%s,\"lines\":%llu,\"bytes\":%llu}\n",
+                                out->more ? "true" : "false",
+                                (unsigned long long)lines, (unsigned long long)bytes);
+        search_append(out, tail, tail_len);
+
+        if (out->failed) {
+            const char *error = "Out of memory";
+            send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        } else {
+            send_http_response(client, 200, "OK", "application/json", out->data, out->len);
+        }
+        client_resumed(client);
+    }
+    hub_put(out->hub);
+    free(out->data);
+    free(out);
+}
+
+// A search waiting for the helper thread to find out whether tmux has
+// the session (snapshot.h)
+typedef struct {
+    uint64_t serial;
+    char query[PATH_MAX];
+} search_request_t;
+
+static void search_session(client_t *client, const char *query, int waited);
+
+// The helper has listed the sessions since the search had to wait
+static void search_ready_task(worker_t *worker, void *arg) {
+    search_request_t *req = arg;
+    client_t *client = client_resume((server_worker_t *)worker, req->serial);
+    if (client) {
+        search_session(client, req->query, 1);
+        client_resumed(client);
+    }
+    free(req);
+}
+
+// Wait for the helper's next pass to search again
+// Returns 0 if the client waits, -1 if not
+static int search_defer(client_t *client, const char *query) {
+    search_request_t *req = malloc(sizeof(*req));
+    if (!req) return -1;
+
+    snprintf(req->query, sizeof(req->query), "%s", query);
+    if (snapshot_wait(&client->owner->worker, search_ready_task, req) < 0) {
+        free(req);
+        return -1;
+    }
+
+    // The answer is posted to this worker, so it comes after this returns
+    req->serial = client_wait(client);
+    return 0;
+}
+
+// Search the history of a session that has a hub or that tmux has;
+// while the helper thread finds out whether it does, the client waits
+// for it, once
+static void search_session(client_t *client, const char *query, int waited) {
+    hub_t *hub = NULL;
+    if (server_config->history_dir && client->session_name) {
+        hub = hub_find(client->session_name);
+        int exists = hub ? 1 : snapshot_session_exists(client->session_name);
+        if (exists < 0 && !waited && search_defer(client, query) == 0) return;
+        if (!hub && exists > 0) hub = hub_get(client->session_name);
+    }
+    if (!hub || !hub->history) {
+        if (hub) hub_put(hub);
+        const char *not_kept = "No history is kept (see --history)";
+        send_http_response(client, 404, "Not Found", "text/plain", not_kept, strlen(not_kept));
+        return;
+    }
+
+    char text[256] = "";
+    char value[32];
+    query_param(query, "q", text, sizeof(text));
+
+    search_out_t *out = calloc(1, sizeof(*out));
+    if (!out) {
+        hub_put(hub);
+        const char *error = "Out of memory";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+    out->limit = SEARCH_LIMIT;
+    if (query_param(query, "limit", value, sizeof(value)) == 0) {
+        out->limit = strtoul(value, NULL, 10);
+        if (out->limit == 0 || out->limit > SEARCH_LIMIT_MAX) out->limit = SEARCH_LIMIT_MAX;
+    }
+    uint64_t before = 0;
+    if (query_param(query, "before", value, sizeof(value)) == 0) {
+        before = strtoull(value, NULL, 10);
+    }
+
+    search_append(out, "{\"matches\":[", 12);
+    out->hub = hub;
+
+    // The answer is posted to this worker, so it comes after this returns
+    if (history_search_post(hub->history, text, before, on_search_match, &client->owner->worker,
+                            search_done_task, out) < 0) {
+        hub_put(hub);
+        free(out->data);
+        free(out);
+        const char *error = "Failed to start the search";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+    out->serial = client_wait(client);
+}
+
+// Search the session's output history: q is the text to find, limit
+// the number of matches (newest first) and before a time in ms to page
+// back from. The search thread reads only the chunks whose trigrams can
+// match, and the client waits for it off the event loop.
+void send_search(client_t *client, const char *query) {
+    search_session(client, query, 0);
+}
+
+// Latency of recent keystrokes, stage by stage, as Chrome trace-event
+// JSON for chrome://tracing or Perfetto
+void send_trace(client_t *client) {
+    if (!trace_on()) {
+        const char *off = "Tracing is off (see --trace)";
+        send_http_response(client, 404, "Not Found", "text/plain", off, strlen(off));
+        return;
+    }
+
+    size_t len;
+    char *json = trace_export(&len);
+    if (!json) {
+        const char *error = "Out of memory";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+    send_http_response(client, 200, "OK", "application/json", json, len);
+    free(json);
+}
+
+static const char *SNAPSHOT_NAMES[SNAPSHOT_FORMATS] = { "text", "ansi", "html" };
+
+// A snapshot request waiting for the helper thread (snapshot.h)
+typedef struct {
+    uint64_t serial;
+    char session[256];
+    int format;
+    uint64_t version;
+    int attempt;
+} snapshot_request_t;
+
+static void serve_snapshot(client_t *client, const char *session, int format, uint64_t version,
+                           int attempt);
+
+// The helper has made a pass since the request had to wait
+static void snapshot_ready_task(worker_t *worker, void *arg) {
+    snapshot_request_t *req = arg;
+    client_t *client = client_resume((server_worker_t *)worker, req->serial);
+    if (client) {
+        serve_snapshot(client, req->session, req->format, req->version, req->attempt + 1);
+        client_resumed(client);
+    }
+    free(req);
+}
+
+// Wait for the helper's next pass to serve the snapshot again, unless
+// the request has waited enough already
+// Returns 0 if the client waits, -1 if not
+static int snapshot_defer(client_t *client, const char *session, int format, uint64_t version,
+                          int attempt) {
+    if (attempt >= SNAPSHOT_ATTEMPTS) return -1;
+    snapshot_request_t *req = malloc(sizeof(*req));
+    if (!req) return -1;
+
+    *req = (snapshot_request_t){ .format = format, .version = version, .attempt = attempt };
+    snprintf(req->session, sizeof(req->session), "%s", session);
+    if (snapshot_wait(&client->owner->worker, snapshot_ready_task, req) < 0) {
+        free(req);
+        return -1;
+    }
+
+    // The answer is posted to this worker, so it comes after this returns
+    req->serial = client_wait(client);
+    return 0;
+}
+
+// Reply with the snapshot of a session tmux has. While the helper thread
+// finds out whether tmux has it, or captures a screen output is known
+// to have changed, the client waits for it.
+static void serve_snapshot(client_t *client, const char *session, int format, uint64_t version,
+                           int attempt) {
+    static const char *TYPES[SNAPSHOT_FORMATS] = {
+        "text/plain; charset=utf-8", "text/plain; charset=utf-8", "text/html; charset=utf-8",
+    };
+
+    int exists = snapshot_session_exists(session);
+    hub_t *hub = exists > 0 ? hub_get(session) : NULL;
+    if ((exists < 0 || (hub && snapshot_changed(hub->snapshot))) &&
+        snapshot_defer(client, session, format, version, attempt) == 0) {
+        if (hub) hub_put(hub);
+        return;
+    }
+    if (!hub && exists < 0) {
+        const char *error = "Failed to list sessions";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+    if (!hub) {
+        const char *error = "No such session";
+        send_http_response(client, 404, "Not Found", "text/plain", error, strlen(error));
+        return;
+    }
+
+    char *data = NULL;
+    size_t len = 0;
+    int copied = snapshot_get(hub->snapshot, format, &version, &data, &len);
+    hub_put(hub);
+    if (copied == SNAPSHOT_PENDING && snapshot_defer(client, session, format, version, attempt) == 0) {
+        return;
+    }
+    if (copied < 0 || copied == SNAPSHOT_PENDING) {
+        const char *error = "Failed to capture the session";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+
+    char headers[128];
+    snprintf(headers, sizeof(headers), "ETag: \"%" PRIx64 "-%s\"\r\nCache-Control: no-cache\r\n",
+             version, SNAPSHOT_NAMES[format]);
+    if (copied) {
+        send_http_reply(client, 200, "OK", TYPES[format], headers, data, len);
+    } else {
+        send_http_reply(client, 304, "Not Modified", TYPES[format], headers, "", 0);
+    }
+    free(data);
+}
+
+// The screen of a session (s, else the one served) as text, ANSI or
+// HTML (format). The ETag is the snapshot's version, so a client that
+// has the current screen gets a 304 without anything being copied.
+void send_snapshot(client_t *client, const char *request, const char *query) {
+    char name[256] = "";
+    if (query_param(query, "s", name, sizeof(name)) < 0 && client->session_name) {
+        snprintf(name, sizeof(name), "%s", client->session_name);
+    }
+
+    char format_name[16] = "text";
+    query_param(query, "format", format_name, sizeof(format_name));
+    int format = 0;
+    while (format < SNAPSHOT_FORMATS && strcmp(SNAPSHOT_NAMES[format], format_name) != 0) format++;
+    if (format == SNAPSHOT_FORMATS || !name[0]) {
+        const char *error = name[0] ? "Unknown format" : "No such session";
+        send_http_response(client, 404, "Not Found", "text/plain", error, strlen(error));
+        return;
+    }
+
+    uint64_t version = 0;
+    const char *match = strstr(request, "\r\nIf-None-Match: \"");
+    char match_format[16];
+    if (match && (sscanf(match + 18, "%" SCNx64 "-%15[a-z]", &version, match_format) != 2 ||
+                  strcmp(match_format, SNAPSHOT_NAMES[format]) != 0)) {
+        version = 0;
+    }
+
+    serve_snapshot(client, name, format, version, 0);
+}
+
+// The one range of a body of size bytes the request asks for:
+// "bytes=A-B", "bytes=A-" or the last N, "bytes=-N". A list of ranges
+// counts as none.
+// Returns 1 with the range in start and last, 0 for the whole body, or
+// -1 if the range lies past the end
+int request_range(const char *request, long long size, long long *start,
+                  long long *last) {
+    *start = 0;
+    *last = size - 1;
+    const char *range = strstr(request, "\r\nRange: bytes=");
+    if (!range) return 0;
+    range += 15;
+    if (range[strcspn(range, ",\r")] == ',') return 0;
+
+    long long first, end;
+    if (sscanf(range, "-%lld", &end) == 1) {
+        *start = end < size ? size - end : 0;
+    } else if (sscanf(range, "%lld-%lld", &first, &end) == 2) {
+        *start = first;
+        if (end < *last) *last = end;
+    } else if (sscanf(range, "%lld-", &first) == 1) {
+        *start = first;
+    } else {
+        *start = size;
+    }
+    return *start >= size || *start > *last ? -1 : 1;
+}
+
+// An /archive request waiting for the reader thread
+typedef struct {
+    archive_request_t read;
+    hub_t *hub;                // Holds a reference while its archive is read
+    uint64_t serial;           // Client waiting for the result
+    uint64_t first, end;       // Archive bounds when asked
+    int range;                 // What request_range() made of the request
+} archive_out_t;
+
+static void archive_out_free(archive_out_t *out) {
+    if (out->hub) hub_put(out->hub);
+    free(out->read.out);
+    free(out);
+}
+
+// Reply with what was read of the scrollback
+static void archive_reply(client_t *client, const archive_out_t *out) {
+    uint64_t offset = out->read.offset;
+    ssize_t n = out->read.copied;
+    const uint8_t *body = out->read.out;
+    if (n < 0) {
+        const char *error = "Failed to read the scrollback";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+
+    char headers[128];
+    if (out->range != 0 && n == 0) {
+        snprintf(headers, sizeof(headers), "Content-Range: bytes */%" PRIu64 "\r\n", out->end);
+        send_http_reply(client, 416, "Range Not Satisfiable", "text/plain", headers, "", 0);
+        return;
+    }
+
+    if (out->range) {
+        snprintf(headers, sizeof(headers),
+                 "Accept-Ranges: bytes\r\nContent-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n"
+                 "Cache-Control: no-cache\r\n",
+                 offset, offset + n - 1, out->end);
+        send_http_reply(client, 206, "Partial Content", "text/plain; charset=utf-8", headers,
+                        (const char *)body, n);
+    } else {
+        // Whole lines only
+        const uint8_t *lines = body;
+        if (offset > out->first && n > 0) {
+            const uint8_t *nl = memchr(body, '\n', n);
+            lines = nl ? nl + 1 : body + n;
+        }
+        snprintf(headers, sizeof(headers), "Accept-Ranges: bytes\r\nCache-Control: no-cache\r\n");
+        send_http_reply(client, 200, "OK", "text/plain; charset=utf-8", headers,
+                        (const char *)lines, n - (lines - body));
+    }
+}
+
+// The reader thread is done: reply to the client if it is still there
+static void archive_done_task(worker_t *worker, void *arg) {
+    archive_out_t *out = arg;
+    client_t *client = client_resume((server_worker_t *)worker, out->serial);
+    if (client) {
+        archive_reply(client, out);
+        client_resumed(client);
+    }
+    archive_out_free(out);
+}
+
+// A session's scrollback (s, else the one served), as lines of text.
+// Offsets count from the first line archived, so a page scrolling up
+// asks for the bytes before the oldest it has; what is no longer kept
+// is skipped. Without a range, the newest lines come back. Chunks are
+// read and decompressed on the reader thread while the client waits.
+void send_archive(client_t *client, const char *request, const char *query) {
+    char name[256] = "";
+    if (query_param(query, "s", name, sizeof(name)) < 0 && client->session_name) {
+        snprintf(name, sizeof(name), "%s", client->session_name);
+    }
+    hub_t *hub = server_config->archive_limit && name[0] ? hub_find(name) : NULL;
+    if (!hub || !hub->archive) {
+        if (hub) hub_put(hub);
+        const char *error = server_config->archive_limit ? "No scrollback for this session" :
+                                                           "No scrollback is kept (see --archive)";
+        send_http_response(client, 404, "Not Found", "text/plain", error, strlen(error));
+        return;
+    }
+
+    archive_out_t *out = calloc(1, sizeof(*out));
+    if (!out) {
+        hub_put(hub);
+        const char *error = "Out of memory";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+    out->hub = hub;
+
+    archive_bounds(hub->archive, &out->first, &out->end);
+    long long start, last;
+    out->range = request_range(request, (long long)out->end, &start, &last);
+    if (out->range == 0 && out->end - out->first > ARCHIVE_READ_MAX) start = out->end - ARCHIVE_READ_MAX;
+    if (start < (long long)out->first) start = out->first;
+    if (last + 1 - start > ARCHIVE_READ_MAX) last = start + ARCHIVE_READ_MAX - 1;
+
+    out->read.offset = start;
+    out->read.size = out->range < 0 || last < start ? 0 : (size_t)(last + 1 - start);
+    out->read.out = malloc(out->read.size ? out->read.size : 1);
+    if (!out->read.out) out->read.copied = -1;
+
+    // Nothing to read, or nothing to read into
+    if (out->read.size == 0 || !out->read.out) {
+        archive_reply(client, out);
+        archive_out_free(out);
+        return;
+    }
+
+    // The answer is posted to this worker, so it comes after this returns
+    if (archive_read_post(hub->archive, &out->read, &client->owner->worker,
+                          archive_done_task, out) < 0) {
+        out->read.copied = -1;
+        archive_reply(client, out);
+        archive_out_free(out);
+        return;
+    }
+    out->serial = client_wait(client);
+}
+
+// Agents connected to this gateway
+void send_hosts(client_t *client) {
+    size_t len;
+    char *json = gateway_hosts(&len);
+    if (!json) {
+        const char *error = "Out of memory";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+    send_http_response(client, 200, "OK", "application/json", json, len);
+    free(json);
+}
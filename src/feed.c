@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+
+#include "feed.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#define FEED_REDRAW_MS 1000   // Least time between redraws asked for by viewers
+
+// Input or a resize for a shared terminal
+typedef struct {
+    hub_t *hub;
+    int cols, rows;
+    size_t len;
+    uint8_t data[];
+} feed_msg_t;
+
+// A frame on its way to the viewers on one worker
+typedef struct {
+    hub_t *hub;
+    shared_buf_t *frame;
+} feed_delivery_t;
+
+static void feed_free(worker_t *worker, void *arg) {
+    (void)worker;
+    free(arg);
+}
+
+void feed_close(feed_t *feed) {
+    server_worker_t *sw = (server_worker_t *)feed->hub->home;
+
+    worker_unwatch(&feed->pty);
+    worker_unwatch(&feed->child);
+    wheel_stop(&feed->redraw);
+    release_terminal(sw, &feed->terminal);
+    vtopt_free(feed->vt);
+    pty_queue_clear(&feed->input, &sw->buffers);
+    atomic_store(&feed->hub->input_queued, 0);
+    if (feed->hub->history) history_release(feed->hub->history, feed);
+    if (feed->hub->archive) archive_release(feed->hub->archive, feed);
+
+    if (feed->prev) feed->prev->next = feed->next;
+    else sw->feeds = feed->next;
+    if (feed->next) feed->next->prev = feed->prev;
+
+    feed->hub->feed = NULL;
+    hub_put(feed->hub);
+    worker_defer(&sw->worker, feed_free, feed);
+}
+
+// Queue a frame for the session's viewers on one worker
+static void deliver_frame(server_worker_t *sw, hub_t *hub, shared_buf_t *frame) {
+    for (client_t *client = sw->clients, *next; client; client = next) {
+        next = client->next;
+        if (client->hub != hub || client->state != CLIENT_WEBSOCKET) continue;
+
+        // A channel's output carries its id, so it gets a copy
+        int failed;
+        if (client->parent) {
+            size_t header_len = frame->data[1] < 126 ? 2 : frame->data[1] == 126 ? 4 : 10;
+            failed = client_send_output(client, frame->data + header_len,
+                                        frame->len - header_len) < 0;
+        } else {
+            failed = client_admit_output(client, frame->len) &&
+                     client_queue_shared(client, frame) < 0;
+        }
+        if (failed) {
+            client_close(client);
+            continue;
+        }
+        if (client_send_pending(client) < 0) {
+            client_close(client);
+            continue;
+        }
+        client_check_resync(client);
+    }
+}
+
+static void deliver_task(worker_t *worker, void *arg) {
+    feed_delivery_t *delivery = arg;
+    deliver_frame((server_worker_t *)worker, delivery->hub, delivery->frame);
+    shared_buf_unref(delivery->frame);
+    hub_put(delivery->hub);
+    free(delivery);
+}
+
+// Hand a frame to every worker with viewers of the session; each worker
+// gets one reference however many viewers it has
+static void feed_broadcast(feed_t *feed, shared_buf_t *frame) {
+    hub_t *hub = feed->hub;
+
+    for (int i = 0; i < worker_count; i++) {
+        if (hub->worker_viewers[i] <= 0) continue;
+
+        if (&workers[i].worker == hub->home) {
+            deliver_frame(&workers[i], hub, frame);
+            continue;
+        }
+
+        feed_delivery_t *delivery = malloc(sizeof(*delivery));
+        if (!delivery) continue;
+        delivery->hub = hub;
+        delivery->frame = shared_buf_ref(frame);
+        hub_ref(hub);
+        if (worker_post(&workers[i].worker, deliver_task, delivery) < 0) {
+            shared_buf_unref(frame);
+            hub_put(hub);
+            free(delivery);
+        }
+    }
+}
+
+// Disconnect the session's viewers on one worker
+static void hub_gone_task(worker_t *worker, void *arg) {
+    server_worker_t *sw = (server_worker_t *)worker;
+
+    for (client_t *client = sw->clients, *next; client; client = next) {
+        next = client->next;
+        if (client->hub == arg) client_close(client);
+    }
+    hub_put(arg);
+}
+
+// Disconnect the session's viewers on every worker that has some
+static void hub_gone(hub_t *hub) {
+    for (int i = 0; i < worker_count; i++) {
+        if (hub->worker_viewers[i] <= 0) continue;
+        hub_ref(hub);
+        if (worker_post(&workers[i].worker, hub_gone_task, hub) < 0) hub_put(hub);
+    }
+}
+
+// The shared tmux client went away; so do its viewers
+void feed_end(feed_t *feed) {
+    hub_t *hub = feed->hub;
+
+    feed_close(feed);
+    hub_gone(hub);
+}
+
+// Let viewers see how far behind the terminal is on input
+static void feed_input_update(feed_t *feed) {
+    pty_queue_watch(&feed->input, &feed->pty);
+    atomic_store(&feed->hub->input_queued, feed->input.bytes);
+}
+
+void on_feed_pty(watcher_t *watcher, uint32_t events) {
+    feed_t *feed = (feed_t *)watcher;
+    server_worker_t *sw = (server_worker_t *)feed->hub->home;
+    char *buffer = sw->read_buf;
+
+    // Room for queued input
+    if (events & EPOLLOUT) {
+        if (pty_queue_flush(&feed->input, &sw->buffers, &feed->terminal) < 0) {
+            pty_queue_clear(&feed->input, &sw->buffers);
+        }
+        feed_input_update(feed);
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+    }
+
+    ssize_t n = terminal_read(&feed->terminal, buffer, BUFFER_SIZE);
+    if (n < 0) {
+        feed_end(feed);
+        return;
+    }
+    if (n == 0) return;
+
+    if (feed->hub->history) history_record(feed->hub->history, feed, (uint8_t *)buffer, n);
+    if (feed->hub->archive) archive_record(feed->hub->archive, feed, (uint8_t *)buffer, n);
+    snapshot_touch(feed->hub->snapshot);
+
+    // Rewritten once for all viewers; a newcomer's redraw resets it
+    if (feed->vt) {
+        n = vtopt_rewrite(feed->vt, (uint8_t *)buffer, n, sw->vt_buf);
+        if (n == 0) return;
+        buffer = (char *)sw->vt_buf;
+    }
+
+    // The only copy of the output, whatever the number of viewers
+    shared_buf_t *frame = shared_buf_new(WS_MAX_HEADER + n);
+    if (!frame) return;
+    size_t header_len = ws_build_header(WS_OPCODE_BIN, n, frame->data);
+    memcpy(frame->data + header_len, buffer, n);
+    frame->len = header_len + n;
+
+    feed_broadcast(feed, frame);
+    shared_buf_unref(frame);
+}
+
+void on_feed_child(watcher_t *watcher, uint32_t events) {
+    (void)events;
+    feed_t *feed = (feed_t *)((char *)watcher - offsetof(feed_t, child));
+    if (terminal_reap(&feed->terminal)) feed_end(feed);
+}
+
+static void feed_open(hub_t *hub) {
+    server_worker_t *sw = (server_worker_t *)hub->home;
+    feed_t *feed = calloc(1, sizeof(*feed));
+    if (!feed) return;
+
+    feed->hub = hub;
+    feed->terminal.master_fd = -1;
+    feed->terminal.pid_fd = -1;
+    if (terminal_create(&feed->terminal, hub->name) < 0 ||
+        worker_watch(&sw->worker, &feed->pty, feed->terminal.master_fd,
+                     EPOLLIN, on_feed_pty) < 0) {
+        fprintf(stderr, "Failed to attach to tmux session %s\n", hub->name);
+        release_terminal(sw, &feed->terminal);
+        free(feed);
+        hub_gone(hub);
+        return;
+    }
+
+    watch_child(sw, &feed->child, &feed->terminal, on_feed_child);
+    if (server_config->compact) feed->vt = vtopt_new(80, 24);
+
+    feed->next = sw->feeds;
+    if (sw->feeds) sw->feeds->prev = feed;
+    sw->feeds = feed;
+    hub->feed = feed;
+    hub_ref(hub);
+}
+
+// Have tmux repaint the shared terminal for every viewer
+static void feed_redraw_now(feed_t *feed) {
+    wheel_stop(&feed->redraw);
+    feed->redraw_ms = worker_now_ms();
+    terminal_redraw(&feed->terminal);
+    if (feed->vt) vtopt_reset(feed->vt);
+}
+
+static void on_feed_redraw(wheel_timer_t *timer) {
+    feed_redraw_now((feed_t *)((char *)timer - offsetof(feed_t, redraw)));
+}
+
+// Viewer count changed, on the hub's home worker: the first viewer
+// attaches the shared tmux client, a newcomer gets a full redraw, and
+// the last one to leave detaches it
+void on_hub_change(hub_t *hub, int delta) {
+    if (!server_config->shared) return;
+    feed_t *feed = hub->feed;
+
+    if (hub->viewers <= 0) {
+        if (feed) feed_close(feed);
+    } else if (!feed) {
+        feed_open(hub);
+    } else if (delta > 0) {
+        feed_redraw_now(feed);
+    }
+}
+
+static void feed_input_task(worker_t *worker, void *arg) {
+    server_worker_t *sw = (server_worker_t *)worker;
+    feed_msg_t *msg = arg;
+    feed_t *feed = msg->hub->feed;
+
+    if (feed && msg->len > 0) {
+        if (pty_queue_write(&feed->input, &sw->buffers, &feed->terminal,
+                            msg->data, msg->len) < 0) {
+            pty_queue_clear(&feed->input, &sw->buffers);
+        }
+        feed_input_update(feed);
+    } else if (feed && msg->cols > 0) {
+        terminal_resize(&feed->terminal, msg->cols, msg->rows);
+        if (feed->vt) vtopt_resize(feed->vt, msg->cols, msg->rows);
+    }
+    hub_put(msg->hub);
+    free(msg);
+}
+
+static void feed_post(hub_t *hub, const uint8_t *data, size_t len, int cols, int rows) {
+    feed_msg_t *msg = malloc(sizeof(*msg) + len);
+    if (!msg) return;
+
+    msg->hub = hub;
+    msg->cols = cols;
+    msg->rows = rows;
+    msg->len = len;
+    if (len > 0) memcpy(msg->data, data, len);
+
+    hub_ref(hub);
+    if (worker_post(hub->home, feed_input_task, msg) < 0) {
+        hub_put(hub);
+        free(msg);
+    }
+}
+
+void feed_input(hub_t *hub, const uint8_t *data, size_t len) {
+    feed_post(hub, data, len, 0, 0);
+}
+
+void feed_resize(hub_t *hub, int cols, int rows) {
+    feed_post(hub, NULL, 0, cols, rows);
+}
+
+// A viewer's resync repaints every viewer, so one that keeps falling
+// behind would have all of them redrawn over and over. A redraw asked
+// for within FEED_REDRAW_MS of the last waits for the rest of it,
+// together with any others asked for meanwhile.
+static void feed_redraw_task(worker_t *worker, void *arg) {
+    hub_t *hub = arg;
+    feed_t *feed = hub->feed;
+    if (feed) {
+        uint64_t due = feed->redraw_ms + FEED_REDRAW_MS;
+        if (!feed->redraw_ms || worker_now_ms() >= due) {
+            feed_redraw_now(feed);
+        } else {
+            wheel_start(&worker->timers, &feed->redraw, due, on_feed_redraw);
+        }
+    }
+    hub_put(hub);
+}
+
+void feed_redraw(hub_t *hub) {
+    hub_ref(hub);
+    if (worker_post(hub->home, feed_redraw_task, hub) < 0) hub_put(hub);
+}
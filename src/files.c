@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include "files.h"
+#include "endpoints.h"
+#include "transfer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define TRANSFER_PART_SUFFIX ".part"  // Added to an upload's file name until it is complete
+
+// The last part of path, made safe to quote in JSON and headers
+static void transfer_name(const char *path, char *out, size_t size) {
+    const char *name = strrchr(path, '/');
+    name = name && name[1] ? name + 1 : path;
+
+    size_t len = 0;
+    for (; *name && len + 1 < size; name++) {
+        unsigned char c = (unsigned char)*name;
+        out[len++] = c < ' ' || c == 0x7f || c == '"' || c == '\\' ? '_' : (char)c;
+    }
+    out[len] = '\0';
+}
+
+// A message for the viewers of a session on one worker
+typedef struct {
+    char session[256];
+    size_t len;
+    char text[];
+} viewer_notice_t;
+
+static void viewer_notice_task(worker_t *worker, void *arg) {
+    server_worker_t *sw = (server_worker_t *)worker;
+    viewer_notice_t *notice = arg;
+
+    for (client_t *client = sw->clients, *next; client; client = next) {
+        next = client->next;
+        if (client->state != CLIENT_WEBSOCKET || client->mux || client->parent ||
+            !client->session_name || strcmp(client->session_name, notice->session) != 0) {
+            continue;
+        }
+        client_send_text(client, notice->text, notice->len);
+        if (client_send_pending(client) < 0) client_close(client);
+    }
+    free(notice);
+}
+
+// Send a JSON message to every viewer of session, on all workers
+static void notify_viewers(const char *session, const char *text, size_t len) {
+    for (int i = 0; i < worker_count; i++) {
+        viewer_notice_t *notice = malloc(sizeof(*notice) + len);
+        if (!notice) return;
+        snprintf(notice->session, sizeof(notice->session), "%s", session);
+        memcpy(notice->text, text, len);
+        notice->len = len;
+        if (worker_post(&workers[i].worker, viewer_notice_task, notice) < 0) free(notice);
+    }
+}
+
+// A helper in a session offers a file to download, or a place to upload
+// one to (/offer?kind=send|receive&path=PATH&session=NAME, on the
+// control socket). The session's viewers hear of it
+void send_offer(client_t *client, const char *query) {
+    char kind_name[16] = "", path[PATH_MAX] = "", session[256] = "";
+    query_param(query, "kind", kind_name, sizeof(kind_name));
+    query_param(query, "path", path, sizeof(path));
+    query_param(query, "session", session, sizeof(session));
+
+    char reply[PATH_MAX + 512];
+    int len;
+
+    // Only our own user's processes may hand out files
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(client->socket_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        cred.uid != getuid()) {
+        len = snprintf(reply, sizeof(reply), "Not yours to offer\n");
+        send_http_response(client, 403, "Forbidden", "text/plain", reply, len);
+        return;
+    }
+
+    int upload = strcmp(kind_name, "receive") == 0;
+    if (path[0] != '/' || (!upload && strcmp(kind_name, "send") != 0)) {
+        len = snprintf(reply, sizeof(reply), "Bad offer\n");
+        send_http_response(client, 400, "Bad Request", "text/plain", reply, len);
+        return;
+    }
+
+    struct stat st;
+    long long size = 0;
+    if (!upload) {
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || access(path, R_OK) < 0) {
+            len = snprintf(reply, sizeof(reply), "Not a readable file: %s\n", path);
+            send_http_response(client, 404, "Not Found", "text/plain", reply, len);
+            return;
+        }
+        size = st.st_size;
+    }
+
+    char token[TRANSFER_TOKEN_LEN + 1];
+    if (transfer_offer(upload ? TRANSFER_UPLOAD : TRANSFER_DOWNLOAD, path, token) < 0) {
+        len = snprintf(reply, sizeof(reply), "Could not make an offer\n");
+        send_http_response(client, 500, "Internal Server Error", "text/plain", reply, len);
+        return;
+    }
+
+    char name[256];
+    transfer_name(path, name, sizeof(name));
+    if (session[0]) {
+        char msg[512];
+        len = snprintf(msg, sizeof(msg),
+                       "{\"type\":\"file\",\"kind\":\"%s\",\"token\":\"%s\",\"name\":\"%s\",\"size\":%lld}",
+                       upload ? "upload" : "download", token, name, size);
+        notify_viewers(session, msg, len);
+    }
+
+    int dir = upload && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    len = snprintf(reply, sizeof(reply), "%s %s%s%s: %s /files/%s%s\n",
+                   upload ? "Upload to" : "Offered", path,
+                   session[0] ? (upload ? " from viewers of " : " to viewers of ") : "", session,
+                   upload ? "PUT" : "GET", token, dir ? "/NAME" : "");
+    send_http_response(client, 200, "OK", "text/plain", reply, len);
+}
+
+// Serve an offered file, or the one range of it asked for
+static void send_file(client_t *client, const char *request, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        const char *gone = "File is gone";
+        send_http_response(client, 404, "Not Found", "text/plain", gone, strlen(gone));
+        return;
+    }
+
+    long long size = st.st_size, start, last;
+    int range = request_range(request, size, &start, &last);
+    if (range < 0) {
+        char headers[64];
+        snprintf(headers, sizeof(headers), "Content-Range: bytes */%lld\r\n", size);
+        close(fd);
+        send_http_reply(client, 416, "Range Not Satisfiable", "text/plain", headers, "", 0);
+        return;
+    }
+
+    char name[256];
+    transfer_name(path, name, sizeof(name));
+    char header[1024];
+    int len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: %lld\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "Content-Disposition: attachment; filename=\"%s\"\r\n",
+        range ? "206 Partial Content" : "200 OK", last + 1 - start, name);
+    if (range) {
+        len += snprintf(header + len, sizeof(header) - len,
+                        "Content-Range: bytes %lld-%lld/%lld\r\n", start, last, size);
+    }
+    len += snprintf(header + len, sizeof(header) - len, "Connection: close\r\n\r\n");
+    client_queue_raw(client, header, len);
+    client->state = CLIENT_CLOSING;
+
+    file_transfer_t *t = NULL;
+    if (strncmp(request, "HEAD ", 5) != 0 && last >= start) t = calloc(1, sizeof(*t));
+    if (!t) {
+        close(fd);
+        return;
+    }
+    t->fd = fd;
+    t->pos = start;
+    t->end = last + 1;
+    client->transfer = t;
+}
+
+// Reply to an upload and stop taking it; a failed one leaves nothing
+static void upload_finish(client_t *client, int status, const char *status_text,
+                          const char *message) {
+    file_transfer_t *t = client->transfer;
+    close(t->fd);
+    if (status == 201) {
+        // In place only once complete, so a cut-off upload replaces nothing
+        char target[PATH_MAX];
+        size_t len = strlen(t->partial) - strlen(TRANSFER_PART_SUFFIX);
+        snprintf(target, sizeof(target), "%.*s", (int)len, t->partial);
+        if (rename(t->partial, target) < 0) {
+            status = 500;
+            status_text = "Internal Server Error";
+            message = strerror(errno);
+        } else {
+            printf("[Files] %s uploaded %s (%lld bytes)\n", client->client_ip, target,
+                   (long long)t->end);
+        }
+    }
+    if (status != 201) unlink(t->partial);
+    free(t->partial);
+    free(t);
+    client->transfer = NULL;
+
+    char body[256];
+    int len = snprintf(body, sizeof(body), "%s\n", message);
+    send_http_response(client, status, status_text, "text/plain", body, len);
+}
+
+static void send_no_offer(client_t *client) {
+    const char *none = "No such offer, or it expired";
+    send_http_response(client, 404, "Not Found", "text/plain", none, strlen(none));
+}
+
+// Take an upload to an offered path, claiming the offer once the request
+// is found fit. A directory takes it under the name the browser gives
+// after the token, /files/TOKEN/NAME
+static void start_upload(client_t *client, const char *request, const char *token,
+                         const char *path, const char *name) {
+    long long length;
+    const char *header = strstr(request, "\r\nContent-Length: ");
+    if (!header || sscanf(header + 18, "%lld", &length) != 1 || length < 0) {
+        const char *need = "Send a Content-Length";
+        send_http_response(client, 411, "Length Required", "text/plain", need, strlen(need));
+        return;
+    }
+
+    char target[PATH_MAX];
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (!name[0] || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') ||
+            (size_t)snprintf(target, sizeof(target), "%s/%s", path, name) >= sizeof(target)) {
+            const char *bad = "Name the file: /files/TOKEN/NAME";
+            send_http_response(client, 400, "Bad Request", "text/plain", bad, strlen(bad));
+            return;
+        }
+    } else {
+        snprintf(target, sizeof(target), "%s", path);
+    }
+
+    // Another upload to the same offer may have started meanwhile
+    char claimed[PATH_MAX];
+    if (transfer_claim(token, TRANSFER_UPLOAD, claimed, sizeof(claimed)) < 0) {
+        send_no_offer(client);
+        return;
+    }
+
+    char partial[PATH_MAX + sizeof(TRANSFER_PART_SUFFIX)];
+    snprintf(partial, sizeof(partial), "%s" TRANSFER_PART_SUFFIX, target);
+    file_transfer_t *t = calloc(1, sizeof(*t));
+    if (t) t->partial = strdup(partial);
+
+    // A stale part file goes first; the new one is created afresh, never
+    // through a link put in its place
+    int fd = -1;
+    if (t && t->partial) {
+        unlink(partial);
+        fd = open(partial, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666);
+    }
+    if (fd < 0) {
+        char error[PATH_MAX + 64];
+        int len = snprintf(error, sizeof(error), "Cannot write %s: %s", target, strerror(errno));
+        if (t) free(t->partial);
+        free(t);
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, len);
+        return;
+    }
+    t->fd = fd;
+    t->end = length;
+    client->transfer = t;
+    client->state = CLIENT_UPLOAD;
+
+    if (strstr(request, "\r\nExpect: 100-continue")) {
+        const char *go_on = "HTTP/1.1 100 Continue\r\n\r\n";
+        client_queue_raw(client, go_on, strlen(go_on));
+    }
+    if (length == 0) upload_finish(client, 201, "Created", "Saved");
+}
+
+// Write body bytes of an upload, and reply once all are there
+// Returns the bytes taken
+size_t client_upload(client_t *client, const uint8_t *data, size_t len) {
+    file_transfer_t *t = client->transfer;
+    if (len > (size_t)(t->end - t->pos)) len = t->end - t->pos;
+
+    // Written on the worker: a write lands in the page cache, and the
+    // socket is read no faster than the disk takes it
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(t->fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            upload_finish(client, 500, "Internal Server Error", strerror(n < 0 ? errno : ENOSPC));
+            return len;
+        }
+        done += n;
+    }
+
+    t->pos += len;
+    if (t->pos == t->end) upload_finish(client, 201, "Created", "Saved");
+    return len;
+}
+
+// /files/TOKEN[/NAME]: fetch an offered file, or upload one
+void serve_files(client_t *client, const char *request, const char *path) {
+    const char *token_start = path + 7;
+    size_t token_len = strcspn(token_start, "/");
+    char token[TRANSFER_TOKEN_LEN + 1];
+    char name[256] = "";
+    snprintf(token, sizeof(token), "%.*s", (int)token_len, token_start);
+    if (token_start[token_len] == '/') url_decode(token_start + token_len + 1, 0, name, sizeof(name));
+
+    // An upload uses up its offer once it starts, not on a request
+    // that is turned away
+    int upload = strncmp(request, "PUT ", 4) == 0 || strncmp(request, "POST ", 5) == 0;
+    char file[PATH_MAX];
+    if (token_len != TRANSFER_TOKEN_LEN ||
+        transfer_peek(token, upload ? TRANSFER_UPLOAD : TRANSFER_DOWNLOAD, file, sizeof(file)) < 0) {
+        send_no_offer(client);
+        return;
+    }
+
+    if (upload) start_upload(client, request, token, file, name);
+    else send_file(client, request, file);
+}
@@ -0,0 +1,922 @@
+#define _GNU_SOURCE
+
+#include "gateway.h"
+#include "listener.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+
+#define LISTEN_BACKLOG 128
+#define MUX_HEADER 9                                     // Type, stream id, length
+#define MUX_FRAME_MAX (POOL_BUF_CAPACITY - MUX_HEADER)   // Largest payload
+#define MUX_IN_SIZE 65536                                // Link read buffer
+#define MUX_MAX_IOV 64
+#define HELLO_TIMEOUT_MS 10000       // Agents must name themselves this soon
+#define CREDIT_BATCH (GATEWAY_WINDOW / 4)  // Credit goes back in batches this large
+#define STREAM_BUCKETS 64
+
+// Link messages: a 1-byte type, 4-byte stream id and 4-byte payload
+// length, both big-endian, then the payload
+enum {
+    MUX_HELLO = 1,  // Agent to gateway, stream 0: name, NUL, token
+    MUX_OPEN,       // Gateway to agent: a new stream
+    MUX_DATA,       // Bytes of a stream, within the receiver's credit
+    MUX_CREDIT,     // 4 bytes: how much more the receiver can take
+    MUX_CLOSE       // The sender is done with the stream
+};
+
+// One relayed connection: the browser's socket on the gateway, one end
+// of a socket pair served by the local server on an agent
+typedef struct stream {
+    watcher_t sock;
+    int fd;
+    struct mux *mux;
+    uint32_t id;
+    struct stream *next;        // In the link's bucket
+    pool_buf_t *out_head;       // Data for the socket, oldest first
+    pool_buf_t *out_tail;
+    size_t out_bytes;
+    size_t credit;              // Bytes the peer can still take
+    size_t consumed;            // Written to the socket, not yet credited back
+    int closing;                // Peer is done; close once out is written
+    int hup;                    // Socket hung up; read what is left
+} stream_t;
+
+// A link between an agent and the gateway
+typedef struct mux {
+    watcher_t sock;
+    worker_t *worker;
+    struct mux *prev, *next;    // The worker's links
+    uint32_t id;                // Gateway side: what routes refer to
+    char name[GATEWAY_NAME_MAX];// Agent name, empty until its hello
+    char peer[64];              // Where the link goes, for logs
+    int agent;                  // We dialled
+    int connected;              // The dial completed
+    wheel_timer_t hello;        // Gateway side: the agent must name itself by then
+    buf_pool_t pool;
+    pool_buf_t *out_head, *out_tail;
+    size_t out_bytes;
+    int blocked;                // Too much queued; streams stopped reading
+    uint8_t in[MUX_IN_SIZE];
+    size_t in_len;
+    stream_t *streams[STREAM_BUCKETS];
+    uint32_t next_stream;
+} mux_t;
+
+// An agent route: where the link of a named agent lives
+typedef struct {
+    char name[GATEWAY_NAME_MAX];
+    uint32_t id;
+    worker_t *worker;
+} route_t;
+
+// A browser connection on its way to a link's worker
+typedef struct {
+    uint32_t link;
+    int fd;
+    size_t len;
+    uint8_t head[];
+} route_task_t;
+
+typedef struct {
+    int fd;
+    char peer[64];
+} link_task_t;
+
+static worker_t **gw_workers;
+static int gw_worker_count;
+static gateway_accept_cb gw_accept;
+static const char *gw_token;
+static mux_t **worker_links;        // Per worker id
+
+static route_t *routes;
+static size_t route_count, route_cap;
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint link_ids;
+static atomic_uint next_link_worker;
+
+static watcher_t listen_watcher;
+static int listen_fd = -1;
+static listen_addr_t listen_addr;
+
+// The one gateway an agent process dials
+static struct {
+    worker_t *worker;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char spec[160];
+    char name[GATEWAY_NAME_MAX];
+    mux_t *link;
+    uint64_t retry_at;
+    int failing;                // Last dial failed; stay quiet until one works
+} agent;
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int valid_name(const char *name) {
+    if (!*name || strlen(name) >= GATEWAY_NAME_MAX) return 0;
+    for (const char *p = name; *p; p++) {
+        if (!(isalnum((unsigned char)*p) || *p == '-' || *p == '_' || *p == '.')) return 0;
+    }
+    return 1;
+}
+
+// A token the hello can carry whole, if one is set
+// Returns 0 if usable, -1 (logged) if not
+static int check_token(void) {
+    if (gw_token && strlen(gw_token) >= GATEWAY_TOKEN_MAX) {
+        fprintf(stderr, "%s is too long (at most %d bytes)\n", GATEWAY_TOKEN_ENV,
+                GATEWAY_TOKEN_MAX - 1);
+        return -1;
+    }
+    return 0;
+}
+
+void gateway_setup(worker_t **workers, int count, gateway_accept_cb accept) {
+    gw_workers = workers;
+    gw_worker_count = count;
+    gw_accept = accept;
+    gw_token = getenv(GATEWAY_TOKEN_ENV);
+    worker_links = calloc(count, sizeof(*worker_links));
+}
+
+// ---- Link output ----
+
+// Queue a message; payloads of up to MUX_FRAME_MAX share buffers
+static int mux_queue(mux_t *mux, uint8_t type, uint32_t id, const void *data, size_t len) {
+    pool_buf_t *buf = mux->out_tail;
+    if (!buf || POOL_BUF_CAPACITY - buf->end < MUX_HEADER + len) {
+        buf = buf_get(&mux->pool);
+        if (!buf) return -1;
+        if (mux->out_tail) mux->out_tail->next = buf;
+        else mux->out_head = buf;
+        mux->out_tail = buf;
+    }
+
+    uint8_t *p = buf->data + buf->end;
+    p[0] = type;
+    put_u32(p + 1, id);
+    put_u32(p + 5, len);
+    if (len > 0) memcpy(p + MUX_HEADER, data, len);
+    buf->end += MUX_HEADER + len;
+    mux->out_bytes += MUX_HEADER + len;
+    return 0;
+}
+
+static void stream_update(stream_t *stream);
+
+// Stop or restart reading every stream of the link
+static void mux_set_blocked(mux_t *mux, int blocked) {
+    if (mux->blocked == blocked) return;
+    mux->blocked = blocked;
+    for (int i = 0; i < STREAM_BUCKETS; i++) {
+        for (stream_t *s = mux->streams[i]; s; s = s->next) stream_update(s);
+    }
+}
+
+// Write what the link takes now
+// Returns 0 on success, -1 if the link is broken
+static int mux_flush(mux_t *mux) {
+    while (mux->out_head && mux->connected) {
+        struct iovec iov[MUX_MAX_IOV];
+        int count = 0;
+        for (pool_buf_t *buf = mux->out_head; buf && count < MUX_MAX_IOV; buf = buf->next) {
+            iov[count].iov_base = buf->data + buf->start;
+            iov[count].iov_len = buf->end - buf->start;
+            count++;
+        }
+
+        ssize_t n = writev(mux->sock.fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+
+        mux->out_bytes -= n;
+        while (n > 0) {
+            pool_buf_t *head = mux->out_head;
+            size_t avail = head->end - head->start;
+            if ((size_t)n < avail) {
+                head->start += n;
+                break;
+            }
+            n -= avail;
+            mux->out_head = head->next;
+            if (!mux->out_head) mux->out_tail = NULL;
+            buf_put(&mux->pool, head);
+        }
+    }
+
+    if (mux->out_bytes >= GATEWAY_MUX_OUT_MAX) mux_set_blocked(mux, 1);
+    else if (mux->out_bytes <= GATEWAY_MUX_OUT_MAX / 2) mux_set_blocked(mux, 0);
+
+    uint32_t events = EPOLLIN;
+    if (!mux->connected || mux->out_head) events |= EPOLLOUT;
+    worker_modify(&mux->sock, events);
+    return 0;
+}
+
+// ---- Streams ----
+
+static stream_t *stream_find(mux_t *mux, uint32_t id) {
+    stream_t *s = mux->streams[id % STREAM_BUCKETS];
+    while (s && s->id != id) s = s->next;
+    return s;
+}
+
+static void on_stream_sock(watcher_t *watcher, uint32_t events);
+
+static stream_t *stream_new(mux_t *mux, uint32_t id, int fd) {
+    stream_t *stream = calloc(1, sizeof(*stream));
+    if (!stream) return NULL;
+
+    stream->fd = fd;
+    stream->mux = mux;
+    stream->id = id;
+    stream->credit = GATEWAY_WINDOW;
+    if (worker_watch(mux->worker, &stream->sock, fd, EPOLLIN, on_stream_sock) < 0) {
+        free(stream);
+        return NULL;
+    }
+
+    stream_t **bucket = &mux->streams[id % STREAM_BUCKETS];
+    stream->next = *bucket;
+    *bucket = stream;
+    return stream;
+}
+
+static void stream_free_task(worker_t *worker, void *arg) {
+    (void)worker;
+    free(arg);
+}
+
+// Drop the stream, telling the peer if it doesn't know yet
+static void stream_close(stream_t *stream, int tell) {
+    mux_t *mux = stream->mux;
+    if (tell) mux_queue(mux, MUX_CLOSE, stream->id, NULL, 0);
+
+    stream_t **p = &mux->streams[stream->id % STREAM_BUCKETS];
+    while (*p != stream) p = &(*p)->next;
+    *p = stream->next;
+
+    worker_unwatch(&stream->sock);
+    close(stream->fd);
+    while (stream->out_head) {
+        pool_buf_t *next = stream->out_head->next;
+        buf_put(&mux->pool, stream->out_head);
+        stream->out_head = next;
+    }
+
+    // Other events in this batch may still point at the stream
+    worker_defer(mux->worker, stream_free_task, stream);
+}
+
+// Watch for what the stream can do now. A hung-up socket that may not
+// be read yet is left unwatched, as it would report the hang-up forever
+static void stream_update(stream_t *stream) {
+    uint32_t events = 0;
+    if (stream->credit > 0 && !stream->mux->blocked && !stream->closing) events |= EPOLLIN;
+    if (stream->out_head) events |= EPOLLOUT;
+
+    if (stream->hup && !(events & EPOLLIN)) {
+        worker_unwatch(&stream->sock);
+    } else if (!stream->sock.worker) {
+        worker_watch(stream->mux->worker, &stream->sock, stream->fd, events, on_stream_sock);
+    } else {
+        worker_modify(&stream->sock, events);
+    }
+}
+
+// Count bytes the socket took, giving the peer credit for them in batches
+static void stream_consumed(stream_t *stream, size_t n) {
+    stream->consumed += n;
+    if (stream->consumed >= CREDIT_BATCH) {
+        uint8_t credit[4];
+        put_u32(credit, stream->consumed);
+        mux_queue(stream->mux, MUX_CREDIT, stream->id, credit, sizeof(credit));
+        stream->consumed = 0;
+    }
+}
+
+// Write queued data to the socket
+// Returns 0 on success, -1 if the socket is gone
+static int stream_write(stream_t *stream) {
+    while (stream->out_head) {
+        pool_buf_t *head = stream->out_head;
+        ssize_t n = send(stream->fd, head->data + head->start, head->end - head->start,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        head->start += n;
+        stream->out_bytes -= n;
+        stream_consumed(stream, n);
+        if (head->start == head->end) {
+            stream->out_head = head->next;
+            if (!stream->out_head) stream->out_tail = NULL;
+            buf_put(&stream->mux->pool, head);
+        }
+    }
+    return 0;
+}
+
+// Data from the peer for the socket
+// Returns 0 on success, -1 if the peer sent more than its credit
+static int stream_deliver(stream_t *stream, const uint8_t *data, size_t len) {
+    if (stream->out_bytes + len > GATEWAY_WINDOW) return -1;
+    if (stream->closing) return 0;
+
+    while (len > 0) {
+        pool_buf_t *tail = stream->out_tail;
+        if (!tail || tail->end == POOL_BUF_CAPACITY) {
+            tail = buf_get(&stream->mux->pool);
+            if (!tail) return -1;
+            if (stream->out_tail) stream->out_tail->next = tail;
+            else stream->out_head = tail;
+            stream->out_tail = tail;
+        }
+
+        size_t chunk = POOL_BUF_CAPACITY - tail->end;
+        if (chunk > len) chunk = len;
+        memcpy(tail->data + tail->end, data, chunk);
+        tail->end += chunk;
+        stream->out_bytes += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+
+    if (stream_write(stream) < 0) {
+        stream_close(stream, 1);
+        return 0;
+    }
+    stream_update(stream);
+    return 0;
+}
+
+// The peer is done: close once what it sent is written
+static void stream_end(stream_t *stream) {
+    stream->closing = 1;
+    if (!stream->out_head) stream_close(stream, 0);
+    else stream_update(stream);
+}
+
+static void mux_close(mux_t *mux);
+
+static void on_stream_sock(watcher_t *watcher, uint32_t events) {
+    stream_t *stream = (stream_t *)((char *)watcher - offsetof(stream_t, sock));
+    mux_t *mux = stream->mux;
+
+    if (events & EPOLLERR) {
+        stream_close(stream, 1);
+    } else if (stream->out_head && stream_write(stream) < 0) {
+        stream_close(stream, 1);
+    } else if (stream->closing) {
+        if (!stream->out_head) stream_close(stream, 0);
+    } else {
+        if (events & EPOLLHUP) stream->hup = 1;
+
+        // One message's worth per event, so streams of a link take turns
+        size_t room = stream->credit < MUX_FRAME_MAX ? stream->credit : MUX_FRAME_MAX;
+        pool_buf_t *buf = room > 0 && !mux->blocked && (events & (EPOLLIN | EPOLLHUP)) ?
+                          buf_get(&mux->pool) : NULL;
+        ssize_t n = buf ? recv(stream->fd, buf->data + MUX_HEADER, room, MSG_DONTWAIT) : -1;
+
+        if (!buf) {
+            stream_update(stream);
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            buf_put(&mux->pool, buf);
+            stream_update(stream);
+        } else if (n <= 0) {
+            buf_put(&mux->pool, buf);
+            stream_close(stream, 1);
+        } else {
+            buf->data[0] = MUX_DATA;
+            put_u32(buf->data + 1, stream->id);
+            put_u32(buf->data + 5, n);
+            buf->end = MUX_HEADER + n;
+            if (mux->out_tail) mux->out_tail->next = buf;
+            else mux->out_head = buf;
+            mux->out_tail = buf;
+            mux->out_bytes += buf->end;
+            stream->credit -= n;
+            stream_update(stream);
+        }
+    }
+
+    if (mux_flush(mux) < 0) mux_close(mux);
+}
+
+// ---- Links ----
+
+static void route_remove(uint32_t id) {
+    pthread_mutex_lock(&routes_lock);
+    for (size_t i = 0; i < route_count; i++) {
+        if (routes[i].id == id) {
+            routes[i] = routes[--route_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&routes_lock);
+}
+
+// The newest link of an agent takes over its name
+static int route_add(const char *name, uint32_t id, worker_t *worker) {
+    pthread_mutex_lock(&routes_lock);
+    size_t i = 0;
+    while (i < route_count && strcmp(routes[i].name, name) != 0) i++;
+    if (i == route_count) {
+        if (route_count == route_cap) {
+            size_t cap = route_cap ? route_cap * 2 : 16;
+            route_t *grown = realloc(routes, cap * sizeof(*routes));
+            if (!grown) {
+                pthread_mutex_unlock(&routes_lock);
+                return -1;
+            }
+            routes = grown;
+            route_cap = cap;
+        }
+        route_count++;
+    }
+    snprintf(routes[i].name, sizeof(routes[i].name), "%s", name);
+    routes[i].id = id;
+    routes[i].worker = worker;
+    pthread_mutex_unlock(&routes_lock);
+    return 0;
+}
+
+static void mux_free_task(worker_t *worker, void *arg) {
+    (void)worker;
+    mux_t *mux = arg;
+    buf_pool_destroy(&mux->pool);
+    free(mux);
+}
+
+static void mux_close(mux_t *mux) {
+    if (!mux->sock.worker && mux->sock.fd < 0) return;  // Already closed
+
+    if (mux->agent) {
+        if (mux->connected && agent.worker) {
+            printf("[Agent] lost gateway %s, redialling\n", mux->peer);
+        }
+        agent.link = NULL;
+        agent.retry_at = worker_now_ms() + GATEWAY_RETRY_MS;
+        agent.failing = !mux->connected;
+    } else if (mux->name[0]) {
+        route_remove(mux->id);
+        printf("[GW] agent %s disconnected\n", mux->name);
+    }
+
+    for (int i = 0; i < STREAM_BUCKETS; i++) {
+        while (mux->streams[i]) stream_close(mux->streams[i], 0);
+    }
+    worker_unwatch(&mux->sock);
+    wheel_stop(&mux->hello);
+    close(mux->sock.fd);
+    mux->sock.fd = -1;
+    while (mux->out_head) {
+        pool_buf_t *next = mux->out_head->next;
+        buf_put(&mux->pool, mux->out_head);
+        mux->out_head = next;
+    }
+
+    mux_t **links = &worker_links[mux->worker->id];
+    if (mux->prev) mux->prev->next = mux->next;
+    else *links = mux->next;
+    if (mux->next) mux->next->prev = mux->prev;
+
+    worker_defer(mux->worker, mux_free_task, mux);
+}
+
+static void on_mux_sock(watcher_t *watcher, uint32_t events);
+
+// A connection that never said who it is
+static void on_hello_timeout(wheel_timer_t *timer) {
+    mux_t *mux = (mux_t *)((char *)timer - offsetof(mux_t, hello));
+    if (!mux->name[0]) mux_close(mux);
+}
+
+static mux_t *mux_new(worker_t *worker, int fd, const char *peer, int is_agent) {
+    mux_t *mux = calloc(1, sizeof(*mux));
+    if (!mux) {
+        close(fd);
+        return NULL;
+    }
+
+    mux->worker = worker;
+    mux->agent = is_agent;
+    mux->connected = !is_agent;
+    mux->id = atomic_fetch_add(&link_ids, 1) + 1;
+    snprintf(mux->peer, sizeof(mux->peer), "%s", peer);
+
+    uint32_t events = is_agent ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    if (worker_watch(worker, &mux->sock, fd, events, on_mux_sock) < 0) {
+        close(fd);
+        free(mux);
+        return NULL;
+    }
+    if (!is_agent) {
+        wheel_start(&worker->timers, &mux->hello, worker_now_ms() + HELLO_TIMEOUT_MS,
+                    on_hello_timeout);
+    }
+
+    mux_t **links = &worker_links[worker->id];
+    mux->next = *links;
+    if (*links) (*links)->prev = mux;
+    *links = mux;
+    return mux;
+}
+
+// Gateway side: an agent names itself
+// Returns 0 on success, -1 on a malformed hello, -2 (logged) on a wrong token
+static int handle_hello(mux_t *mux, const uint8_t *data, size_t len) {
+    if (mux->agent || mux->name[0]) return -1;
+
+    char name[GATEWAY_NAME_MAX] = "";
+    size_t name_len = strnlen((const char *)data, len);
+    if (name_len >= sizeof(name)) return -1;
+    memcpy(name, data, name_len);
+    if (!valid_name(name)) return -1;
+
+    const char *token = name_len < len ? (const char *)data + name_len + 1 : "";
+    size_t token_len = name_len < len ? len - name_len - 1 : 0;
+    if (gw_token && (token_len != strlen(gw_token) || CRYPTO_memcmp(token, gw_token, token_len))) {
+        fprintf(stderr, "[GW] agent %s from %s: wrong token\n", name, mux->peer);
+        return -2;
+    }
+
+    if (route_add(name, mux->id, mux->worker) < 0) return -1;
+    snprintf(mux->name, sizeof(mux->name), "%s", name);
+    printf("[GW] agent %s connected from %s\n", name, mux->peer);
+    return 0;
+}
+
+// Agent side: the gateway sends a connection our way
+static int handle_open(mux_t *mux, uint32_t id) {
+    if (!mux->agent || stream_find(mux, id)) return -1;
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0) {
+        perror("socketpair");
+        return mux_queue(mux, MUX_CLOSE, id, NULL, 0);
+    }
+    if (!stream_new(mux, id, pair[0])) {
+        close(pair[0]);
+        close(pair[1]);
+        return mux_queue(mux, MUX_CLOSE, id, NULL, 0);
+    }
+    gw_accept(mux->worker, pair[1]);
+    return 0;
+}
+
+// Returns 0 on success, -1 if the peer broke the protocol, -2 if it was
+// refused and that is logged
+static int mux_handle(mux_t *mux, uint8_t type, uint32_t id, const uint8_t *data, size_t len) {
+    if (!mux->agent && !mux->name[0] && type != MUX_HELLO) return -1;
+
+    stream_t *stream;
+    switch (type) {
+        case MUX_HELLO:
+            return handle_hello(mux, data, len);
+        case MUX_OPEN:
+            return handle_open(mux, id);
+        case MUX_DATA:
+            // Data for a stream we closed is dropped
+            stream = stream_find(mux, id);
+            return stream ? stream_deliver(stream, data, len) : 0;
+        case MUX_CREDIT:
+            stream = stream_find(mux, id);
+            if (len != 4) return -1;
+            if (stream) {
+                stream->credit += get_u32(data);
+                if (stream->credit > GATEWAY_WINDOW) return -1;
+                stream_update(stream);
+            }
+            return 0;
+        case MUX_CLOSE:
+            stream = stream_find(mux, id);
+            if (stream) stream_end(stream);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static void send_hello(mux_t *mux) {
+    char hello[GATEWAY_NAME_MAX + GATEWAY_TOKEN_MAX];
+    const char *token = gw_token ? gw_token : "";
+    size_t token_len = strlen(token);
+    size_t name_len = strlen(agent.name);
+    memcpy(hello, agent.name, name_len + 1);
+    memcpy(hello + name_len + 1, token, token_len);
+    mux_queue(mux, MUX_HELLO, 0, hello, name_len + 1 + token_len);
+}
+
+static void on_mux_sock(watcher_t *watcher, uint32_t events) {
+    mux_t *mux = (mux_t *)((char *)watcher - offsetof(mux_t, sock));
+
+    // Our dial finished, one way or the other
+    if (!mux->connected) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(mux->sock.fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0) error = errno;
+        if (error) {
+            if (!agent.failing) fprintf(stderr, "[Agent] can't reach gateway %s: %s\n",
+                                        mux->peer, strerror(error));
+            mux_close(mux);
+            return;
+        }
+        if (!(events & EPOLLOUT)) return;
+        mux->connected = 1;
+        agent.failing = 0;
+        printf("[Agent] connected to gateway %s as %s\n", mux->peer, agent.name);
+        send_hello(mux);
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ssize_t n = recv(mux->sock.fd, mux->in + mux->in_len, MUX_IN_SIZE - mux->in_len,
+                         MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            mux_close(mux);
+            return;
+        }
+        if (n > 0) mux->in_len += n;
+
+        size_t offset = 0;
+        while (mux->in_len - offset >= MUX_HEADER) {
+            const uint8_t *p = mux->in + offset;
+            uint32_t len = get_u32(p + 5);
+            if (len > MUX_FRAME_MAX) {
+                mux_close(mux);
+                return;
+            }
+            if (mux->in_len - offset < MUX_HEADER + len) break;
+
+            int r = mux_handle(mux, p[0], get_u32(p + 1), p + MUX_HEADER, len);
+            if (r < 0) {
+                if (r == -1) {
+                    fprintf(stderr, "[GW] protocol error on link to %s\n",
+                            mux->name[0] ? mux->name : mux->peer);
+                }
+                mux_close(mux);
+                return;
+            }
+            offset += MUX_HEADER + len;
+        }
+        memmove(mux->in, mux->in + offset, mux->in_len - offset);
+        mux->in_len -= offset;
+    }
+
+    if (mux_flush(mux) < 0) mux_close(mux);
+}
+
+// ---- Gateway side ----
+
+static void link_task(worker_t *worker, void *arg) {
+    link_task_t *task = arg;
+    mux_new(worker, task->fd, task->peer, 0);
+    free(task);
+}
+
+// Agents are spread over the workers as they connect
+static void on_gateway_accept(watcher_t *watcher, uint32_t events) {
+    (void)events;
+
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(watcher->fd, (struct sockaddr *)&addr, &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+            if (errno == ECONNABORTED) continue;
+            perror("accept");
+            return;
+        }
+
+        link_task_t *task = malloc(sizeof(*task));
+        worker_t *target = gw_workers[atomic_fetch_add(&next_link_worker, 1) % gw_worker_count];
+        if (!task) {
+            close(fd);
+            continue;
+        }
+        task->fd = fd;
+        peer_addr_format(&addr, task->peer, sizeof(task->peer));
+        if (worker_post(target, link_task, task) < 0) {
+            close(fd);
+            free(task);
+        }
+    }
+}
+
+int gateway_listen(worker_t *worker, const char *spec) {
+    if (listen_addr_parse(spec, &listen_addr) < 0 ||
+        (listen_addr.family != AF_UNIX && listen_addr.port == 0)) {
+        fprintf(stderr, "Invalid gateway address '%s' (needs a port)\n", spec);
+        return -1;
+    }
+    if (check_token() < 0) return -1;
+    if (!gw_token && !listen_addr_is_local(&listen_addr)) {
+        fprintf(stderr, "Gateway address '%s' is reachable from other machines; set %s "
+                "so only your agents can register\n", spec, GATEWAY_TOKEN_ENV);
+        return -1;
+    }
+
+    listen_fd = listen_addr.family == AF_UNIX ?
+                listen_unix(&listen_addr, LISTEN_BACKLOG, -1, NULL) :
+                listen_tcp(&listen_addr, listen_addr.port, LISTEN_BACKLOG);
+    if (listen_fd < 0) {
+        perror("gateway listen");
+        return -1;
+    }
+    return worker_watch(worker, &listen_watcher, listen_fd, EPOLLIN, on_gateway_accept);
+}
+
+static void route_task(worker_t *worker, void *arg) {
+    route_task_t *task = arg;
+
+    mux_t *mux = worker_links[worker->id];
+    while (mux && mux->id != task->link) mux = mux->next;
+
+    stream_t *stream = mux ? stream_new(mux, ++mux->next_stream, task->fd) : NULL;
+    if (!stream) {
+        close(task->fd);
+        free(task);
+        return;
+    }
+
+    mux_queue(mux, MUX_OPEN, stream->id, NULL, 0);
+    for (size_t off = 0; off < task->len; off += MUX_FRAME_MAX) {
+        size_t chunk = task->len - off < MUX_FRAME_MAX ? task->len - off : MUX_FRAME_MAX;
+        mux_queue(mux, MUX_DATA, stream->id, task->head + off, chunk);
+    }
+    stream->credit -= task->len;
+    stream_update(stream);
+    free(task);
+
+    if (mux_flush(mux) < 0) mux_close(mux);
+}
+
+int gateway_route(const char *host, int fd, const uint8_t *head, size_t len) {
+    if (len > GATEWAY_WINDOW) return -1;
+
+    pthread_mutex_lock(&routes_lock);
+    size_t i = 0;
+    while (i < route_count && strcmp(routes[i].name, host) != 0) i++;
+    route_t route = i < route_count ? routes[i] : (route_t){ .worker = NULL };
+    pthread_mutex_unlock(&routes_lock);
+    if (!route.worker) return -1;
+
+    // If the link drops before the task runs, the connection is closed
+    route_task_t *task = malloc(sizeof(*task) + len);
+    if (!task) return -1;
+    task->link = route.id;
+    task->fd = fd;
+    task->len = len;
+    memcpy(task->head, head, len);
+    if (worker_post(route.worker, route_task, task) < 0) {
+        free(task);
+        return -1;
+    }
+    return 0;
+}
+
+char *gateway_hosts(size_t *len) {
+    pthread_mutex_lock(&routes_lock);
+    size_t size = 16 + route_count * (GATEWAY_NAME_MAX + 3);
+    char *out = malloc(size);
+    if (out) {
+        size_t n = snprintf(out, size, "{\"hosts\":[");
+        for (size_t i = 0; i < route_count; i++) {
+            n += snprintf(out + n, size - n, "%s\"%s\"", i ? "," : "", routes[i].name);
+        }
+        n += snprintf(out + n, size - n, "]}\n");
+        *len = n;
+    }
+    pthread_mutex_unlock(&routes_lock);
+    return out;
+}
+
+// ---- Agent side ----
+
+static void agent_dial(void) {
+    int fd = socket(agent.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        agent.retry_at = worker_now_ms() + GATEWAY_RETRY_MS;
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&agent.addr, agent.addr_len) < 0 && errno != EINPROGRESS) {
+        if (!agent.failing) fprintf(stderr, "[Agent] can't reach gateway %s: %s\n",
+                                    agent.spec, strerror(errno));
+        agent.failing = 1;
+        close(fd);
+        agent.retry_at = worker_now_ms() + GATEWAY_RETRY_MS;
+        return;
+    }
+    agent.link = mux_new(agent.worker, fd, agent.spec, 1);
+    if (!agent.link) agent.retry_at = worker_now_ms() + GATEWAY_RETRY_MS;
+}
+
+int gateway_agent_start(worker_t *worker, const char *addr, const char *name) {
+    if (!valid_name(name)) {
+        fprintf(stderr, "Invalid agent name '%s' (letters, digits, '-', '_', '.')\n", name);
+        return -1;
+    }
+    if (check_token() < 0) return -1;
+    snprintf(agent.name, sizeof(agent.name), "%s", name);
+    snprintf(agent.spec, sizeof(agent.spec), "%s", addr);
+    agent.worker = worker;
+
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&agent.addr;
+        if (strlen(addr + 5) >= sizeof(sun->sun_path)) {
+            fprintf(stderr, "Gateway socket path too long '%s'\n", addr);
+            return -1;
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, addr + 5);
+        agent.addr_len = sizeof(*sun);
+    } else {
+        // HOST:PORT or [V6ADDR]:PORT, resolved once
+        char host[256];
+        const char *port = strrchr(addr, ':');
+        size_t host_len = port ? (size_t)(port - addr) : 0;
+        if (host_len > 1 && addr[0] == '[' && addr[host_len - 1] == ']') {
+            addr++;
+            host_len -= 2;
+        }
+        if (!port || host_len == 0 || host_len >= sizeof(host) || !port[1]) {
+            fprintf(stderr, "Invalid gateway address '%s' (HOST:PORT or unix:/path)\n", agent.spec);
+            return -1;
+        }
+        memcpy(host, addr, host_len);
+        host[host_len] = '\0';
+
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        struct addrinfo *res;
+        int rc = getaddrinfo(host, port + 1, &hints, &res);
+        if (rc != 0) {
+            fprintf(stderr, "Can't resolve gateway '%s': %s\n", agent.spec, gai_strerror(rc));
+            return -1;
+        }
+        memcpy(&agent.addr, res->ai_addr, res->ai_addrlen);
+        agent.addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+
+    agent_dial();
+    return 0;
+}
+
+void gateway_tick(worker_t *worker) {
+    uint64_t now = worker_now_ms();
+
+    if (agent.worker == worker && !agent.link && now >= agent.retry_at) agent_dial();
+}
+
+void gateway_shutdown(worker_t *worker) {
+    if (!worker_links) return;
+    if (agent.worker == worker) agent.worker = NULL;
+    while (worker_links[worker->id]) mux_close(worker_links[worker->id]);
+    if (listen_watcher.worker == worker) worker_unwatch(&listen_watcher);
+}
+
+void gateway_cleanup(void) {
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        if (listen_addr.family == AF_UNIX) unlink(listen_addr.path);
+        listen_fd = -1;
+    }
+    free(routes);
+    routes = NULL;
+    route_count = route_cap = 0;
+    free(worker_links);
+    worker_links = NULL;
+}
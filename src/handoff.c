@@ -0,0 +1,175 @@
+#include "handoff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#define CHUNK_SIZE 32768  // Bytes per message of a block
+
+extern char **environ;
+
+int handoff_spawn(const char *exe, char *const argv[], pid_t *pid) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    // Build the environment up front; the child may only make
+    // async-signal-safe calls before exec
+    size_t count = 0;
+    while (environ[count]) count++;
+
+    char **envp = calloc(count + 2, sizeof(char *));
+    char setting[64];
+    if (!envp) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    size_t n = 0;
+    size_t prefix = strlen(HANDOFF_ENV);
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], HANDOFF_ENV, prefix) == 0 && environ[i][prefix] == '=') continue;
+        envp[n++] = environ[i];
+    }
+    snprintf(setting, sizeof(setting), "%s=%d", HANDOFF_ENV, sv[1]);
+    envp[n++] = setting;
+    envp[n] = NULL;
+
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        free(envp);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (child == 0) {
+        // Keep our end across exec, and don't pass on the signal mask
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        fcntl(sv[1], F_SETFD, 0);
+        execve(exe, argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+    close(sv[1]);
+    *pid = child;
+    return sv[0];
+}
+
+int handoff_inherited(void) {
+    const char *value = getenv(HANDOFF_ENV);
+    if (!value) return -1;
+
+    char *end;
+    long fd = strtol(value, &end, 10);
+    unsetenv(HANDOFF_ENV);
+    if (*value == '\0' || *end != '\0' || fd < 0) return -1;
+
+    fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+    return (int)fd;
+}
+
+int handoff_wait(int sock, int timeout_ms) {
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+    while (1) {
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        return ready < 0 ? -1 : ready > 0;
+    }
+}
+
+int handoff_send(int sock, const void *data, size_t len, const int *fds, int fd_count) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (fd_count > HANDOFF_MAX_FDS) return -1;
+    if (fd_count > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+ssize_t handoff_recv(int sock, void *data, size_t size, int *fds, int *fd_count) {
+    struct iovec iov = { .iov_base = data, .iov_len = size };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+        if (errno != EINTR) return -1;
+    }
+
+    *fd_count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (count > HANDOFF_MAX_FDS) count = HANDOFF_MAX_FDS;
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+        *fd_count = count;
+    }
+
+    return n == 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ? -1 : n;
+}
+
+int handoff_send_bytes(int sock, const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        size_t chunk = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+        if (handoff_send(sock, p, chunk, NULL, 0) < 0) return -1;
+        p += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int handoff_recv_bytes(int sock, void *data, size_t len) {
+    char *p = data;
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count;
+
+    while (len > 0) {
+        size_t chunk = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+        if (handoff_recv(sock, p, chunk, fds, &fd_count) != (ssize_t)chunk) return -1;
+        p += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+
+#include "history.h"
+#include "lines.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define BLOOM_BYTES (HISTORY_BLOOM_BITS / 8)
+#define QUERY_MAX 256
+
+// Whole lines at [offset, offset + len) of the file
+typedef struct {
+    off_t offset;
+    uint32_t len;
+    uint64_t first_ms, last_ms;
+    uint8_t bloom[BLOOM_BYTES];
+} history_chunk_t;
+
+struct history {
+    pthread_mutex_t lock;
+    int fd;
+    off_t file_len;
+    int write_failed;
+
+    history_chunk_t *chunks;      // Written chunks, oldest first
+    size_t chunk_count, chunk_cap;
+    history_chunk_t pending;      // Lines not written yet, in pending_data
+    char *pending_data;
+    uint64_t lines, bytes;
+
+    const void *source;           // Who is recording
+    lines_t parser;               // Its output parsed into lines
+};
+
+// A search for the search thread
+typedef struct search_job {
+    history_t *history;
+    char query[QUERY_MAX];
+    uint64_t before_ms;
+    history_match_cb cb;
+    worker_t *worker;
+    void (*done)(worker_t *worker, void *arg);
+    void *arg;
+    struct search_job *next;
+} search_job_t;
+
+// The search thread and its queue, oldest first
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t search_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t search_thread;
+static int search_started;
+static int search_stopping;
+static search_job_t *search_head, *search_tail;
+
+static void add_line(const char *text, size_t len, void *arg);
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t trigram_bit(const char *p) {
+    uint32_t t = (uint32_t)tolower((unsigned char)p[0]) << 16 |
+                 (uint32_t)tolower((unsigned char)p[1]) << 8 |
+                 (uint32_t)tolower((unsigned char)p[2]);
+    return (t * 2654435761u) >> (32 - 16);
+}
+
+static void bloom_add(uint8_t *bloom, const char *text, size_t len) {
+    for (size_t i = 0; i + 3 <= len; i++) {
+        uint32_t bit = trigram_bit(text + i);
+        bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static int bloom_has(const uint8_t *bloom, const uint32_t *bits, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!(bloom[bits[i] / 8] & (1 << (bits[i] % 8)))) return 0;
+    }
+    return 1;
+}
+
+// Split a "<ms>\t<text>" line; returns 0 if it is not one
+static int parse_line(const char *p, size_t len, uint64_t *ms, const char **text, size_t *text_len) {
+    const char *tab = memchr(p, '\t', len);
+    if (!tab || tab == p) return 0;
+
+    uint64_t value = 0;
+    for (const char *d = p; d < tab; d++) {
+        if (*d < '0' || *d > '9') return 0;
+        value = value * 10 + (*d - '0');
+    }
+    *ms = value;
+    *text = tab + 1;
+    *text_len = len - (tab + 1 - p);
+    return 1;
+}
+
+// Add every line of data to a chunk's filter and time range
+static void index_lines(history_t *history, history_chunk_t *chunk, const char *data, size_t len) {
+    const char *p = data, *end = data + len;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) break;
+
+        uint64_t ms;
+        const char *text;
+        size_t text_len;
+        if (parse_line(p, nl - p, &ms, &text, &text_len)) {
+            if (!chunk->first_ms) chunk->first_ms = ms;
+            chunk->last_ms = ms;
+            bloom_add(chunk->bloom, text, text_len);
+            history->lines++;
+        }
+        p = nl + 1;
+    }
+}
+
+static int add_chunk(history_t *history, const history_chunk_t *chunk) {
+    if (history->chunk_count == history->chunk_cap) {
+        size_t cap = history->chunk_cap ? history->chunk_cap * 2 : 64;
+        history_chunk_t *chunks = realloc(history->chunks, cap * sizeof(*chunks));
+        if (!chunks) return -1;
+        history->chunks = chunks;
+        history->chunk_cap = cap;
+    }
+    history->chunks[history->chunk_count++] = *chunk;
+    return 0;
+}
+
+// Index what an earlier run left behind, dropping a cut-off last line
+static int load_file(history_t *history) {
+    struct stat st;
+    if (fstat(history->fd, &st) < 0) return -1;
+
+    char *data = malloc(HISTORY_CHUNK_SIZE);
+    if (!data) return -1;
+
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        ssize_t n = pread(history->fd, data, HISTORY_CHUNK_SIZE, offset);
+        if (n <= 0) break;
+
+        char *last_nl = memrchr(data, '\n', n);
+        if (!last_nl) break;
+
+        history_chunk_t chunk = { .offset = offset, .len = last_nl + 1 - data };
+        index_lines(history, &chunk, data, chunk.len);
+        if (add_chunk(history, &chunk) < 0) break;
+        offset += chunk.len;
+    }
+    free(data);
+
+    if (offset < st.st_size && ftruncate(history->fd, offset) < 0) return -1;
+    history->file_len = offset;
+    history->bytes = offset;
+    return 0;
+}
+
+history_t *history_open(const char *dir, const char *session) {
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return NULL;
+    }
+
+    // Session names may hold anything but the file name may not
+    char path[4096];
+    int len = snprintf(path, sizeof(path), "%s/%s.history", dir, session);
+    if (len < 0 || (size_t)len >= sizeof(path)) return NULL;
+    for (char *p = path + strlen(dir) + 1; *p; p++) {
+        if (*p == '/') *p = '_';
+    }
+
+    history_t *history = calloc(1, sizeof(*history));
+    if (!history) return NULL;
+    history->pending_data = malloc(HISTORY_CHUNK_SIZE);
+
+    history->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history->fd < 0) perror(path);
+
+    if (history->fd < 0 || !history->pending_data || load_file(history) < 0) {
+        if (history->fd >= 0) close(history->fd);
+        free(history->pending_data);
+        free(history->chunks);
+        free(history);
+        return NULL;
+    }
+
+    lines_init(&history->parser, add_line, history, 1);
+    pthread_mutex_init(&history->lock, NULL);
+    return history;
+}
+
+// Write the pending lines out as a chunk (locked)
+static void write_pending(history_t *history) {
+    history_chunk_t *chunk = &history->pending;
+    if (chunk->len == 0) return;
+
+    size_t done = 0;
+    while (done < chunk->len) {
+        ssize_t n = write(history->fd, history->pending_data + done, chunk->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+
+    if (done == chunk->len) {
+        chunk->offset = history->file_len;
+        history->file_len += chunk->len;
+        if (add_chunk(history, chunk) == 0) history->write_failed = 0;
+    } else {
+        // Drop the chunk; a part of it left in the file would run into
+        // the next line
+        if (!history->write_failed) perror("history write");
+        history->write_failed = 1;
+        if (done > 0 && ftruncate(history->fd, history->file_len) < 0) perror("history truncate");
+    }
+
+    memset(chunk, 0, sizeof(*chunk));
+}
+
+// Append a finished line (locked)
+static void add_line(const char *text, size_t len, void *arg) {
+    history_t *history = arg;
+    char prefix[24];
+    uint64_t ms = now_ms();
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%llu\t", (unsigned long long)ms);
+    size_t record_len = prefix_len + len + 1;
+
+    history_chunk_t *chunk = &history->pending;
+    if (chunk->len + record_len > HISTORY_CHUNK_SIZE) write_pending(history);
+
+    char *p = history->pending_data + chunk->len;
+    memcpy(p, prefix, prefix_len);
+    memcpy(p + prefix_len, text, len);
+    p[prefix_len + len] = '\n';
+    chunk->len += record_len;
+
+    if (!chunk->first_ms) chunk->first_ms = ms;
+    chunk->last_ms = ms;
+    bloom_add(chunk->bloom, text, len);
+    history->lines++;
+    history->bytes += record_len;
+}
+
+void history_record(history_t *history, const void *source, const uint8_t *data, size_t len) {
+    pthread_mutex_lock(&history->lock);
+
+    if (!history->source) {
+        history->source = source;
+        lines_reset(&history->parser);
+    }
+    if (history->source == source) lines_feed(&history->parser, data, len);
+
+    pthread_mutex_unlock(&history->lock);
+}
+
+void history_release(history_t *history, const void *source) {
+    pthread_mutex_lock(&history->lock);
+    if (history->source == source) history->source = NULL;
+    pthread_mutex_unlock(&history->lock);
+}
+
+static int contains_nocase(const char *text, size_t len, const char *query, size_t query_len) {
+    if (query_len == 0) return 1;
+    for (size_t i = 0; i + query_len <= len; i++) {
+        if (tolower((unsigned char)text[i]) == query[0] &&
+            strncasecmp(text + i, query, query_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Report matching lines of a chunk, newest first
+// Returns nonzero once the callback asked to stop
+static int search_chunk(const char *data, size_t len, const char *query, size_t query_len,
+                        uint64_t before_ms, history_match_cb cb, void *arg, size_t *matches) {
+    size_t end = len;
+
+    while (end > 0) {
+        // [start, end - 1) is a line, end - 1 its newline
+        const char *nl = end > 1 ? memrchr(data, '\n', end - 1) : NULL;
+        size_t start = nl ? (size_t)(nl - data) + 1 : 0;
+
+        uint64_t ms;
+        const char *text;
+        size_t text_len;
+        if (parse_line(data + start, end - 1 - start, &ms, &text, &text_len) &&
+            (!before_ms || ms < before_ms) &&
+            contains_nocase(text, text_len, query, query_len)) {
+            (*matches)++;
+            if (cb(ms, text, text_len, arg)) return 1;
+        }
+        end = start;
+    }
+    return 0;
+}
+
+size_t history_search(history_t *history, const char *query, uint64_t before_ms,
+                      history_match_cb cb, void *arg) {
+    char q[QUERY_MAX];
+    size_t query_len = strlen(query);
+    if (query_len >= sizeof(q)) query_len = sizeof(q) - 1;
+    for (size_t i = 0; i < query_len; i++) q[i] = tolower((unsigned char)query[i]);
+    q[query_len] = '\0';
+
+    // Every trigram of the query must be in a chunk that matches
+    uint32_t bits[QUERY_MAX];
+    size_t bit_count = 0;
+    for (size_t i = 0; i + 3 <= query_len; i++) bits[bit_count++] = trigram_bit(q + i);
+
+    char *data = malloc(HISTORY_CHUNK_SIZE);
+    if (!data) return 0;
+    size_t matches = 0;
+
+    // Lines not written yet are the newest
+    pthread_mutex_lock(&history->lock);
+    size_t len = history->pending.len;
+    memcpy(data, history->pending_data, len);
+    size_t index = history->chunk_count;
+    pthread_mutex_unlock(&history->lock);
+
+    int stop = search_chunk(data, len, q, query_len, before_ms, cb, arg, &matches);
+
+    // Chunks are never rewritten, so they are read without the lock
+    while (!stop && index > 0) {
+        index--;
+
+        pthread_mutex_lock(&history->lock);
+        history_chunk_t *chunk = &history->chunks[index];
+        int candidate = (!before_ms || chunk->first_ms < before_ms) &&
+                        bloom_has(chunk->bloom, bits, bit_count);
+        off_t offset = chunk->offset;
+        len = chunk->len;
+        pthread_mutex_unlock(&history->lock);
+
+        if (!candidate) continue;
+        if (pread(history->fd, data, len, offset) != (ssize_t)len) break;
+        stop = search_chunk(data, len, q, query_len, before_ms, cb, arg, &matches);
+    }
+
+    free(data);
+    return matches;
+}
+
+static void search_job_done(search_job_t *job) {
+    if (worker_post(job->worker, job->done, job->arg) < 0) perror("history search");
+    free(job);
+}
+
+// Run queued searches one at a time until stopped
+static void *search_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&search_lock);
+    for (;;) {
+        while (!search_head && !search_stopping) pthread_cond_wait(&search_cond, &search_lock);
+        if (search_stopping) break;
+        search_job_t *job = search_head;
+        search_head = job->next;
+        if (!search_head) search_tail = NULL;
+        pthread_mutex_unlock(&search_lock);
+
+        history_search(job->history, job->query, job->before_ms, job->cb, job->arg);
+        search_job_done(job);
+
+        pthread_mutex_lock(&search_lock);
+    }
+    pthread_mutex_unlock(&search_lock);
+    return NULL;
+}
+
+int history_search_post(history_t *history, const char *query, uint64_t before_ms,
+                        history_match_cb cb, worker_t *worker,
+                        void (*done)(worker_t *worker, void *arg), void *arg) {
+    search_job_t *job = calloc(1, sizeof(*job));
+    if (!job) return -1;
+    job->history = history;
+    snprintf(job->query, sizeof(job->query), "%s", query);
+    job->before_ms = before_ms;
+    job->cb = cb;
+    job->worker = worker;
+    job->done = done;
+    job->arg = arg;
+
+    pthread_mutex_lock(&search_lock);
+    if (!search_started && !search_stopping) {
+        int err = pthread_create(&search_thread, NULL, search_main, NULL);
+        if (err == 0) {
+            search_started = 1;
+        } else {
+            errno = err;
+            perror("pthread_create history search");
+        }
+    }
+    if (!search_started || search_stopping) {
+        pthread_mutex_unlock(&search_lock);
+        free(job);
+        return -1;
+    }
+    if (search_tail) search_tail->next = job;
+    else search_head = job;
+    search_tail = job;
+    pthread_cond_signal(&search_cond);
+    pthread_mutex_unlock(&search_lock);
+    return 0;
+}
+
+void history_search_stop(void) {
+    pthread_mutex_lock(&search_lock);
+    search_stopping = 1;
+    pthread_cond_signal(&search_cond);
+    int started = search_started;
+    pthread_mutex_unlock(&search_lock);
+
+    if (started) pthread_join(search_thread, NULL);
+
+    // What is left is reported without having been searched
+    while (search_head) {
+        search_job_t *job = search_head;
+        search_head = job->next;
+        search_job_done(job);
+    }
+    search_tail = NULL;
+}
+
+void history_size(history_t *history, uint64_t *lines, uint64_t *bytes) {
+    pthread_mutex_lock(&history->lock);
+    *lines = history->lines;
+    *bytes = history->bytes;
+    pthread_mutex_unlock(&history->lock);
+}
+
+void history_flush(history_t *history) {
+    pthread_mutex_lock(&history->lock);
+    write_pending(history);
+    pthread_mutex_unlock(&history->lock);
+}
+
+void history_close(history_t *history) {
+    history_flush(history);
+    pthread_mutex_destroy(&history->lock);
+    close(history->fd);
+    free(history->pending_data);
+    free(history->chunks);
+    free(history);
+}
@@ -0,0 +1,220 @@
+#include "hub.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define HUB_IDLE_MS 30000   // How long a hub nobody holds is kept for the next to ask
+
+// Viewer change handed to the hub's home worker
+typedef struct {
+    hub_t *hub;
+    int worker_id;
+    int delta;
+    int quiet;          // Count only; no log line, no change callback
+    char client_ip[64];
+} hub_event_t;
+
+static worker_t **hub_workers;
+static int hub_worker_count;
+static hub_change_cb hub_on_change;
+static const char *hub_history_dir;
+static size_t hub_archive_limit;
+static const char *hub_archive_dir;
+static hub_t *hubs;
+static pthread_mutex_t hubs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a, so a session always maps to the same worker
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void hub_setup(worker_t **workers, int count, hub_change_cb on_change,
+               const char *history_dir, size_t archive_limit, const char *archive_dir) {
+    hub_workers = workers;
+    hub_worker_count = count;
+    hub_on_change = on_change;
+    hub_history_dir = history_dir;
+    hub_archive_limit = archive_limit;
+    hub_archive_dir = archive_dir;
+}
+
+hub_t *hub_get(const char *name) {
+    pthread_mutex_lock(&hubs_lock);
+
+    hub_t *hub;
+    for (hub = hubs; hub; hub = hub->next) {
+        if (strcmp(hub->name, name) == 0) break;
+    }
+
+    if (hub) {
+        hub->refs++;
+        hub->idle_ms = 0;
+    } else {
+        hub = calloc(1, sizeof(*hub));
+        int *worker_viewers = calloc(hub_worker_count, sizeof(int));
+        snapshot_t *snapshot = snapshot_new(name);
+        if (hub && worker_viewers && snapshot) {
+            hub->worker_viewers = worker_viewers;
+            hub->snapshot = snapshot;
+            hub->name = strdup(name);
+            hub->home = hub_workers[hash_name(name) % hub_worker_count];
+            hub->refs = 1;
+            if (hub_history_dir) {
+                hub->history = history_open(hub_history_dir, name);
+                if (!hub->history) fprintf(stderr, "No history kept for %s\n", name);
+            }
+            if (hub_archive_limit) {
+                hub->archive = archive_open(hub_archive_limit, hub_archive_dir);
+                if (!hub->archive) fprintf(stderr, "No scrollback kept for %s\n", name);
+            }
+            hub->next = hubs;
+            hubs = hub;
+        } else {
+            free(hub);
+            free(worker_viewers);
+            snapshot_free(snapshot);
+            hub = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&hubs_lock);
+    return hub;
+}
+
+hub_t *hub_find(const char *name) {
+    pthread_mutex_lock(&hubs_lock);
+    hub_t *hub = hubs;
+    while (hub && strcmp(hub->name, name) != 0) hub = hub->next;
+    if (hub) {
+        hub->refs++;
+        hub->idle_ms = 0;
+    }
+    pthread_mutex_unlock(&hubs_lock);
+    return hub;
+}
+
+void hub_ref(hub_t *hub) {
+    pthread_mutex_lock(&hubs_lock);
+    hub->refs++;
+    pthread_mutex_unlock(&hubs_lock);
+}
+
+static void hub_free(hub_t *hub) {
+    if (hub->history) history_close(hub->history);
+    if (hub->archive) archive_close(hub->archive);
+    snapshot_free(hub->snapshot);
+    free(hub->name);
+    free(hub->worker_viewers);
+    free(hub);
+}
+
+// An unreferenced hub stays a while, so a session polled for snapshots
+// or searched keeps its capture and history index between requests;
+// the last reference to go frees those that stayed long enough
+void hub_put(hub_t *hub) {
+    hub_t *expired = NULL;
+    pthread_mutex_lock(&hubs_lock);
+    if (--hub->refs == 0) {
+        uint64_t now = now_ms();
+        hub->idle_ms = now;
+        for (hub_t **link = &hubs; *link;) {
+            hub_t *idle = *link;
+            if (idle->refs > 0 || now - idle->idle_ms < HUB_IDLE_MS) {
+                link = &idle->next;
+                continue;
+            }
+            *link = idle->next;
+            idle->next = expired;
+            expired = idle;
+        }
+    }
+    pthread_mutex_unlock(&hubs_lock);
+
+    while (expired) {
+        hub_t *next = expired->next;
+        hub_free(expired);
+        expired = next;
+    }
+}
+
+static void hub_event_task(worker_t *worker, void *arg) {
+    (void)worker;
+    hub_event_t *event = arg;
+    hub_t *hub = event->hub;
+
+    hub->viewers += event->delta;
+    hub->worker_viewers[event->worker_id] += event->delta;
+    if (event->quiet) {
+        hub_put(hub);
+        free(event);
+        return;
+    }
+
+    printf("[WS] %s %s %s (%d viewer%s)\n", event->client_ip,
+           event->delta > 0 ? "connected to" : "disconnected from",
+           hub->name, hub->viewers, hub->viewers == 1 ? "" : "s");
+
+    if (hub_on_change) hub_on_change(hub, event->delta);
+    hub_put(hub);
+    free(event);
+}
+
+static void hub_post_event(hub_t *hub, worker_t *from, const char *client_ip, int delta, int quiet) {
+    hub_event_t *event = malloc(sizeof(*event));
+    if (!event) return;
+
+    event->hub = hub;
+    event->worker_id = from->id;
+    event->delta = delta;
+    event->quiet = quiet;
+    snprintf(event->client_ip, sizeof(event->client_ip), "%s", client_ip);
+
+    hub_ref(hub);
+    if (worker_post(hub->home, hub_event_task, event) < 0) {
+        hub_put(hub);
+        free(event);
+    }
+}
+
+void hub_join(hub_t *hub, worker_t *from, const char *client_ip) {
+    hub_post_event(hub, from, client_ip, 1, 0);
+}
+
+void hub_leave(hub_t *hub, worker_t *from, const char *client_ip) {
+    hub_post_event(hub, from, client_ip, -1, 0);
+}
+
+void hub_adopt(hub_t *hub, worker_t *from) {
+    hub_post_event(hub, from, "", 1, 1);
+}
+
+void hub_flush(void) {
+    pthread_mutex_lock(&hubs_lock);
+    for (hub_t *hub = hubs; hub; hub = hub->next) {
+        if (hub->history) history_flush(hub->history);
+    }
+    pthread_mutex_unlock(&hubs_lock);
+}
+
+void hub_cleanup(void) {
+    pthread_mutex_lock(&hubs_lock);
+    while (hubs) {
+        hub_t *next = hubs->next;
+        hub_free(hubs);
+        hubs = next;
+    }
+    pthread_mutex_unlock(&hubs_lock);
+}
@@ -0,0 +1,216 @@
+#include "lines.h"
+#include <string.h>
+
+// Escape sequence parser states
+enum {
+    PARSE_TEXT,
+    PARSE_ESC,      // After ESC
+    PARSE_CSI,      // ESC [ ... final byte
+    PARSE_STRING,   // OSC, DCS, APC, PM, SOS: up to BEL or ST
+    PARSE_STRING_ESC,
+    PARSE_CHARSET   // ESC ( and friends take one more byte
+};
+
+void lines_init(lines_t *lines, lines_cb cb, void *arg, int dedupe) {
+    memset(lines, 0, sizeof(*lines));
+    lines->cb = cb;
+    lines->arg = arg;
+    lines->dedupe = dedupe;
+    lines->bottom = LINES_ROWS - 1;
+}
+
+void lines_reset(lines_t *lines) {
+    lines->state = PARSE_TEXT;
+    lines->line_len = 0;
+    lines->col = 0;
+
+    // Where the new source's cursor is and how tall its screen is come
+    // with its first redraw
+    lines->row = 0;
+    lines->top = 0;
+    lines->bottom = LINES_ROWS - 1;
+    lines->repaint = 0;
+}
+
+// The cursor left the line: keep it unless it is blank or a repeat that
+// is to be ignored
+static void end_line(lines_t *lines) {
+    size_t len = lines->line_len;
+    while (len > 0 && lines->line[len - 1] == ' ') len--;
+    lines->line_len = 0;
+    lines->col = 0;
+    if (len == 0) return;
+
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)lines->line[i]) * 16777619u;
+    }
+    int seen = 0;
+    for (size_t i = 0; i < LINES_RECENT && !seen; i++) {
+        seen = lines->recent[i] == hash;
+    }
+    if (seen && (lines->dedupe || lines->repaint)) return;
+    if (!seen) {
+        lines->recent[lines->recent_next] = hash;
+        lines->recent_next = (lines->recent_next + 1) % LINES_RECENT;
+
+        // New output, so whatever repaint there was is over
+        lines->repaint = 0;
+    }
+
+    lines->cb(lines->line, len, lines->arg);
+}
+
+// Put a character at the cursor, padding with blanks
+static void put_char(lines_t *lines, char c) {
+    if (lines->col >= LINES_MAX_LEN) return;
+    while (lines->line_len < lines->col) lines->line[lines->line_len++] = ' ';
+
+    lines->line[lines->col++] = c;
+    if (lines->col > lines->line_len) lines->line_len = lines->col;
+}
+
+// Move the cursor a line down; at the bottom of the scroll region the
+// screen scrolls instead, so what follows is new output
+static void line_feed(lines_t *lines) {
+    if (lines->row == lines->bottom) lines->repaint = 0;
+    else if (lines->row < LINES_ROWS - 1) lines->row++;
+}
+
+// Put the cursor on a row, counting from 1
+static void move_to_row(lines_t *lines, unsigned row) {
+    lines->row = row > LINES_ROWS ? LINES_ROWS - 1 : row - 1;
+}
+
+// Apply a complete CSI sequence
+static void csi_final(lines_t *lines, uint8_t final) {
+    unsigned n = lines->csi_param[0] ? lines->csi_param[0] : 1;
+    if (n > LINES_MAX_LEN) n = LINES_MAX_LEN;
+
+    // Private sequences set modes, none of which moves the cursor
+    if (lines->csi_private) return;
+
+    switch (final) {
+        case 'A': case 'F':
+            end_line(lines);
+            lines->row = lines->row > n ? lines->row - n : 0;
+            break;
+        case 'B': case 'E':
+            end_line(lines);
+            move_to_row(lines, lines->row + 1 + n);
+            break;
+        case 'H': case 'f':
+            end_line(lines);
+            move_to_row(lines, n);
+            // A redraw starts from the top left corner
+            if (n == 1 && lines->csi_param[1] <= 1) lines->repaint = 1;
+            break;
+        case 'd':
+            end_line(lines);
+            move_to_row(lines, n);
+            break;
+        case 'J':
+            end_line(lines);
+            break;
+        case 'S':
+            lines->repaint = 0;
+            break;
+        case 'r':
+            lines->top = n - 1;
+            lines->bottom = lines->csi_param[1] ? lines->csi_param[1] - 1 : LINES_ROWS - 1;
+            if (lines->bottom >= LINES_ROWS || lines->top >= lines->bottom) {
+                lines->top = 0;
+                lines->bottom = LINES_ROWS - 1;
+            }
+            lines->row = 0;
+            break;
+        case 'C':
+            lines->col += n;
+            break;
+        case 'D':
+            lines->col = lines->col > n ? lines->col - n : 0;
+            break;
+        case 'G': case '`':
+            lines->col = n - 1;
+            break;
+        case 'K':
+            if (lines->csi_param[0] == 0 && lines->col < lines->line_len) {
+                lines->line_len = lines->col;
+            }
+            break;
+    }
+}
+
+void lines_feed(lines_t *lines, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+
+        switch (lines->state) {
+            case PARSE_TEXT:
+                if (c == 0x1b) {
+                    lines->state = PARSE_ESC;
+                } else if (c == '\n') {
+                    end_line(lines);
+                    line_feed(lines);
+                }
+                else if (c == '\r') lines->col = 0;
+                else if (c == '\b') lines->col -= lines->col > 0;
+                else if (c == '\t') put_char(lines, ' ');
+                else if (c >= 0x20 && c != 0x7f) put_char(lines, c);
+                break;
+
+            case PARSE_ESC:
+                lines->state = PARSE_TEXT;
+                if (c == '[') {
+                    lines->state = PARSE_CSI;
+                    lines->csi_param[0] = lines->csi_param[1] = 0;
+                    lines->csi_count = 0;
+                    lines->csi_private = 0;
+                } else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+                    lines->state = PARSE_STRING;
+                } else if (strchr("()*+-./#%", c)) {
+                    lines->state = PARSE_CHARSET;
+                } else if (c == 'E' || c == 'D') {
+                    end_line(lines);
+                    line_feed(lines);
+                } else if (c == 'M') {
+                    end_line(lines);
+                    if (lines->row > lines->top) lines->row--;
+                }
+                break;
+
+            case PARSE_CSI:
+                if (c >= '0' && c <= '9') {
+                    if (lines->csi_count == 0) lines->csi_count = 1;
+                    if (lines->csi_count <= 2 && lines->csi_param[lines->csi_count - 1] < 100000) {
+                        unsigned *param = &lines->csi_param[lines->csi_count - 1];
+                        *param = *param * 10 + (c - '0');
+                    }
+                } else if (c == ';' || c == ':') {
+                    if (lines->csi_count == 0) lines->csi_count = 1;
+                    if (lines->csi_count < 3) lines->csi_count++;
+                } else if (c >= '<' && c <= '?') {
+                    lines->csi_private = 1;
+                } else if (c >= 0x40 && c <= 0x7e) {
+                    csi_final(lines, c);
+                    lines->state = PARSE_TEXT;
+                } else if (c == 0x1b) {
+                    lines->state = PARSE_ESC;
+                }
+                break;
+
+            case PARSE_STRING:
+                if (c == 0x07) lines->state = PARSE_TEXT;
+                else if (c == 0x1b) lines->state = PARSE_STRING_ESC;
+                break;
+
+            case PARSE_STRING_ESC:
+                lines->state = c == '\\' ? PARSE_TEXT : PARSE_STRING;
+                break;
+
+            case PARSE_CHARSET:
+                lines->state = PARSE_TEXT;
+                break;
+        }
+    }
+}
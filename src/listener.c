@@ -0,0 +1,243 @@
+#include "listener.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <grp.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+
+static int parse_port(const char *text) {
+    char *end;
+    long port = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || port <= 0 || port > 65535) return -1;
+    return (int)port;
+}
+
+static int parse_ip(const char *text, listen_addr_t *la) {
+    struct sockaddr_in *in4 = (struct sockaddr_in *)&la->addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&la->addr;
+
+    if (inet_pton(AF_INET, text, &in4->sin_addr) == 1) {
+        in4->sin_family = AF_INET;
+        la->family = AF_INET;
+        la->addr_len = sizeof(*in4);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, text, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        la->family = AF_INET6;
+        la->addr_len = sizeof(*in6);
+        return 0;
+    }
+    return -1;
+}
+
+int listen_addr_parse(const char *spec, listen_addr_t *la) {
+    char host[INET6_ADDRSTRLEN];
+    const char *port = NULL;
+    size_t host_len;
+
+    memset(la, 0, sizeof(*la));
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        const char *path = spec + 5;
+        if (*path == '\0' || strlen(path) >= sizeof(la->path)) return -1;
+
+        struct sockaddr_un *un = (struct sockaddr_un *)&la->addr;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        strcpy(la->path, path);
+        la->family = AF_UNIX;
+        la->addr_len = sizeof(*un);
+        return 0;
+    }
+
+    if (spec[0] == '[') {
+        // [v6]:port
+        const char *close = strchr(spec, ']');
+        if (!close) return -1;
+        host_len = close - spec - 1;
+        spec++;
+        if (close[1] == ':') port = close + 2;
+        else if (close[1] != '\0') return -1;
+    } else {
+        // A single colon separates an IPv4 address from its port; more
+        // than one means a bare IPv6 address
+        const char *colon = strchr(spec, ':');
+        if (colon && !strchr(colon + 1, ':')) {
+            host_len = colon - spec;
+            port = colon + 1;
+        } else {
+            host_len = strlen(spec);
+        }
+    }
+
+    if (host_len == 0 || host_len >= sizeof(host)) return -1;
+    memcpy(host, spec, host_len);
+    host[host_len] = '\0';
+
+    if (parse_ip(host, la) < 0) return -1;
+    if (port && (la->port = parse_port(port)) < 0) return -1;
+    return 0;
+}
+
+int listen_addr_is_any(const listen_addr_t *la) {
+    if (la->family == AF_INET) {
+        return ((const struct sockaddr_in *)&la->addr)->sin_addr.s_addr == htonl(INADDR_ANY);
+    }
+    if (la->family == AF_INET6) {
+        return IN6_IS_ADDR_UNSPECIFIED(&((const struct sockaddr_in6 *)&la->addr)->sin6_addr);
+    }
+    return 0;
+}
+
+int listen_addr_is_local(const listen_addr_t *la) {
+    if (la->family == AF_INET) {
+        uint32_t addr = ntohl(((const struct sockaddr_in *)&la->addr)->sin_addr.s_addr);
+        return addr >> 24 == 127;
+    }
+    if (la->family == AF_INET6) {
+        const struct in6_addr *addr = &((const struct sockaddr_in6 *)&la->addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(addr) || (IN6_IS_ADDR_V4MAPPED(addr) && addr->s6_addr[12] == 127);
+    }
+    return la->family == AF_UNIX;
+}
+
+int listen_tcp(const listen_addr_t *la, int port, int backlog) {
+    struct sockaddr_storage addr = la->addr;
+
+    if (la->family == AF_INET) {
+        ((struct sockaddr_in *)&addr)->sin_port = htons(port);
+    } else {
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+    }
+
+    int fd = socket(la->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    // Allow address reuse, and one listener per worker
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    if (la->family == AF_INET6) {
+        int v6only = la->v6only;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, la->addr_len) < 0 ||
+        listen(fd, backlog) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    return fd;
+}
+
+// Remove a socket file left behind by a server that is gone
+// Returns 0 if the path is free, -1 if it is in use or not a socket
+static int remove_stale_socket(const listen_addr_t *la) {
+    struct stat st;
+
+    if (lstat(la->path, &st) < 0) return errno == ENOENT ? 0 : -1;
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "%s exists and is not a socket\n", la->path);
+        return -1;
+    }
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) return -1;
+    int live = connect(probe, (const struct sockaddr *)&la->addr, la->addr_len) == 0 ||
+               errno != ECONNREFUSED;
+    close(probe);
+
+    if (live) {
+        fprintf(stderr, "%s is in use by another server\n", la->path);
+        return -1;
+    }
+    return unlink(la->path);
+}
+
+// Apply the requested permissions to the socket file
+static int set_socket_access(const listen_addr_t *la, int mode, const char *group) {
+    if (mode >= 0 && chmod(la->path, mode) < 0) {
+        perror("chmod");
+        return -1;
+    }
+
+    if (group) {
+        struct group *gr = getgrnam(group);
+        if (!gr) {
+            fprintf(stderr, "Unknown group '%s'\n", group);
+            return -1;
+        }
+        if (chown(la->path, (uid_t)-1, gr->gr_gid) < 0) {
+            perror("chown");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int listen_unix(const listen_addr_t *la, int backlog, int mode, const char *group) {
+    if (remove_stale_socket(la) < 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (bind(fd, (const struct sockaddr *)&la->addr, la->addr_len) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    // Nobody can connect before listen(), so set permissions first
+    int ok = set_socket_access(la, mode, group) == 0;
+    if (ok && listen(fd, backlog) < 0) {
+        perror("listen");
+        ok = 0;
+    }
+    if (!ok) {
+        close(fd);
+        unlink(la->path);
+        return -1;
+    }
+    return fd;
+}
+
+void listen_addr_format(const listen_addr_t *la, int port, char *out, size_t size) {
+    char host[INET6_ADDRSTRLEN];
+
+    if (la->family == AF_UNIX) {
+        snprintf(out, size, "unix:%s", la->path);
+    } else if (la->family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)&la->addr)->sin_addr, host, sizeof(host));
+        snprintf(out, size, "http://%s:%d", host, port);
+    } else {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)&la->addr)->sin6_addr, host, sizeof(host));
+        snprintf(out, size, "http://[%s]:%d", host, port);
+    }
+}
+
+void peer_addr_format(const struct sockaddr_storage *addr, char *out, size_t size) {
+    if (addr->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, out, size);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct in6_addr *a = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a)) {
+            inet_ntop(AF_INET, &a->s6_addr[12], out, size);
+        } else {
+            inet_ntop(AF_INET6, a, out, size);
+        }
+    } else {
+        snprintf(out, size, "unix");
+    }
+}
@@ -2,8 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
 #include "server.h"
 #include "session.h"
+#include "handoff.h"
+#include "transfer.h"
 
 #define DEFAULT_PORT 8080
 
@@ -13,7 +18,44 @@ static void print_usage(const char *program_name) {
     printf("Options:\n");
     printf("  -p, --port PORT        Port to listen on (default: %d)\n", DEFAULT_PORT);
     printf("  -s, --session NAME     tmux session name (interactive if omitted)\n");
-    printf("  -b, --bind ADDR        Address to bind to (default: 0.0.0.0)\n");
+    printf("  -b, --bind ADDR        Address to listen on, repeatable (default: 0.0.0.0)\n");
+    printf("                         ADDR is IP, IP:PORT, [IPv6]:PORT or unix:/path;\n");
+    printf("                         :: also accepts IPv4 unless IPv4 is bound too\n");
+    printf("      --socket-mode MODE Permissions of unix sockets, octal (e.g. 660)\n");
+    printf("      --socket-group GRP Group of unix sockets\n");
+    printf("      --flood-limit N    Bytes of output a client may lag behind before\n");
+    printf("                         it is resynced with a redraw (default: 1 screen)\n");
+    printf("  -t, --threads N        I/O worker threads (default: one per CPU)\n");
+    printf("      --shared           Viewers of a session share one tmux client and\n");
+    printf("                         its output is encoded once for all of them\n");
+    printf("      --splice           Move terminal output into sockets with splice(),\n");
+    printf("                         bypassing userspace (not with --shared,\n");
+    printf("                         --history, --archive or --compact)\n");
+    printf("      --history DIR      Keep each session's output in DIR, searchable\n");
+    printf("                         at /search?q=TEXT\n");
+    printf("      --trace            Time each keystroke from browser to screen;\n");
+    printf("                         Chrome trace JSON at /trace\n");
+    printf("      --gateway ADDR     Accept agents on ADDR (IP:PORT or unix:/path) and\n");
+    printf("                         serve their sessions at /HOST/SESSION/; needs\n");
+    printf("                         OATMUX_GATEWAY_TOKEN unless ADDR is loopback\n");
+    printf("      --agent ADDR       Dial the gateway at HOST:PORT or unix:/path and\n");
+    printf("                         serve sessions through it, with the gateway's\n");
+    printf("                         OATMUX_GATEWAY_TOKEN\n");
+    printf("      --name NAME        Name to register with the gateway (default: host name)\n");
+    printf("      --warm N           Keep N tmux clients attached in advance to each\n");
+    printf("                         session in use, per worker, for instant connects\n");
+    printf("                         (tmux 3.2+, not with --shared)\n");
+    printf("      --compact          Rewrite terminal output into fewer bytes with\n");
+    printf("                         the same effect, for slow links\n");
+    printf("      --transfer         Take file offers from --send and --receive run\n");
+    printf("                         in sessions, and serve them over HTTP\n");
+    printf("      --archive SIZE     Keep each session's scrollback on the server,\n");
+    printf("                         compressed, up to SIZE in memory (e.g. 16M);\n");
+    printf("                         browsers page back through it at /archive\n");
+    printf("      --archive-dir DIR  Move scrollback past that limit to files in DIR\n");
+    printf("      --send FILE        In a session: offer FILE to the browsers viewing it\n");
+    printf("      --receive PATH     In a session: let them upload to PATH, a file or\n");
+    printf("                         a directory\n");
     printf("  -l, --list             List available tmux sessions\n");
     printf("  -h, --help             Show this help message\n");
     printf("\nExamples:\n");
@@ -21,6 +63,9 @@ static void print_usage(const char *program_name) {
     printf("  %s -s mysession           # Attach to 'mysession' on port 8080\n", program_name);
     printf("  %s -p 3000 -s dev         # Attach to 'dev' on port 3000\n", program_name);
     printf("  %s -b 127.0.0.1           # Only allow local connections\n", program_name);
+    printf("  %s -b :: -b unix:/run/oatmux.sock\n", program_name);
+    printf("                            # Dual-stack TCP plus a socket for a local proxy\n");
+    printf("\nSend SIGUSR2 to restart into a new binary without dropping connections.\n");
 }
 
 static void list_sessions(void) {
@@ -29,6 +74,7 @@ static void list_sessions(void) {
     if (session_list_get(&list) < 0) {
         printf("No tmux sessions found.\n");
         printf("Create one with: tmux new -s <name>\n");
+        session_list_free(&list);
         return;
     }
 
@@ -44,13 +90,56 @@ static void list_sessions(void) {
                s->attached ? "yes" : "no");
     }
     printf("\n");
+    session_list_free(&list);
+}
+
+// Offer a file to the server's viewers of the session we run in, or ask
+// them for one
+// Returns the exit status
+static int request_transfer(transfer_kind_t kind, const char *arg) {
+    char path[PATH_MAX];
+
+    // A file to receive need not exist yet, but its directory must
+    if (!realpath(arg, path)) {
+        char dir_arg[PATH_MAX], base_arg[PATH_MAX], dir[PATH_MAX];
+        snprintf(dir_arg, sizeof(dir_arg), "%s", arg);
+        snprintf(base_arg, sizeof(base_arg), "%s", arg);
+        if (kind == TRANSFER_DOWNLOAD || !realpath(dirname(dir_arg), dir) ||
+            (size_t)snprintf(path, sizeof(path), "%s/%s", dir, basename(base_arg)) >= sizeof(path)) {
+            perror(arg);
+            return 1;
+        }
+    }
+
+    char session[MAX_SESSION_NAME];
+    char reply[1024];
+    int ok = transfer_request(kind, path, session_current(session, sizeof(session)) == 0 ? session : NULL,
+                              reply, sizeof(reply)) == 0;
+    fputs(reply, ok ? stdout : stderr);
+    return ok ? 0 : 1;
 }
 
 int main(int argc, char *argv[]) {
     server_config_t config = {
         .port = DEFAULT_PORT,
         .tmux_session = NULL,
-        .bind_addr = NULL
+        .bind_count = 0,
+        .socket_mode = -1,
+        .socket_group = NULL,
+        .flood_limit = 0,
+        .threads = 0,
+        .shared = 0,
+        .splice = 0,
+        .history_dir = NULL,
+        .trace = 0,
+        .gateway = NULL,
+        .agent = NULL,
+        .agent_name = NULL,
+        .warm = 0,
+        .compact = 0,
+        .transfer = 0,
+        .archive_limit = 0,
+        .archive_dir = NULL
     };
 
     char *allocated_session = NULL;
@@ -59,13 +148,31 @@ int main(int argc, char *argv[]) {
         {"port",    required_argument, 0, 'p'},
         {"session", required_argument, 0, 's'},
         {"bind",    required_argument, 0, 'b'},
+        {"socket-mode", required_argument, 0, 'M'},
+        {"socket-group", required_argument, 0, 'G'},
+        {"flood-limit", required_argument, 0, 'F'},
+        {"threads", required_argument, 0, 't'},
+        {"shared",  no_argument,       0, 'S'},
+        {"splice",  no_argument,       0, 'P'},
+        {"history", required_argument, 0, 'H'},
+        {"trace",   no_argument,       0, 'T'},
+        {"gateway", required_argument, 0, 'W'},
+        {"agent",   required_argument, 0, 'A'},
+        {"name",    required_argument, 0, 'N'},
+        {"warm",    required_argument, 0, 'R'},
+        {"compact", no_argument,       0, 'C'},
+        {"transfer", no_argument,      0, 'X'},
+        {"archive", required_argument, 0, 'Z'},
+        {"archive-dir", required_argument, 0, 'D'},
+        {"send",    required_argument, 0, 'O'},
+        {"receive", required_argument, 0, 'I'},
         {"list",    no_argument,       0, 'l'},
         {"help",    no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "p:s:b:lh", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:s:b:t:lh", long_options, NULL)) != -1) {
         switch (opt) {
             case 'p':
                 config.port = atoi(optarg);
@@ -78,8 +185,95 @@ int main(int argc, char *argv[]) {
                 config.tmux_session = optarg;
                 break;
             case 'b':
-                config.bind_addr = optarg;
+                if (config.bind_count == MAX_LISTENERS) {
+                    fprintf(stderr, "Error: At most %d listen addresses\n", MAX_LISTENERS);
+                    return 1;
+                }
+                config.bind_addrs[config.bind_count++] = optarg;
+                break;
+            case 'M': {
+                char *end;
+                long mode = strtol(optarg, &end, 8);
+                if (*optarg == '\0' || *end != '\0' || mode < 0 || mode > 07777) {
+                    fprintf(stderr, "Error: Invalid socket mode '%s'\n", optarg);
+                    return 1;
+                }
+                config.socket_mode = (int)mode;
+                break;
+            }
+            case 'G':
+                config.socket_group = optarg;
+                break;
+            case 'F': {
+                char *end;
+                long long limit = strtoll(optarg, &end, 10);
+                if (*end != '\0' || limit < 0) {
+                    fprintf(stderr, "Error: Invalid flood limit '%s'\n", optarg);
+                    return 1;
+                }
+                config.flood_limit = (size_t)limit;
+                break;
+            }
+            case 't':
+                config.threads = atoi(optarg);
+                if (config.threads <= 0 || config.threads > 1024) {
+                    fprintf(stderr, "Error: Invalid thread count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                config.shared = 1;
+                break;
+            case 'P':
+                config.splice = 1;
+                break;
+            case 'H':
+                config.history_dir = optarg;
                 break;
+            case 'T':
+                config.trace = 1;
+                break;
+            case 'W':
+                config.gateway = optarg;
+                break;
+            case 'A':
+                config.agent = optarg;
+                break;
+            case 'N':
+                config.agent_name = optarg;
+                break;
+            case 'R':
+                config.warm = atoi(optarg);
+                if (config.warm < 0 || config.warm > 16) {
+                    fprintf(stderr, "Error: Invalid warm pool size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'C':
+                config.compact = 1;
+                break;
+            case 'X':
+                config.transfer = 1;
+                break;
+            case 'Z': {
+                char *end;
+                long long size = strtoll(optarg, &end, 10);
+                int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+                if (shift) end++;
+                if (end == optarg || *end != '\0' || size <= 0 || size > (1LL << 40) >> shift) {
+                    fprintf(stderr, "Error: Invalid archive size '%s'\n", optarg);
+                    return 1;
+                }
+                config.archive_limit = (size_t)size << shift;
+                break;
+            }
+            case 'D':
+                config.archive_dir = optarg;
+                break;
+            case 'O':
+                return request_transfer(TRANSFER_DOWNLOAD, optarg);
+            case 'I':
+                return request_transfer(TRANSFER_UPLOAD, optarg);
             case 'l':
                 list_sessions();
                 return 0;
@@ -92,8 +286,33 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // If no session specified, show interactive selector
-    if (!config.tmux_session) {
+    config.argv = argv;
+
+    if (config.archive_dir && !config.archive_limit) {
+        fprintf(stderr, "Error: --archive-dir needs --archive\n");
+        return 1;
+    }
+
+    // History, the archive and compaction work on output on its way
+    // through userspace
+    if (config.history_dir || config.archive_limit || config.compact) config.splice = 0;
+
+    // An agent goes by its host name unless told otherwise
+    char hostname[256];
+    if (config.agent && !config.agent_name) {
+        if (gethostname(hostname, sizeof(hostname)) < 0) {
+            perror("gethostname");
+            return 1;
+        }
+        hostname[sizeof(hostname) - 1] = '\0';
+        hostname[strcspn(hostname, ".")] = '\0';
+        config.agent_name = hostname;
+    }
+
+    // If no session specified, show interactive selector; a successor
+    // taking over from a running server learns it from its predecessor.
+    // Gateways and agents can serve sessions by path instead
+    if (!config.tmux_session && !getenv(HANDOFF_ENV) && !config.gateway && !config.agent) {
         allocated_session = session_select_interactive();
         if (!allocated_session) {
             return 1;
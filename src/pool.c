@@ -0,0 +1,128 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+pool_buf_t *buf_get(buf_pool_t *pool) {
+    pool_buf_t *buf = pool->idle;
+
+    if (buf) {
+        pool->idle = buf->next;
+        pool->idle_count--;
+    } else {
+        buf = malloc(POOL_BUF_SIZE);
+        if (!buf) return NULL;
+        atomic_fetch_add_explicit(&pool->allocated, 1, memory_order_relaxed);
+    }
+
+    buf->next = NULL;
+    buf->start = 0;
+    buf->end = 0;
+    buf->shared = NULL;
+    atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed);
+    return buf;
+}
+
+void buf_put(buf_pool_t *pool, pool_buf_t *buf) {
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+
+    // Keep a few for the next burst, give the rest back
+    if (pool->idle_count >= POOL_MAX_IDLE) {
+        free(buf);
+        atomic_fetch_sub_explicit(&pool->allocated, 1, memory_order_relaxed);
+        return;
+    }
+
+    buf->next = pool->idle;
+    pool->idle = buf;
+    pool->idle_count++;
+}
+
+void buf_pool_destroy(buf_pool_t *pool) {
+    while (pool->idle) {
+        pool_buf_t *next = pool->idle->next;
+        free(pool->idle);
+        pool->idle = next;
+        atomic_fetch_sub_explicit(&pool->allocated, 1, memory_order_relaxed);
+    }
+    pool->idle_count = 0;
+}
+
+size_t buf_pool_bytes(buf_pool_t *pool) {
+    return atomic_load_explicit(&pool->allocated, memory_order_relaxed) * POOL_BUF_SIZE;
+}
+
+shared_buf_t *shared_buf_new(size_t len) {
+    shared_buf_t *buf = malloc(sizeof(*buf) + len);
+    if (!buf) return NULL;
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    return buf;
+}
+
+void shared_buf_unref(shared_buf_t *buf) {
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+        free(buf);
+    }
+}
+
+void slab_init(slab_t *slab, size_t object_size) {
+    memset(slab, 0, sizeof(*slab));
+
+    // Objects hold the free list link while free, and stay aligned
+    size_t align = _Alignof(max_align_t);
+    if (object_size < sizeof(void *)) object_size = sizeof(void *);
+    slab->object_size = (object_size + align - 1) & ~(align - 1);
+
+    // The first object-sized slot of each page holds the page link
+    slab->per_page = SLAB_PAGE_SIZE / slab->object_size - 1;
+    if (slab->per_page < 1) slab->per_page = 1;
+}
+
+static int slab_grow(slab_t *slab) {
+    char *page = malloc(slab->object_size * (slab->per_page + 1));
+    if (!page) return -1;
+
+    *(void **)page = slab->pages;
+    slab->pages = page;
+    atomic_fetch_add_explicit(&slab->page_count, 1, memory_order_relaxed);
+
+    for (size_t i = slab->per_page; i >= 1; i--) {
+        void *object = page + i * slab->object_size;
+        *(void **)object = slab->free_list;
+        slab->free_list = object;
+    }
+    return 0;
+}
+
+void *slab_alloc(slab_t *slab) {
+    if (!slab->free_list && slab_grow(slab) < 0) {
+        return NULL;
+    }
+
+    void *object = slab->free_list;
+    slab->free_list = *(void **)object;
+    memset(object, 0, slab->object_size);
+    atomic_fetch_add_explicit(&slab->in_use, 1, memory_order_relaxed);
+    return object;
+}
+
+void slab_free(slab_t *slab, void *object) {
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    atomic_fetch_sub_explicit(&slab->in_use, 1, memory_order_relaxed);
+}
+
+void slab_destroy(slab_t *slab) {
+    while (slab->pages) {
+        void *next = *(void **)slab->pages;
+        free(slab->pages);
+        slab->pages = next;
+    }
+    slab->free_list = NULL;
+    atomic_store(&slab->page_count, 0);
+}
+
+size_t slab_bytes(slab_t *slab) {
+    return atomic_load_explicit(&slab->page_count, memory_order_relaxed) *
+           slab->object_size * (slab->per_page + 1);
+}
@@ -1,21 +1,34 @@
+#define _GNU_SOURCE
+
 #include "server.h"
-#include "websocket.h"
-#include "terminal.h"
+#include "client.h"
+#include "feed.h"
+#include "endpoints.h"
+#include "files.h"
+#include "channels.h"
+#include "upgrade.h"
+#include "handoff.h"
+#include "gateway.h"
+#include "transfer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <sys/select.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <linux/filter.h>
 
-#define MAX_CLIENTS 10
-#define BUFFER_SIZE 65536
+#define LISTEN_BACKLOG 128
+#define MAX_FRAME_SIZE (1 << 20)  // Largest frame accepted from a browser
 
 // Embedded HTML page with xterm.js
 static const char *HTML_PAGE =
@@ -33,14 +46,23 @@ static const char *HTML_PAGE =
 "        #terminal .xterm { height: 100%; }\n"
 "        #status { position: fixed; top: 8px; right: 12px; color: #0f0; font-family: monospace; font-size: 12px; z-index: 9999; background: rgba(0,0,0,0.8); padding: 3px 10px; border-radius: 4px; }\n"
 "        .disconnected { color: #f00 !important; }\n"
+"        #files { position: fixed; bottom: 8px; right: 12px; z-index: 9999; color: #ccc; font-family: monospace; font-size: 12px; }\n"
+"        #files div { background: rgba(0,0,0,0.8); border: 1px solid #444; border-radius: 4px; padding: 4px 10px; margin-top: 4px; }\n"
+"        #files a { color: #0cf; }\n"
+"        #files button { margin-left: 8px; background: none; border: none; color: #888; cursor: pointer; }\n"
+"        #predict { position: absolute; display: none; z-index: 10; pointer-events: none; white-space: pre; text-decoration: underline; color: #ccc; background: #000; font-family: Menlo, Monaco, \"Courier New\", monospace; font-size: 14px; }\n"
+"        #archive { position: absolute; top: 0; left: 0; right: 0; bottom: 0; display: none; z-index: 20; overflow-y: scroll; outline: none; padding: 0 4px; white-space: pre; color: #ccc; background: #000; font-family: Menlo, Monaco, \"Courier New\", monospace; font-size: 14px; }\n"
 "    </style>\n"
 "</head>\n"
 "<body>\n"
 "    <div id=\"status\">Connecting...</div>\n"
 "    <div id=\"terminal\"></div>\n"
+"    <div id=\"archive\" tabindex=\"0\"></div>\n"
+"    <div id=\"files\"></div>\n"
 "    <script src=\"https://cdn.jsdelivr.net/npm/xterm@5.3.0/lib/xterm.min.js\"></script>\n"
 "    <script src=\"https://cdn.jsdelivr.net/npm/xterm-addon-fit@0.8.0/lib/xterm-addon-fit.min.js\"></script>\n"
 "    <script src=\"https://cdn.jsdelivr.net/npm/xterm-addon-web-links@0.9.0/lib/xterm-addon-web-links.min.js\"></script>\n"
+"    <script src=\"https://cdn.jsdelivr.net/npm/xterm-addon-webgl@0.16.0/lib/xterm-addon-webgl.min.js\"></script>\n"
 "    <script>\n"
 "        const term = new Terminal({\n"
 "            cursorBlink: true,\n"
@@ -54,28 +76,241 @@ static const char *HTML_PAGE =
 "        term.loadAddon(fitAddon);\n"
 "        term.loadAddon(webLinksAddon);\n"
 "        term.open(document.getElementById('terminal'));\n"
+"        // Drawn on the GPU where the browser allows it, else by the DOM\n"
+"        if (typeof WebglAddon !== 'undefined') {\n"
+"            try {\n"
+"                const webgl = new WebglAddon.WebglAddon();\n"
+"                webgl.onContextLoss(() => webgl.dispose());\n"
+"                term.loadAddon(webgl);\n"
+"            } catch (e) {\n"
+"                console.warn('WebGL renderer unavailable:', e);\n"
+"            }\n"
+"        }\n"
 "        fitAddon.fit();\n"
 "\n"
 "        const status = document.getElementById('status');\n"
 "        let ws;\n"
 "        let reconnectTimer;\n"
 "\n"
+"        // Predictive local echo: typed characters are drawn underlined at the\n"
+"        // cursor until the server reports the output that reflects them\n"
+"        const predict = { enabled: false, seq: 0, acked: 0, hold: 0, pending: [] };\n"
+"        const overlay = document.createElement('div');\n"
+"        overlay.id = 'predict';\n"
+"        term.element.appendChild(overlay);\n"
+"\n"
+"        function predictRender() {\n"
+"            const buf = term.buffer.active;\n"
+"            if (!predict.pending.length || buf.viewportY !== buf.baseY) {\n"
+"                overlay.style.display = 'none';\n"
+"                return;\n"
+"            }\n"
+"            const screen = term.element.querySelector('.xterm-screen');\n"
+"            const cw = screen.clientWidth / term.cols;\n"
+"            const ch = screen.clientHeight / term.rows;\n"
+"            overlay.textContent = predict.pending.map((p) => p.ch).join('');\n"
+"            overlay.style.left = (screen.offsetLeft + buf.cursorX * cw) + 'px';\n"
+"            overlay.style.top = (screen.offsetTop + buf.cursorY * ch) + 'px';\n"
+"            overlay.style.lineHeight = ch + 'px';\n"
+"            overlay.style.display = 'block';\n"
+"        }\n"
+"\n"
+"        // Drop all predictions; with hold, stay quiet until the server has\n"
+"        // caught up with everything typed so far\n"
+"        function predictReset(hold) {\n"
+"            predict.pending = [];\n"
+"            if (hold) predict.hold = predict.seq;\n"
+"            predictRender();\n"
+"        }\n"
+"\n"
+"        function predictInput(data) {\n"
+"            predict.seq++;\n"
+"            if (!predict.enabled || predict.acked < predict.hold) return;\n"
+"            const c = data.charCodeAt(0);\n"
+"            if (data.length === 1 && c >= 0x20 && c !== 0x7f) {\n"
+"                if (term.buffer.active.cursorX + predict.pending.length < term.cols - 1) {\n"
+"                    predict.pending.push({ seq: predict.seq, ch: data, time: performance.now() });\n"
+"                }\n"
+"            } else if (data === '\\x7f' && predict.pending.length) {\n"
+"                predict.pending.pop();\n"
+"            } else {\n"
+"                predictReset(true);\n"
+"            }\n"
+"            predictRender();\n"
+"        }\n"
+"\n"
+"        // Output reflecting input seq has been drawn: the last confirmed\n"
+"        // character must now sit just left of the cursor, else roll back\n"
+"        function predictConfirm(seq) {\n"
+"            predict.acked = seq;\n"
+"            const done = predict.pending.filter((p) => p.seq <= seq);\n"
+"            predict.pending = predict.pending.filter((p) => p.seq > seq);\n"
+"            if (done.length) {\n"
+"                const buf = term.buffer.active;\n"
+"                const line = buf.getLine(buf.baseY + buf.cursorY);\n"
+"                const cell = line && buf.cursorX > 0 ? line.getCell(buf.cursorX - 1) : null;\n"
+"                if (!cell || cell.getChars() !== done[done.length - 1].ch) predictReset(true);\n"
+"            }\n"
+"            predictRender();\n"
+"        }\n"
+"\n"
+"        // Latency tracing (--trace): when the echo of each input arrived\n"
+"        // and was drawn, reported back to the server in microseconds\n"
+"        const trace = { enabled: false, sent: [] };\n"
+"\n"
+"        function traceReport(seq, received) {\n"
+"            const drawn = performance.now();\n"
+"            while (trace.sent.length && trace.sent[0].seq <= seq) {\n"
+"                const s = trace.sent.shift();\n"
+"                ws.send(JSON.stringify({ type: 'trace', seq: s.seq,\n"
+"                    rtt: Math.round((received - s.time) * 1000),\n"
+"                    render: Math.round((drawn - received) * 1000) }));\n"
+"            }\n"
+"        }\n"
+"\n"
+"        function handleControl(msg) {\n"
+"            if (msg.type === 'echo') {\n"
+"                const received = performance.now();\n"
+"                term.write('', () => {\n"
+"                    predictConfirm(msg.seq);\n"
+"                    if (trace.enabled) requestAnimationFrame(() => traceReport(msg.seq, received));\n"
+"                });\n"
+"            } else if (msg.type === 'predict') {\n"
+"                predict.enabled = msg.enabled;\n"
+"                if (!msg.enabled) predictReset(false);\n"
+"            } else if (msg.type === 'trace') {\n"
+"                trace.enabled = msg.enabled;\n"
+"            } else if (msg.type === 'file') {\n"
+"                showFile(msg);\n"
+"            }\n"
+"        }\n"
+"\n"
+"        // A file offered from the session (oatmux --send), or a place\n"
+"        // there to upload one to (oatmux --receive), over plain HTTP\n"
+"        function showFile(msg) {\n"
+"            const base = location.pathname.replace(/\\/(index\\.html)?$/, '');\n"
+"            const url = base + '/files/' + msg.token;\n"
+"            const item = document.createElement('div');\n"
+"            const label = document.createElement('span');\n"
+"            item.appendChild(label);\n"
+"            if (msg.kind === 'download') {\n"
+"                const link = document.createElement('a');\n"
+"                link.href = url;\n"
+"                link.download = msg.name;\n"
+"                link.textContent = 'Download ' + msg.name + ' (' + msg.size + ' bytes)';\n"
+"                label.appendChild(link);\n"
+"            } else {\n"
+"                const input = document.createElement('input');\n"
+"                input.type = 'file';\n"
+"                label.textContent = 'Upload to ' + msg.name + ' ';\n"
+"                input.onchange = () => {\n"
+"                    const file = input.files[0];\n"
+"                    if (!file) return;\n"
+"                    input.remove();\n"
+"                    label.textContent = 'Uploading ' + file.name + '...';\n"
+"                    fetch(url + '/' + encodeURIComponent(file.name), { method: 'PUT', body: file })\n"
+"                        .then((r) => r.text().then((text) => { label.textContent = r.ok ? 'Uploaded ' + file.name : text; }))\n"
+"                        .catch(() => { label.textContent = 'Upload of ' + file.name + ' failed'; });\n"
+"                };\n"
+"                item.appendChild(input);\n"
+"            }\n"
+"            const close = document.createElement('button');\n"
+"            close.textContent = 'x';\n"
+"            close.onclick = () => item.remove();\n"
+"            item.appendChild(close);\n"
+"            document.getElementById('files').appendChild(item);\n"
+"        }\n"
+"\n"
+"        setInterval(() => {\n"
+"            if (predict.pending.length && performance.now() - predict.pending[0].time > 1500) {\n"
+"                predictReset(true);\n"
+"            }\n"
+"        }, 250);\n"
+"        term.onCursorMove(predictRender);\n"
+"        term.onScroll(predictRender);\n"
+"\n"
+"        // Output is written once per animation frame, in one piece, and\n"
+"        // acknowledged once drawn. The server stops sending to a page more\n"
+"        // than a screenful behind and redraws it instead\n"
+"        const output = { chunks: [], bytes: 0, scheduled: false, unacked: 0, ackTimer: null };\n"
+"\n"
+"        function queueOutput(chunk) {\n"
+"            output.chunks.push(chunk);\n"
+"            output.bytes += chunk.length;\n"
+"            if (!output.scheduled) {\n"
+"                output.scheduled = true;\n"
+"                requestAnimationFrame(flushOutput);\n"
+"            }\n"
+"        }\n"
+"\n"
+"        function flushOutput() {\n"
+"            output.scheduled = false;\n"
+"            if (!output.chunks.length) return;\n"
+"\n"
+"            let data = output.chunks[0];\n"
+"            if (output.chunks.length > 1) {\n"
+"                data = new Uint8Array(output.bytes);\n"
+"                let offset = 0;\n"
+"                for (const chunk of output.chunks) {\n"
+"                    data.set(chunk, offset);\n"
+"                    offset += chunk.length;\n"
+"                }\n"
+"            }\n"
+"            const bytes = output.bytes;\n"
+"            const socket = ws;\n"
+"            output.chunks = [];\n"
+"            output.bytes = 0;\n"
+"            term.write(data, () => ackOutput(socket, bytes));\n"
+"        }\n"
+"\n"
+"        // Acknowledgements are sent per 16 KiB, or 50 ms after the last\n"
+"        function ackOutput(socket, bytes) {\n"
+"            if (socket !== ws) return;\n"
+"            output.unacked += bytes;\n"
+"            if (output.unacked >= 16384) sendAck();\n"
+"            else if (!output.ackTimer) output.ackTimer = setTimeout(sendAck, 50);\n"
+"        }\n"
+"\n"
+"        function sendAck() {\n"
+"            clearTimeout(output.ackTimer);\n"
+"            output.ackTimer = null;\n"
+"            if (output.unacked && ws && ws.readyState === WebSocket.OPEN) {\n"
+"                ws.send(JSON.stringify({ type: 'ack', bytes: output.unacked }));\n"
+"            }\n"
+"            output.unacked = 0;\n"
+"        }\n"
+"\n"
 "        function connect() {\n"
 "            const protocol = location.protocol === 'https:' ? 'wss:' : 'ws:';\n"
-"            ws = new WebSocket(protocol + '//' + location.host + '/ws');\n"
+"            // Behind a gateway the page is at /HOST/SESSION/\n"
+"            const base = location.pathname.replace(/\\/(index\\.html)?$/, '');\n"
+"            ws = new WebSocket(protocol + '//' + location.host + base + '/ws');\n"
 "            ws.binaryType = 'arraybuffer';\n"
 "\n"
 "            ws.onopen = () => {\n"
 "                status.textContent = 'Connected';\n"
 "                status.classList.remove('disconnected');\n"
+"                Object.assign(predict, { enabled: false, seq: 0, acked: 0, hold: 0 });\n"
+"                Object.assign(trace, { enabled: false, sent: [] });\n"
+"                predictReset(false);\n"
+"                clearTimeout(output.ackTimer);\n"
+"                Object.assign(output, { unacked: 0, ackTimer: null });\n"
 "                // Send initial size\n"
 "                const size = { type: 'resize', cols: term.cols, rows: term.rows };\n"
 "                ws.send(JSON.stringify(size));\n"
+"                if (document.hidden) sendVisibility();\n"
 "            };\n"
 "\n"
 "            ws.onmessage = (event) => {\n"
 "                if (event.data instanceof ArrayBuffer) {\n"
-"                    term.write(new Uint8Array(event.data));\n"
+"                    queueOutput(new Uint8Array(event.data));\n"
+"                    return;\n"
+"                }\n"
+"                // Messages refer to the output before them, an echo to\n"
+"                // what it confirms: that goes to the terminal first\n"
+"                flushOutput();\n"
+"                if (event.data[0] === '{') {\n"
+"                    handleControl(JSON.parse(event.data));\n"
 "                } else {\n"
 "                    term.write(event.data);\n"
 "                }\n"
@@ -95,7 +330,10 @@ static const char *HTML_PAGE =
 "\n"
 "        term.onData((data) => {\n"
 "            if (ws && ws.readyState === WebSocket.OPEN) {\n"
+"                const time = performance.now();\n"
 "                ws.send(data);\n"
+"                predictInput(data);\n"
+"                if (trace.enabled && trace.sent.length < 1000) trace.sent.push({ seq: predict.seq, time });\n"
 "            }\n"
 "        });\n"
 "\n"
@@ -107,6 +345,91 @@ static const char *HTML_PAGE =
 "            }\n"
 "        });\n"
 "\n"
+"        // A background tab is sent no output, and a redraw once it is\n"
+"        // back in front\n"
+"        function sendVisibility() {\n"
+"            if (ws && ws.readyState === WebSocket.OPEN) {\n"
+"                ws.send(JSON.stringify({ type: 'visibility', hidden: document.hidden }));\n"
+"            }\n"
+"        }\n"
+"        document.addEventListener('visibilitychange', sendVisibility);\n"
+"\n"
+"        // Scrollback kept by the server (--archive): scrolling up past the\n"
+"        // top of the terminal opens it, and older lines are fetched as\n"
+"        // they come into view\n"
+"        const archive = { el: document.getElementById('archive'), start: 0, open: false, off: false, loading: false };\n"
+"\n"
+"        // The lines in a range of the archive; one cut off at the start is\n"
+"        // left out. Returns null if there are none\n"
+"        async function archiveFetch(range) {\n"
+"            const base = location.pathname.replace(/\\/(index\\.html)?$/, '');\n"
+"            const res = await fetch(base + '/archive', { headers: { Range: 'bytes=' + range }, cache: 'no-store' });\n"
+"            if (res.status === 404) archive.off = true;\n"
+"            if (res.status !== 206) return null;\n"
+"            const bytes = new Uint8Array(await res.arrayBuffer());\n"
+"            let start = +/bytes (\\d+)-/.exec(res.headers.get('Content-Range'))[1];\n"
+"            // A range may begin mid-line where asked, but not where it\n"
+"            // was moved up to the oldest line kept\n"
+"            const asked = range.startsWith('-') ? -1 : parseInt(range, 10);\n"
+"            let skip = 0;\n"
+"            if (start > 0 && (asked < 0 || start === asked)) skip = bytes.indexOf(10) + 1;\n"
+"            start += skip;\n"
+"            return { start, text: new TextDecoder().decode(bytes.subarray(skip)) };\n"
+"        }\n"
+"\n"
+"        async function openArchive() {\n"
+"            if (archive.open || archive.off || archive.loading) return;\n"
+"            archive.loading = true;\n"
+"            const page = await archiveFetch('-65536').catch(() => null);\n"
+"            archive.loading = false;\n"
+"            if (!page) return;\n"
+"            archive.open = true;\n"
+"            archive.start = page.start;\n"
+"            archive.el.textContent = page.text;\n"
+"            archive.el.style.display = 'block';\n"
+"            archive.el.scrollTop = archive.el.scrollHeight;\n"
+"            archive.el.focus();\n"
+"        }\n"
+"\n"
+"        function closeArchive() {\n"
+"            archive.open = false;\n"
+"            archive.el.style.display = 'none';\n"
+"            archive.el.textContent = '';\n"
+"            term.focus();\n"
+"        }\n"
+"\n"
+"        archive.el.addEventListener('scroll', async () => {\n"
+"            if (archive.loading || archive.start === 0 || archive.el.scrollTop > archive.el.clientHeight) return;\n"
+"            archive.loading = true;\n"
+"            const from = Math.max(0, archive.start - 65536);\n"
+"            const page = await archiveFetch(from + '-' + (archive.start - 1)).catch(() => null);\n"
+"            archive.loading = false;\n"
+"            if (!archive.open) return;\n"
+"            if (!page) {\n"
+"                archive.start = 0; // Nothing older is kept\n"
+"                return;\n"
+"            }\n"
+"            const height = archive.el.scrollHeight;\n"
+"            archive.el.prepend(page.text);\n"
+"            archive.el.scrollTop += archive.el.scrollHeight - height;\n"
+"            archive.start = page.start;\n"
+"        });\n"
+"        archive.el.addEventListener('wheel', (e) => {\n"
+"            const bottom = archive.el.scrollTop + archive.el.clientHeight >= archive.el.scrollHeight - 1;\n"
+"            if (e.deltaY > 0 && bottom) closeArchive();\n"
+"        }, { passive: true });\n"
+"        archive.el.addEventListener('keydown', (e) => {\n"
+"            if (e.key === 'Escape' || e.key === 'q') closeArchive();\n"
+"        });\n"
+"        document.getElementById('terminal').addEventListener('wheel', (e) => {\n"
+"            if (e.deltaY < 0 && term.buffer.active.viewportY === 0) openArchive();\n"
+"        }, { passive: true });\n"
+"        term.attachCustomKeyEventHandler((e) => {\n"
+"            if (e.type !== 'keydown' || !e.shiftKey || e.key !== 'PageUp' || term.buffer.active.viewportY > 0) return true;\n"
+"            openArchive();\n"
+"            return false;\n"
+"        });\n"
+"\n"
 "        // Handle mobile keyboard\n"
 "        term.textarea.setAttribute('autocapitalize', 'off');\n"
 "        term.textarea.setAttribute('autocorrect', 'off');\n"
@@ -116,27 +439,166 @@ static const char *HTML_PAGE =
 "</body>\n"
 "</html>\n";
 
-static volatile int server_running = 1;
-static int server_socket = -1;
+// Several sessions tiled on one multiplexed connection (/tile?s=a,b)
+static const char *TILE_PAGE =
+"<!DOCTYPE html>\n"
+"<html>\n"
+"<head>\n"
+"    <meta charset=\"UTF-8\">\n"
+"    <meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
+"    <title>oatmux</title>\n"
+"    <link rel=\"stylesheet\" href=\"https://cdn.jsdelivr.net/npm/xterm@5.3.0/css/xterm.css\">\n"
+"    <style>\n"
+"        * { margin: 0; padding: 0; box-sizing: border-box; }\n"
+"        html, body { height: 100%; width: 100%; background: #000; overflow: hidden; }\n"
+"        #grid { position: absolute; top: 0; left: 0; right: 0; bottom: 0; display: grid; gap: 2px; background: #333; }\n"
+"        .tile { position: relative; background: #000; overflow: hidden; }\n"
+"        .tile .term { position: absolute; top: 0; left: 0; right: 0; bottom: 0; }\n"
+"        .tile .term .xterm { height: 100%; }\n"
+"        .tile .name { position: absolute; top: 0; right: 0; z-index: 10; color: #0f0; font-family: monospace; font-size: 12px; background: rgba(0,0,0,0.8); padding: 2px 8px; }\n"
+"        .tile.closed .name { color: #f00; }\n"
+"        #status { position: fixed; bottom: 8px; right: 12px; color: #0f0; font-family: monospace; font-size: 12px; z-index: 9999; background: rgba(0,0,0,0.8); padding: 3px 10px; border-radius: 4px; }\n"
+"        .disconnected { color: #f00 !important; }\n"
+"    </style>\n"
+"</head>\n"
+"<body>\n"
+"    <div id=\"status\">Connecting...</div>\n"
+"    <div id=\"grid\"></div>\n"
+"    <script src=\"https://cdn.jsdelivr.net/npm/xterm@5.3.0/lib/xterm.min.js\"></script>\n"
+"    <script src=\"https://cdn.jsdelivr.net/npm/xterm-addon-fit@0.8.0/lib/xterm-addon-fit.min.js\"></script>\n"
+"    <script>\n"
+"        // Every session in ?s=a,b,c is a channel of one WebSocket (/mux):\n"
+"        // binary frames carry the channel id in their first byte, JSON\n"
+"        // messages a ch member\n"
+"        const sessions = (new URLSearchParams(location.search).get('s') || '')\n"
+"            .split(',').filter((s) => s).slice(0, 32);\n"
+"        const grid = document.getElementById('grid');\n"
+"        const status = document.getElementById('status');\n"
+"        const encoder = new TextEncoder();\n"
+"        const tiles = [];\n"
+"        let ws;\n"
+"\n"
+"        const columns = Math.ceil(Math.sqrt(sessions.length));\n"
+"        grid.style.gridTemplateColumns = 'repeat(' + columns + ', 1fr)';\n"
+"        grid.style.gridTemplateRows = 'repeat(' + Math.ceil(sessions.length / columns) + ', 1fr)';\n"
+"\n"
+"        function control(msg) {\n"
+"            if (ws && ws.readyState === WebSocket.OPEN) ws.send(JSON.stringify(msg));\n"
+"        }\n"
+"\n"
+"        // Output is acknowledged once drawn, at most once per task; the\n"
+"        // server redraws a channel that falls too far behind instead\n"
+"        function ack(tile, bytes) {\n"
+"            tile.unacked += bytes;\n"
+"            if (tile.ackTimer) return;\n"
+"            tile.ackTimer = setTimeout(() => {\n"
+"                tile.ackTimer = null;\n"
+"                control({ type: 'ack', ch: tile.ch, bytes: tile.unacked });\n"
+"                tile.unacked = 0;\n"
+"            }, 0);\n"
+"        }\n"
+"\n"
+"        sessions.forEach((name, ch) => {\n"
+"            const el = document.createElement('div');\n"
+"            el.className = 'tile';\n"
+"            el.innerHTML = '<div class=\"term\"></div><div class=\"name\"></div>';\n"
+"            el.querySelector('.name').textContent = name;\n"
+"            grid.appendChild(el);\n"
+"\n"
+"            const term = new Terminal({\n"
+"                cursorBlink: true,\n"
+"                fontSize: 13,\n"
+"                fontFamily: 'Menlo, Monaco, \"Courier New\", monospace',\n"
+"                theme: { background: '#000000' },\n"
+"                scrollback: 5000\n"
+"            });\n"
+"            const fit = new FitAddon.FitAddon();\n"
+"            term.loadAddon(fit);\n"
+"            term.open(el.querySelector('.term'));\n"
+"\n"
+"            const tile = { ch, name, el, term, fit, unacked: 0, ackTimer: null };\n"
+"            tiles.push(tile);\n"
+"            term.onData((data) => {\n"
+"                if (!ws || ws.readyState !== WebSocket.OPEN) return;\n"
+"                const bytes = encoder.encode(data);\n"
+"                const frame = new Uint8Array(bytes.length + 1);\n"
+"                frame[0] = ch;\n"
+"                frame.set(bytes, 1);\n"
+"                ws.send(frame);\n"
+"            });\n"
+"        });\n"
+"\n"
+"        function connect() {\n"
+"            const protocol = location.protocol === 'https:' ? 'wss:' : 'ws:';\n"
+"            // Behind a gateway the page is at /HOST/SESSION/tile\n"
+"            const base = location.pathname.replace(/\\/tile$/, '');\n"
+"            ws = new WebSocket(protocol + '//' + location.host + base + '/mux');\n"
+"            ws.binaryType = 'arraybuffer';\n"
+"\n"
+"            ws.onopen = () => {\n"
+"                status.textContent = 'Connected';\n"
+"                status.classList.remove('disconnected');\n"
+"                for (const tile of tiles) {\n"
+"                    tile.unacked = 0;\n"
+"                    tile.el.classList.remove('closed');\n"
+"                    tile.fit.fit();\n"
+"                    control({ type: 'open', ch: tile.ch, cols: tile.term.cols,\n"
+"                              rows: tile.term.rows, session: tile.name });\n"
+"                }\n"
+"                if (document.hidden) control({ type: 'visibility', hidden: true });\n"
+"            };\n"
+"\n"
+"            ws.onmessage = (event) => {\n"
+"                if (event.data instanceof ArrayBuffer) {\n"
+"                    const bytes = new Uint8Array(event.data);\n"
+"                    const tile = tiles[bytes[0]];\n"
+"                    if (tile) tile.term.write(bytes.subarray(1), () => ack(tile, bytes.length - 1));\n"
+"                    return;\n"
+"                }\n"
+"                const msg = JSON.parse(event.data);\n"
+"                if (msg.type === 'closed' && tiles[msg.ch]) tiles[msg.ch].el.classList.add('closed');\n"
+"            };\n"
+"\n"
+"            ws.onclose = () => {\n"
+"                status.textContent = 'Disconnected - Reconnecting...';\n"
+"                status.classList.add('disconnected');\n"
+"                setTimeout(connect, 2000);\n"
+"            };\n"
+"\n"
+"            ws.onerror = (err) => {\n"
+"                console.error('WebSocket error:', err);\n"
+"                ws.close();\n"
+"            };\n"
+"        }\n"
+"\n"
+"        window.addEventListener('resize', () => {\n"
+"            for (const tile of tiles) {\n"
+"                tile.fit.fit();\n"
+"                control({ type: 'resize', ch: tile.ch, cols: tile.term.cols, rows: tile.term.rows });\n"
+"            }\n"
+"        });\n"
+"\n"
+"        // No output while in a background tab; every tile is redrawn on return\n"
+"        document.addEventListener('visibilitychange', () => {\n"
+"            control({ type: 'visibility', hidden: document.hidden });\n"
+"        });\n"
+"\n"
+"        if (sessions.length) {\n"
+"            connect();\n"
+"        } else {\n"
+"            status.textContent = 'Name the sessions to show: tile?s=one,two';\n"
+"        }\n"
+"    </script>\n"
+"</body>\n"
+"</html>\n";
 
-// Client connection state
-typedef struct {
-    int socket_fd;
-    terminal_t terminal;
-    int websocket_ready;
-    pthread_t thread;
-    char *session_name;
-    char client_ip[INET_ADDRSTRLEN];
-} client_t;
-
-static void signal_handler(int sig) {
-    (void)sig;
-    server_running = 0;
-    if (server_socket >= 0) {
-        close(server_socket);
-        server_socket = -1;
-    }
-}
+const server_config_t *server_config;
+
+server_listener_t listeners[LISTENER_SLOTS];
+int listener_count;
+
+server_worker_t *workers;
+int worker_count;
 
 // Parse HTTP headers and extract WebSocket key
 static int parse_http_request(const char *request, char *ws_key, size_t ws_key_size, char *path, size_t path_size) {
@@ -149,7 +611,7 @@ static int parse_http_request(const char *request, char *ws_key, size_t ws_key_s
     if (!path_end) return -1;
 
     size_t path_len = path_end - path_start;
-    if (path_len >= path_size) path_len = path_size - 1;
+    if (path_len >= path_size) return -1;
     strncpy(path, path_start, path_len);
     path[path_len] = '\0';
 
@@ -173,235 +635,777 @@ static int parse_http_request(const char *request, char *ws_key, size_t ws_key_s
     return 1; // WebSocket upgrade request
 }
 
-// Send HTTP response
-static int send_http_response(int fd, int status_code, const char *status_text,
-                              const char *content_type, const char *body, size_t body_len) {
-    char header[512];
-    int header_len = snprintf(header, sizeof(header),
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        status_code, status_text, content_type, body_len);
-
-    if (write(fd, header, header_len) < 0) return -1;
-    if (body_len > 0 && write(fd, body, body_len) < 0) return -1;
+// Gateway mode: hand a request for /HOST/SESSION/REST to agent HOST as
+// one for REST, naming SESSION and the client's address in headers. The
+// agent's link relays the connection from then on. Whatever followed the
+// request in the same read, a body or pipelined requests, goes after it.
+// Returns 0 if the client was handed over, -1 to serve it here
+static int route_to_agent(client_t *client, const char *request,
+                          const uint8_t *extra, size_t extra_len) {
+    size_t method_len = strcspn(request, " ");
+    const char *host = request + method_len;
+    if (strncmp(host, " /", 2) != 0) return -1;
+    host += 2;
+
+    size_t host_len = strcspn(host, "/? ");
+    const char *session = host + host_len + 1;
+    size_t session_len = strcspn(session, "/? ");
+    if (host_len == 0 || host_len >= GATEWAY_NAME_MAX || host[host_len] != '/' ||
+        session_len == 0) {
+        return -1;
+    }
+    const char *rest = session + session_len;
+    size_t rest_len = strcspn(rest, " ");
+    const char *headers = strstr(rest, "\r\n");
+    if (!headers) return -1;
+
+    char name[GATEWAY_NAME_MAX];
+    memcpy(name, host, host_len);
+    name[host_len] = '\0';
+
+    size_t size = strlen(request) + 256 + sizeof(client->client_ip) + extra_len;
+    char *head = malloc(size);
+    if (!head) return -1;
+    size_t len = snprintf(head, size,
+        "%.*s %s%.*s HTTP/1.1\r\nX-Oatmux-Session: %.*s\r\nX-Forwarded-For: %s%s\r\n",
+        (int)method_len, request, rest[0] == '/' ? "" : "/", (int)rest_len, rest,
+        (int)session_len, session, client->client_ip, headers);
+    memcpy(head + len, extra, extra_len);
+    len += extra_len;
+
+    int routed = gateway_route(name, client->socket_fd, (uint8_t *)head, len);
+    free(head);
+    if (routed < 0) return -1;
+
+    worker_unwatch(&client->sock);
+    client->socket_fd = -1;
+    client_close(client);
     return 0;
 }
 
-// Send WebSocket upgrade response
-static int send_ws_upgrade_response(int fd, const char *accept_key) {
-    char response[512];
-    int len = snprintf(response, sizeof(response),
-        "HTTP/1.1 101 Switching Protocols\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: %s\r\n"
-        "\r\n",
-        accept_key);
-
-    return write(fd, response, len) == len ? 0 : -1;
+// Attach a client that switched to WebSocket to its session: join the
+// hub of the shared terminal, or start a tmux client of its own
+// Returns 0 on success, -1 on error
+int client_attach(client_t *client) {
+    // Viewers of a shared terminal only need to join its hub
+    if (server_config->shared) {
+        client->hub = hub_get(client->session_name);
+        if (!client->hub) return -1;
+        client->websocket_ready = 1;
+        hub_join(client->hub, &client->owner->worker, client->client_ip);
+        return 0;
+    }
+
+    // Take a tmux client that is already attached if there is one, else
+    // start one
+    server_worker_t *sw = client->owner;
+    int created = sw->warm && warm_take(sw->warm, client->session_name, &client->terminal) == 0;
+    if (!created) created = terminal_create(&client->terminal, client->session_name) == 0;
+    if (!created ||
+        worker_watch(&sw->worker, &client->pty, client->terminal.master_fd,
+                     EPOLLIN, on_client_pty) < 0) {
+        return -1;
+    }
+    watch_child(sw, &client->child, &client->terminal, on_client_child);
+    if (server_config->compact) client->vt = vtopt_new(client->cols, client->rows);
+
+    // Without a pipe, output takes the copying path; a channel shares
+    // its connection's socket and always does
+    if (server_config->splice && !client->parent &&
+        pipe2(client->splice_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        client->splice_pipe[0] = client->splice_pipe[1] = -1;
+    }
+
+    client->websocket_ready = 1;
+    if (trace_on() && !client->parent) {
+        const char *msg = "{\"type\":\"trace\",\"enabled\":true}";
+        client_send_text(client, msg, strlen(msg));
+    }
+    client->hub = hub_get(client->session_name);
+    if (client->hub) hub_join(client->hub, &client->owner->worker, client->client_ip);
+    return 0;
 }
 
-// Client handler thread
-static void *client_handler(void *arg) {
-    client_t *client = (client_t *)arg;
-    char buffer[BUFFER_SIZE];
-    uint8_t ws_buffer[BUFFER_SIZE];
-    size_t ws_buffer_len = 0;
+// Paths about the session a request is for
+static int session_path(const char *path) {
+    return strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0 ||
+           strcmp(path, "/search") == 0 || strcmp(path, "/snapshot") == 0 ||
+           strcmp(path, "/archive") == 0;
+}
 
-    // Read HTTP request
-    ssize_t n = read(client->socket_fd, buffer, sizeof(buffer) - 1);
-    if (n <= 0) {
-        goto cleanup;
+// Take the session a gateway asked for from its X-Oatmux-Session header
+static void routed_session(client_t *client, const char *request) {
+    const char *session = strstr(request, "\r\nX-Oatmux-Session: ");
+    if (!session) return;
+
+    session += 20;
+    size_t len = strcspn(session, "\r");
+    if (len == 0 || len >= 256) return;
+    client->session_copy = strndup(session, len);
+    client->session_name = client->session_copy;
+}
+
+// A WebSocket upgrade waiting for the helper thread to find out whether
+// tmux has the session (snapshot.h)
+typedef struct {
+    uint64_t serial;
+    char ws_key[256];
+} websocket_request_t;
+
+static void websocket_accept(client_t *client, const char *ws_key, int mux, int waited);
+
+// The helper has listed the sessions since the upgrade had to wait
+static void websocket_ready_task(worker_t *worker, void *arg) {
+    websocket_request_t *req = arg;
+    client_t *client = client_resume((server_worker_t *)worker, req->serial);
+    if (client) {
+        websocket_accept(client, req->ws_key, 0, 1);
+        if (client->sock.worker && client->state == CLIENT_CLOSING) {
+            client_resumed(client);
+        } else if (client->sock.worker && client_send_pending(client) < 0) {
+            client_close(client);
+        }
+    }
+    free(req);
+}
+
+// Wait for the helper's next pass to accept the upgrade
+// Returns 0 if the client waits, -1 if not
+static int websocket_defer(client_t *client, const char *ws_key) {
+    websocket_request_t *req = malloc(sizeof(*req));
+    if (!req) return -1;
+
+    snprintf(req->ws_key, sizeof(req->ws_key), "%s", ws_key);
+    if (snapshot_wait(&client->owner->worker, websocket_ready_task, req) < 0) {
+        free(req);
+        return -1;
     }
-    buffer[n] = '\0';
 
+    // The answer is posted to this worker, so it comes after this returns
+    req->serial = client_wait(client);
+    return 0;
+}
+
+// Route a complete, NUL-terminated HTTP request; extra is what came
+// after it in the same read
+static void handle_request(client_t *client, char *request,
+                           const uint8_t *extra, size_t extra_len) {
     char ws_key[256] = {0};
-    char path[256] = {0};
-    int is_websocket = parse_http_request(buffer, ws_key, sizeof(ws_key), path, sizeof(path));
+    char path[PATH_MAX] = {0};
+    int is_websocket = parse_http_request(request, ws_key, sizeof(ws_key), path, sizeof(path));
+
+    // A local proxy knows who the client really is
+    if (client->local) {
+        const char *forwarded = strstr(request, "\r\nX-Forwarded-For: ");
+        if (forwarded) {
+            forwarded += 19;
+            size_t len = strcspn(forwarded, ", \r");
+            if (len > 0 && len < sizeof(client->client_ip)) {
+                memcpy(client->client_ip, forwarded, len);
+                client->client_ip[len] = '\0';
+            }
+        }
+    }
 
     if (is_websocket < 0) {
-        goto cleanup;
+        client_close(client);
+        return;
+    }
+
+    if (server_config->gateway && route_to_agent(client, request, extra, extra_len) == 0) return;
+
+    char *query = strchr(path, '?');
+    if (query) *query++ = '\0';
+    else query = "";
+
+    // A gateway names the session in the path it was asked for; only
+    // what is about a session looks for it
+    int mux = strcmp(path, "/mux") == 0;
+    if (client->routed && ((is_websocket > 0 && !mux) || session_path(path))) {
+        routed_session(client, request);
     }
 
     // Handle regular HTTP request
     if (is_websocket == 0 || strlen(ws_key) == 0) {
-        if (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
-            send_http_response(client->socket_fd, 200, "OK", "text/html", HTML_PAGE, strlen(HTML_PAGE));
+        if ((strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) && client->session_name) {
+            send_http_response(client, 200, "OK", "text/html", HTML_PAGE, strlen(HTML_PAGE));
+        } else if (strcmp(path, "/tile") == 0) {
+            send_http_response(client, 200, "OK", "text/html", TILE_PAGE, strlen(TILE_PAGE));
+        } else if (strcmp(path, "/stats") == 0) {
+            send_stats(client);
+        } else if (strcmp(path, "/hosts") == 0 && server_config->gateway) {
+            send_hosts(client);
+        } else if (strcmp(path, "/search") == 0) {
+            send_search(client, query);
+        } else if (strcmp(path, "/trace") == 0) {
+            send_trace(client);
+        } else if (strcmp(path, "/snapshot") == 0) {
+            send_snapshot(client, request, query);
+        } else if (strcmp(path, "/archive") == 0) {
+            send_archive(client, request, query);
+        } else if (strncmp(path, "/files/", 7) == 0 && server_config->transfer) {
+            serve_files(client, request, path);
+        } else if (strcmp(path, "/offer") == 0 && client->control) {
+            send_offer(client, query);
         } else {
             const char *not_found = "404 Not Found";
-            send_http_response(client->socket_fd, 404, "Not Found", "text/plain", not_found, strlen(not_found));
+            send_http_response(client, 404, "Not Found", "text/plain", not_found, strlen(not_found));
         }
-        goto cleanup;
+        return;
     }
 
-    // WebSocket upgrade
-    char accept_key[64];
-    if (ws_generate_accept_key(ws_key, accept_key, sizeof(accept_key)) < 0) {
-        goto cleanup;
+    // A gateway or agent started without -s only serves sessions by
+    // path; a multiplexed connection names them per channel
+    if (!client->session_name && !mux) {
+        const char *no_session = "No session; open /HOST/SESSION/ on the gateway";
+        send_http_response(client, 404, "Not Found", "text/plain", no_session, strlen(no_session));
+        return;
+    }
+
+    websocket_accept(client, ws_key, mux, 0);
+}
+
+// Switch to WebSocket and attach to the session. A gateway's session
+// has to be one tmux has; while the helper thread finds out, the client
+// waits for it, once.
+static void websocket_accept(client_t *client, const char *ws_key, int mux, int waited) {
+    int exists = client->routed && !mux ? snapshot_session_exists(client->session_name) : 1;
+    if (exists < 0 && !waited && websocket_defer(client, ws_key) == 0) return;
+    if (exists < 0) {
+        const char *error = "Failed to list sessions";
+        send_http_response(client, 500, "Internal Server Error", "text/plain", error, strlen(error));
+        return;
+    }
+    if (exists == 0) {
+        const char *error = "No such session";
+        send_http_response(client, 404, "Not Found", "text/plain", error, strlen(error));
+        return;
     }
 
-    if (send_ws_upgrade_response(client->socket_fd, accept_key) < 0) {
-        goto cleanup;
+    char accept_key[64];
+    if (ws_generate_accept_key(ws_key, accept_key, sizeof(accept_key)) < 0 ||
+        send_ws_upgrade_response(client, accept_key) < 0) {
+        client_close(client);
+        return;
     }
 
-    client->websocket_ready = 1;
-    printf("[WS] %s connected\n", client->client_ip);
+    client->state = CLIENT_WEBSOCKET;
+    if (mux) {
+        client->mux = 1;
+        client->session_name = NULL;
+        client->websocket_ready = 1;
+        return;
+    }
 
-    // Create terminal attached to tmux session
-    if (terminal_create(&client->terminal, client->session_name) < 0) {
+    if (client_attach(client) < 0) {
         const char *error = "Failed to attach to tmux session";
-        ws_send_text(client->socket_fd, error, strlen(error));
-        goto cleanup;
+        client_send_text(client, error, strlen(error));
+        client->state = CLIENT_CLOSING;
     }
+}
 
-    // Main I/O loop
-    fd_set read_fds;
-    struct timeval tv;
+// Handle the WebSocket frames that are complete in data
+// Returns the bytes consumed, or -1 once the client has been closed
+// Input payloads are gathered at the start of data, over frames already
+// parsed, and written together; frames of other kinds flush them first
+// to keep the order
+static ssize_t process_frames(client_t *client, uint8_t *data, size_t len) {
+    size_t offset = 0;
+    size_t input_len = 0;
+    int cols = 0, rows = 0;
+
+    while (offset < len) {
+        ws_frame_t frame;
+        size_t consumed;
+
+        if (ws_parse_frame(data + offset, len - offset, &frame, &consumed) < 0) {
+            break; // Need more data
+        }
 
-    while (server_running && terminal_is_running(&client->terminal)) {
-        FD_ZERO(&read_fds);
-        FD_SET(client->socket_fd, &read_fds);
-        FD_SET(client->terminal.master_fd, &read_fds);
+        // Handle frame based on opcode
+        switch (frame.opcode) {
+            case WS_OPCODE_TEXT:
+            case WS_OPCODE_BIN:
+                // Check for resize command; only the last size counts
+                if (frame.payload_len > 0 && frame.payload[0] == '{') {
+                    // The payload is not terminated; parse a bounded copy
+                    char json[128];
+                    size_t json_len = frame.payload_len < sizeof(json) - 1 ?
+                                      frame.payload_len : sizeof(json) - 1;
+                    memcpy(json, frame.payload, json_len);
+                    json[json_len] = '\0';
+
+                    int c, r;
+                    if (sscanf(json, "{\"type\":\"resize\",\"cols\":%d,\"rows\":%d}",
+                               &c, &r) == 2) {
+                        cols = c;
+                        rows = r;
+                        break;
+                    }
 
-        int max_fd = client->socket_fd > client->terminal.master_fd ?
-                     client->socket_fd : client->terminal.master_fd;
+                    char hidden[6];
+                    if (sscanf(json, "{\"type\":\"visibility\",\"hidden\":%5[a-z]}",
+                               hidden) == 1) {
+                        client_set_hidden(client, strcmp(hidden, "true") == 0);
+                        break;
+                    }
+
+                    // Output the page has drawn; from the first of these
+                    // on, what it hasn't counts as backlog
+                    unsigned bytes;
+                    if (sscanf(json, "{\"type\":\"ack\",\"bytes\":%u}", &bytes) == 1) {
+                        client->acking = 1;
+                        client_ack(client, bytes);
+                        client_check_resync(client);
+                        break;
+                    }
+
+                    // The browser's timing of an input it saw echoed
+                    unsigned seq, rtt, render;
+                    if (sscanf(json, "{\"type\":\"trace\",\"seq\":%u,\"rtt\":%u,\"render\":%u}",
+                               &seq, &rtt, &render) == 3) {
+                        if (trace_on()) {
+                            if (!client->trace_id) client->trace_id = trace_conn_id();
+                            trace_record(TRACE_BROWSER, client->trace_id, seq, rtt, render);
+                        }
+                        break;
+                    }
+                }
 
-        tv.tv_sec = 0;
-        tv.tv_usec = 50000; // 50ms timeout
+                // Regular input. Every frame counts towards the sequence
+                // the browser numbers its predictions with
+                if (frame.payload_len > 0) {
+                    memmove(data + input_len, frame.payload, frame.payload_len);
+                    input_len += frame.payload_len;
+                    client->input_seq++;
+                    client_trace(client, TRACE_INPUT, client->input_seq);
+                }
+                break;
+
+            case WS_OPCODE_PING:
+                client_input(client, data, input_len);
+                input_len = 0;
+                client_send_frame(client, WS_OPCODE_PONG, frame.payload, frame.payload_len);
+                break;
+
+            case WS_OPCODE_CLOSE:
+                client_input(client, data, input_len);
+                client_send_frame(client, WS_OPCODE_CLOSE, NULL, 0);
+                client_flush(client);
+                client_close(client);
+                return -1;
+        }
 
-        int ret = select(max_fd + 1, &read_fds, NULL, NULL, &tv);
-        if (ret < 0) {
-            if (errno == EINTR) continue;
-            break;
+        offset += consumed;
+    }
+
+    client_input(client, data, input_len);
+    if (cols > 0) client_resize(client, cols, rows);
+    return offset;
+}
+
+// Handle whatever is complete in data, a NUL-terminated writable buffer
+// Returns the bytes consumed, or -1 once the client has been closed
+static ssize_t client_consume(client_t *client, uint8_t *data, size_t len) {
+    size_t offset = 0;
+
+    if (client->state == CLIENT_HTTP) {
+        char *end = strstr((char *)data, "\r\n\r\n");
+        if (!end) {
+            if (len >= BUFFER_SIZE - 1) {
+                client_close(client);
+                return -1;
+            }
+            return 0;
         }
 
-        // Read from WebSocket client
-        if (FD_ISSET(client->socket_fd, &read_fds)) {
-            n = read(client->socket_fd, ws_buffer + ws_buffer_len,
-                     sizeof(ws_buffer) - ws_buffer_len);
-            if (n <= 0) break;
-            ws_buffer_len += n;
+        offset = end + 4 - (char *)data;
+        end[2] = '\0';
+        handle_request(client, (char *)data, data + offset, len - offset);
+        if (client->sock.worker == NULL) return -1;
+    }
 
-            // Process WebSocket frames
-            while (ws_buffer_len > 0) {
-                ws_frame_t frame;
-                size_t consumed;
+    if (client->state == CLIENT_UPLOAD) {
+        offset += client_upload(client, data + offset, len - offset);
+    }
 
-                if (ws_parse_frame(ws_buffer, ws_buffer_len, &frame, &consumed) < 0) {
-                    break; // Need more data
-                }
+    if (client->state == CLIENT_WEBSOCKET) {
+        ssize_t n = client->mux ? process_mux_frames(client, data + offset, len - offset)
+                                : process_frames(client, data + offset, len - offset);
+        if (n < 0) return -1;
+        offset += n;
 
-                // Handle frame based on opcode
-                switch (frame.opcode) {
-                    case WS_OPCODE_TEXT:
-                    case WS_OPCODE_BIN:
-                        // Check for resize command
-                        if (frame.payload_len > 0 && frame.payload[0] == '{') {
-                            // Try to parse as JSON resize command
-                            int cols, rows;
-                            if (sscanf((char *)frame.payload,
-                                       "{\"type\":\"resize\",\"cols\":%d,\"rows\":%d}",
-                                       &cols, &rows) == 2) {
-                                terminal_resize(&client->terminal, cols, rows);
-                            } else {
-                                // Regular input
-                                terminal_write(&client->terminal,
-                                             (char *)frame.payload, frame.payload_len);
-                            }
-                        } else if (frame.payload_len > 0) {
-                            terminal_write(&client->terminal,
-                                         (char *)frame.payload, frame.payload_len);
-                        }
-                        break;
+        // Refuse to buffer an unreasonably large frame
+        size_t frame_size = ws_frame_size(data + offset, len - offset);
+        if (frame_size > MAX_FRAME_SIZE) {
+            client_close(client);
+            return -1;
+        }
+    } else if (client->state == CLIENT_WAITING || client->state == CLIENT_CLOSING) {
+        offset = len;
+    }
 
-                    case WS_OPCODE_PING:
-                        ws_send_pong(client->socket_fd, frame.payload, frame.payload_len);
-                        break;
+    return offset;
+}
 
-                    case WS_OPCODE_CLOSE:
-                        ws_send_close(client->socket_fd);
-                        free(frame.payload);
-                        goto cleanup;
-                }
+// Read from the socket into the worker's scratch buffer; only bytes left
+// over from an incomplete request or frame are kept with the client
+static int client_read(client_t *client) {
+    uint8_t *scratch = (uint8_t *)client->owner->read_buf;
+
+    // Keep room for the terminating NUL of a request
+    ssize_t n = read(client->socket_fd, scratch, BUFFER_SIZE - 1);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        client_close(client);
+        return -1;
+    }
+    if (n < 0) return 0;
+    client->heard_ms = worker_now_ms();
 
-                free(frame.payload);
+    uint8_t *data = scratch;
+    size_t len = n;
 
-                // Remove processed data from buffer
-                memmove(ws_buffer, ws_buffer + consumed, ws_buffer_len - consumed);
-                ws_buffer_len -= consumed;
-            }
+    if (client->in_len > 0) {
+        if (client_in_reserve(client, client->in_len + n) < 0) {
+            client_close(client);
+            return -1;
+        }
+        memcpy(client->in_data + client->in_len, scratch, n);
+        client->in_len += n;
+        data = client->in_data;
+        len = client->in_len;
+    }
+    data[len] = '\0';
+
+    ssize_t consumed = client_consume(client, data, len);
+    if (consumed < 0) return -1;
+
+    size_t left = len - consumed;
+    if (left == 0) {
+        client_in_release(client);
+    } else if (data == scratch) {
+        if (client_in_reserve(client, left) < 0) {
+            client_close(client);
+            return -1;
         }
+        memcpy(client->in_data, scratch + consumed, left);
+        client->in_len = left;
+    } else if (consumed > 0) {
+        memmove(client->in_data, client->in_data + consumed, left);
+        client->in_len = left;
+    }
+    return 0;
+}
+
+void on_client_socket(watcher_t *watcher, uint32_t events) {
+    client_t *client = (client_t *)watcher;
 
-        // Read from terminal
-        if (FD_ISSET(client->terminal.master_fd, &read_fds)) {
-            n = terminal_read(&client->terminal, buffer, sizeof(buffer));
-            if (n > 0) {
-                ws_send_binary(client->socket_fd, (uint8_t *)buffer, n);
-            } else if (n < 0) {
-                break; // Terminal closed
+    if (events & EPOLLOUT) {
+        if (client_flush(client) < 0) {
+            client_close(client);
+            return;
+        }
+        if (client->state == CLIENT_CLOSING && client_pending(client) == 0) {
+            client_close(client);
+            return;
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (client->state == CLIENT_WAITING || client->state == CLIENT_CLOSING) {
+            // Nothing more to say; just wait for the response to drain
+            char discard[512];
+            ssize_t n = read(client->socket_fd, discard, sizeof(discard));
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                client_close(client);
+                return;
             }
+        } else if (client_read(client) < 0) {
+            return;
         }
     }
 
-cleanup:
-    if (client->websocket_ready) {
-        printf("[WS] %s disconnected\n", client->client_ip);
+    if (client_send_pending(client) < 0) {
+        client_close(client);
+        return;
+    }
+
+    if (client->state == CLIENT_CLOSING && client_pending(client) == 0) {
+        client_close(client);
     }
-    terminal_close(&client->terminal);
-    close(client->socket_fd);
-    free(client->session_name);
-    free(client);
-    return NULL;
 }
 
-int server_start(server_config_t *config) {
-    struct sockaddr_in server_addr;
+// Move terminal output to the socket through the client's pipe, so only
+// the frame header passes through userspace (--splice). Only used while
+// nothing else is queued for the client.
+// Returns bytes of output handled, 0 if none was available, -1 on error
+static ssize_t client_splice_output(client_t *client) {
+    ssize_t n = terminal_splice(&client->terminal, client->splice_pipe[1], BUFFER_SIZE);
+    if (n <= 0) return n;
+
+    // Over the flood limit the regular path decides what to drop
+    if (client_backlog(client) + n > client_flood_limit(client)) {
+        uint8_t *buffer = (uint8_t *)client->owner->read_buf;
+        if (read(client->splice_pipe[0], buffer, n) != n) return -1;
+        client_send_output(client, buffer, n);
+        return n;
+    }
 
-    // Set up signal handlers
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    signal(SIGPIPE, SIG_IGN);
+    client->splice_header_len = ws_build_header(WS_OPCODE_BIN, n, client->splice_header);
+    client->splice_pending = n;
+    client->unacked += n;
+    return client_flush(client) < 0 ? -1 : n;
+}
 
-    // Create socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("socket");
-        return -1;
-    }
+void on_client_pty(watcher_t *watcher, uint32_t events) {
+    client_t *client = (client_t *)((char *)watcher - offsetof(client_t, pty));
+    char *buffer = client->owner->read_buf;
 
-    // Allow address reuse
-    int opt = 1;
-    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // Room for queued input; reading the socket may resume
+    if (events & EPOLLOUT) {
+        if (pty_queue_flush(&client->input, &client->owner->buffers, &client->terminal) < 0) {
+            pty_queue_clear(&client->input, &client->owner->buffers);
+        }
+        if (!client->input.head) client_trace(client, TRACE_PTY_WRITE, client->input_seq);
+        pty_queue_watch(&client->input, &client->pty);
 
-    // Bind - try multiple ports if needed
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            if (client_send_pending(client) < 0) client_close(client);
+            return;
+        }
+    }
 
-    if (config->bind_addr && strlen(config->bind_addr) > 0) {
-        inet_pton(AF_INET, config->bind_addr, &server_addr.sin_addr);
+    // Output after new input is the first to reflect it
+    int echo = client->echo_seq != client->input_seq;
+    ssize_t n;
+    // A hidden page's output is read to be dropped, never spliced to it
+    if (client->splice_pipe[0] >= 0 && client_pending(client) == 0 && !client->resyncing &&
+        !client_hidden(client)) {
+        n = client_splice_output(client);
+        if (n > 0 && echo) client_trace(client, TRACE_PTY_OUTPUT, client->input_seq);
     } else {
-        server_addr.sin_addr.s_addr = INADDR_ANY;
+        n = terminal_read(&client->terminal, buffer, BUFFER_SIZE);
+        if (n > 0 && echo) client_trace(client, TRACE_PTY_OUTPUT, client->input_seq);
+        if (n > 0) client_send_output(client, (uint8_t *)buffer, n);
+        if (n > 0 && client->hub && client->hub->history) {
+            history_record(client->hub->history, client, (uint8_t *)buffer, n);
+        }
+        if (n > 0 && client->hub && client->hub->archive) {
+            archive_record(client->hub->archive, client, (uint8_t *)buffer, n);
+        }
+    }
+    if (n < 0) {
+        client_close(client); // Terminal closed
+        return;
+    }
+    if (n > 0 && client->hub) snapshot_touch(client->hub->snapshot);
+
+    // Tag the output with the latest input it reflects so the browser
+    // can confirm or roll back its predictions
+    if (n > 0 && echo) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "{\"type\":\"echo\",\"seq\":%u}",
+                           client->input_seq);
+        client_send_text(client, msg, len);
+        client->echo_seq = client->input_seq;
+        client_trace_queued(client, client->input_seq);
     }
 
-    int bound = 0;
-    int try_port = config->port;
-    int max_tries = 10;
+    if (client_send_pending(client) < 0) {
+        client_close(client);
+        return;
+    }
+    client_check_resync(client);
+}
 
-    for (int i = 0; i < max_tries; i++) {
-        server_addr.sin_port = htons(try_port);
+// The tmux client exited
+void on_client_child(watcher_t *watcher, uint32_t events) {
+    (void)events;
+    client_t *client = (client_t *)((char *)watcher - offsetof(client_t, child));
+    if (terminal_reap(&client->terminal)) client_close(client);
+}
 
-        if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
-            bound = 1;
-            config->port = try_port;  // Update with actual port
-            break;
+// Start serving a new connection on the worker
+// Returns the client, or NULL on error with the socket closed
+static client_t *client_add(server_worker_t *sw, int client_fd,
+                            const struct sockaddr_storage *client_addr) {
+    client_t *client = slab_alloc(&sw->client_slab);
+    if (!client) {
+        close(client_fd);
+        return NULL;
+    }
+
+    client->owner = sw;
+    client->socket_fd = client_fd;
+    client->state = CLIENT_HTTP;
+    client->terminal.master_fd = -1;
+    client->terminal.pid_fd = -1;
+    client->splice_pipe[0] = client->splice_pipe[1] = -1;
+    client->session_name = server_config->tmux_session;
+    client->websocket_ready = 0;
+    client->predict = -1;
+    client->cols = 80;
+    client->rows = 24;
+    client->local = client_addr->ss_family == AF_UNIX;
+    peer_addr_format(client_addr, client->client_ip, sizeof(client->client_ip));
+
+    if (worker_watch(&sw->worker, &client->sock, client_fd, EPOLLIN, on_client_socket) < 0) {
+        close(client_fd);
+        slab_free(&sw->client_slab, client);
+        return NULL;
+    }
+
+    client->next = sw->clients;
+    if (sw->clients) sw->clients->prev = client;
+    sw->clients = client;
+    client_start_timer(client);
+    return client;
+}
+
+static void on_accept(watcher_t *watcher, uint32_t events) {
+    (void)events;
+    server_worker_t *sw = (server_worker_t *)watcher->worker;
+
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(watcher->fd, (struct sockaddr *)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+            if (errno == ECONNABORTED) continue;
+            perror("accept");
+            return;
+        }
+
+        client_t *client = client_add(sw, client_fd, &client_addr);
+        if (client) client->control = listeners[watcher - sw->accept_watchers].control;
+    }
+}
+
+// A connection relayed by the gateway (--agent), served like one from a
+// local proxy that may also choose the session
+static void accept_routed(worker_t *worker, int fd) {
+    struct sockaddr_storage addr = { .ss_family = AF_UNIX };
+    client_t *client = client_add((server_worker_t *)worker, fd, &addr);
+    if (client) client->routed = 1;
+}
+
+// Periodic housekeeping for the worker's clients
+void worker_tick(worker_t *worker) {
+    server_worker_t *sw = (server_worker_t *)worker;
+
+    for (client_t *client = sw->clients, *next; client; client = next) {
+        next = client->next;
+        if (client->state != CLIENT_WEBSOCKET) continue;
+
+        if (client->resize_pending &&
+            worker_now_ms() - client->resize_seen >= RESIZE_QUIET_MS) {
+            client_apply_size(client);
+        }
+
+        // A shared terminal's input queue drains on another worker
+        if (client->input_paused && client_send_pending(client) < 0) {
+            client_close(client);
+            continue;
+        }
+
+        // The kernel drains a resync backlog without telling us
+        client_check_resync(client);
+        if (client_pending(client) > 0 && client_send_pending(client) < 0) {
+            client_close(client);
+        }
+    }
+
+    if (sw->warm) warm_tick(sw->warm);
+    gateway_tick(worker);
+}
+
+// Close every connection on the worker; runs on the worker before it stops
+static void worker_shutdown(worker_t *worker, void *arg) {
+    (void)arg;
+    server_worker_t *sw = (server_worker_t *)worker;
+
+    while (sw->clients) {
+        client_close(sw->clients);
+    }
+    while (sw->feeds) {
+        feed_close(sw->feeds);
+    }
+    warm_pool_free(sw->warm);
+    sw->warm = NULL;
+
+    // Hung up; whatever has not exited yet is reaped by init
+    while (sw->orphans) {
+        orphan_free(sw, sw->orphans);
+    }
+    for (int i = 0; i < listener_count; i++) {
+        worker_unwatch(&sw->accept_watchers[i]);
+    }
+    gateway_shutdown(worker);
+}
+
+// Some child exited; find out which of the terminals without a pidfd
+// it was
+static void reap_task(worker_t *worker, void *arg) {
+    (void)arg;
+    server_worker_t *sw = (server_worker_t *)worker;
+
+    for (client_t *client = sw->clients, *next; client; client = next) {
+        next = client->next;
+        if (client->terminal.pid > 0 && client->terminal.pid_fd < 0 &&
+            terminal_reap(&client->terminal)) {
+            client_close(client);
+        }
+    }
+    for (feed_t *feed = sw->feeds, *next; feed; feed = next) {
+        next = feed->next;
+        if (feed->terminal.pid > 0 && feed->terminal.pid_fd < 0 &&
+            terminal_reap(&feed->terminal)) {
+            feed_end(feed);
+        }
+    }
+    for (orphan_t *orphan = sw->orphans, *next; orphan; orphan = next) {
+        next = orphan->next;
+        if (orphan->terminal.pid_fd < 0 && terminal_reap(&orphan->terminal)) {
+            orphan_free(sw, orphan);
+        }
+    }
+}
+
+// Steer each new connection to the listener of the worker pinned to the
+// CPU that took its packets, so a connection stays on one core
+static void steer_by_cpu(int listen_fd, int count) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)count },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+    }
+}
+
+// Bind a TCP listener for the first worker, trying successive ports if
+// the listener uses the default port
+static int open_first_listener(server_config_t *config, server_listener_t *l) {
+    int try_port = l->port;
+    int max_tries = l->addr.port ? 1 : 10;
+
+    for (int i = 0; i < max_tries; i++) {
+        int fd = listen_tcp(&l->addr, try_port, LISTEN_BACKLOG);
+        if (fd >= 0) {
+            l->port = try_port;
+            if (!l->addr.port) config->port = try_port;  // Update with actual port
+            return fd;
         }
 
-        if (errno != EADDRINUSE) {
+        if (errno != EADDRINUSE || max_tries == 1) {
             perror("bind");
-            close(server_socket);
             return -1;
         }
 
@@ -412,80 +1416,330 @@ int server_start(server_config_t *config) {
         try_port++;
     }
 
-    if (!bound) {
-        fprintf(stderr, "Could not find available port (tried %d-%d)\n",
-                config->port, try_port - 1);
-        close(server_socket);
+    fprintf(stderr, "Could not find available port (tried %d-%d)\n",
+            l->port, try_port - 1);
+    return -1;
+}
+
+// Parse the listen specs and open the first worker's sockets
+// Returns 0 on success, -1 on error
+static int open_listeners(server_config_t *config, server_worker_t *first) {
+    static char *default_bind = "0.0.0.0";
+    char **specs = config->bind_count > 0 ? config->bind_addrs : &default_bind;
+    int count = config->bind_count > 0 ? config->bind_count : 1;
+
+    for (int i = 0; i < count; i++) {
+        server_listener_t *l = &listeners[i];
+        if (listen_addr_parse(specs[i], &l->addr) < 0) {
+            fprintf(stderr, "Invalid listen address '%s'\n", specs[i]);
+            return -1;
+        }
+        l->shared_fd = -1;
+    }
+
+    // :: takes IPv4 too unless an IPv4 listener wants the same port
+    for (int i = 0; i < count; i++) {
+        listen_addr_t *la = &listeners[i].addr;
+        if (la->family != AF_INET6) continue;
+        la->v6only = !listen_addr_is_any(la);
+        for (int j = 0; j < count; j++) {
+            if (listeners[j].addr.family == AF_INET && listeners[j].addr.port == la->port) {
+                la->v6only = 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        server_listener_t *l = &listeners[i];
+        int fd;
+
+        if (l->addr.family == AF_UNIX) {
+            fd = listen_unix(&l->addr, LISTEN_BACKLOG, config->socket_mode, config->socket_group);
+            l->shared_fd = fd;
+        } else {
+            l->port = l->addr.port ? l->addr.port : config->port;
+            fd = open_first_listener(config, l);
+        }
+        if (fd < 0) return -1;
+
+        first->listen_fds[i] = fd;
+        listener_count = i + 1;
+    }
+
+    // Helpers in sessions offer files on a socket only we can reach
+    if (config->transfer) {
+        server_listener_t *l = &listeners[listener_count];
+        char path[sizeof(l->addr.path) + 5] = "unix:";
+        if (transfer_socket_path(path + 5, sizeof(path) - 5) < 0 ||
+            listen_addr_parse(path, &l->addr) < 0) {
+            fprintf(stderr, "No control socket for --transfer\n");
+            return -1;
+        }
+        l->control = 1;
+        l->shared_fd = listen_unix(&l->addr, LISTEN_BACKLOG, 0600, NULL);
+        if (l->shared_fd < 0) return -1;
+        first->listen_fds[listener_count++] = l->shared_fd;
+    }
+    return 0;
+}
+
+// Open the worker's own TCP sockets where it has none yet, and watch
+// all listeners
+// Returns 0 on success, -1 on error
+int watch_listeners(server_worker_t *sw) {
+    for (int i = 0; i < listener_count; i++) {
+        server_listener_t *l = &listeners[i];
+        uint32_t events = EPOLLIN;
+
+        if (l->shared_fd >= 0) {
+            // Wake one worker per connection rather than all of them
+            sw->listen_fds[i] = l->shared_fd;
+            events |= EPOLLEXCLUSIVE;
+        } else if (sw->listen_fds[i] < 0) {
+            sw->listen_fds[i] = listen_tcp(&l->addr, l->port, LISTEN_BACKLOG);
+            if (sw->listen_fds[i] < 0) {
+                perror("bind");
+                return -1;
+            }
+        }
+
+        if (worker_watch(&sw->worker, &sw->accept_watchers[i], sw->listen_fds[i],
+                         events, on_accept) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Close the listening sockets once the workers are gone
+static void close_listeners(void) {
+    for (int i = 0; i < listener_count; i++) {
+        server_listener_t *l = &listeners[i];
+        for (int w = 0; w < worker_count; w++) {
+            int fd = workers[w].listen_fds[i];
+            if (fd >= 0 && fd != l->shared_fd) close(fd);
+        }
+        if (l->shared_fd >= 0) {
+            close(l->shared_fd);
+            unlink(l->addr.path);
+        }
+    }
+    listener_count = 0;
+}
+
+// Pick the CPU each worker is pinned to, from the CPUs we may run on
+// Returns 1 if worker i got CPU i for every worker
+static int plan_cpus(int *cpus, int count) {
+    cpu_set_t allowed;
+    int identity = 1;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) < count) {
+        for (int i = 0; i < count; i++) cpus[i] = -1;
+        return 0;
+    }
+
+    int cpu = 0;
+    for (int i = 0; i < count; i++) {
+        while (!CPU_ISSET(cpu, &allowed)) cpu++;
+        cpus[i] = cpu;
+        if (cpu != i) identity = 0;
+        cpu++;
+    }
+    return identity;
+}
+
+// Stop the started workers, then release all of them
+static void stop_workers(int count) {
+    for (int i = 0; i < count; i++) {
+        if (!workers[i].worker.started) continue;
+        worker_post(&workers[i].worker, worker_shutdown, NULL);
+        worker_stop(&workers[i].worker);
+    }
+    for (int i = 0; i < count; i++) {
+        worker_destroy(&workers[i].worker);
+        slab_destroy(&workers[i].client_slab);
+        slab_destroy(&workers[i].ref_slab);
+        buf_pool_destroy(&workers[i].buffers);
+    }
+}
+
+int server_start(server_config_t *config) {
+    server_config = config;
+
+    int predecessor = upgrade_setup();
+
+    worker_count = config->threads;
+    if (worker_count <= 0) {
+        cpu_set_t allowed;
+        worker_count = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ?
+                       CPU_COUNT(&allowed) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (worker_count <= 0) worker_count = 1;
+    }
+
+    workers = calloc(worker_count, sizeof(*workers));
+    worker_t **hub_targets = calloc(worker_count, sizeof(*hub_targets));
+    int *cpus = calloc(worker_count, sizeof(*cpus));
+    if (!workers || !hub_targets || !cpus) {
+        perror("calloc");
+        free(workers);
+        free(hub_targets);
+        free(cpus);
         return -1;
     }
 
-    // Listen
-    if (listen(server_socket, MAX_CLIENTS) < 0) {
-        perror("listen");
-        close(server_socket);
+    // Stop, upgrade and child signals are only taken by this thread;
+    // workers inherit the mask
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGUSR2);
+    sigaddset(&stop_signals, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < worker_count; i++) {
+        for (int j = 0; j < LISTENER_SLOTS; j++) {
+            workers[i].listen_fds[j] = -1;
+        }
+        hub_targets[i] = &workers[i].worker;
+    }
+    hub_setup(hub_targets, worker_count, on_hub_change, config->history_dir,
+              config->archive_limit, config->archive_dir);
+    if (config->trace) trace_start();
+    gateway_setup(hub_targets, worker_count, accept_routed);
+
+    // Index the session's history now rather than while its first
+    // viewer (or a predecessor handing over) waits, and keep it indexed
+    if (config->history_dir && config->tmux_session) hub_get(config->tmux_session);
+
+    // TCP listeners are bound in worker order so the CPU steering program
+    // can index them
+    int created = 0;
+    int ok = predecessor >= 0 ? adopt_listeners(config, predecessor) == 0 :
+                                open_listeners(config, &workers[0]) == 0;
+    for (int i = 0; i < worker_count && ok; i++) {
+        server_worker_t *sw = &workers[i];
+
+        if (worker_init(&sw->worker, i) < 0) {
+            ok = 0;
+            break;
+        }
+        created = i + 1;
+        slab_init(&sw->client_slab, sizeof(client_t));
+        slab_init(&sw->ref_slab, sizeof(pool_buf_t));
+        sw->worker.tick = worker_tick;
+        warm_start(sw);
+
+        if (watch_listeners(sw) < 0) ok = 0;
+    }
+    if (ok && config->gateway && gateway_listen(&workers[0].worker, config->gateway) < 0) ok = 0;
+    if (ok && config->agent &&
+        gateway_agent_start(&workers[0].worker, config->agent, config->agent_name) < 0) {
+        ok = 0;
+    }
+
+    if (ok) {
+        if (predecessor >= 0) {
+            if (adopt_connections(predecessor) < 0) {
+                fprintf(stderr, "Some connections were lost in the handover\n");
+            }
+            for (int i = 0; i < worker_count && ok; i++) {
+                if (watch_connections(&workers[i]) < 0) ok = 0;
+            }
+        }
+
+        int identity = plan_cpus(cpus, worker_count);
+        if (identity && worker_count > 1) {
+            for (int i = 0; i < listener_count; i++) {
+                if (listeners[i].shared_fd < 0) steer_by_cpu(workers[0].listen_fds[i], worker_count);
+            }
+        }
+
+        for (int i = 0; i < worker_count && ok; i++) {
+            if (worker_start(&workers[i].worker, cpus[i]) < 0) ok = 0;
+        }
+    }
+
+    if (predecessor >= 0) adopt_done(predecessor, ok);
+
+    if (!ok) {
+        stop_workers(created);
+        close_listeners();
+        gateway_cleanup();
+        free(workers);
+        free(hub_targets);
+        free(cpus);
+        workers = NULL;
+        pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
         return -1;
     }
 
     printf("\n");
     printf("  \033[1m🌾 oatmux\033[0m\n");
     printf("  ─────────────────────────────────\n");
-    printf("  Session:  \033[32m%s\033[0m\n", config->tmux_session);
-    printf("  URL:      \033[36mhttp://%s:%d\033[0m\n",
-           config->bind_addr ? config->bind_addr : "0.0.0.0",
-           config->port);
+    printf("  Session:  \033[32m%s\033[0m\n",
+           config->tmux_session ? config->tmux_session : "by path");
+    for (int i = 0; i < listener_count; i++) {
+        if (listeners[i].control) {
+            printf("  Files:    offered on %s\n", listeners[i].addr.path);
+            continue;
+        }
+        char url[160];
+        listen_addr_format(&listeners[i].addr, listeners[i].port, url, sizeof(url));
+        printf("  %-10s\033[36m%s\033[0m\n", i == 0 ? "URL:" : "", url);
+    }
+    if (config->gateway) printf("  Agents:   %s\n", config->gateway);
+    if (config->agent) printf("  Gateway:  %s as %s\n", config->agent, config->agent_name);
+    if (config->warm > 0 && !config->shared) {
+        printf("  Warm:     %d per session and worker\n", config->warm);
+    }
+    if (config->compact) printf("  Output:   compacted\n");
+    printf("  Workers:  %d\n", worker_count);
     printf("  ─────────────────────────────────\n");
     printf("  Press \033[1mCtrl+C\033[0m to stop\n");
     printf("\n");
+    fflush(stdout);
 
-    // Accept loop
-    while (server_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+    int sig;
+    while (1) {
+        if (sigwait(&stop_signals, &sig) != 0) continue;  // Retry on spurious failure
 
-        int client_fd = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            if (errno == EINTR || !server_running) break;
-            perror("accept");
+        // Only terminals without a pidfd need telling
+        if (sig == SIGCHLD) {
+            if (!atomic_load(&reap_on_sigchld)) continue;
+            for (int i = 0; i < worker_count; i++) {
+                worker_post(&workers[i].worker, reap_task, NULL);
+            }
             continue;
         }
+        if (sig != SIGUSR2) break;
 
-        // Create client structure
-        client_t *client = calloc(1, sizeof(client_t));
-        if (!client) {
-            close(client_fd);
-            continue;
+        // The successor owns everything now; leave it all open
+        if (server_upgrade(cpus) == 0) {
+            printf("Upgrade: done\n");
+            return 0;
         }
-
-        client->socket_fd = client_fd;
-        client->session_name = strdup(config->tmux_session);
-        client->websocket_ready = 0;
-        inet_ntop(AF_INET, &client_addr.sin_addr, client->client_ip, sizeof(client->client_ip));
-
-        // Spawn handler thread
-        if (pthread_create(&client->thread, NULL, client_handler, client) != 0) {
-            perror("pthread_create");
-            close(client_fd);
-            free(client->session_name);
-            free(client);
-            continue;
-        }
-
-        pthread_detach(client->thread);
     }
 
-    if (server_socket >= 0) {
-        close(server_socket);
-        server_socket = -1;
-    }
+    snapshot_stop();
+    history_search_stop();
+    archive_read_stop();
+    stop_workers(worker_count);
+    close_listeners();
+    gateway_cleanup();
+    hub_cleanup();
+    transfer_cleanup();
+    free(workers);
+    free(hub_targets);
+    free(cpus);
+    workers = NULL;
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
 
     printf("\nServer stopped\n");
     return 0;
 }
 
 void server_stop(void) {
-    server_running = 0;
-    if (server_socket >= 0) {
-        close(server_socket);
-        server_socket = -1;
-    }
+    kill(getpid(), SIGTERM);
 }
@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
+
 #include "session.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
 #include <termios.h>
 #include <sys/ioctl.h>
@@ -11,6 +17,8 @@
 #define CURSOR_HOME     "\033[H"
 #define CURSOR_HIDE     "\033[?25l"
 #define CURSOR_SHOW     "\033[?25h"
+#define ALT_SCREEN_ON   "\033[?1049h"
+#define ALT_SCREEN_OFF  "\033[?1049l"
 #define BOLD            "\033[1m"
 #define DIM             "\033[2m"
 #define RESET           "\033[0m"
@@ -18,50 +26,84 @@
 #define FG_GREEN        "\033[32m"
 #define FG_YELLOW       "\033[33m"
 #define FG_WHITE        "\033[37m"
+#define FG_DEFAULT      "\033[39m"
 #define BG_BLUE         "\033[44m"
 #define CLEAR_LINE      "\033[2K"
 
+int session_current(char *name, size_t size) {
+    if (!getenv("TMUX")) return -1;
+
+    FILE *fp = popen("tmux display-message -p '#{session_name}' 2>/dev/null", "r");
+    if (!fp) return -1;
+    int ok = fgets(name, size, fp) != NULL;
+    pclose(fp);
+    if (!ok) return -1;
+
+    name[strcspn(name, "\n")] = '\0';
+    return name[0] ? 0 : -1;
+}
+
 int session_list_get(session_list_t *list) {
+    list->sessions = NULL;
     list->count = 0;
+    list->capacity = 0;
 
     FILE *fp = popen("tmux list-sessions -F '#{session_name}|#{session_windows}|#{session_attached}|#{session_created}' 2>/dev/null", "r");
     if (!fp) {
         return -1;
     }
 
-    char line[512];
-    while (fgets(line, sizeof(line), fp) && list->count < MAX_SESSIONS) {
-        // Remove newline
-        line[strcspn(line, "\n")] = 0;
-
-        tmux_session_t *s = &list->sessions[list->count];
-
-        // Parse: name|windows|attached|created
-        char *token = strtok(line, "|");
-        if (token) {
-            strncpy(s->name, token, MAX_SESSION_NAME - 1);
-            s->name[MAX_SESSION_NAME - 1] = '\0';
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, fp)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+
+        // Parse: name|windows|attached|created, from the right since the
+        // name may hold a '|' itself
+        char *fields[3];
+        int found = 0;
+        for (int i = 2; i >= 0; i--) {
+            char *bar = strrchr(line, '|');
+            if (!bar) break;
+            *bar = '\0';
+            fields[i] = bar + 1;
+            found++;
         }
-
-        token = strtok(NULL, "|");
-        if (token) s->windows = atoi(token);
-
-        token = strtok(NULL, "|");
-        if (token) s->attached = atoi(token);
-
-        token = strtok(NULL, "|");
-        if (token) {
-            strncpy(s->created, token, sizeof(s->created) - 1);
-            s->created[sizeof(s->created) - 1] = '\0';
+        if (found < 3) continue;
+
+        if (list->count == list->capacity) {
+            int capacity = list->capacity ? list->capacity * 2 : 64;
+            tmux_session_t *grown = realloc(list->sessions, capacity * sizeof(*grown));
+            if (!grown) break;
+            list->sessions = grown;
+            list->capacity = capacity;
         }
 
+        tmux_session_t *s = &list->sessions[list->count];
+        s->name = strdup(line);
+        if (!s->name) break;
+        s->windows = atoi(fields[0]);
+        s->attached = atoi(fields[1]);
+        snprintf(s->created, sizeof(s->created), "%s", fields[2]);
         list->count++;
     }
 
+    free(line);
     pclose(fp);
     return list->count > 0 ? 0 : -1;
 }
 
+void session_list_free(session_list_t *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->sessions[i].name);
+    }
+    free(list->sessions);
+    list->sessions = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
 static struct termios orig_termios;
 static int raw_mode_enabled = 0;
 
@@ -79,125 +121,410 @@ static void enable_raw_mode(void) {
     atexit(disable_raw_mode);
 
     struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ECHO | ICANON);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG);
     raw.c_cc[VMIN] = 1;
     raw.c_cc[VTIME] = 0;
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
     printf(CURSOR_HIDE);
 }
 
-static int get_terminal_width(void) {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
-        return 80;
+// Frames are built in memory and written at once, rewriting only the
+// screen rows that differ from the last frame
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} frame_buf_t;
+
+static void buf_append(frame_buf_t *b, const char *s, size_t len) {
+    if (len == 0) return;
+    if (b->len + len > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->len + len) capacity *= 2;
+        char *grown = realloc(b->data, capacity);
+        if (!grown) return;
+        b->data = grown;
+        b->capacity = capacity;
     }
-    return ws.ws_col;
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
 }
 
-static void draw_box_top(int width) {
-    printf(FG_CYAN "╭");
-    for (int i = 0; i < width - 2; i++) printf("─");
-    printf("╮" RESET "\n");
+static void buf_puts(frame_buf_t *b, const char *s) {
+    buf_append(b, s, strlen(s));
 }
 
-static void draw_box_bottom(int width) {
-    printf(FG_CYAN "╰");
-    for (int i = 0; i < width - 2; i++) printf("─");
-    printf("╯" RESET "\n");
+static void buf_repeat(frame_buf_t *b, const char *s, int n) {
+    for (int i = 0; i < n; i++) buf_puts(b, s);
 }
 
-static void draw_separator(int width) {
-    printf(FG_CYAN "├");
-    for (int i = 0; i < width - 2; i++) printf("─");
-    printf("┤" RESET "\n");
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        data += n;
+        len -= n;
+    }
 }
 
-static void render_ui(session_list_t *list, int selected) {
-    int term_width = get_terminal_width();
-    int box_width = term_width > 60 ? 56 : term_width - 4;
-
-    printf(CLEAR_SCREEN CURSOR_HOME);
-    printf("\n");
-
-    // Header
-    draw_box_top(box_width);
-    printf(FG_CYAN "│" RESET BOLD "   🌾 oatmux - tmux session selector" RESET);
-    int padding = box_width - 39;
-    for (int i = 0; i < padding; i++) printf(" ");
-    printf(FG_CYAN "│" RESET "\n");
-    draw_separator(box_width);
-
-    if (list->count == 0) {
-        printf(FG_CYAN "│" RESET "  No tmux sessions found.                    ");
-        padding = box_width - 46;
-        for (int i = 0; i < padding; i++) printf(" ");
-        printf(FG_CYAN "│" RESET "\n");
-        printf(FG_CYAN "│" RESET "  Run: " FG_GREEN "tmux new -s <name>" RESET " to create one.  ");
-        padding = box_width - 46;
-        for (int i = 0; i < padding; i++) printf(" ");
-        printf(FG_CYAN "│" RESET "\n");
-    } else {
-        for (int i = 0; i < list->count && i < 15; i++) {
-            tmux_session_t *s = &list->sessions[i];
+// Bytes in the UTF-8 character at s
+static int char_len(const char *s) {
+    unsigned char c = (unsigned char)*s;
+    int len = c < 0x80 ? 1 : (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 :
+              (c & 0xf8) == 0xf0 ? 4 : 1;
+    for (int i = 1; i < len; i++) {
+        if (!s[i]) return i;
+    }
+    return len;
+}
+
+// Whether query's next character is the one at s, ASCII case ignored
+static int char_equal(const char *query, const char *s) {
+    int len = char_len(query);
+    if (len == 1) return tolower((unsigned char)*query) == tolower((unsigned char)*s);
+    return char_len(s) == len && memcmp(query, s, len) == 0;
+}
 
-            printf(FG_CYAN "│" RESET);
+// Columns s takes, one per character
+static int text_width(const char *s) {
+    int width = 0;
+    for (; *s; s++) {
+        if (((unsigned char)*s & 0xc0) != 0x80) width++;
+    }
+    return width;
+}
 
-            if (i == selected) {
-                printf(BG_BLUE BOLD FG_WHITE " ▶ ");
-            } else {
-                printf("   ");
-            }
+// Score name against query: its characters in order, not necessarily
+// adjacent. Characters that follow the previous match or start a word
+// count extra
+// Returns the score, or -1 if name does not match
+static int fuzzy_score(const char *name, const char *query) {
+    int score = 0;
+    const char *p = name;
+    const char *last = NULL;        // Just past the previous match
+    while (*query) {
+        while (*p && !char_equal(query, p)) p += char_len(p);
+        if (!*p) return -1;
+
+        score++;
+        if (p == last) score += 4;
+        if (p == name || strchr(" -_./:", p[-1])) score += 3;
+        p += char_len(p);
+        last = p;
+        query += char_len(query);
+    }
+    return score;
+}
 
-            // Session name
-            printf("%-20.20s", s->name);
+typedef struct {
+    int index;                      // Into the session list
+    int score;
+} picker_match_t;
+
+typedef struct {
+    session_list_t *list;
+    char query[MAX_SESSION_NAME];
+    size_t query_len;
+    picker_match_t *matches;        // Best first
+    int match_count;
+    int selected;                   // Index into matches
+    int top;                        // First match shown
+    int visible;                    // Matches the list has room for
+    char **shown;                   // Each screen row as last drawn, NULL if unknown
+    int rows, cols;                 // Screen size shown was drawn for
+} picker_t;
+
+#define PICKER_CHROME 8             // Rows around the list: margin, rules, header, filter, footer
+#define PICKER_ESC_WAIT_MS 30       // How long after Esc the rest of a key's sequence may take
+
+static int match_compare(const void *a, const void *b) {
+    const picker_match_t *x = a, *y = b;
+    if (x->score != y->score) return y->score - x->score;
+    return x->index - y->index;
+}
 
-            // Windows count
-            printf(DIM " %2d win" RESET, s->windows);
+// Filter the sessions by the query. When it only grew, nothing outside
+// the current matches can match, so only those are looked at again
+static void picker_filter(picker_t *p, int grew) {
+    int count = 0;
+    if (grew) {
+        for (int i = 0; i < p->match_count; i++) {
+            int index = p->matches[i].index;
+            int score = fuzzy_score(p->list->sessions[index].name, p->query);
+            if (score >= 0) p->matches[count++] = (picker_match_t){ index, score };
+        }
+    } else {
+        for (int i = 0; i < p->list->count; i++) {
+            int score = fuzzy_score(p->list->sessions[i].name, p->query);
+            if (score >= 0) p->matches[count++] = (picker_match_t){ i, score };
+        }
+    }
+    p->match_count = count;
+    if (p->query_len) qsort(p->matches, count, sizeof(*p->matches), match_compare);
+    p->selected = 0;
+    p->top = 0;
+}
 
-            // Attached indicator
-            if (s->attached) {
-                printf(FG_GREEN " ●" RESET);
-            } else {
-                printf(DIM " ○" RESET);
-            }
+static void picker_move(picker_t *p, int delta, int wrap) {
+    int count = p->match_count;
+    if (count == 0) return;
+
+    int selected = p->selected + delta;
+    if (wrap) {
+        selected = (selected % count + count) % count;
+    } else if (selected < 0) {
+        selected = 0;
+    } else if (selected >= count) {
+        selected = count - 1;
+    }
+    p->selected = selected;
+}
 
-            if (i == selected) {
-                printf(RESET);
-            }
+static void picker_forget(picker_t *p) {
+    for (int i = 0; p->shown && i < p->rows; i++) {
+        free(p->shown[i]);
+    }
+    free(p->shown);
+    p->shown = NULL;
+}
 
-            // Padding
-            int content_len = 3 + 20 + 7 + 2;
-            padding = box_width - content_len - 2;
-            for (int j = 0; j < padding; j++) printf(" ");
+static void box_rule(frame_buf_t *line, const char *left, const char *right, int inner) {
+    buf_puts(line, FG_CYAN);
+    buf_puts(line, left);
+    buf_repeat(line, "─", inner);
+    buf_puts(line, right);
+    buf_puts(line, RESET);
+}
+
+// Close a box row whose content took width columns
+static void box_close(frame_buf_t *line, int width, int inner) {
+    buf_repeat(line, " ", inner - width);
+    buf_puts(line, FG_CYAN "│" RESET);
+}
 
-            printf(FG_CYAN "│" RESET "\n");
+// Append name in width columns, cut short with '…', with the characters
+// the query matched highlighted
+static void put_name(frame_buf_t *line, const char *name, const char *query,
+                     int width, const char *fg) {
+    int room = text_width(name) > width ? width - 1 : width;
+    int used = 0;
+    const char *s = name;
+    for (; *s && used < room; used++) {
+        int len = char_len(s);
+        int hit = *query && char_equal(query, s);
+        if (hit) {
+            buf_puts(line, FG_YELLOW);
+            query += char_len(query);
         }
+        buf_append(line, s, len);
+        if (hit) buf_puts(line, fg);
+        s += len;
+    }
+    if (*s) {
+        buf_puts(line, "…");
+        used++;
+    }
+    buf_repeat(line, " ", width - used);
+}
+
+static void picker_entry(picker_t *p, frame_buf_t *line, int i, int inner) {
+    tmux_session_t *s = &p->list->sessions[p->matches[i].index];
+    int selected = i == p->selected;
+
+    char windows[24];
+    int windows_width = snprintf(windows, sizeof(windows), " %2d win", s->windows);
+    int name_width = inner - 3 - windows_width - 3;
+    if (name_width < 8) name_width = 8;
+
+    if (selected) {
+        buf_puts(line, BG_BLUE BOLD FG_WHITE " ▶ ");
+        put_name(line, s->name, p->query, name_width, FG_WHITE);
+        buf_puts(line, windows);
+        buf_puts(line, s->attached ? FG_GREEN " ●" FG_WHITE " " : " ○ ");
+        buf_puts(line, RESET);
+    } else {
+        buf_puts(line, "   ");
+        put_name(line, s->name, p->query, name_width, FG_DEFAULT);
+        buf_puts(line, DIM);
+        buf_puts(line, windows);
+        buf_puts(line, RESET);
+        buf_puts(line, s->attached ? FG_GREEN " ● " RESET : DIM " ○ " RESET);
+    }
+    buf_puts(line, FG_CYAN "│" RESET);
+}
+
+// The filter as typed, its tail if too long, and how many sessions match
+static void picker_query_line(picker_t *p, frame_buf_t *line, int inner) {
+    char count[32];
+    int count_width = snprintf(count, sizeof(count), "%d/%d", p->match_count, p->list->count);
+
+    buf_puts(line, FG_CYAN "│" RESET "  > ");
+    int used = 4;
+    const char *query = p->query;
+    int room = inner - used - count_width - 3;
+    while (text_width(query) > room) query += char_len(query);
+    buf_puts(line, query);
+    used += text_width(query);
+
+    // The terminal's cursor stays hidden, so draw one
+    buf_puts(line, "\033[7m \033[27m");
+    used++;
+    if (!p->query_len && room > 16) {
+        buf_puts(line, DIM " type to filter" RESET);
+        used += 15;
+    }
+
+    buf_repeat(line, " ", inner - used - count_width - 1);
+    buf_puts(line, DIM);
+    buf_puts(line, count);
+    buf_puts(line, RESET " " FG_CYAN "│" RESET);
+}
 
-        if (list->count > 15) {
-            printf(FG_CYAN "│" RESET DIM "   ... and %d more" RESET, list->count - 15);
-            padding = box_width - 22;
-            for (int i = 0; i < padding; i++) printf(" ");
-            printf(FG_CYAN "│" RESET "\n");
+static void picker_line(picker_t *p, frame_buf_t *line, int row, int inner) {
+    int entry = row - 5;
+
+    if (row == 0 || row >= PICKER_CHROME + p->visible) return;
+
+    if (row == 1) {
+        box_rule(line, "╭", "╮", inner);
+    } else if (row == 2) {
+        buf_puts(line, FG_CYAN "│" RESET BOLD "   🌾 oatmux - tmux session selector" RESET);
+        box_close(line, 37, inner);
+    } else if (row == 3) {
+        picker_query_line(p, line, inner);
+    } else if (row == 4 || entry == p->visible) {
+        box_rule(line, "├", "┤", inner);
+    } else if (entry < p->visible) {
+        if (p->top + entry < p->match_count) {
+            buf_puts(line, FG_CYAN "│" RESET);
+            picker_entry(p, line, p->top + entry, inner);
+        } else if (p->match_count == 0 && entry == 0) {
+            buf_puts(line, FG_CYAN "│" RESET DIM "   No sessions match" RESET);
+            box_close(line, 20, inner);
+        } else {
+            buf_puts(line, FG_CYAN "│" RESET);
+            box_close(line, 0, inner);
         }
+    } else if (entry == p->visible + 1) {
+        buf_puts(line, FG_CYAN "│" RESET DIM "  ↑↓ navigate  Enter select  Esc quit" RESET);
+        box_close(line, 37, inner);
+    } else {
+        box_rule(line, "╰", "╯", inner);
     }
+}
 
-    draw_separator(box_width);
+static void picker_render(picker_t *p) {
+    int rows = 24, cols = 80;
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+        rows = ws.ws_row;
+        cols = ws.ws_col;
+    }
 
-    // Footer
-    printf(FG_CYAN "│" RESET DIM "  ↑↓ navigate  " RESET DIM "Enter select  " RESET DIM "q quit" RESET);
-    padding = box_width - 42;
-    for (int i = 0; i < padding; i++) printf(" ");
-    printf(FG_CYAN "│" RESET "\n");
+    frame_buf_t out = {0}, line = {0};
 
-    draw_box_bottom(box_width);
+    // After a resize nothing on screen can be trusted
+    if (!p->shown || rows != p->rows || cols != p->cols) {
+        picker_forget(p);
+        p->shown = calloc(rows, sizeof(char *));
+        if (!p->shown) return;
+        p->rows = rows;
+        p->cols = cols;
+        buf_puts(&out, CLEAR_SCREEN);
+    }
 
-    fflush(stdout);
+    int box_width = cols > 60 ? 56 : cols - 4;
+    if (box_width < 30) box_width = 30;
+    int inner = box_width - 2;
+
+    p->visible = rows - PICKER_CHROME;
+    if (p->visible > p->list->count) p->visible = p->list->count;
+    if (p->visible < 1) p->visible = 1;
+
+    // Keep the selection in view
+    if (p->selected < p->top) p->top = p->selected;
+    if (p->selected >= p->top + p->visible) p->top = p->selected - p->visible + 1;
+
+    for (int row = 0; row < rows; row++) {
+        line.len = 0;
+        picker_line(p, &line, row, inner);
+
+        const char *text = line.len ? line.data : "";
+        char *shown = p->shown[row];
+        if (shown && strlen(shown) == line.len && memcmp(shown, text, line.len) == 0) continue;
+
+        free(shown);
+        p->shown[row] = strndup(text, line.len);
+
+        char move[24];
+        snprintf(move, sizeof(move), "\033[%d;1H", row + 1);
+        buf_puts(&out, move);
+        buf_append(&out, text, line.len);
+        buf_puts(&out, "\033[K");
+    }
+
+    write_all(STDOUT_FILENO, out.data, out.len);
+    free(out.data);
+    free(line.data);
+}
+
+enum {
+    KEY_UP = 0x100,
+    KEY_DOWN,
+    KEY_PAGE_UP,
+    KEY_PAGE_DOWN,
+    KEY_HOME,
+    KEY_END,
+    KEY_RESIZE,
+    KEY_EOF
+};
+
+// Next key, with the escape sequences of the keys we use decoded. Esc
+// on its own is told apart by nothing following it
+// Returns a byte, a KEY_* code, or 0 for a key we don't use
+static int read_key(void) {
+    unsigned char c;
+    ssize_t n = read(STDIN_FILENO, &c, 1);
+    if (n < 0 && errno == EINTR) return KEY_RESIZE;
+    if (n <= 0) return KEY_EOF;
+    if (c != 27) return c;
+
+    char seq[8];
+    size_t len = 0;
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    while (len < sizeof(seq) - 1 && poll(&pfd, 1, PICKER_ESC_WAIT_MS) > 0) {
+        if (read(STDIN_FILENO, &seq[len], 1) != 1) break;
+        len++;
+        if (len == 1 && seq[0] != '[' && seq[0] != 'O') break;
+        if (len > 1 && seq[len - 1] >= 0x40 && seq[len - 1] <= 0x7e) break;
+    }
+    seq[len] = '\0';
+
+    if (len == 0) return 27;
+    if (!strcmp(seq, "[A") || !strcmp(seq, "OA")) return KEY_UP;
+    if (!strcmp(seq, "[B") || !strcmp(seq, "OB")) return KEY_DOWN;
+    if (!strcmp(seq, "[5~")) return KEY_PAGE_UP;
+    if (!strcmp(seq, "[6~")) return KEY_PAGE_DOWN;
+    if (!strcmp(seq, "[H") || !strcmp(seq, "OH") || !strcmp(seq, "[1~") || !strcmp(seq, "[7~")) {
+        return KEY_HOME;
+    }
+    if (!strcmp(seq, "[F") || !strcmp(seq, "OF") || !strcmp(seq, "[4~") || !strcmp(seq, "[8~")) {
+        return KEY_END;
+    }
+    return 0;
+}
+
+// Only there to interrupt read_key(), so a resize is redrawn at once
+static void on_resize(int sig) {
+    (void)sig;
 }
 
 char *session_select_interactive(void) {
     session_list_t list;
 
-    if (session_list_get(&list) < 0 || list.count == 0) {
+    if (session_list_get(&list) < 0) {
+        session_list_free(&list);
         printf("\n" FG_YELLOW "  No tmux sessions found." RESET "\n");
         printf("  Create one with: " FG_GREEN "tmux new -s <name>" RESET "\n\n");
         return NULL;
@@ -206,72 +533,106 @@ char *session_select_interactive(void) {
     // If only one session, auto-select it
     if (list.count == 1) {
         printf("\n" FG_GREEN "  Auto-selecting session: %s" RESET "\n\n", list.sessions[0].name);
-        return strdup(list.sessions[0].name);
+        char *name = strdup(list.sessions[0].name);
+        session_list_free(&list);
+        return name;
     }
 
-    enable_raw_mode();
-
-    int selected = 0;
-    int max_visible = list.count < 15 ? list.count : 15;
-
-    render_ui(&list, selected);
-
-    while (1) {
-        int c = getchar();
-
-        if (c == 'q' || c == 'Q' || c == 27) {
-            // Check for escape sequence (arrow keys)
-            if (c == 27) {
-                int next = getchar();
-                if (next == '[') {
-                    int arrow = getchar();
-                    if (arrow == 'A') { // Up
-                        selected = (selected - 1 + max_visible) % max_visible;
-                        render_ui(&list, selected);
-                        continue;
-                    } else if (arrow == 'B') { // Down
-                        selected = (selected + 1) % max_visible;
-                        render_ui(&list, selected);
-                        continue;
-                    }
-                }
-                // Plain escape - quit
-                disable_raw_mode();
-                printf(CLEAR_SCREEN CURSOR_HOME);
-                printf("Cancelled.\n");
-                return NULL;
-            }
-            // q pressed
-            disable_raw_mode();
-            printf(CLEAR_SCREEN CURSOR_HOME);
-            printf("Cancelled.\n");
-            return NULL;
-        }
-
-        if (c == '\n' || c == '\r') {
-            disable_raw_mode();
-            printf(CLEAR_SCREEN CURSOR_HOME);
-            return strdup(list.sessions[selected].name);
-        }
+    picker_t p = { .list = &list };
+    p.matches = malloc(list.count * sizeof(*p.matches));
+    if (!p.matches) {
+        session_list_free(&list);
+        return NULL;
+    }
+    picker_filter(&p, 0);
 
-        if (c == 'k' || c == 'K') { // vim up
-            selected = (selected - 1 + max_visible) % max_visible;
-            render_ui(&list, selected);
-        }
+    struct sigaction sa = { .sa_handler = on_resize }, old_sa;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, &old_sa);
 
-        if (c == 'j' || c == 'J') { // vim down
-            selected = (selected + 1) % max_visible;
-            render_ui(&list, selected);
-        }
+    enable_raw_mode();
+    printf(ALT_SCREEN_ON);
+    fflush(stdout);
 
-        // Number selection (1-9)
-        if (c >= '1' && c <= '9') {
-            int idx = c - '1';
-            if (idx < list.count) {
-                disable_raw_mode();
-                printf(CLEAR_SCREEN CURSOR_HOME);
-                return strdup(list.sessions[idx].name);
+    char *chosen = NULL;
+    int done = 0;
+    while (!done) {
+        picker_render(&p);
+
+        int key = read_key();
+        switch (key) {
+        case KEY_UP:
+        case 16:                    // Ctrl-P
+            picker_move(&p, -1, 1);
+            break;
+        case KEY_DOWN:
+        case 14:                    // Ctrl-N
+            picker_move(&p, 1, 1);
+            break;
+        case KEY_PAGE_UP:
+            picker_move(&p, -p.visible, 0);
+            break;
+        case KEY_PAGE_DOWN:
+            picker_move(&p, p.visible, 0);
+            break;
+        case KEY_HOME:
+            picker_move(&p, -p.match_count, 0);
+            break;
+        case KEY_END:
+            picker_move(&p, p.match_count, 0);
+            break;
+        case KEY_RESIZE:
+        case 0:
+            break;
+        case '\r':
+        case '\n':
+            if (p.match_count) {
+                chosen = strdup(list.sessions[p.matches[p.selected].index].name);
+                done = 1;
+            }
+            break;
+        case 27:                    // Esc clears the filter first
+            if (!p.query_len) {
+                done = 1;
+                break;
+            }
+            /* fall through */
+        case 21:                    // Ctrl-U
+            p.query_len = 0;
+            p.query[0] = '\0';
+            picker_filter(&p, 0);
+            break;
+        case 127:
+        case 8:                     // Backspace, a whole character
+            if (!p.query_len) break;
+            do {
+                p.query_len--;
+            } while (p.query_len && ((unsigned char)p.query[p.query_len] & 0xc0) == 0x80);
+            p.query[p.query_len] = '\0';
+            picker_filter(&p, 0);
+            break;
+        case 3:                     // Ctrl-C
+        case 4:                     // Ctrl-D
+        case KEY_EOF:
+            done = 1;
+            break;
+        default:
+            if (key >= ' ' && key < 0x100 && p.query_len + 1 < sizeof(p.query)) {
+                p.query[p.query_len++] = (char)key;
+                p.query[p.query_len] = '\0';
+                picker_filter(&p, 1);
             }
+            break;
         }
     }
+
+    printf(ALT_SCREEN_OFF);
+    disable_raw_mode();
+    sigaction(SIGWINCH, &old_sa, NULL);
+    if (!chosen) printf("Cancelled.\n");
+
+    picker_forget(&p);
+    free(p.matches);
+    session_list_free(&list);
+    return chosen;
 }
@@ -0,0 +1,706 @@
+#define _GNU_SOURCE
+
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define STATE_MAX 64               // Current window and pane ids, e.g. "@3%7"
+
+struct snapshot {
+    char *session;
+    pthread_mutex_t lock;
+    atomic_uint_fast64_t gen;      // Output seen
+    uint64_t captured_gen;         // gen when last captured
+    uint64_t version;              // gen when the screen last changed
+    uint64_t checked_ms;           // When tmux's activity was last compared
+    uint64_t captured_ms;
+    time_t captured_sec;           // Wall clock just before the capture
+    char state[STATE_MAX];         // Window and pane captured
+    char seen_state[STATE_MAX];    // Window and pane tmux last reported
+    char *data[SNAPSHOT_FORMATS];  // The screen in each format, NULL until asked for
+    size_t len[SNAPSHOT_FORMATS];
+    int wanted;                    // For the helper to bring up to date
+    int failed;                    // Nothing captured, and the last try failed
+    int listed;                    // On the helper's list
+    struct snapshot *next;         // Helper's list, newest first
+    struct snapshot *retired_next; // Freed, waiting for the helper's pass to end
+};
+
+// Every session's "<activity> <window><pane> <name>" line, as tmux last
+// listed them
+static pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *listing;
+static uint64_t listing_ms;
+
+// Someone to tell when the helper has done what was asked of it so far
+typedef struct waiter {
+    worker_t *worker;
+    void (*fn)(worker_t *worker, void *arg);
+    void *arg;
+    struct waiter *next;
+} waiter_t;
+
+// The helper thread, which does all the asking of tmux
+static pthread_mutex_t helper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t helper_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t helper_thread;
+static int helper_started;
+static int helper_stopping;
+static int helper_work;            // Woken since the last pass began
+static waiter_t *waiters;
+static snapshot_t *snapshots;      // Those asked for at least once
+static snapshot_t *retired;        // Freed while the helper may be looking
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+    int failed;
+} out_t;
+
+static void out_append(out_t *out, const char *data, size_t len) {
+    if (out->failed) return;
+    if (out->len + len + 1 > out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 4096;
+        while (cap < out->len + len + 1) cap *= 2;
+        char *grown = realloc(out->data, cap);
+        if (!grown) {
+            out->failed = 1;
+            return;
+        }
+        out->data = grown;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    out->data[out->len] = '\0';
+}
+
+static void out_printf(out_t *out, const char *fmt, ...) {
+    char text[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (n > 0) out_append(out, text, (size_t)n < sizeof(text) ? (size_t)n : sizeof(text) - 1);
+}
+
+// Everything fd gives until EOF
+// Returns 0 on success, -1 on error
+static int out_read(out_t *out, int fd) {
+    char buf[8192];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        out_append(out, buf, n);
+    }
+    return out->failed ? -1 : 0;
+}
+
+// Ask tmux about every session, at most every SNAPSHOT_CHECK_MS (helper
+// thread)
+static void listing_refresh(void) {
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&listing_lock);
+    int fresh = listing && now - listing_ms < SNAPSHOT_CHECK_MS;
+    pthread_mutex_unlock(&listing_lock);
+    if (fresh) return;
+
+    FILE *fp = popen("tmux list-sessions -F '#{window_activity} #{window_id}#{pane_id} #{session_name}' 2>/dev/null", "r");
+    if (!fp) return;
+
+    out_t out = {0};
+    out_read(&out, fileno(fp));
+    pclose(fp);
+    if (out.failed) {
+        free(out.data);
+        return;
+    }
+
+    char *fresh_listing = out.data ? out.data : strdup("");
+    if (!fresh_listing) return;
+    pthread_mutex_lock(&listing_lock);
+    free(listing);
+    listing = fresh_listing;
+    listing_ms = now;
+    pthread_mutex_unlock(&listing_lock);
+}
+
+// tmux's last report on a session: when its current window last had
+// output (s since the epoch) and which window and pane are current
+// Returns 0 if tmux has the session, -1 if not or if tmux wasn't asked yet
+static int session_state(const char *session, long long *activity, char *state) {
+    size_t name_len = strlen(session);
+    int found = -1;
+
+    pthread_mutex_lock(&listing_lock);
+    for (const char *line = listing; line && *line && found < 0;) {
+        const char *end = strchr(line, '\n');
+        if (!end) end = line + strlen(line);
+
+        long long act;
+        char st[STATE_MAX];
+        int offset;
+        if (sscanf(line, "%lld %63s %n", &act, st, &offset) == 2 &&
+            (size_t)(end - line - offset) == name_len &&
+            memcmp(line + offset, session, name_len) == 0) {
+            if (activity) *activity = act;
+            if (state) memcpy(state, st, STATE_MAX);
+            found = 0;
+        }
+        line = *end ? end + 1 : end;
+    }
+
+    pthread_mutex_unlock(&listing_lock);
+    return found;
+}
+
+static void *helper_main(void *arg);
+
+// Have the helper make a pass, starting it if need be
+static void helper_wake(void) {
+    pthread_mutex_lock(&helper_lock);
+    if (!helper_started && !helper_stopping) {
+        int err = pthread_create(&helper_thread, NULL, helper_main, NULL);
+        if (err == 0) {
+            helper_started = 1;
+        } else {
+            errno = err;
+            perror("pthread_create snapshot helper");
+        }
+    }
+    helper_work = 1;
+    pthread_cond_signal(&helper_cond);
+    pthread_mutex_unlock(&helper_lock);
+}
+
+int snapshot_session_exists(const char *session) {
+    pthread_mutex_lock(&listing_lock);
+    int fresh = listing && now_ms() - listing_ms < SNAPSHOT_CHECK_MS;
+    pthread_mutex_unlock(&listing_lock);
+
+    // A session missing from an old listing may have been created since
+    if (session_state(session, NULL, NULL) == 0) return 1;
+    if (fresh) return 0;
+    helper_wake();
+    return -1;
+}
+
+// The session's current pane as capture-pane prints it with -e
+// Returns 0 on success, -1 on error
+static int capture(const char *session, out_t *out) {
+    char target[512];
+    snprintf(target, sizeof(target), "=%s:", session);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Child: run tmux without the server's blocked signals
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        dup2(fds[1], STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDERR_FILENO);
+        execlp("tmux", "tmux", "capture-pane", "-p", "-e", "-t", target, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    int ok = out_read(out, fds[0]) == 0;
+    close(fds[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Length of the escape sequence at p (p[0] is ESC), or of what is left
+// if it is cut off
+static size_t escape_len(const char *p, const char *end) {
+    const char *q = p + 1;
+    if (q == end) return 1;
+
+    if (*q == '[') {
+        // CSI: parameters and intermediates, then a final byte
+        for (q++; q < end; q++) {
+            if (*q >= 0x40 && *q <= 0x7e) return q + 1 - p;
+        }
+        return end - p;
+    }
+    if (*q == ']') {
+        // OSC: up to BEL or ST
+        for (q++; q < end; q++) {
+            if (*q == '\a') return q + 1 - p;
+            if (*q == '\033' && q + 1 < end && q[1] == '\\') return q + 2 - p;
+        }
+        return end - p;
+    }
+    return 2;
+}
+
+static void to_text(const char *ansi, size_t len, out_t *out) {
+    const char *end = ansi + len;
+    for (const char *p = ansi; p < end;) {
+        const char *esc = memchr(p, '\033', end - p);
+        if (!esc) esc = end;
+        out_append(out, p, esc - p);
+        p = esc < end ? esc + escape_len(esc, end) : end;
+    }
+}
+
+typedef struct {
+    int32_t fg, bg;                // 0xRRGGBB, -1 for the default
+    int bold, dim, italic, underline, reverse;
+} sgr_t;
+
+static int32_t palette(int n) {
+    static const int32_t base[16] = {
+        0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+        0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff,
+    };
+    if (n < 16) return base[n];
+    if (n < 232) {
+        static const int levels[6] = { 0, 95, 135, 175, 215, 255 };
+        n -= 16;
+        return levels[n / 36] << 16 | levels[n / 6 % 6] << 8 | levels[n % 6];
+    }
+    int grey = 8 + (n - 232) * 10;
+    return grey << 16 | grey << 8 | grey;
+}
+
+// Apply the parameters of an SGR sequence ("1;38;5;208")
+static void sgr_apply(sgr_t *sgr, const char *p, const char *end) {
+    int params[32], count = 0;
+    while (p <= end && count < 32) {
+        int value = 0;
+        while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+        params[count++] = value;
+        p++;                       // ';' or ':'
+    }
+
+    for (int i = 0; i < count; i++) {
+        int n = params[i];
+        if (n == 0) *sgr = (sgr_t){ .fg = -1, .bg = -1 };
+        else if (n == 1) sgr->bold = 1;
+        else if (n == 2) sgr->dim = 1;
+        else if (n == 3) sgr->italic = 1;
+        else if (n == 4) sgr->underline = 1;
+        else if (n == 7) sgr->reverse = 1;
+        else if (n == 22) sgr->bold = sgr->dim = 0;
+        else if (n == 23) sgr->italic = 0;
+        else if (n == 24) sgr->underline = 0;
+        else if (n == 27) sgr->reverse = 0;
+        else if (n >= 30 && n <= 37) sgr->fg = palette(n - 30);
+        else if (n == 39) sgr->fg = -1;
+        else if (n >= 40 && n <= 47) sgr->bg = palette(n - 40);
+        else if (n == 49) sgr->bg = -1;
+        else if (n >= 90 && n <= 97) sgr->fg = palette(n - 90 + 8);
+        else if (n >= 100 && n <= 107) sgr->bg = palette(n - 100 + 8);
+        else if ((n == 38 || n == 48) && i + 2 < count && params[i + 1] == 5) {
+            int32_t color = palette(params[i + 2] & 0xff);
+            if (n == 38) sgr->fg = color;
+            else sgr->bg = color;
+            i += 2;
+        } else if ((n == 38 || n == 48) && i + 4 < count && params[i + 1] == 2) {
+            int32_t color = (params[i + 2] & 0xff) << 16 | (params[i + 3] & 0xff) << 8 |
+                            (params[i + 4] & 0xff);
+            if (n == 38) sgr->fg = color;
+            else sgr->bg = color;
+            i += 4;
+        }
+    }
+}
+
+static void html_open(out_t *out, const sgr_t *sgr) {
+    int32_t fg = sgr->fg, bg = sgr->bg;
+    if (sgr->reverse) {
+        fg = sgr->bg < 0 ? 0x000000 : sgr->bg;
+        bg = sgr->fg < 0 ? 0xcccccc : sgr->fg;
+    }
+    if (fg < 0 && bg < 0 && !sgr->bold && !sgr->dim && !sgr->italic && !sgr->underline) return;
+
+    out_append(out, "<span style=\"", 13);
+    if (fg >= 0) out_printf(out, "color:#%06x;", fg);
+    if (bg >= 0) out_printf(out, "background:#%06x;", bg);
+    if (sgr->bold) out_append(out, "font-weight:bold;", 17);
+    if (sgr->dim) out_append(out, "opacity:0.6;", 12);
+    if (sgr->italic) out_append(out, "font-style:italic;", 18);
+    if (sgr->underline) out_append(out, "text-decoration:underline;", 26);
+    out_append(out, "\">", 2);
+}
+
+static const char HTML_START[] =
+    "<pre class=\"oatmux-snapshot\" style=\"margin:0;background:#000;color:#ccc;"
+    "font-family:Menlo,Monaco,'Courier New',monospace\">";
+
+static int sgr_equal(const sgr_t *a, const sgr_t *b) {
+    return a->fg == b->fg && a->bg == b->bg && a->bold == b->bold && a->dim == b->dim &&
+           a->italic == b->italic && a->underline == b->underline && a->reverse == b->reverse;
+}
+
+// Spans are opened as text is written, so attributes that tmux sets one
+// sequence at a time, or that change before any text, leave no empty ones
+static void to_html(const char *ansi, size_t len, out_t *out) {
+    sgr_t sgr = { .fg = -1, .bg = -1 };
+    sgr_t shown = sgr;             // Attributes of the open span
+    const char *end = ansi + len;
+    int opened = 0;                // Inside a span
+
+    out_append(out, HTML_START, sizeof(HTML_START) - 1);
+
+    for (const char *p = ansi; p < end;) {
+        if (*p == '\033') {
+            size_t n = escape_len(p, end);
+            if (n >= 3 && p[1] == '[' && p[n - 1] == 'm') sgr_apply(&sgr, p + 2, p + n - 1);
+            p += n;
+            continue;
+        }
+
+        if (!sgr_equal(&sgr, &shown)) {
+            if (opened) out_append(out, "</span>", 7);
+            size_t before = out->len;
+            html_open(out, &sgr);
+            opened = out->len != before;
+            shown = sgr;
+        }
+
+        if (*p == '<') {
+            out_append(out, "&lt;", 4);
+            p++;
+        } else if (*p == '>') {
+            out_append(out, "&gt;", 4);
+            p++;
+        } else if (*p == '&') {
+            out_append(out, "&amp;", 5);
+            p++;
+        } else {
+            const char *q = p;
+            while (q < end && *q != '\033' && *q != '<' && *q != '>' && *q != '&') q++;
+            out_append(out, p, q - p);
+            p = q;
+        }
+    }
+
+    if (opened) out_append(out, "</span>", 7);
+    out_append(out, "</pre>\n", 7);
+}
+
+snapshot_t *snapshot_new(const char *session) {
+    snapshot_t *snapshot = calloc(1, sizeof(*snapshot));
+    if (!snapshot) return NULL;
+
+    snapshot->session = strdup(session);
+    if (!snapshot->session) {
+        free(snapshot);
+        return NULL;
+    }
+    pthread_mutex_init(&snapshot->lock, NULL);
+
+    // Generations start at the wall clock in microseconds, so versions
+    // handed out by an earlier run don't match
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    atomic_store(&snapshot->gen, (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    return snapshot;
+}
+
+void snapshot_touch(snapshot_t *snapshot) {
+    atomic_fetch_add_explicit(&snapshot->gen, 1, memory_order_relaxed);
+}
+
+// Capture the screen again; an unchanged screen keeps its version and
+// what was made of it (helper thread, unlocked)
+static void snapshot_capture(snapshot_t *snapshot) {
+    pthread_mutex_lock(&snapshot->lock);
+    uint64_t gen = atomic_load(&snapshot->gen);
+    pthread_mutex_unlock(&snapshot->lock);
+
+    time_t before = time(NULL);
+    out_t out = {0};
+    int ok = capture(snapshot->session, &out) == 0;
+    if (ok && !out.data) out.data = strdup("");
+
+    pthread_mutex_lock(&snapshot->lock);
+    if (!ok || !out.data) {
+        free(out.data);
+        snapshot->failed = !snapshot->data[SNAPSHOT_ANSI];
+        pthread_mutex_unlock(&snapshot->lock);
+        return;
+    }
+
+    snapshot->failed = 0;
+    snapshot->captured_gen = gen;
+    snapshot->captured_ms = now_ms();
+    snapshot->captured_sec = before;
+    memcpy(snapshot->state, snapshot->seen_state, STATE_MAX);
+
+    char *ansi = snapshot->data[SNAPSHOT_ANSI];
+    if (ansi && snapshot->len[SNAPSHOT_ANSI] == out.len && memcmp(ansi, out.data, out.len) == 0) {
+        free(out.data);
+        pthread_mutex_unlock(&snapshot->lock);
+        return;
+    }
+
+    for (int i = 0; i < SNAPSHOT_FORMATS; i++) {
+        free(snapshot->data[i]);
+        snapshot->data[i] = NULL;
+    }
+    snapshot->data[SNAPSHOT_ANSI] = out.data;
+    snapshot->len[SNAPSHOT_ANSI] = out.len;
+    snapshot->version = gen;
+    pthread_mutex_unlock(&snapshot->lock);
+}
+
+// Compare tmux's activity time with the capture's and capture again if
+// the screen may have changed (helper thread, with a fresh listing)
+static void snapshot_update(snapshot_t *snapshot) {
+    pthread_mutex_lock(&snapshot->lock);
+    snapshot->wanted = 0;
+    uint64_t now = now_ms();
+    int have = snapshot->data[SNAPSHOT_ANSI] != NULL;
+
+    // Output nobody here watched shows in tmux's activity time; the
+    // current window changing doesn't, so that is compared too. Activity
+    // in the second of the capture may have come after it.
+    if (!have || now - snapshot->checked_ms >= SNAPSHOT_CHECK_MS) {
+        long long activity;
+        if (session_state(snapshot->session, &activity, snapshot->seen_state) < 0) {
+            snapshot->failed = !have;
+            pthread_mutex_unlock(&snapshot->lock);
+            return;
+        }
+        snapshot->checked_ms = now;
+        if (activity >= snapshot->captured_sec || strcmp(snapshot->seen_state, snapshot->state) != 0) {
+            atomic_fetch_add(&snapshot->gen, 1);
+        }
+    }
+
+    uint64_t gen = atomic_load(&snapshot->gen);
+    int due = !have || (gen != snapshot->captured_gen && now - snapshot->captured_ms >= SNAPSHOT_MIN_MS);
+    pthread_mutex_unlock(&snapshot->lock);
+
+    if (due) snapshot_capture(snapshot);
+}
+
+// Post what waited for a pass to the workers that asked
+static void waiters_post(waiter_t *waiter) {
+    while (waiter) {
+        waiter_t *next = waiter->next;
+        if (worker_post(waiter->worker, waiter->fn, waiter->arg) < 0) perror("snapshot waiter");
+        free(waiter);
+        waiter = next;
+    }
+}
+
+static void snapshot_destroy(snapshot_t *snapshot) {
+    for (int i = 0; i < SNAPSHOT_FORMATS; i++) free(snapshot->data[i]);
+    pthread_mutex_destroy(&snapshot->lock);
+    free(snapshot->session);
+    free(snapshot);
+}
+
+static void retired_free(snapshot_t *snapshot) {
+    while (snapshot) {
+        snapshot_t *next = snapshot->retired_next;
+        snapshot_destroy(snapshot);
+        snapshot = next;
+    }
+}
+
+// Each pass refreshes the listing if it is old and brings the snapshots
+// asked for up to date, then tells those waiting for it. Snapshots freed
+// during a pass are only let go at the start of the next one.
+static void *helper_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&helper_lock);
+    for (;;) {
+        while (!helper_work && !helper_stopping) pthread_cond_wait(&helper_cond, &helper_lock);
+        if (helper_stopping) break;
+        helper_work = 0;
+        waiter_t *done = waiters;
+        waiters = NULL;
+        snapshot_t *list = snapshots;
+        snapshot_t *gone = retired;
+        retired = NULL;
+        pthread_mutex_unlock(&helper_lock);
+
+        retired_free(gone);
+        listing_refresh();
+        for (snapshot_t *snapshot = list; snapshot; snapshot = snapshot->next) {
+            pthread_mutex_lock(&snapshot->lock);
+            int wanted = snapshot->wanted;
+            pthread_mutex_unlock(&snapshot->lock);
+            if (wanted) snapshot_update(snapshot);
+        }
+        waiters_post(done);
+
+        pthread_mutex_lock(&helper_lock);
+    }
+    pthread_mutex_unlock(&helper_lock);
+    return NULL;
+}
+
+int snapshot_wait(worker_t *worker, void (*fn)(worker_t *worker, void *arg), void *arg) {
+    waiter_t *waiter = malloc(sizeof(*waiter));
+    if (!waiter) return -1;
+    waiter->worker = worker;
+    waiter->fn = fn;
+    waiter->arg = arg;
+
+    pthread_mutex_lock(&helper_lock);
+    if (!helper_started || helper_stopping) {
+        pthread_mutex_unlock(&helper_lock);
+        free(waiter);
+        return -1;
+    }
+    waiter->next = waiters;
+    waiters = waiter;
+    helper_work = 1;
+    pthread_cond_signal(&helper_cond);
+    pthread_mutex_unlock(&helper_lock);
+    return 0;
+}
+
+void snapshot_stop(void) {
+    pthread_mutex_lock(&helper_lock);
+    helper_stopping = 1;
+    pthread_cond_signal(&helper_cond);
+    int started = helper_started;
+    waiter_t *left = waiters;
+    waiters = NULL;
+    pthread_mutex_unlock(&helper_lock);
+
+    if (started) pthread_join(helper_thread, NULL);
+    waiters_post(left);
+
+    pthread_mutex_lock(&helper_lock);
+    helper_started = 0;
+    snapshot_t *gone = retired;
+    retired = NULL;
+    pthread_mutex_unlock(&helper_lock);
+    retired_free(gone);
+}
+
+// Have the helper bring the snapshot up to date if it may be stale
+// Returns whether output is known to have changed the screen since it
+// was captured and it may be captured again
+static int snapshot_want(snapshot_t *snapshot, int *have, int *failed) {
+    pthread_mutex_lock(&snapshot->lock);
+    uint64_t now = now_ms();
+    *have = snapshot->data[SNAPSHOT_ANSI] != NULL;
+    *failed = snapshot->failed;
+
+    int changed = atomic_load(&snapshot->gen) != snapshot->captured_gen;
+    int stale = !*have || now - snapshot->checked_ms >= SNAPSHOT_CHECK_MS || changed;
+    int wake = stale && !snapshot->wanted;
+    if (stale) snapshot->wanted = 1;
+    int list = !snapshot->listed;
+    snapshot->listed = 1;
+    int due = changed && now - snapshot->captured_ms >= SNAPSHOT_MIN_MS;
+    pthread_mutex_unlock(&snapshot->lock);
+
+    if (list) {
+        pthread_mutex_lock(&helper_lock);
+        snapshot->next = snapshots;
+        snapshots = snapshot;
+        pthread_mutex_unlock(&helper_lock);
+    }
+    if (wake) helper_wake();
+    return due;
+}
+
+int snapshot_changed(snapshot_t *snapshot) {
+    int have, failed;
+    return snapshot_want(snapshot, &have, &failed) && have;
+}
+
+int snapshot_get(snapshot_t *snapshot, snapshot_format_t format, uint64_t *version,
+                 char **data, size_t *len) {
+    // What is cached is served while the helper looks for changes
+    int have, failed;
+    snapshot_want(snapshot, &have, &failed);
+    if (!have) return failed ? -1 : SNAPSHOT_PENDING;
+
+    pthread_mutex_lock(&snapshot->lock);
+    if (*version == snapshot->version) {
+        pthread_mutex_unlock(&snapshot->lock);
+        return 0;
+    }
+
+    if (!snapshot->data[format]) {
+        out_t out = {0};
+        const char *ansi = snapshot->data[SNAPSHOT_ANSI];
+        if (format == SNAPSHOT_TEXT) to_text(ansi, snapshot->len[SNAPSHOT_ANSI], &out);
+        else to_html(ansi, snapshot->len[SNAPSHOT_ANSI], &out);
+        if (!out.data) out.data = strdup("");
+        if (out.failed || !out.data) {
+            free(out.data);
+            pthread_mutex_unlock(&snapshot->lock);
+            return -1;
+        }
+        snapshot->data[format] = out.data;
+        snapshot->len[format] = out.len;
+    }
+
+    *len = snapshot->len[format];
+    *data = malloc(*len + 1);
+    if (*data) {
+        memcpy(*data, snapshot->data[format], *len + 1);
+        *version = snapshot->version;
+    }
+    pthread_mutex_unlock(&snapshot->lock);
+    return *data ? 1 : -1;
+}
+
+void snapshot_free(snapshot_t *snapshot) {
+    if (!snapshot) return;
+    if (snapshot->listed) {
+        // The helper may be part way through its list, past this one or
+        // about to step on it, so it frees it once its pass is over
+        pthread_mutex_lock(&helper_lock);
+        snapshot_t **link = &snapshots;
+        while (*link && *link != snapshot) link = &(*link)->next;
+        if (*link) *link = snapshot->next;
+        int keep = helper_started;
+        if (keep) {
+            snapshot->retired_next = retired;
+            retired = snapshot;
+            helper_work = 1;
+            pthread_cond_signal(&helper_cond);
+        }
+        pthread_mutex_unlock(&helper_lock);
+        if (keep) return;
+    }
+    snapshot_destroy(snapshot);
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "terminal.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,12 +8,32 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <spawn.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <pty.h>
 #include <termios.h>
 
-int terminal_create(terminal_t *term, const char *session_name) {
+extern char **environ;
+
+// A descriptor that turns readable when pid exits, or -1 if the kernel
+// has no pidfds (before 5.3)
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+// Fork a tmux client attached to session_name on a new PTY; a spare
+// attaches with ignore-size
+static int spawn(terminal_t *term, const char *session_name, int spare) {
+    term->pid_fd = -1;
+
     struct winsize ws = {
         .ws_row = 24,
         .ws_col = 80,
@@ -27,13 +49,23 @@ int terminal_create(terminal_t *term, const char *session_name) {
     }
 
     if (pid == 0) {
-        // Child process - exec tmux attach
-        char *args[5];
-        args[0] = "tmux";
-        args[1] = "attach-session";
-        args[2] = "-t";
-        args[3] = (char *)session_name;
-        args[4] = NULL;
+        // Child process - exec tmux attach, without the server's blocked
+        // signals
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        char *args[7];
+        int argc = 0;
+        args[argc++] = "tmux";
+        args[argc++] = "attach-session";
+        if (spare) {
+            args[argc++] = "-f";
+            args[argc++] = "ignore-size";
+        }
+        args[argc++] = "-t";
+        args[argc++] = (char *)session_name;
+        args[argc] = NULL;
 
         // Set TERM environment variable
         setenv("TERM", "xterm-256color", 1);
@@ -45,6 +77,8 @@ int terminal_create(terminal_t *term, const char *session_name) {
         // Try creating a new session instead
         args[1] = "new-session";
         args[2] = "-s";
+        args[3] = (char *)session_name;
+        args[4] = NULL;
         execvp("tmux", args);
         perror("execvp tmux new");
         _exit(1);
@@ -52,9 +86,14 @@ int terminal_create(terminal_t *term, const char *session_name) {
 
     // Parent process
     term->pid = pid;
-    term->session_name = strdup(session_name);
+    term->pid_fd = open_pidfd(pid);
+    term->session_name = session_name;
     term->running = 1;
 
+    if (ptsname_r(term->master_fd, term->tty_name, sizeof(term->tty_name)) != 0) {
+        term->tty_name[0] = '\0';
+    }
+
     // Set master fd to non-blocking
     int flags = fcntl(term->master_fd, F_GETFL, 0);
     fcntl(term->master_fd, F_SETFL, flags | O_NONBLOCK);
@@ -62,6 +101,26 @@ int terminal_create(terminal_t *term, const char *session_name) {
     return 0;
 }
 
+int terminal_create(terminal_t *term, const char *session_name) {
+    return spawn(term, session_name, 0);
+}
+
+int terminal_create_spare(terminal_t *term, const char *session_name) {
+    return spawn(term, session_name, 1);
+}
+
+void terminal_adopt(terminal_t *term, pid_t pid, int master_fd, const char *session_name) {
+    term->pid = pid;
+    term->pid_fd = open_pidfd(pid);
+    term->master_fd = master_fd;
+    term->session_name = session_name;
+    term->running = 1;
+
+    if (ptsname_r(master_fd, term->tty_name, sizeof(term->tty_name)) != 0) {
+        term->tty_name[0] = '\0';
+    }
+}
+
 ssize_t terminal_read(terminal_t *term, char *buf, size_t bufsize) {
     if (!term->running) return -1;
 
@@ -83,23 +142,40 @@ ssize_t terminal_read(terminal_t *term, char *buf, size_t bufsize) {
     return n;
 }
 
+ssize_t terminal_splice(terminal_t *term, int pipe_fd, size_t len) {
+    if (!term->running) return -1;
+
+    ssize_t n = splice(term->master_fd, NULL, pipe_fd, NULL, len,
+                       SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0; // No data available
+        }
+        term->running = 0;
+        return -1;
+    }
+
+    if (n == 0) {
+        term->running = 0;
+        return -1; // EOF
+    }
+
+    return n;
+}
+
 ssize_t terminal_write(terminal_t *term, const char *buf, size_t len) {
     if (!term->running) return -1;
 
-    ssize_t total = 0;
-    while ((size_t)total < len) {
-        ssize_t n = write(term->master_fd, buf + total, len - total);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(1000); // Brief pause and retry
-                continue;
-            }
-            return -1;
+    ssize_t n = write(term->master_fd, buf, len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0; // Full; the caller waits for writability
         }
-        total += n;
+        return -1;
     }
 
-    return total;
+    return n;
 }
 
 int terminal_resize(terminal_t *term, int cols, int rows) {
@@ -115,38 +191,179 @@ int terminal_resize(terminal_t *term, int cols, int rows) {
     return ioctl(term->master_fd, TIOCSWINSZ, &ws);
 }
 
-void terminal_close(terminal_t *term) {
+int terminal_redraw(terminal_t *term) {
+    if (!term->running || term->pid <= 0) return -1;
+
+    // The tmux client answers SIGWINCH by reporting its size; the server
+    // then resets all cached terminal state and redraws the client. The
+    // window size is unchanged, so the programs inside see nothing.
+    return kill(term->pid, SIGWINCH);
+}
+
+void terminal_hangup(terminal_t *term) {
     if (term->master_fd >= 0) {
         close(term->master_fd);
         term->master_fd = -1;
     }
 
+    // Through the pidfd the signal can't reach a process that took over
+    // the pid of one already reaped
     if (term->pid > 0) {
+#ifdef SYS_pidfd_send_signal
+        if (term->pid_fd < 0 || syscall(SYS_pidfd_send_signal, term->pid_fd, SIGHUP, NULL, 0) < 0) {
+            kill(term->pid, SIGHUP);
+        }
+#else
         kill(term->pid, SIGHUP);
-        waitpid(term->pid, NULL, WNOHANG);
-        term->pid = 0;
+#endif
     }
 
-    if (term->session_name) {
-        free(term->session_name);
-        term->session_name = NULL;
+    term->running = 0;
+}
+
+int terminal_reap(terminal_t *term) {
+    if (term->pid <= 0) return 1;
+
+    pid_t result = waitpid(term->pid, NULL, WNOHANG);
+    if (result == 0 || (result < 0 && errno != ECHILD)) return 0;
+
+    // Not our child: it has exited once the pidfd is readable
+    if (result < 0) {
+        if (term->pid_fd >= 0) {
+            struct pollfd pfd = { .fd = term->pid_fd, .events = POLLIN };
+            if (poll(&pfd, 1, 0) == 0) return 0;
+        } else if (kill(term->pid, 0) == 0 || errno != ESRCH) {
+            return 0;
+        }
     }
 
+    term->pid = 0;
     term->running = 0;
+    return 1;
+}
+
+void terminal_close(terminal_t *term) {
+    terminal_hangup(term);
+    terminal_reap(term);
+
+    if (term->pid_fd >= 0) {
+        close(term->pid_fd);
+        term->pid_fd = -1;
+    }
+    term->pid = 0;
+    term->session_name = NULL;
 }
 
 int terminal_is_running(terminal_t *term) {
-    if (!term->running) return 0;
+    return term->running;
+}
 
-    // Check if child process is still alive
-    int status;
-    pid_t result = waitpid(term->pid, &status, WNOHANG);
+int terminal_echo_probe(terminal_t *term, echo_probe_t *probe) {
+    probe->pid = 0;
+    probe->fd = -1;
+    probe->len = 0;
+    if (!term->running || !term->tty_name[0]) return -1;
 
-    if (result == term->pid) {
-        // Process has exited
-        term->running = 0;
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) < 0) return -1;
+
+    // Ask tmux about the pane this client is looking at
+    char *args[] = { "tmux", "display-message", "-c", term->tty_name, "-p",
+                     "#{alternate_on}|#{pane_in_mode}|#{pane_tty}", NULL };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    // Without the server's blocked signals
+    posix_spawnattr_t attr;
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, "tmux", &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(out[1]);
+    if (err != 0) {
+        close(out[0]);
+        return -1;
+    }
+
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    probe->pid = pid;
+    probe->fd = out[0];
+    return 0;
+}
+
+// tmux closed its output, so it has exited or is about to; one still
+// exiting stays in probe->pid rather than be waited for
+static void probe_end(echo_probe_t *probe) {
+    close(probe->fd);
+    probe->fd = -1;
+    pid_t result;
+    while ((result = waitpid(probe->pid, NULL, WNOHANG)) < 0 && errno == EINTR) {}
+    if (result != 0) probe->pid = 0;
+}
+
+// Echo mode from tmux's answer
+static int probe_mode(const char *answer) {
+    int alternate, in_mode;
+    char pane_tty[128];
+    if (sscanf(answer, "%d|%d|%127[^\n]", &alternate, &in_mode, pane_tty) != 3) {
+        return -1;
+    }
+
+    // Full-screen programs and copy mode don't echo input at the cursor
+    if (alternate || in_mode) return 0;
+
+    int fd = open(pane_tty, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return 1;
+
+    struct termios tio;
+    int have_tio = tcgetattr(fd, &tio) == 0;
+    close(fd);
+
+    // Canonical mode without echo is a password prompt
+    if (have_tio && (tio.c_lflag & ICANON) && !(tio.c_lflag & ECHO)) {
         return 0;
     }
 
     return 1;
 }
+
+int terminal_echo_read(echo_probe_t *probe, int *mode) {
+    for (;;) {
+        ssize_t n = read(probe->fd, probe->out + probe->len, sizeof(probe->out) - 1 - probe->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n > 0) {
+            probe->len += n;
+            if (probe->len < sizeof(probe->out) - 1) continue;
+        }
+        break;
+    }
+
+    probe_end(probe);
+    probe->out[probe->len] = '\0';
+    *mode = probe_mode(probe->out);
+    return 1;
+}
+
+void terminal_echo_cancel(echo_probe_t *probe) {
+    if (probe->pid == 0) return;
+    kill(probe->pid, SIGKILL);
+    probe_end(probe);
+}
+
+void terminal_echo_orphan(echo_probe_t *probe, terminal_t *term) {
+    memset(term, 0, sizeof(*term));
+    term->pid = probe->pid;
+    term->pid_fd = open_pidfd(probe->pid);
+    term->master_fd = -1;
+    probe->pid = 0;
+}
@@ -0,0 +1,261 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+typedef struct {
+    uint64_t ns;          // CLOCK_MONOTONIC
+    uint32_t conn, seq;
+    uint32_t a, b;
+    uint32_t type;
+} trace_event_t;
+
+// One thread's events; only that thread writes, head counts every event
+// it ever recorded
+typedef struct trace_ring {
+    struct trace_ring *next;
+    atomic_uint_fast64_t head;
+    trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+atomic_int trace_enabled;
+
+static _Atomic(trace_ring_t *) rings;    // Every thread's ring, never freed
+static _Thread_local trace_ring_t *ring;  // This thread's
+static atomic_uint conn_ids;
+
+static const char *STAGE_NAMES[TRACE_TYPES] = {
+    [TRACE_PTY_WRITE] = "server: input to terminal",
+    [TRACE_PTY_OUTPUT] = "terminal: tmux and program",
+    [TRACE_QUEUED] = "server: output to frame",
+    [TRACE_SENT] = "server: socket write",
+};
+
+void trace_start(void) {
+    atomic_store(&trace_enabled, 1);
+}
+
+uint32_t trace_conn_id(void) {
+    return atomic_fetch_add(&conn_ids, 1) + 1;
+}
+
+void trace_record(trace_type_t type, uint32_t conn, uint32_t seq, uint32_t a, uint32_t b) {
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring) return;
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {}
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t *ev = &ring->events[head % TRACE_RING_EVENTS];
+    ev->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ev->conn = conn;
+    ev->seq = seq;
+    ev->a = a;
+    ev->b = b;
+    ev->type = type;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copy what the rings hold; events a thread overwrote while we copied
+// are dropped
+static trace_event_t *collect(size_t *count) {
+    size_t cap = 0;
+    for (trace_ring_t *r = atomic_load(&rings); r; r = r->next) cap += TRACE_RING_EVENTS;
+
+    trace_event_t *events = malloc((cap ? cap : 1) * sizeof(*events));
+    if (!events) return NULL;
+
+    size_t n = 0;
+    for (trace_ring_t *r = atomic_load(&rings); r; r = r->next) {
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        size_t start = n;
+        for (uint64_t i = first; i < head; i++) {
+            events[n++] = r->events[i % TRACE_RING_EVENTS];
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t now = atomic_load_explicit(&r->head, memory_order_relaxed);
+        uint64_t valid = now > TRACE_RING_EVENTS ? now - TRACE_RING_EVENTS : 0;
+        if (valid > first) {
+            size_t lost = valid - first < head - first ? valid - first : head - first;
+            memmove(events + start, events + start + lost, (n - start - lost) * sizeof(*events));
+            n -= lost;
+        }
+    }
+    *count = n;
+    return events;
+}
+
+static int compare_events(const void *a, const void *b) {
+    const trace_event_t *x = a, *y = b;
+    if (x->conn != y->conn) return x->conn < y->conn ? -1 : 1;
+    if (x->ns != y->ns) return x->ns < y->ns ? -1 : 1;
+    return x->type < y->type ? -1 : x->type > y->type;
+}
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+    int failed;
+    uint64_t base_ns;     // Time zero of the trace
+} trace_out_t;
+
+static void out_printf(trace_out_t *out, const char *fmt, ...) {
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            out->failed = 1;
+            return;
+        }
+        if (out->len + n < out->cap) {
+            out->len += n;
+            return;
+        }
+
+        size_t cap = out->cap * 2;
+        while (cap <= out->len + n) cap *= 2;
+        char *data = realloc(out->data, cap);
+        if (!data) {
+            out->failed = 1;
+            return;
+        }
+        out->data = data;
+        out->cap = cap;
+    }
+}
+
+// Begin and end of a span on the async track of one keystroke
+static void out_span(trace_out_t *out, uint32_t conn, uint32_t seq, const char *name,
+                     uint64_t from_ns, uint64_t to_ns) {
+    double from = (double)(int64_t)(from_ns - out->base_ns) / 1000;
+    double to = (double)(int64_t)(to_ns - out->base_ns) / 1000;
+    out_printf(out,
+        ",\n{\"name\":\"%s\",\"cat\":\"keystroke\",\"ph\":\"b\",\"id\":\"%u.%u\","
+        "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"seq\":%u}}"
+        ",\n{\"name\":\"%s\",\"cat\":\"keystroke\",\"ph\":\"e\",\"id\":\"%u.%u\","
+        "\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+        name, conn, seq, conn, from, seq, name, conn, seq, conn, to);
+}
+
+// Spans for the keystroke at events[i]: each stage starts where the
+// previous one ended and ends at the first event of its kind that
+// covers the input. Inputs are numbered in order, so where each stage
+// was found only moves forward; next[] keeps that per stage.
+static void out_keystroke(trace_out_t *out, const trace_event_t *events, size_t i,
+                          size_t end, size_t *next) {
+    const trace_event_t *input = &events[i];
+    size_t found[TRACE_TYPES] = {0};
+    size_t prev = i;
+    int last = TRACE_INPUT;
+
+    for (int type = TRACE_PTY_WRITE; type <= TRACE_SENT; type++) {
+        size_t j = next[type] > prev ? next[type] : prev + 1;
+        while (j < end && !(events[j].type == (uint32_t)type && events[j].seq >= input->seq)) j++;
+        next[type] = j;
+        if (j == end) break;
+        found[type] = j;
+        prev = j;
+        last = type;
+    }
+
+    size_t j = next[TRACE_BROWSER] > i ? next[TRACE_BROWSER] : i + 1;
+    while (j < end && !(events[j].type == TRACE_BROWSER && events[j].seq >= input->seq)) j++;
+    next[TRACE_BROWSER] = j;
+    const trace_event_t *browser = j < end && events[j].seq == input->seq ? &events[j] : NULL;
+
+    // The browser's round trip less our part is the network's, guessed
+    // to be half each way
+    uint64_t start = input->ns, finish = events[prev].ns;
+    uint64_t net = 0, render = 0;
+    if (browser && last == TRACE_SENT) {
+        uint64_t rtt = (uint64_t)browser->a * 1000;
+        uint64_t server = events[prev].ns - input->ns;
+        net = rtt > server ? (rtt - server) / 2 : 0;
+        render = (uint64_t)browser->b * 1000;
+        start -= net;
+        finish += net + render;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "keystroke %u", input->seq);
+    out_printf(out,
+        ",\n{\"name\":\"%s\",\"cat\":\"keystroke\",\"ph\":\"b\",\"id\":\"%u.%u\","
+        "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"seq\":%u,\"browser\":%s}}",
+        name, input->conn, input->seq, input->conn,
+        (double)(int64_t)(start - out->base_ns) / 1000, input->seq, browser ? "true" : "false");
+
+    if (net > 0) out_span(out, input->conn, input->seq, "network: to server (est.)", start, input->ns);
+    for (int type = TRACE_PTY_WRITE; type <= last; type++) {
+        out_span(out, input->conn, input->seq, STAGE_NAMES[type],
+                 events[type == TRACE_PTY_WRITE ? i : found[type - 1]].ns, events[found[type]].ns);
+    }
+    if (browser && last == TRACE_SENT) {
+        uint64_t sent = events[prev].ns;
+        if (net > 0) out_span(out, input->conn, input->seq, "network: to browser (est.)", sent, sent + net);
+        out_span(out, input->conn, input->seq, "browser: render", sent + net, finish);
+    }
+
+    out_printf(out,
+        ",\n{\"name\":\"%s\",\"cat\":\"keystroke\",\"ph\":\"e\",\"id\":\"%u.%u\","
+        "\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+        name, input->conn, input->seq, input->conn, (double)(int64_t)(finish - out->base_ns) / 1000);
+}
+
+char *trace_export(size_t *len) {
+    size_t count;
+    trace_event_t *events = collect(&count);
+    if (!events) return NULL;
+    qsort(events, count, sizeof(*events), compare_events);
+
+    trace_out_t out = { .cap = 65536 };
+    out.data = malloc(out.cap);
+    if (!out.data) {
+        free(events);
+        return NULL;
+    }
+
+    // Times count from the oldest event; estimated network time may
+    // start a keystroke before that
+    out.base_ns = UINT64_MAX;
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].ns < out.base_ns) out.base_ns = events[i].ns;
+    }
+
+    out_printf(&out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                     "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"oatmux\"}}");
+
+    for (size_t first = 0; first < count && !out.failed;) {
+        uint32_t conn = events[first].conn;
+        size_t end = first;
+        while (end < count && events[end].conn == conn) end++;
+
+        out_printf(&out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                         "\"args\":{\"name\":\"connection %u\"}}", conn, conn);
+
+        size_t next[TRACE_TYPES] = {0};
+        for (size_t i = first; i < end && !out.failed; i++) {
+            if (events[i].type == TRACE_INPUT) out_keystroke(&out, events, i, end, next);
+        }
+        first = end;
+    }
+    out_printf(&out, "\n]}\n");
+    free(events);
+
+    if (out.failed) {
+        free(out.data);
+        return NULL;
+    }
+    *len = out.len;
+    return out.data;
+}
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+
+#include "transfer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+typedef struct {
+    char token[TRANSFER_TOKEN_LEN + 1];
+    transfer_kind_t kind;
+    char *path;                    // NULL if the slot is free
+    uint64_t created_ms;
+} offer_t;
+
+static pthread_mutex_t offers_lock = PTHREAD_MUTEX_INITIALIZER;
+static offer_t offers[TRANSFER_MAX];
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void offer_drop(offer_t *offer) {
+    free(offer->path);
+    offer->path = NULL;
+}
+
+int transfer_offer(transfer_kind_t kind, const char *path, char *token) {
+    uint8_t random[TRANSFER_TOKEN_LEN / 2];
+    if (getrandom(random, sizeof(random), 0) != (ssize_t)sizeof(random)) {
+        perror("getrandom");
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(random); i++) {
+        snprintf(token + i * 2, 3, "%02x", random[i]);
+    }
+
+    char *copy = strdup(path);
+    if (!copy) return -1;
+
+    // A free or expired slot, else the oldest offer's
+    pthread_mutex_lock(&offers_lock);
+    uint64_t now = now_ms();
+    offer_t *slot = &offers[0];
+    for (int i = 0; i < TRANSFER_MAX; i++) {
+        offer_t *offer = &offers[i];
+        if (!offer->path || now - offer->created_ms >= TRANSFER_TTL_MS) {
+            slot = offer;
+            break;
+        }
+        if (offer->created_ms < slot->created_ms) slot = offer;
+    }
+    offer_drop(slot);
+    memcpy(slot->token, token, sizeof(slot->token));
+    slot->kind = kind;
+    slot->path = copy;
+    slot->created_ms = now;
+    pthread_mutex_unlock(&offers_lock);
+    return 0;
+}
+
+// Copy the path of an open offer, using up an upload if asked to
+static int offer_find(const char *token, transfer_kind_t kind, char *path, size_t size, int use) {
+    if (strlen(token) != TRANSFER_TOKEN_LEN) return -1;
+
+    int found = -1;
+    pthread_mutex_lock(&offers_lock);
+    for (int i = 0; i < TRANSFER_MAX; i++) {
+        offer_t *offer = &offers[i];
+        if (!offer->path || memcmp(offer->token, token, TRANSFER_TOKEN_LEN) != 0) continue;
+
+        if (now_ms() - offer->created_ms >= TRANSFER_TTL_MS) {
+            offer_drop(offer);
+        } else if (offer->kind == kind) {
+            snprintf(path, size, "%s", offer->path);
+            if (use && kind == TRANSFER_UPLOAD) offer_drop(offer);
+            found = 0;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&offers_lock);
+    return found;
+}
+
+int transfer_peek(const char *token, transfer_kind_t kind, char *path, size_t size) {
+    return offer_find(token, kind, path, size, 0);
+}
+
+int transfer_claim(const char *token, transfer_kind_t kind, char *path, size_t size) {
+    return offer_find(token, kind, path, size, 1);
+}
+
+void transfer_cleanup(void) {
+    pthread_mutex_lock(&offers_lock);
+    for (int i = 0; i < TRANSFER_MAX; i++) {
+        offer_drop(&offers[i]);
+    }
+    pthread_mutex_unlock(&offers_lock);
+}
+
+int transfer_socket_path(char *out, size_t size) {
+    const char *env = getenv("OATMUX_SOCKET");
+    if (env && *env) return (size_t)snprintf(out, size, "%s", env) < size ? 0 : -1;
+
+    // A directory of our own, so nobody else can put a socket in its place
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/oatmux-%u", (unsigned)getuid());
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    struct stat st;
+    if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 077)) {
+        fprintf(stderr, "%s is not a private directory of ours\n", dir);
+        return -1;
+    }
+    return (size_t)snprintf(out, size, "%s/transfer.sock", dir) < size ? 0 : -1;
+}
+
+// Append s to out, percent-encoding what a query value can't hold
+static size_t url_encode(char *out, size_t size, size_t len, const char *s) {
+    for (; *s && len + 4 < size; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c > ' ' && c < 0x7f && !strchr("%&+#?", c)) {
+            out[len++] = c;
+        } else {
+            len += snprintf(out + len, size - len, "%%%02X", c);
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+int transfer_request(transfer_kind_t kind, const char *path, const char *session,
+                     char *reply, size_t size) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (transfer_socket_path(addr.sun_path, sizeof(addr.sun_path)) < 0) {
+        snprintf(reply, size, "No place for the control socket\n");
+        return -1;
+    }
+
+    char request[16384];
+    size_t len = snprintf(request, sizeof(request), "POST /offer?kind=%s&path=",
+                          kind == TRANSFER_DOWNLOAD ? "send" : "receive");
+    len = url_encode(request, sizeof(request), len, path);
+    if (session) {
+        len += snprintf(request + len, sizeof(request) - len, "&session=");
+        len = url_encode(request, sizeof(request), len, session);
+    }
+    len += snprintf(request + len, sizeof(request) - len,
+                    " HTTP/1.1\r\nHost: oatmux\r\nContent-Length: 0\r\n\r\n");
+    if (len >= sizeof(request)) {
+        snprintf(reply, size, "Path too long\n");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        snprintf(reply, size, "No oatmux --transfer server at %s: %s\n",
+                 addr.sun_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    // The server answers and hangs up
+    char response[4096];
+    size_t got = 0;
+    int ok = write(fd, request, len) == (ssize_t)len;
+    while (ok && got + 1 < sizeof(response)) {
+        ssize_t n = read(fd, response + got, sizeof(response) - 1 - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    response[got] = '\0';
+
+    const char *body = strstr(response, "\r\n\r\n");
+    if (!ok || !body) {
+        snprintf(reply, size, "No answer from the server\n");
+        return -1;
+    }
+    snprintf(reply, size, "%s", body + 4);
+    return strncmp(response, "HTTP/1.1 200 ", 13) == 0 ? 0 : -1;
+}
@@ -0,0 +1,634 @@
+#define _GNU_SOURCE
+
+#include "upgrade.h"
+#include "feed.h"
+#include "handoff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define HANDOFF_TIMEOUT_MS 10000  // Wait for the successor at each step
+
+typedef enum {
+    HANDOFF_READY = 1,  // Successor is waiting for state (successor -> us)
+    HANDOFF_SESSION,    // tmux session served; name
+    HANDOFF_LISTENER,   // A listening socket; fds: the socket
+    HANDOFF_CLIENT,     // A connection; fds: socket, terminal; then its bytes.
+                        // Channels follow their connection, fds: terminal
+    HANDOFF_FEED,       // A shared terminal; name, fds: terminal
+    HANDOFF_END,        // End of the listeners, then of the connections
+    HANDOFF_DONE        // Successor has taken over (successor -> us)
+} handoff_type_t;
+
+typedef struct {
+    uint32_t type;
+    int32_t index;                    // Listener index
+    int32_t worker;                   // Owning worker, -1 for a shared listener
+    int32_t port;
+    int32_t control;                  // Listener is the control socket (--transfer)
+    listen_addr_t addr;
+    char name[256];                   // Session (SESSION, FEED, CLIENT)
+    char client_ip[INET6_ADDRSTRLEN];
+    int32_t state;
+    int32_t websocket_ready;
+    int32_t local;
+    int32_t predict;
+    int32_t cols, rows;
+    int32_t resize_pending;
+    int32_t resyncing, dirty, hidden;
+    uint32_t input_seq, echo_seq;
+    int32_t pid;                      // tmux client, 0 if none
+    uint32_t raw_len;                 // Unsent bytes that are not whole frames
+    uint32_t frames_len;              // Queued frames, the first possibly partly sent
+    uint32_t frames_sent;             // Bytes of the first frame already sent
+    uint32_t in_len;                  // Unprocessed input
+    uint32_t pty_len;                 // Input queued for the terminal
+    int32_t mux;
+    int32_t channel;                  // Channel id, -1 for a connection
+    int32_t acking;                   // Browser acknowledges output it has drawn
+    uint64_t unacked;                 // Output not yet acknowledged
+} handoff_record_t;
+
+static char exe_path[PATH_MAX];
+
+static atomic_int quiesced;
+
+int upgrade_setup(void) {
+    ssize_t exe_len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[exe_len > 0 ? exe_len : 0] = '\0';
+    return handoff_inherited();
+}
+
+// Stop watching everything; connections and terminals stay open and
+// their pending bytes wait in the kernel
+static void quiesce_task(worker_t *worker, void *arg) {
+    (void)arg;
+    server_worker_t *sw = (server_worker_t *)worker;
+
+    for (client_t *client = sw->clients; client; client = client->next) {
+        worker_unwatch(&client->sock);
+        worker_unwatch(&client->pty);
+        worker_unwatch(&client->child);
+        client_probe_cancel(client);
+    }
+    for (feed_t *feed = sw->feeds; feed; feed = feed->next) {
+        worker_unwatch(&feed->pty);
+        worker_unwatch(&feed->child);
+    }
+
+    // Spares are not handed over; a successor starts its own
+    warm_pool_free(sw->warm);
+    sw->warm = NULL;
+    for (orphan_t *orphan = sw->orphans; orphan; orphan = orphan->next) {
+        worker_unwatch(&orphan->child);
+    }
+    for (int i = 0; i < listener_count; i++) {
+        worker_unwatch(&sw->accept_watchers[i]);
+    }
+    atomic_fetch_add(&quiesced, 1);
+}
+
+// Register a worker's connections and shared terminals with its loop
+// Returns 0 on success, -1 on error
+int watch_connections(server_worker_t *sw) {
+    for (client_t *client = sw->clients; client; client = client->next) {
+        if (client->socket_fd >= 0 &&
+            worker_watch(&sw->worker, &client->sock, client->socket_fd,
+                         client_sock_events(client), on_client_socket) < 0) {
+            return -1;
+        }
+        if (client->socket_fd >= 0) client_start_timer(client);
+        if (client->terminal.master_fd >= 0 &&
+            worker_watch(&sw->worker, &client->pty, client->terminal.master_fd,
+                         client->input.head ? EPOLLIN | EPOLLOUT : EPOLLIN,
+                         on_client_pty) < 0) {
+            return -1;
+        }
+        watch_child(sw, &client->child, &client->terminal, on_client_child);
+    }
+    for (feed_t *feed = sw->feeds; feed; feed = feed->next) {
+        if (worker_watch(&sw->worker, &feed->pty, feed->terminal.master_fd,
+                         feed->input.head ? EPOLLIN | EPOLLOUT : EPOLLIN, on_feed_pty) < 0) {
+            return -1;
+        }
+        watch_child(sw, &feed->child, &feed->terminal, on_feed_child);
+    }
+    for (orphan_t *orphan = sw->orphans; orphan; orphan = orphan->next) {
+        watch_child(sw, &orphan->child, &orphan->terminal, on_orphan_exit);
+    }
+    return 0;
+}
+
+// Freeze all workers and wait for their threads to exit
+static void freeze_workers(void) {
+    atomic_store(&quiesced, 0);
+    for (int i = 0; i < worker_count; i++) {
+        worker_post(&workers[i].worker, quiesce_task, NULL);
+    }
+
+    // Work posted before every worker froze still runs before the stop
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+    while (atomic_load(&quiesced) < worker_count) {
+        nanosleep(&pause, NULL);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        worker_stop(&workers[i].worker);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        worker_destroy(&workers[i].worker);
+    }
+}
+
+// Restart frozen workers with everything they had
+// Returns 0 on success, -1 on error
+static int thaw_workers(const int *cpus) {
+    for (int i = 0; i < worker_count; i++) {
+        server_worker_t *sw = &workers[i];
+        if (worker_init(&sw->worker, i) < 0) return -1;
+        sw->worker.tick = worker_tick;
+        if (watch_listeners(sw) < 0 || watch_connections(sw) < 0) return -1;
+        warm_start(sw);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (worker_start(&workers[i].worker, cpus[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+// Flatten a client's output queue into bytes that must go out whole
+// (the rest of an HTTP response, or of a spliced frame) followed by
+// frames, the first of which may be partly sent
+// Returns 0 on success, -1 on error
+static int collect_output(client_t *client, uint8_t **raw, size_t *raw_len,
+                          uint8_t **frames, size_t *frames_len, size_t *frames_sent) {
+    size_t raw_total = client->splice_header_len + client->splice_pending;
+    pool_buf_t *first_frame = client->out_head;
+
+    // Only HTTP responses and the upgrade response are queued raw
+    if (client->state != CLIENT_WEBSOCKET) {
+        for (pool_buf_t *buf = client->out_head; buf; buf = buf->next) raw_total += buf->end - buf->start;
+        first_frame = NULL;
+    } else if (first_frame && first_frame == client->out_raw) {
+        raw_total += first_frame->end - first_frame->start;
+        first_frame = first_frame->next;
+    }
+
+    *raw = malloc(raw_total + 1);
+    if (!*raw) return -1;
+    size_t len = 0;
+
+    memcpy(*raw, client->splice_header, client->splice_header_len);
+    len += client->splice_header_len;
+    if (client->splice_pending > 0) {
+        if (read(client->splice_pipe[0], *raw + len, client->splice_pending) !=
+            (ssize_t)client->splice_pending) {
+            return -1;
+        }
+        len += client->splice_pending;
+    }
+    for (pool_buf_t *buf = client->out_head; buf != first_frame; buf = buf->next) {
+        memcpy(*raw + len, pool_buf_bytes(buf) + buf->start, buf->end - buf->start);
+        len += buf->end - buf->start;
+    }
+    *raw_len = len;
+
+    // Go back to the start of the frame on the wire
+    size_t frames_total = 0;
+    uint32_t first_start = 0;
+    if (first_frame) {
+        uint32_t next = 0;
+        while (next <= first_frame->start && next < first_frame->end) {
+            first_start = next;
+            next += ws_frame_size(pool_buf_bytes(first_frame) + next, first_frame->end - next);
+        }
+        for (pool_buf_t *buf = first_frame; buf; buf = buf->next) {
+            frames_total += buf->end - (buf == first_frame ? first_start : buf->start);
+        }
+    }
+
+    *frames = malloc(frames_total + 1);
+    if (!*frames) return -1;
+    len = 0;
+    for (pool_buf_t *buf = first_frame; buf; buf = buf->next) {
+        uint32_t start = buf == first_frame ? first_start : buf->start;
+        memcpy(*frames + len, pool_buf_bytes(buf) + start, buf->end - start);
+        len += buf->end - start;
+    }
+    *frames_len = len;
+    *frames_sent = first_frame ? first_frame->start - first_start : 0;
+    return 0;
+}
+
+// A copy of the input queued for a terminal
+static uint8_t *pty_queue_copy(const pty_queue_t *q) {
+    uint8_t *data = malloc(q->bytes + 1);
+    if (!data) return NULL;
+
+    size_t len = 0;
+    for (pool_buf_t *buf = q->head; buf; buf = buf->next) {
+        memcpy(data + len, buf->data + buf->start, buf->end - buf->start);
+        len += buf->end - buf->start;
+    }
+    return data;
+}
+
+static int handoff_client(int sock, client_t *client) {
+    handoff_record_t rec = { .type = HANDOFF_CLIENT };
+    uint8_t *raw = NULL, *frames = NULL;
+    size_t raw_len = 0, frames_len = 0, frames_sent = 0;
+
+    if (collect_output(client, &raw, &raw_len, &frames, &frames_len, &frames_sent) < 0) {
+        free(raw);
+        free(frames);
+        return -1;
+    }
+
+    rec.worker = client->owner->worker.id;
+    snprintf(rec.name, sizeof(rec.name), "%s", client->session_name ? client->session_name : "");
+    snprintf(rec.client_ip, sizeof(rec.client_ip), "%s", client->client_ip);
+    rec.state = client->state;
+    rec.websocket_ready = client->websocket_ready;
+    rec.local = client->local;
+    rec.predict = client->predict;
+    rec.cols = client->cols;
+    rec.rows = client->rows;
+    rec.resize_pending = client->resize_pending;
+    rec.resyncing = client->resyncing;
+    rec.dirty = client->dirty;
+    rec.hidden = client->hidden;
+    rec.input_seq = client->input_seq;
+    rec.echo_seq = client->echo_seq;
+    rec.pid = client->terminal.pid;
+    rec.raw_len = raw_len;
+    rec.frames_len = frames_len;
+    rec.frames_sent = frames_sent;
+    rec.in_len = client->in_len;
+    rec.pty_len = client->input.bytes;
+    rec.mux = client->mux;
+    rec.channel = client->parent ? client->channel : -1;
+    rec.acking = client->acking;
+    rec.unacked = client->unacked;
+
+    // A channel has no socket of its own
+    uint8_t *pty = pty_queue_copy(&client->input);
+    int fds[2] = { client->socket_fd, client->terminal.master_fd };
+    const int *send_fds = client->parent ? fds + 1 : fds;
+    int fd_count = (client->socket_fd >= 0) + (client->terminal.master_fd >= 0);
+    int ok = pty && handoff_send(sock, &rec, sizeof(rec), send_fds, fd_count) == 0 &&
+             handoff_send_bytes(sock, raw, raw_len) == 0 &&
+             handoff_send_bytes(sock, frames, frames_len) == 0 &&
+             handoff_send_bytes(sock, client->in_data, client->in_len) == 0 &&
+             handoff_send_bytes(sock, pty, rec.pty_len) == 0;
+
+    free(raw);
+    free(frames);
+    free(pty);
+    return ok ? 0 : -1;
+}
+
+// Send everything to the successor
+// Returns 0 on success, -1 on error
+static int handoff_state(int sock) {
+    handoff_record_t rec = { .type = HANDOFF_SESSION };
+    snprintf(rec.name, sizeof(rec.name), "%s", server_config->tmux_session);
+    if (handoff_send(sock, &rec, sizeof(rec), NULL, 0) < 0) return -1;
+
+    for (int i = 0; i < listener_count; i++) {
+        for (int w = 0; w < worker_count; w++) {
+            // A shared listener goes once
+            if (listeners[i].shared_fd >= 0 && w > 0) break;
+
+            rec = (handoff_record_t){ .type = HANDOFF_LISTENER, .index = i, .worker = w };
+            if (listeners[i].shared_fd >= 0) rec.worker = -1;
+            rec.addr = listeners[i].addr;
+            rec.port = listeners[i].port;
+            rec.control = listeners[i].control;
+            if (handoff_send(sock, &rec, sizeof(rec), &workers[w].listen_fds[i], 1) < 0) return -1;
+        }
+    }
+
+    rec = (handoff_record_t){ .type = HANDOFF_END };
+    if (handoff_send(sock, &rec, sizeof(rec), NULL, 0) < 0) return -1;
+
+    for (int w = 0; w < worker_count; w++) {
+        for (feed_t *feed = workers[w].feeds; feed; feed = feed->next) {
+            rec = (handoff_record_t){ .type = HANDOFF_FEED, .pid = feed->terminal.pid };
+            snprintf(rec.name, sizeof(rec.name), "%s", feed->hub->name);
+            rec.pty_len = feed->input.bytes;
+
+            uint8_t *pty = pty_queue_copy(&feed->input);
+            int ok = pty && handoff_send(sock, &rec, sizeof(rec), &feed->terminal.master_fd, 1) == 0 &&
+                     handoff_send_bytes(sock, pty, rec.pty_len) == 0;
+            free(pty);
+            if (!ok) return -1;
+        }
+        for (client_t *client = workers[w].clients; client; client = client->next) {
+            // Nothing left to do for these; a transfer is cut short, and a
+            // download can pick up from there with a range. A request
+            // waiting on another thread is dropped; the browser retries.
+            if (client->state == CLIENT_CLOSING && client_pending(client) == 0) continue;
+            if (client->state == CLIENT_WAITING) continue;
+            if (client->transfer) continue;
+            if (client->parent) continue;
+            if (handoff_client(sock, client) < 0) return -1;
+            for (client_t *channel = client->channels; channel; channel = channel->sibling) {
+                if (handoff_client(sock, channel) < 0) return -1;
+            }
+        }
+    }
+
+    rec = (handoff_record_t){ .type = HANDOFF_END };
+    return handoff_send(sock, &rec, sizeof(rec), NULL, 0);
+}
+
+// Wait for the successor's next message of the given type
+static int handoff_expect(int sock, handoff_type_t type) {
+    handoff_record_t rec;
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count;
+
+    if (handoff_wait(sock, HANDOFF_TIMEOUT_MS) <= 0) return -1;
+    if (handoff_recv(sock, &rec, sizeof(rec), fds, &fd_count) != sizeof(rec)) return -1;
+    return rec.type == type ? 0 : -1;
+}
+
+// Hand everything over to a freshly started copy of ourselves
+// Returns 0 once the successor has taken over; otherwise we keep running
+int server_upgrade(const int *cpus) {
+    pid_t pid;
+    int sock = handoff_spawn(exe_path, server_config->argv, &pid);
+    if (sock < 0) return -1;
+
+    if (handoff_expect(sock, HANDOFF_READY) < 0) {
+        fprintf(stderr, "Upgrade: new process did not start\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sock);
+        return -1;
+    }
+
+    printf("Upgrade: handing over to pid %d\n", (int)pid);
+    fflush(stdout);
+    freeze_workers();
+    hub_flush();
+
+    if (handoff_state(sock) == 0 && handoff_expect(sock, HANDOFF_DONE) == 0) {
+        close(sock);
+        return 0;
+    }
+
+    // The successor is gone or stuck; make sure it is gone and carry on
+    fprintf(stderr, "Upgrade: handover failed, resuming\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sock);
+    if (thaw_workers(cpus) < 0) {
+        fprintf(stderr, "Upgrade: could not resume, stopping\n");
+        server_stop();
+    }
+    return -1;
+}
+
+// Receive the predecessor's session and listening sockets
+// Returns 0 on success, -1 on error
+int adopt_listeners(server_config_t *config, int sock) {
+    static char session[256];
+    handoff_record_t rec = { .type = HANDOFF_READY };
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count;
+
+    if (handoff_send(sock, &rec, sizeof(rec), NULL, 0) < 0) return -1;
+
+    while (handoff_recv(sock, &rec, sizeof(rec), fds, &fd_count) == sizeof(rec)) {
+        if (rec.type == HANDOFF_END) return listener_count > 0 ? 0 : -1;
+
+        if (rec.type == HANDOFF_SESSION) {
+            snprintf(session, sizeof(session), "%s", rec.name);
+            config->tmux_session = session;
+            continue;
+        }
+
+        if (rec.type != HANDOFF_LISTENER || fd_count != 1 ||
+            rec.index < 0 || rec.index >= LISTENER_SLOTS) {
+            for (int i = 0; i < fd_count; i++) close(fds[i]);
+            return -1;
+        }
+
+        server_listener_t *l = &listeners[rec.index];
+        if (rec.index >= listener_count) {
+            l->addr = rec.addr;
+            l->port = rec.port;
+            l->control = rec.control;
+            l->shared_fd = -1;
+            listener_count = rec.index + 1;
+            if (l->addr.family != AF_UNIX && !l->addr.port) config->port = rec.port;
+        }
+
+        // Sockets of workers we don't have take their queued
+        // connections with them
+        if (rec.worker < 0) {
+            l->shared_fd = fds[0];
+        } else if (rec.worker < worker_count) {
+            workers[rec.worker].listen_fds[rec.index] = fds[0];
+        } else {
+            close(fds[0]);
+        }
+    }
+    return -1;
+}
+
+// Receive input queued for a terminal and queue it again
+// Returns 0 on success, -1 on error
+static int adopt_pty_queue(int sock, uint32_t len, pty_queue_t *q, buf_pool_t *pool,
+                           terminal_t *term) {
+    uint8_t *data = malloc(len + 1);
+    if (!data || handoff_recv_bytes(sock, data, len) < 0) {
+        free(data);
+        return -1;
+    }
+    if (len > 0 && pty_queue_write(q, pool, term, data, len) < 0) pty_queue_clear(q, pool);
+    free(data);
+    return 0;
+}
+
+// Rebuild one connection from its record
+// Rebuild a connection, or a channel of conn, the connection before it
+// Returns the client, or NULL on error
+static client_t *adopt_client(int sock, const handoff_record_t *rec, const int *fds, int fd_count,
+                              client_t *conn) {
+    server_worker_t *sw = conn ? conn->owner : &workers[rec->worker % worker_count];
+    client_t *client = slab_alloc(&sw->client_slab);
+    if (!client) return NULL;
+
+    // A channel has no socket of its own
+    client->owner = sw;
+    client->socket_fd = conn ? -1 : fds[0];
+    if (!conn) {
+        fds++;
+        fd_count--;
+    }
+    client->terminal.master_fd = -1;
+    client->terminal.pid_fd = -1;
+    client->splice_pipe[0] = client->splice_pipe[1] = -1;
+    client->session_copy = rec->name[0] ? strdup(rec->name) : NULL;
+    client->session_name = client->session_copy;
+    snprintf(client->client_ip, sizeof(client->client_ip), "%s", rec->client_ip);
+    client->state = rec->state;
+    client->websocket_ready = rec->websocket_ready;
+    client->local = rec->local;
+    client->predict = rec->predict;
+    client->cols = rec->cols;
+    client->rows = rec->rows;
+    client->resize_pending = rec->resize_pending;
+    client->resyncing = rec->resyncing;
+    client->dirty = rec->dirty;
+    client->hidden = rec->hidden;
+    client->input_seq = rec->input_seq;
+    client->echo_seq = rec->echo_seq;
+    client->mux = rec->mux;
+    client->acking = rec->acking;
+    client->unacked = rec->unacked;
+    if (fd_count > 0) terminal_adopt(&client->terminal, rec->pid, fds[0], client->session_name);
+    if (server_config->compact && fd_count > 0) client->vt = vtopt_new(client->cols, client->rows);
+
+    client->next = sw->clients;
+    if (sw->clients) sw->clients->prev = client;
+    sw->clients = client;
+
+    if (conn) {
+        client->parent = conn;
+        client->channel = rec->channel;
+        client->sibling = conn->channels;
+        conn->channels = client;
+        conn->channel_count++;
+    }
+
+    // Queued output comes back as one block for the raw bytes and one
+    // for the frames, in front of anything new
+    uint32_t lens[2] = { rec->raw_len, rec->frames_len };
+    for (int i = 0; i < 2; i++) {
+        if (lens[i] == 0) continue;
+
+        shared_buf_t *bytes = shared_buf_new(lens[i]);
+        pool_buf_t *ref = bytes ? slab_alloc(&sw->ref_slab) : NULL;
+        if (!ref) {
+            if (bytes) shared_buf_unref(bytes);
+            return NULL;
+        }
+        if (handoff_recv_bytes(sock, bytes->data, lens[i]) < 0) {
+            shared_buf_unref(bytes);
+            slab_free(&sw->ref_slab, ref);
+            return NULL;
+        }
+
+        ref->shared = bytes;
+        ref->start = i == 1 ? rec->frames_sent : 0;
+        ref->end = lens[i];
+        if (client->out_tail) client->out_tail->next = ref;
+        else client->out_head = ref;
+        client->out_tail = ref;
+        client->out_bytes += ref->end - ref->start;
+        if (i == 0) client->out_raw = ref;
+    }
+
+    if (rec->in_len > 0) {
+        if (client_in_reserve(client, rec->in_len) < 0 ||
+            handoff_recv_bytes(sock, client->in_data, rec->in_len) < 0) {
+            return NULL;
+        }
+        client->in_len = rec->in_len;
+    }
+    if (adopt_pty_queue(sock, rec->pty_len, &client->input, &sw->buffers, &client->terminal) < 0) {
+        return NULL;
+    }
+
+    if (server_config->splice && !conn && client->terminal.master_fd >= 0 &&
+        pipe2(client->splice_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        client->splice_pipe[0] = client->splice_pipe[1] = -1;
+    }
+
+    if (client->websocket_ready && client->session_name) {
+        client->hub = hub_get(client->session_name);
+        if (client->hub) hub_adopt(client->hub, &sw->worker);
+    }
+    return client;
+}
+
+// Rebuild a shared terminal on its hub's home worker; the feed keeps the
+// reference to the hub
+static int adopt_feed(int sock, const handoff_record_t *rec, int master_fd) {
+    hub_t *hub = hub_get(rec->name);
+    feed_t *feed = hub ? calloc(1, sizeof(*feed)) : NULL;
+    if (!feed) {
+        if (hub) hub_put(hub);
+        close(master_fd);
+        return -1;
+    }
+
+    server_worker_t *sw = (server_worker_t *)hub->home;
+    feed->hub = hub;
+    terminal_adopt(&feed->terminal, rec->pid, master_fd, hub->name);
+    if (adopt_pty_queue(sock, rec->pty_len, &feed->input, &sw->buffers, &feed->terminal) < 0) {
+        terminal_close(&feed->terminal);
+        free(feed);
+        hub_put(hub);
+        return -1;
+    }
+    atomic_store(&hub->input_queued, feed->input.bytes);
+    if (server_config->compact) feed->vt = vtopt_new(80, 24);
+    feed->next = sw->feeds;
+    if (sw->feeds) sw->feeds->prev = feed;
+    sw->feeds = feed;
+    hub->feed = feed;
+    return 0;
+}
+
+// Receive the predecessor's connections and shared terminals
+// Returns 0 on success, -1 if some were lost
+int adopt_connections(int sock) {
+    handoff_record_t rec;
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count;
+    int clients = 0;
+    client_t *conn = NULL;        // Connection the channels that follow belong to
+
+    while (handoff_recv(sock, &rec, sizeof(rec), fds, &fd_count) == sizeof(rec)) {
+        if (rec.type == HANDOFF_END) {
+            printf("Took over %d connection%s\n", clients, clients == 1 ? "" : "s");
+            return 0;
+        }
+
+        if (rec.type == HANDOFF_FEED && fd_count == 1) {
+            if (adopt_feed(sock, &rec, fds[0]) < 0) return -1;
+        } else if (rec.type == HANDOFF_CLIENT && rec.channel >= 0 && conn && conn->mux) {
+            if (!adopt_client(sock, &rec, fds, fd_count, conn)) return -1;
+        } else if (rec.type == HANDOFF_CLIENT && fd_count >= 1 && rec.worker >= 0) {
+            conn = adopt_client(sock, &rec, fds, fd_count, NULL);
+            if (!conn) return -1;
+            clients++;
+        } else {
+            for (int i = 0; i < fd_count; i++) close(fds[i]);
+            return -1;
+        }
+    }
+    return -1;
+}
+
+void adopt_done(int sock, int ok) {
+    if (ok) {
+        handoff_record_t done = { .type = HANDOFF_DONE };
+        handoff_send(sock, &done, sizeof(done), NULL, 0);
+    }
+    close(sock);
+}
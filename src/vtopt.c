@@ -0,0 +1,1203 @@
+#include "vtopt.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Parser states, after the DEC-compatible parser xterm.js also follows
+enum {
+    ST_GROUND,
+    ST_ESC,
+    ST_ESC_INTER,
+    ST_CSI_ENTRY,
+    ST_CSI_PARAM,
+    ST_CSI_INTER,
+    ST_CSI_IGNORE,              // Malformed CSI, ignored up to its final byte
+    ST_STRING,                  // OSC, DCS, SOS, PM or APC contents
+    ST_STRING_ESC,              // ESC in a string: ST, or a new sequence
+    ST_COUNT
+};
+
+// Byte classes
+enum {
+    CL_CTRL,                    // C0 controls the terminal executes
+    CL_BEL,
+    CL_CAN,                     // CAN, SUB
+    CL_ESC,
+    CL_INTER,                   // 0x20-0x2f
+    CL_PARAM,                   // Digits, ':' and ';'
+    CL_PRIV,                    // '<' '=' '>' '?'
+    CL_CSI,                     // '['
+    CL_STR,                     // 'P' ']' 'X' '^' '_'
+    CL_ST,                      // '\\'
+    CL_FINAL,                   // The rest of 0x40-0x7e
+    CL_DEL,
+    CL_HIGH,                    // UTF-8 lead and continuation bytes
+    CL_COUNT
+};
+
+// Actions on a byte
+enum {
+    AC_DROP,                    // DEL inside a sequence, which terminals ignore
+    AC_PRINT,
+    AC_UTF8,
+    AC_EXEC,
+    AC_START,                   // ESC: hold a new sequence
+    AC_COLLECT,
+    AC_ESC_DISPATCH,
+    AC_CSI_DISPATCH,
+    AC_IGNORE_END,
+    AC_STR_START,
+    AC_STR_PUT,
+    AC_STR_BEL,                 // Ends an OSC string, is data in others
+    AC_STR_END,
+    AC_STR_BREAK,               // ESC in a string starting a new sequence
+    AC_CANCEL,
+    AC_INVALID
+};
+
+#define T(action, state) (uint8_t)((action) << 4 | (state))
+
+static const uint8_t byte_class[256] = {
+    // 0x00: C0 with BEL at 0x07, CAN at 0x18, SUB at 0x1a and ESC at 0x1b
+    CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_BEL,
+    CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL,
+    CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL,
+    CL_CAN, CL_CTRL, CL_CAN, CL_ESC, CL_CTRL, CL_CTRL, CL_CTRL, CL_CTRL,
+    // 0x20: intermediates
+    CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER,
+    CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER,
+    // 0x30: parameters and private markers
+    CL_PARAM, CL_PARAM, CL_PARAM, CL_PARAM, CL_PARAM, CL_PARAM, CL_PARAM, CL_PARAM,
+    CL_PARAM, CL_PARAM, CL_PARAM, CL_PARAM, CL_PRIV, CL_PRIV, CL_PRIV, CL_PRIV,
+    // 0x40: finals, with DCS 'P', CSI '[', ST '\\' and the string introducers
+    CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+    CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+    CL_STR, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+    CL_STR, CL_FINAL, CL_FINAL, CL_CSI, CL_ST, CL_STR, CL_STR, CL_STR,
+    // 0x60: finals and DEL
+    CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+    CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+    CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+    CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_DEL,
+    // 0x80-0xff: UTF-8
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+    CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH, CL_HIGH,
+};
+
+// Action and next state for each state and byte class. C0 controls run
+// even inside sequences, CAN and SUB abort them and ESC starts over
+static const uint8_t transitions[ST_COUNT][CL_COUNT] = {
+    [ST_GROUND] = {
+        T(AC_EXEC, ST_GROUND), T(AC_EXEC, ST_GROUND), T(AC_EXEC, ST_GROUND),
+        T(AC_START, ST_ESC), T(AC_PRINT, ST_GROUND), T(AC_PRINT, ST_GROUND),
+        T(AC_PRINT, ST_GROUND), T(AC_PRINT, ST_GROUND), T(AC_PRINT, ST_GROUND),
+        T(AC_PRINT, ST_GROUND), T(AC_PRINT, ST_GROUND), T(AC_EXEC, ST_GROUND),
+        T(AC_UTF8, ST_GROUND),
+    },
+    [ST_ESC] = {
+        T(AC_EXEC, ST_ESC), T(AC_EXEC, ST_ESC), T(AC_CANCEL, ST_GROUND),
+        T(AC_START, ST_ESC), T(AC_COLLECT, ST_ESC_INTER), T(AC_ESC_DISPATCH, ST_GROUND),
+        T(AC_ESC_DISPATCH, ST_GROUND), T(AC_COLLECT, ST_CSI_ENTRY), T(AC_STR_START, ST_STRING),
+        T(AC_ESC_DISPATCH, ST_GROUND), T(AC_ESC_DISPATCH, ST_GROUND), T(AC_DROP, ST_ESC),
+        T(AC_INVALID, ST_GROUND),
+    },
+    [ST_ESC_INTER] = {
+        T(AC_EXEC, ST_ESC_INTER), T(AC_EXEC, ST_ESC_INTER), T(AC_CANCEL, ST_GROUND),
+        T(AC_START, ST_ESC), T(AC_COLLECT, ST_ESC_INTER), T(AC_ESC_DISPATCH, ST_GROUND),
+        T(AC_ESC_DISPATCH, ST_GROUND), T(AC_ESC_DISPATCH, ST_GROUND), T(AC_ESC_DISPATCH, ST_GROUND),
+        T(AC_ESC_DISPATCH, ST_GROUND), T(AC_ESC_DISPATCH, ST_GROUND), T(AC_DROP, ST_ESC_INTER),
+        T(AC_INVALID, ST_GROUND),
+    },
+    [ST_CSI_ENTRY] = {
+        T(AC_EXEC, ST_CSI_ENTRY), T(AC_EXEC, ST_CSI_ENTRY), T(AC_CANCEL, ST_GROUND),
+        T(AC_START, ST_ESC), T(AC_COLLECT, ST_CSI_INTER), T(AC_COLLECT, ST_CSI_PARAM),
+        T(AC_COLLECT, ST_CSI_PARAM), T(AC_CSI_DISPATCH, ST_GROUND), T(AC_CSI_DISPATCH, ST_GROUND),
+        T(AC_CSI_DISPATCH, ST_GROUND), T(AC_CSI_DISPATCH, ST_GROUND), T(AC_DROP, ST_CSI_ENTRY),
+        T(AC_INVALID, ST_GROUND),
+    },
+    [ST_CSI_PARAM] = {
+        T(AC_EXEC, ST_CSI_PARAM), T(AC_EXEC, ST_CSI_PARAM), T(AC_CANCEL, ST_GROUND),
+        T(AC_START, ST_ESC), T(AC_COLLECT, ST_CSI_INTER), T(AC_COLLECT, ST_CSI_PARAM),
+        T(AC_COLLECT, ST_CSI_IGNORE), T(AC_CSI_DISPATCH, ST_GROUND), T(AC_CSI_DISPATCH, ST_GROUND),
+        T(AC_CSI_DISPATCH, ST_GROUND), T(AC_CSI_DISPATCH, ST_GROUND), T(AC_DROP, ST_CSI_PARAM),
+        T(AC_INVALID, ST_GROUND),
+    },
+    [ST_CSI_INTER] = {
+        T(AC_EXEC, ST_CSI_INTER), T(AC_EXEC, ST_CSI_INTER), T(AC_CANCEL, ST_GROUND),
+        T(AC_START, ST_ESC), T(AC_COLLECT, ST_CSI_INTER), T(AC_COLLECT, ST_CSI_IGNORE),
+        T(AC_COLLECT, ST_CSI_IGNORE), T(AC_CSI_DISPATCH, ST_GROUND), T(AC_CSI_DISPATCH, ST_GROUND),
+        T(AC_CSI_DISPATCH, ST_GROUND), T(AC_CSI_DISPATCH, ST_GROUND), T(AC_DROP, ST_CSI_INTER),
+        T(AC_INVALID, ST_GROUND),
+    },
+    [ST_CSI_IGNORE] = {
+        T(AC_EXEC, ST_CSI_IGNORE), T(AC_EXEC, ST_CSI_IGNORE), T(AC_CANCEL, ST_GROUND),
+        T(AC_START, ST_ESC), T(AC_COLLECT, ST_CSI_IGNORE), T(AC_COLLECT, ST_CSI_IGNORE),
+        T(AC_COLLECT, ST_CSI_IGNORE), T(AC_IGNORE_END, ST_GROUND), T(AC_IGNORE_END, ST_GROUND),
+        T(AC_IGNORE_END, ST_GROUND), T(AC_IGNORE_END, ST_GROUND), T(AC_DROP, ST_CSI_IGNORE),
+        T(AC_INVALID, ST_GROUND),
+    },
+    [ST_STRING] = {
+        T(AC_STR_PUT, ST_STRING), T(AC_STR_BEL, ST_STRING), T(AC_STR_END, ST_GROUND),
+        T(AC_DROP, ST_STRING_ESC), T(AC_STR_PUT, ST_STRING), T(AC_STR_PUT, ST_STRING),
+        T(AC_STR_PUT, ST_STRING), T(AC_STR_PUT, ST_STRING), T(AC_STR_PUT, ST_STRING),
+        T(AC_STR_PUT, ST_STRING), T(AC_STR_PUT, ST_STRING), T(AC_STR_PUT, ST_STRING),
+        T(AC_STR_PUT, ST_STRING),
+    },
+    [ST_STRING_ESC] = {
+        T(AC_STR_BREAK, ST_ESC), T(AC_STR_BREAK, ST_ESC), T(AC_STR_BREAK, ST_ESC),
+        T(AC_STR_BREAK, ST_ESC), T(AC_STR_BREAK, ST_ESC), T(AC_STR_BREAK, ST_ESC),
+        T(AC_STR_BREAK, ST_ESC), T(AC_STR_BREAK, ST_ESC), T(AC_STR_BREAK, ST_ESC),
+        T(AC_STR_END, ST_GROUND), T(AC_STR_BREAK, ST_ESC), T(AC_STR_BREAK, ST_ESC),
+        T(AC_STR_BREAK, ST_ESC),
+    },
+};
+
+#define COLOR_DEFAULT 0
+#define COLOR_P16 (1u << 24)    // 30-37, 90-97, which bold may brighten
+#define COLOR_P256 (2u << 24)   // 38;5;N
+#define COLOR_RGB (3u << 24)    // 38;2;R;G;B
+#define COLOR_MODE 0xff000000u
+
+enum {
+    ATTR_BOLD = 1,
+    ATTR_DIM = 2,
+    ATTR_ITALIC = 4,
+    ATTR_BLINK = 8,
+    ATTR_INVERSE = 16,
+    ATTR_INVISIBLE = 32,
+    ATTR_STRIKE = 64,
+    ATTR_OVERLINE = 128
+};
+
+// Attributes that show on a blank cell, which an erase would not draw
+#define ATTR_SHOW_BLANK (ATTR_INVERSE | ATTR_STRIKE | ATTR_OVERLINE)
+
+typedef struct {
+    uint32_t fg, bg, ul;        // COLOR_DEFAULT or a COLOR_* mode | value
+    uint8_t attrs;              // ATTR_*
+    uint8_t underline;          // 0 none, 1 single, 2 double
+} sgr_t;
+
+// What decides how a pending run of spaces is written
+enum {
+    NEXT_OTHER,                 // Anything: as it is
+    NEXT_PRINT,                 // A character: erase and move past it
+    NEXT_MOVE                   // A move to an absolute column: just erase
+};
+
+struct vtopt {
+    int cols, rows;
+
+    // Parser
+    uint8_t state;
+    uint8_t seq[VTOPT_HELD_MAX];  // Escape sequence so far, not written yet
+    size_t seq_len;
+    int spilled;                // Too long to hold; written as it came
+    int string_osc;             // In an OSC string, which BEL ends too
+    uint32_t cp;                // UTF-8 character being decoded
+    int cp_need;                // Continuation bytes it still needs
+
+    // What the terminal has been sent; -1 where unknown
+    int row, col;
+    int wrap;                   // Printed in the last column, wrap put off
+    int top, bottom;            // Scrolling region
+    sgr_t sgr;
+    int sgr_known;
+    int g0_ascii;               // G0 is known to be ASCII
+
+    // Modes tmux leaves at their defaults or restores straight away, so
+    // they are taken to survive output that is lost
+    int origin, insert, autowrap, newline, margins_lr;
+
+    // Output held until the next byte decides how to write it
+    int spaces;                 // Run of spaces starting at space_col
+    int space_col;
+    int grouping;               // Run of SGR sequences
+    sgr_t group;                // Attributes after it
+    int group_known;
+    char group_params[128];     // Its parameters, joined
+    size_t group_len;
+};
+
+static uint8_t *put(uint8_t *o, const void *data, size_t len) {
+    memcpy(o, data, len);
+    return o + len;
+}
+
+static char *put_num(char *p, unsigned n) {
+    char digits[10];
+    int len = 0;
+    do {
+        digits[len++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+    while (len) *p++ = digits[--len];
+    return p;
+}
+
+static int clamp(int v, int max) {
+    return v < 0 ? 0 : v > max ? max : v;
+}
+
+static void pos_forget(vtopt_t *vt) {
+    vt->row = vt->col = -1;
+    vt->wrap = 0;
+}
+
+static void forget(vtopt_t *vt) {
+    pos_forget(vt);
+    vt->top = vt->bottom = -1;
+    vt->sgr_known = 0;
+    vt->g0_ascii = 0;
+}
+
+static void sgr_default(sgr_t *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+static int sgr_equal(const sgr_t *a, const sgr_t *b) {
+    return a->fg == b->fg && a->bg == b->bg && a->ul == b->ul && a->attrs == b->attrs &&
+           a->underline == b->underline;
+}
+
+// The terminal as it is after a full reset
+static void reset_state(vtopt_t *vt) {
+    vt->row = vt->col = 0;
+    vt->wrap = 0;
+    vt->top = 0;
+    vt->bottom = vt->rows - 1;
+    sgr_default(&vt->sgr);
+    vt->sgr_known = 1;
+    vt->g0_ascii = 1;
+    vt->origin = vt->insert = vt->newline = vt->margins_lr = 0;
+    vt->autowrap = 1;
+}
+
+vtopt_t *vtopt_new(int cols, int rows) {
+    vtopt_t *vt = calloc(1, sizeof(*vt));
+    if (!vt) return NULL;
+
+    vt->cols = cols > 0 ? cols : 80;
+    vt->rows = rows > 0 ? rows : 24;
+    vt->state = ST_GROUND;
+    reset_state(vt);
+    forget(vt);
+    return vt;
+}
+
+void vtopt_resize(vtopt_t *vt, int cols, int rows) {
+    if (cols > 0) vt->cols = cols;
+    if (rows > 0) vt->rows = rows;
+    pos_forget(vt);
+    vt->top = vt->bottom = -1;
+}
+
+void vtopt_reset(vtopt_t *vt) {
+    forget(vt);
+}
+
+void vtopt_free(vtopt_t *vt) {
+    free(vt);
+}
+
+// n single-width characters were printed
+static void advance(vtopt_t *vt, int n) {
+    if (vt->col < 0) return;
+    if (vt->wrap) {
+        pos_forget(vt);             // The first one went to the next line
+        return;
+    }
+
+    int col = vt->col + n;
+    if (col < vt->cols) {
+        vt->col = col;
+    } else if (col == vt->cols && vt->autowrap) {
+        vt->col = vt->cols - 1;
+        vt->wrap = 1;
+    } else {
+        pos_forget(vt);
+    }
+}
+
+static void linefeed(vtopt_t *vt) {
+    if (vt->wrap) vt->col = -1;
+    vt->wrap = 0;
+    if (vt->newline) vt->col = 0;
+
+    if (vt->row < 0) return;
+    if (vt->bottom < 0) {
+        vt->row = -1;
+    } else if (vt->row != vt->bottom && vt->row < vt->rows - 1) {
+        vt->row++;
+    }
+}
+
+// Display width of a character where every terminal agrees on it, else -1
+static int char_width(uint32_t cp) {
+    if (cp >= 0xa0 && cp <= 0x2ff) return 1;        // Latin
+    if (cp >= 0x370 && cp <= 0x482) return 1;       // Greek, Cyrillic
+    if (cp >= 0x2500 && cp <= 0x259f) return 1;     // Box drawing, blocks
+    return -1;
+}
+
+// SGR: colors and attributes
+
+// Parse ';'-separated numbers, -1 for an empty one
+// Returns how many, or -1 for sub-parameters or too many
+static int parse_params(const uint8_t *p, size_t len, int *v, int max) {
+    int n = 0;
+    size_t i = 0;
+    for (;;) {
+        if (n == max) return -1;
+        int value = -1;
+        for (; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
+            value = (value < 0 ? 0 : value) * 10 + (p[i] - '0');
+            if (value > 99999) value = 99999;
+        }
+        v[n++] = value;
+        if (i == len) return n;
+        if (p[i] != ';') return -1;
+        i++;
+    }
+}
+
+// Apply SGR parameters
+// Returns whether the result is known
+static int sgr_apply(sgr_t *s, int known, const char *text, size_t len) {
+    int v[32];
+    int n = parse_params((const uint8_t *)text, len, v, 32);
+    if (n < 0) return 0;
+
+    for (int i = 0; i < n; i++) {
+        int p = v[i] < 0 ? 0 : v[i];
+        if (p == 0) {
+            sgr_default(s);
+            known = 1;
+            continue;
+        }
+        if (!known) continue;
+
+        if (p == 38 || p == 48 || p == 58) {
+            uint32_t color;
+            if (i + 2 < n && v[i + 1] == 5 && v[i + 2] >= 0 && v[i + 2] <= 255) {
+                color = COLOR_P256 | (uint32_t)v[i + 2];
+                i += 2;
+            } else if (i + 4 < n && v[i + 1] == 2 && v[i + 2] >= 0 && v[i + 2] <= 255 &&
+                       v[i + 3] >= 0 && v[i + 3] <= 255 && v[i + 4] >= 0 && v[i + 4] <= 255) {
+                color = COLOR_RGB | (uint32_t)v[i + 2] << 16 | (uint32_t)v[i + 3] << 8 | (uint32_t)v[i + 4];
+                i += 4;
+            } else {
+                return 0;
+            }
+            if (p == 38) s->fg = color;
+            else if (p == 48) s->bg = color;
+            else s->ul = color;
+            continue;
+        }
+
+        switch (p) {
+            case 1: s->attrs |= ATTR_BOLD; break;
+            case 2: s->attrs |= ATTR_DIM; break;
+            case 3: s->attrs |= ATTR_ITALIC; break;
+            case 4: s->underline = 1; break;
+            case 5: s->attrs |= ATTR_BLINK; break;
+            case 7: s->attrs |= ATTR_INVERSE; break;
+            case 8: s->attrs |= ATTR_INVISIBLE; break;
+            case 9: s->attrs |= ATTR_STRIKE; break;
+            case 21: s->underline = 2; break;
+            case 22: s->attrs &= ~(ATTR_BOLD | ATTR_DIM); break;
+            case 23: s->attrs &= ~ATTR_ITALIC; break;
+            case 24: s->underline = 0; break;
+            case 25: s->attrs &= ~ATTR_BLINK; break;
+            case 27: s->attrs &= ~ATTR_INVERSE; break;
+            case 28: s->attrs &= ~ATTR_INVISIBLE; break;
+            case 29: s->attrs &= ~ATTR_STRIKE; break;
+            case 39: s->fg = COLOR_DEFAULT; break;
+            case 49: s->bg = COLOR_DEFAULT; break;
+            case 53: s->attrs |= ATTR_OVERLINE; break;
+            case 55: s->attrs &= ~ATTR_OVERLINE; break;
+            case 59: s->ul = COLOR_DEFAULT; break;
+            default:
+                if (p >= 30 && p <= 37) s->fg = COLOR_P16 | (uint32_t)(p - 30);
+                else if (p >= 90 && p <= 97) s->fg = COLOR_P16 | (uint32_t)(p - 90 + 8);
+                else if (p >= 40 && p <= 47) s->bg = COLOR_P16 | (uint32_t)(p - 40);
+                else if (p >= 100 && p <= 107) s->bg = COLOR_P16 | (uint32_t)(p - 100 + 8);
+                else return 0;
+        }
+    }
+    return known;
+}
+
+// Append ";" unless at the start, then the parameters setting a color;
+// base is 30 (foreground), 40 (background) or 50 (underline)
+static char *sgr_color(char *p, char *start, uint32_t color, int base) {
+    if (p != start) *p++ = ';';
+    uint32_t value = color & ~COLOR_MODE;
+
+    switch (color & COLOR_MODE) {
+        case COLOR_P16:
+            p = put_num(p, value < 8 ? base + value : base + 60 + value - 8);
+            break;
+        case COLOR_P256:
+            p = put_num(p, base + 8);
+            memcpy(p, ";5;", 3);
+            p = put_num(p + 3, value);
+            break;
+        case COLOR_RGB:
+            p = put_num(p, base + 8);
+            memcpy(p, ";2;", 3);
+            p = put_num(p + 3, value >> 16);
+            *p++ = ';';
+            p = put_num(p, (value >> 8) & 0xff);
+            *p++ = ';';
+            p = put_num(p, value & 0xff);
+            break;
+        default:
+            p = put_num(p, base + 9);
+    }
+    return p;
+}
+
+static char *sgr_code(char *p, char *start, int code) {
+    if (p != start) *p++ = ';';
+    return put_num(p, code);
+}
+
+// Parameters taking the terminal from attributes from to attributes to
+static char *sgr_diff(char *p, const sgr_t *from, const sgr_t *to) {
+    char *start = p;
+    uint8_t on = to->attrs & ~from->attrs, off = from->attrs & ~to->attrs;
+
+    // 22 clears both bold and dim
+    if (off & (ATTR_BOLD | ATTR_DIM)) {
+        p = sgr_code(p, start, 22);
+        on |= to->attrs & (ATTR_BOLD | ATTR_DIM);
+    }
+    if (on & ATTR_BOLD) p = sgr_code(p, start, 1);
+    if (on & ATTR_DIM) p = sgr_code(p, start, 2);
+    if (on & ATTR_ITALIC) p = sgr_code(p, start, 3);
+    if (off & ATTR_ITALIC) p = sgr_code(p, start, 23);
+    if (to->underline != from->underline) {
+        p = sgr_code(p, start, to->underline == 2 ? 21 : to->underline ? 4 : 24);
+    }
+    if (on & ATTR_BLINK) p = sgr_code(p, start, 5);
+    if (off & ATTR_BLINK) p = sgr_code(p, start, 25);
+    if (on & ATTR_INVERSE) p = sgr_code(p, start, 7);
+    if (off & ATTR_INVERSE) p = sgr_code(p, start, 27);
+    if (on & ATTR_INVISIBLE) p = sgr_code(p, start, 8);
+    if (off & ATTR_INVISIBLE) p = sgr_code(p, start, 28);
+    if (on & ATTR_STRIKE) p = sgr_code(p, start, 9);
+    if (off & ATTR_STRIKE) p = sgr_code(p, start, 29);
+    if (on & ATTR_OVERLINE) p = sgr_code(p, start, 53);
+    if (off & ATTR_OVERLINE) p = sgr_code(p, start, 55);
+    if (to->fg != from->fg) p = sgr_color(p, start, to->fg, 30);
+    if (to->bg != from->bg) p = sgr_color(p, start, to->bg, 40);
+    if (to->ul != from->ul) p = sgr_color(p, start, to->ul, 50);
+    return p;
+}
+
+// Write the pending SGR run as the shortest of: nothing if it changes
+// nothing, the change from the current attributes, a reset followed by
+// the new attributes, or its own parameters joined into one sequence
+static uint8_t *sgr_flush(vtopt_t *vt, uint8_t *o) {
+    if (!vt->grouping) return o;
+    vt->grouping = 0;
+
+    char best[160], cand[160];
+    size_t best_len;
+
+    // Joined; a lone reset needs no parameter
+    best[0] = '\033';
+    best[1] = '[';
+    int bare = vt->group_len == 1 && vt->group_params[0] == '0';
+    memcpy(best + 2, vt->group_params, bare ? 0 : vt->group_len);
+    best_len = 2 + (bare ? 0 : vt->group_len);
+    best[best_len++] = 'm';
+
+    if (vt->group_known) {
+        sgr_t none;
+        sgr_default(&none);
+
+        if (vt->sgr_known && sgr_equal(&vt->sgr, &vt->group)) {
+            best_len = 0;
+        } else {
+            // An empty first parameter is a reset
+            char *p = cand + 2;
+            cand[0] = '\033';
+            cand[1] = '[';
+            if (!sgr_equal(&none, &vt->group)) *p++ = ';';
+            p = sgr_diff(p, &none, &vt->group);
+            *p++ = 'm';
+            if ((size_t)(p - cand) < best_len) {
+                best_len = p - cand;
+                memcpy(best, cand, best_len);
+            }
+
+            if (vt->sgr_known) {
+                p = sgr_diff(cand + 2, &vt->sgr, &vt->group);
+                *p++ = 'm';
+                if ((size_t)(p - cand) < best_len) {
+                    best_len = p - cand;
+                    memcpy(best, cand, best_len);
+                }
+            }
+        }
+    }
+
+    vt->sgr = vt->group;
+    vt->sgr_known = vt->group_known;
+    return put(o, best, best_len);
+}
+
+static uint8_t *sgr_add(vtopt_t *vt, uint8_t *o, const uint8_t *params, size_t len) {
+    if (vt->grouping && vt->group_len + len + 2 > sizeof(vt->group_params)) {
+        o = sgr_flush(vt, o);
+    }
+    if (len + 2 > sizeof(vt->group_params)) {
+        // Too long to join; written as it is
+        o = put(o, vt->seq, vt->seq_len);
+        vt->sgr_known = sgr_apply(&vt->sgr, vt->sgr_known, (const char *)params, len);
+        return o;
+    }
+    if (!vt->grouping) {
+        vt->grouping = 1;
+        vt->group = vt->sgr;
+        vt->group_known = vt->sgr_known;
+        vt->group_len = 0;
+    }
+
+    if (vt->group_len > 0) vt->group_params[vt->group_len++] = ';';
+    if (len == 0) {
+        vt->group_params[vt->group_len++] = '0';
+    } else {
+        memcpy(vt->group_params + vt->group_len, params, len);
+        vt->group_len += len;
+    }
+    vt->group_known = sgr_apply(&vt->group, vt->group_known, (const char *)params, len);
+    return o;
+}
+
+// Runs of spaces
+
+// Whether spaces at the cursor could be erased instead: nothing about
+// the current attributes shows on a blank cell, and printing them
+// neither shifts the line nor wraps
+static int blank_safe(const vtopt_t *vt) {
+    return vt->col >= 0 && !vt->wrap && vt->sgr_known && !vt->insert && vt->autowrap &&
+           !vt->margins_lr && !vt->sgr.underline && !(vt->sgr.attrs & ATTR_SHOW_BLANK);
+}
+
+static size_t csi_num(char *buf, int n, char final) {
+    char *p = buf;
+    *p++ = '\033';
+    *p++ = '[';
+    if (n > 1) p = put_num(p, n);
+    *p++ = final;
+    return p - buf;
+}
+
+static uint8_t *spaces_flush(vtopt_t *vt, uint8_t *o, int next) {
+    int n = vt->spaces;
+    if (!n) return o;
+    vt->spaces = 0;
+
+    int end = vt->space_col + n;
+    char seq[32];
+    size_t len = 0;
+
+    // ECH erases without moving; EL erases to the margin
+    if (next == NEXT_MOVE) {
+        len = end == vt->cols ? 3 : csi_num(seq, n, 'X');
+        if (end == vt->cols) memcpy(seq, "\033[K", 3);
+        if (len < (size_t)n) {
+            vt->col = vt->space_col;
+            return put(o, seq, len);
+        }
+    } else if (next == NEXT_PRINT && end < vt->cols) {
+        len = csi_num(seq, n, 'X');
+        len += csi_num(seq + len, n, 'C');
+        if (len < (size_t)n) {
+            vt->col = end;
+            return put(o, seq, len);
+        }
+    }
+
+    memset(o, ' ', n);
+    vt->col = vt->space_col;
+    advance(vt, n);
+    return o + n;
+}
+
+// Write what is pending before something of kind next
+static uint8_t *settle(vtopt_t *vt, uint8_t *o, int next) {
+    o = sgr_flush(vt, o);
+    return spaces_flush(vt, o, next);
+}
+
+// Cursor movement
+
+static void consider(char *best, size_t *best_len, const char *cand, size_t len) {
+    if (len < *best_len) {
+        memcpy(best, cand, len);
+        *best_len = len;
+    }
+}
+
+// Move the cursor to row, col on the screen, which seq (len bytes) does
+// too, the shortest way there is from where it is
+static uint8_t *move_to(vtopt_t *vt, uint8_t *o, int row, int col, const char *seq, size_t len) {
+    char best[32], cand[32];
+    size_t best_len = len;
+    memcpy(best, seq, len);
+
+    if (vt->row >= 0 && vt->col >= 0 && !vt->origin && !vt->margins_lr) {
+        if (row == vt->row && col == vt->col && !vt->wrap) {
+            best_len = 0;
+        }
+        if (row == vt->row && col == 0) consider(best, &best_len, "\r", 1);
+        if (row == vt->row && col > vt->col && !vt->wrap) {
+            consider(best, &best_len, cand, csi_num(cand, col - vt->col, 'C'));
+        }
+        if (row == vt->row && col < vt->col && !vt->wrap) {
+            consider(best, &best_len, cand, csi_num(cand, vt->col - col, 'D'));
+        }
+
+        // A line feed that does not scroll
+        if (row == vt->row + 1 && vt->bottom >= 0 && vt->row != vt->bottom &&
+            row < vt->rows && !vt->newline) {
+            if (col == 0) consider(best, &best_len, "\r\n", 2);
+            if (col == vt->col && !vt->wrap) consider(best, &best_len, "\n", 1);
+        }
+
+        // Up and down stop at the margins
+        if (col == vt->col && !vt->wrap && vt->top >= 0) {
+            int limit = vt->row >= vt->top ? vt->top : 0;
+            if (row < vt->row && row >= limit) {
+                consider(best, &best_len, cand, csi_num(cand, vt->row - row, 'A'));
+            }
+            limit = vt->row <= vt->bottom ? vt->bottom : vt->rows - 1;
+            if (row > vt->row && row <= limit) {
+                consider(best, &best_len, cand, csi_num(cand, row - vt->row, 'B'));
+            }
+        }
+    }
+
+    vt->row = row;
+    vt->col = col;
+    vt->wrap = 0;
+    return put(o, best, best_len);
+}
+
+static void set_mode(vtopt_t *vt, int mode, int on) {
+    if (mode == 4) vt->insert = on;
+    else if (mode == 20) vt->newline = on;
+}
+
+static void set_private_mode(vtopt_t *vt, int mode, int on) {
+    switch (mode) {
+        case 6:                     // Origin mode, which homes the cursor
+            vt->origin = on;
+            pos_forget(vt);
+            break;
+        case 7:
+            vt->autowrap = on;
+            break;
+        case 69:                    // Left and right margins
+            vt->margins_lr = on;
+            pos_forget(vt);
+            break;
+        case 3:                     // 80/132 columns
+        case 1047:                  // Alternate screen, saving the cursor
+        case 1048:
+        case 1049:
+            forget(vt);
+            break;
+    }
+}
+
+// A CSI sequence with a private marker or intermediates
+static void csi_other(vtopt_t *vt, uint8_t priv, uint8_t inter, uint8_t final,
+                      const int *v, int n) {
+    if (priv == '?' && (final == 'h' || final == 'l') && !inter) {
+        for (int i = 0; i < n; i++) set_private_mode(vt, v[i], final == 'h');
+    } else if (priv == '?' && final == 'r') {
+        forget(vt);                 // Restores modes saved earlier
+    } else if (priv && !inter) {
+        // Reports, keyboard and selective-erase modes
+    } else if (!priv && inter == ' ' && final == 'q') {
+        // Cursor style
+    } else if (!priv && inter == '!' && final == 'p') {
+        // Soft reset: modes and attributes, but not the cursor
+        reset_state(vt);
+        forget(vt);
+        vt->sgr_known = 1;
+        vt->g0_ascii = 1;
+    } else {
+        forget(vt);
+    }
+}
+
+static uint8_t *csi_dispatch(vtopt_t *vt, uint8_t *o) {
+    uint8_t final = vt->seq[vt->seq_len - 1];
+    const uint8_t *p = vt->seq + 2, *end = vt->seq + vt->seq_len - 1;
+    uint8_t priv = 0, inter = 0;
+
+    if (p < end && *p >= '<' && *p <= '?') priv = *p++;
+    const uint8_t *params = p;
+    while (p < end && *p >= '0' && *p <= ';') p++;
+    size_t params_len = p - params;
+    if (p < end) inter = p + 1 == end ? *p : 0xff;
+
+    if (!priv && !inter && final == 'm') {
+        if (vt->spaces) o = spaces_flush(vt, o, NEXT_OTHER);
+        return sgr_add(vt, o, params, params_len);
+    }
+
+    int move = !priv && !inter && (final == 'H' || final == 'f' || final == 'G' || final == '`');
+    o = settle(vt, o, move ? NEXT_MOVE : NEXT_OTHER);
+
+    int v[16];
+    int n = parse_params(params, params_len, v, 16);
+    if (priv || inter || n < 0) {
+        if (n >= 0) csi_other(vt, priv, inter, final, v, n);
+        else forget(vt);
+        return put(o, vt->seq, vt->seq_len);
+    }
+
+    int a = v[0] > 0 ? v[0] : 1;    // First parameter where it defaults to 1
+    char seq[32];
+    size_t len = vt->seq_len;
+    memcpy(seq, vt->seq, len);
+
+    switch (final) {
+        case 'H':
+        case 'f': {
+            int b = n > 1 && v[1] > 0 ? v[1] : 1;
+            if (n <= 2) {
+                char *q = seq + 2;
+                if (a > 1) q = put_num(q, a);
+                if (b > 1) {
+                    *q++ = ';';
+                    q = put_num(q, b);
+                }
+                *q++ = 'H';
+                if ((size_t)(q - seq) > vt->seq_len) {
+                    len = vt->seq_len;
+                    memcpy(seq, vt->seq, len);
+                } else {
+                    len = q - seq;
+                }
+            }
+            if (vt->origin || a > vt->rows || b > vt->cols) {
+                pos_forget(vt);
+                return put(o, seq, len);
+            }
+            return move_to(vt, o, a - 1, b - 1, seq, len);
+        }
+
+        case 'G':
+        case '`':
+            if (n == 1 && csi_num(seq, a, final) < vt->seq_len) len = csi_num(seq, a, final);
+            if (a > vt->cols) {
+                pos_forget(vt);
+                return put(o, seq, len);
+            }
+            if (vt->row >= 0) return move_to(vt, o, vt->row, a - 1, seq, len);
+            vt->col = a - 1;
+            vt->wrap = 0;
+            return put(o, seq, len);
+
+        case 'd':
+            if (n == 1 && csi_num(seq, a, final) < vt->seq_len) len = csi_num(seq, a, final);
+            if (vt->origin || a > vt->rows) {
+                pos_forget(vt);
+            } else if (vt->col >= 0 && !vt->wrap) {
+                return move_to(vt, o, a - 1, vt->col, seq, len);
+            } else {
+                vt->row = a - 1;
+                vt->wrap = 0;
+            }
+            return put(o, seq, len);
+
+        case 'A':
+        case 'B':
+        case 'C':
+        case 'D':
+        case 'E':
+        case 'F':
+        case 'X':
+        case 'P':
+        case '@':
+        case 'L':
+        case 'M':
+        case 'S':
+        case 'T':
+            if (n == 1 && csi_num(seq, a, final) < vt->seq_len) len = csi_num(seq, a, final);
+            break;
+
+        case 'J':
+        case 'K':
+            if (n == 1 && v[0] <= 0) {
+                seq[2] = final;
+                len = 3;
+            }
+            break;
+    }
+
+    // What each does to the cursor
+    int wrapped = vt->wrap;
+    switch (final) {
+        case 'A':
+            vt->wrap = 0;
+            if (vt->row >= 0 && vt->top >= 0) {
+                int limit = vt->row >= vt->top ? vt->top : 0;
+                vt->row = vt->row - a < limit ? limit : vt->row - a;
+            } else {
+                vt->row = -1;
+            }
+            break;
+        case 'B':
+            vt->wrap = 0;
+            if (vt->row >= 0 && vt->bottom >= 0) {
+                int limit = vt->row <= vt->bottom ? vt->bottom : vt->rows - 1;
+                vt->row = vt->row + a > limit ? limit : vt->row + a;
+            } else {
+                vt->row = -1;
+            }
+            break;
+        case 'C':
+        case 'D':
+            if (wrapped || vt->col < 0) {
+                pos_forget(vt);
+                vt->row = -1;
+            } else {
+                vt->col = clamp(final == 'C' ? vt->col + a : vt->col - a, vt->cols - 1);
+            }
+            break;
+        case 'E':
+        case 'F':
+            vt->row = -1;
+            vt->col = 0;
+            vt->wrap = 0;
+            break;
+        case 'J':
+        case 'K':
+        case 'X':
+        case 'P':
+        case '@':
+        case 'S':
+        case 'T':
+            if (wrapped) vt->col = -1;
+            vt->wrap = 0;
+            break;
+        case 'L':
+        case 'M':
+            vt->col = -1;
+            vt->wrap = 0;
+            break;
+        case 'r': {
+            int top = a, bottom = n > 1 && v[1] > 0 ? v[1] : vt->rows;
+            if (top < bottom && bottom <= vt->rows) {
+                vt->top = top - 1;
+                vt->bottom = bottom - 1;
+                vt->row = vt->origin ? -1 : 0;
+                vt->col = 0;
+                vt->wrap = 0;
+            } else {
+                vt->top = vt->bottom = -1;
+                pos_forget(vt);
+            }
+            break;
+        }
+        case 'h':
+        case 'l':
+            for (int i = 0; i < n; i++) set_mode(vt, v[i], final == 'h');
+            break;
+        case 's':
+        case 'n':
+        case 'c':
+        case 't':
+        case 'g':
+        case 'i':
+        case 'x':
+        case 'q':
+            break;
+        case 'u':
+            pos_forget(vt);
+            break;
+        default:
+            forget(vt);
+    }
+    return put(o, seq, len);
+}
+
+static uint8_t *esc_dispatch(vtopt_t *vt, uint8_t *o) {
+    o = settle(vt, o, NEXT_OTHER);
+    uint8_t final = vt->seq[vt->seq_len - 1];
+    uint8_t inter = vt->seq_len == 3 ? vt->seq[1] : vt->seq_len > 3 ? 0xff : 0;
+
+    if (inter == '(') {
+        if (final == 'B') {
+            if (vt->g0_ascii) return o;
+            vt->g0_ascii = 1;
+        } else {
+            vt->g0_ascii = 0;
+        }
+    } else if (inter == ')' || inter == '*' || inter == '+' || inter == '-' ||
+               inter == '.' || inter == '/') {
+        // Other character sets
+    } else if (inter) {
+        forget(vt);
+    } else {
+        switch (final) {
+            case '7':
+            case '=':
+            case '>':
+            case 'H':
+            case 'N':
+            case 'O':
+            case '\\':
+                break;
+            case 'D':
+            case 'M':
+                vt->row = -1;
+                if (vt->wrap) vt->col = -1;
+                vt->wrap = 0;
+                break;
+            case 'E':
+                vt->row = -1;
+                vt->col = 0;
+                vt->wrap = 0;
+                break;
+            case 'c':
+                reset_state(vt);
+                break;
+            default:
+                forget(vt);
+        }
+    }
+    return put(o, vt->seq, vt->seq_len);
+}
+
+static void execute(vtopt_t *vt, uint8_t c) {
+    switch (c) {
+        case '\r':
+            vt->col = 0;
+            vt->wrap = 0;
+            break;
+        case '\n':
+        case '\v':
+        case '\f':
+            linefeed(vt);
+            break;
+        case '\b':
+            if (vt->col > 0 && !vt->wrap) vt->col--;
+            else pos_forget(vt);
+            break;
+        case '\t':
+        case 0x1a:                  // SUB prints a substitute
+            vt->col = -1;
+            vt->wrap = 0;
+            break;
+    }
+}
+
+// A byte of a UTF-8 character; returns with the cursor moved once it
+// is complete
+static void utf8_byte(vtopt_t *vt, uint8_t c) {
+    if (c >= 0xc2 && c <= 0xf4) {
+        if (vt->cp_need) pos_forget(vt);
+        vt->cp_need = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+        vt->cp = c & (c >= 0xf0 ? 0x07 : c >= 0xe0 ? 0x0f : 0x1f);
+        return;
+    }
+    if (c >= 0x80 && c <= 0xbf && vt->cp_need) {
+        vt->cp = vt->cp << 6 | (c & 0x3f);
+        if (--vt->cp_need) return;
+
+        // U+0080-U+009F are C1 controls to some terminals
+        if (vt->cp < 0xa0) forget(vt);
+        else if (char_width(vt->cp) == 1) advance(vt, 1);
+        else pos_forget(vt);
+        return;
+    }
+    vt->cp_need = 0;
+    pos_forget(vt);
+}
+
+// Write the held sequence, or the byte of one that no longer fits
+static uint8_t *collect(vtopt_t *vt, uint8_t *o, uint8_t c) {
+    if (vt->spilled) {
+        *o++ = c;
+        return o;
+    }
+    if (vt->seq_len < VTOPT_HELD_MAX) {
+        vt->seq[vt->seq_len++] = c;
+        return o;
+    }
+
+    o = settle(vt, o, NEXT_OTHER);
+    o = put(o, vt->seq, vt->seq_len);
+    *o++ = c;
+    vt->seq_len = 0;
+    vt->spilled = 1;
+    return o;
+}
+
+// Write whatever of the current sequence is held, unchanged
+static uint8_t *release(vtopt_t *vt, uint8_t *o) {
+    o = put(o, vt->seq, vt->seq_len);
+    vt->seq_len = 0;
+    vt->spilled = 0;
+    return o;
+}
+
+size_t vtopt_rewrite(vtopt_t *vt, const uint8_t *in, size_t len, uint8_t *out) {
+    uint8_t *o = out;
+    size_t i = 0;
+
+    while (i < len) {
+        uint8_t c = in[i];
+
+        // Runs of printable ASCII other than spaces, the bulk of output
+        if (vt->state == ST_GROUND && c > ' ' && c < 0x7f) {
+            size_t j = i + 1;
+            while (j < len && in[j] > ' ' && in[j] < 0x7f) j++;
+
+            if (vt->cp_need) {
+                vt->cp_need = 0;
+                pos_forget(vt);
+            }
+            o = settle(vt, o, NEXT_PRINT);
+            o = put(o, in + i, j - i);
+            advance(vt, (int)(j - i));
+            i = j;
+            continue;
+        }
+
+        uint8_t entry = transitions[vt->state][byte_class[c]];
+        uint8_t action = entry >> 4;
+        vt->state = entry & 0x0f;
+
+        if (vt->cp_need && action != AC_UTF8) {
+            vt->cp_need = 0;
+            pos_forget(vt);
+        }
+
+        switch (action) {
+            case AC_DROP:
+                break;
+
+            case AC_PRINT:
+                // c is a space
+                o = sgr_flush(vt, o);
+                if (vt->spaces && vt->space_col + vt->spaces < vt->cols) {
+                    vt->spaces++;
+                    break;
+                }
+                o = spaces_flush(vt, o, NEXT_OTHER);
+                if (blank_safe(vt)) {
+                    vt->spaces = 1;
+                    vt->space_col = vt->col;
+                    break;
+                }
+                *o++ = c;
+                advance(vt, 1);
+                break;
+
+            case AC_UTF8:
+                o = settle(vt, o, NEXT_PRINT);
+                *o++ = c;
+                utf8_byte(vt, c);
+                break;
+
+            case AC_EXEC:
+                o = settle(vt, o, c == '\r' ? NEXT_MOVE : NEXT_OTHER);
+                *o++ = c;
+                execute(vt, c);
+                break;
+
+            case AC_START:
+                // A sequence cut short by ESC goes out as it was
+                if (vt->seq_len || vt->spilled) o = settle(vt, o, NEXT_OTHER);
+                o = release(vt, o);
+                vt->seq[0] = c;
+                vt->seq_len = 1;
+                break;
+
+            case AC_COLLECT:
+                o = collect(vt, o, c);
+                break;
+
+            case AC_ESC_DISPATCH:
+            case AC_CSI_DISPATCH:
+                if (vt->spilled) {
+                    *o++ = c;
+                    vt->spilled = 0;
+                    forget(vt);
+                    break;
+                }
+                vt->seq[vt->seq_len++] = c;
+                o = action == AC_ESC_DISPATCH ? esc_dispatch(vt, o) : csi_dispatch(vt, o);
+                vt->seq_len = 0;
+                break;
+
+            case AC_IGNORE_END:
+            case AC_CANCEL:
+            case AC_INVALID:
+                o = settle(vt, o, NEXT_OTHER);
+                o = release(vt, o);
+                *o++ = c;
+                if (action == AC_CANCEL) execute(vt, c);
+                else forget(vt);
+                break;
+
+            case AC_STR_START:
+                o = settle(vt, o, NEXT_OTHER);
+                o = release(vt, o);
+                *o++ = c;
+                vt->string_osc = c == ']';
+                break;
+
+            case AC_STR_PUT:
+                *o++ = c;
+                break;
+
+            case AC_STR_BEL:
+                *o++ = c;
+                if (vt->string_osc) vt->state = ST_GROUND;
+                break;
+
+            case AC_STR_END:
+                if (c == '\\') *o++ = '\033';
+                *o++ = c;
+                break;
+
+            case AC_STR_BREAK:
+                // The ESC ended the string and starts a sequence; c is
+                // read again in that sequence
+                vt->seq[0] = '\033';
+                vt->seq_len = 1;
+                continue;
+        }
+        i++;
+    }
+
+    // Nothing is held for bytes that may be a while coming, except an
+    // unfinished sequence
+    o = settle(vt, o, NEXT_OTHER);
+    return o - out;
+}
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+
+#include "warm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+struct warm_session;
+
+// A tmux client waiting to be taken
+typedef struct spare {
+    watcher_t pty;              // Output, read and thrown away
+    terminal_t terminal;
+    int ready;                  // Has drawn, so it is attached
+    warm_pool_t *pool;
+    struct warm_session *session;
+    struct spare *next;
+} spare_t;
+
+typedef struct warm_session {
+    char *name;                 // NULL for a free slot
+    spare_t *spares;
+    int count;
+    int keep;                   // Never dropped for going unused
+    uint64_t used_ms;           // Last wanted
+    uint64_t failed_ms;         // Last time a spare exited unused, 0 if never
+} warm_session_t;
+
+// tmux refresh-client clearing the ignore-size flag of a taken spare
+typedef struct helper {
+    watcher_t child;            // The command's pidfd
+    pid_t pid;
+    int client_fd;              // pidfd of the taken tmux client
+    warm_pool_t *pool;
+    struct helper *next;
+} helper_t;
+
+struct warm_pool {
+    worker_t *worker;
+    int size;                   // Spares per session
+    warm_release_cb release;
+    warm_session_t sessions[WARM_SESSIONS_MAX];
+    helper_t *helpers;
+    char scratch[4096];         // Discarded output
+};
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+static void pidfd_signal(int pid_fd, int sig) {
+#ifdef SYS_pidfd_send_signal
+    syscall(SYS_pidfd_send_signal, pid_fd, sig, NULL, 0);
+#else
+    (void)pid_fd;
+    (void)sig;
+#endif
+}
+
+warm_pool_t *warm_pool_new(worker_t *worker, int size, warm_release_cb release) {
+    warm_pool_t *pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+
+    pool->worker = worker;
+    pool->size = size;
+    pool->release = release;
+    return pool;
+}
+
+static void spare_drop(spare_t *spare, int failed) {
+    warm_session_t *session = spare->session;
+    warm_pool_t *pool = spare->pool;
+
+    spare_t **link = &session->spares;
+    while (*link != spare) link = &(*link)->next;
+    *link = spare->next;
+    session->count--;
+    if (failed) session->failed_ms = worker_now_ms();
+
+    worker_unwatch(&spare->pty);
+    pool->release(pool->worker, &spare->terminal);
+    free(spare);
+}
+
+static void on_spare_pty(watcher_t *watcher, uint32_t events) {
+    (void)events;
+    spare_t *spare = (spare_t *)watcher;
+
+    ssize_t n = terminal_read(&spare->terminal, spare->pool->scratch, sizeof(spare->pool->scratch));
+    if (n > 0) spare->ready = 1;
+    if (n < 0) spare_drop(spare, 1);  // The tmux client exited
+}
+
+static void spare_start(warm_pool_t *pool, warm_session_t *session) {
+    spare_t *spare = calloc(1, sizeof(*spare));
+    if (!spare) return;
+
+    if (terminal_create_spare(&spare->terminal, session->name) < 0) {
+        session->failed_ms = worker_now_ms();
+        free(spare);
+        return;
+    }
+    if (worker_watch(pool->worker, &spare->pty, spare->terminal.master_fd, EPOLLIN,
+                     on_spare_pty) < 0) {
+        pool->release(pool->worker, &spare->terminal);
+        free(spare);
+        return;
+    }
+
+    spare->pool = pool;
+    spare->session = session;
+    spare->next = session->spares;
+    session->spares = spare;
+    session->count++;
+}
+
+static void session_drop(warm_session_t *session) {
+    while (session->spares) {
+        spare_drop(session->spares, 0);
+    }
+    free(session->name);
+    memset(session, 0, sizeof(*session));
+}
+
+static warm_session_t *session_find(warm_pool_t *pool, const char *name) {
+    for (int i = 0; i < WARM_SESSIONS_MAX; i++) {
+        if (pool->sessions[i].name && strcmp(pool->sessions[i].name, name) == 0) {
+            return &pool->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+void warm_want(warm_pool_t *pool, const char *session, int keep) {
+    if (pool->size <= 0) return;
+
+    warm_session_t *s = session_find(pool, session);
+    if (!s) {
+        // A free slot, else the one unused the longest
+        for (int i = 0; i < WARM_SESSIONS_MAX; i++) {
+            warm_session_t *slot = &pool->sessions[i];
+            if (!slot->name) {
+                s = slot;
+                break;
+            }
+            if (!slot->keep && (!s || slot->used_ms < s->used_ms)) s = slot;
+        }
+        if (!s) return;
+        if (s->name) session_drop(s);
+
+        s->name = strdup(session);
+        if (!s->name) return;
+    }
+
+    s->used_ms = worker_now_ms();
+    if (keep) s->keep = 1;
+}
+
+static void helper_free(warm_pool_t *pool, helper_t *helper) {
+    helper_t **link = &pool->helpers;
+    while (*link != helper) link = &(*link)->next;
+    *link = helper->next;
+
+    worker_unwatch(&helper->child);
+    while (waitpid(helper->pid, NULL, 0) < 0 && errno == EINTR) {}
+
+    // With the flag gone, the size the client reports counts
+    pidfd_signal(helper->client_fd, SIGWINCH);
+    close(helper->child.fd);
+    close(helper->client_fd);
+    free(helper);
+}
+
+static void on_helper_exit(watcher_t *watcher, uint32_t events) {
+    (void)events;
+    helper_t *helper = (helper_t *)watcher;
+    helper_free(helper->pool, helper);
+}
+
+// Clear a taken spare's ignore-size flag without waiting for tmux
+static void spare_claim(warm_pool_t *pool, terminal_t *term) {
+    char *args[] = { "tmux", "refresh-client", "-t", term->tty_name, "-f", "!ignore-size", NULL };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    // Without the server's blocked signals
+    posix_spawnattr_t attr;
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, "tmux", &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        perror("posix_spawnp tmux refresh-client");
+        return;
+    }
+
+    helper_t *helper = malloc(sizeof(*helper));
+    int pid_fd = open_pidfd(pid);
+    int client_fd = term->pid_fd >= 0 ? fcntl(term->pid_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (!helper || pid_fd < 0 || client_fd < 0 ||
+        worker_watch(pool->worker, &helper->child, pid_fd, EPOLLIN, on_helper_exit) < 0) {
+        // Wait for it here instead
+        free(helper);
+        if (pid_fd >= 0) close(pid_fd);
+        if (client_fd >= 0) close(client_fd);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {}
+        kill(term->pid, SIGWINCH);
+        return;
+    }
+
+    helper->pid = pid;
+    helper->client_fd = client_fd;
+    helper->pool = pool;
+    helper->next = pool->helpers;
+    pool->helpers = helper;
+}
+
+int warm_take(warm_pool_t *pool, const char *session, terminal_t *term) {
+    warm_want(pool, session, 0);
+    warm_session_t *s = session_find(pool, session);
+    if (!s) return -1;
+
+    spare_t *spare = s->spares;
+    while (spare && !spare->ready) spare = spare->next;
+    if (!spare) return -1;
+
+    // What it drew while it waited is stale; the redraw replaces it
+    while (terminal_read(&spare->terminal, pool->scratch, sizeof(pool->scratch)) > 0) {}
+    if (!terminal_is_running(&spare->terminal)) {
+        spare_drop(spare, 1);
+        return -1;
+    }
+
+    spare_t **link = &s->spares;
+    while (*link != spare) link = &(*link)->next;
+    *link = spare->next;
+    s->count--;
+    worker_unwatch(&spare->pty);
+
+    *term = spare->terminal;
+    term->session_name = session;
+    free(spare);
+
+    terminal_redraw(term);
+    spare_claim(pool, term);
+    return 0;
+}
+
+void warm_tick(warm_pool_t *pool) {
+    uint64_t now = worker_now_ms();
+
+    // One new spare per session and tick keeps forks spread out
+    for (int i = 0; i < WARM_SESSIONS_MAX; i++) {
+        warm_session_t *s = &pool->sessions[i];
+        if (!s->name) continue;
+
+        if (!s->keep && now - s->used_ms >= WARM_IDLE_MS) {
+            session_drop(s);
+            continue;
+        }
+        if (s->count >= pool->size) continue;
+        if (s->failed_ms && now - s->failed_ms < WARM_RETRY_MS) continue;
+        spare_start(pool, s);
+    }
+}
+
+void warm_pool_free(warm_pool_t *pool) {
+    if (!pool) return;
+
+    for (int i = 0; i < WARM_SESSIONS_MAX; i++) {
+        if (pool->sessions[i].name) session_drop(&pool->sessions[i]);
+    }
+    while (pool->helpers) {
+        helper_free(pool, pool->helpers);
+    }
+    free(pool);
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <openssl/sha.h>
 
 // WebSocket magic GUID for handshake
@@ -60,7 +61,7 @@ int ws_generate_accept_key(const char *client_key, char *accept_key, size_t acce
     return base64_encode(sha1_hash, SHA_DIGEST_LENGTH, accept_key, accept_key_size);
 }
 
-int ws_parse_frame(const uint8_t *data, size_t data_len, ws_frame_t *frame, size_t *consumed) {
+int ws_parse_frame(uint8_t *data, size_t data_len, ws_frame_t *frame, size_t *consumed) {
     if (data_len < 2) {
         return -1; // Need more data
     }
@@ -103,40 +104,20 @@ int ws_parse_frame(const uint8_t *data, size_t data_len, ws_frame_t *frame, size
         return -1; // Need more data
     }
 
-    // Allocate and copy/unmask payload
-    frame->payload = malloc(payload_len + 1);
-    if (!frame->payload) return -2;
-
-    for (size_t i = 0; i < payload_len; i++) {
-        if (masked) {
-            frame->payload[i] = data[offset + i] ^ mask_key[i % 4];
-        } else {
-            frame->payload[i] = data[offset + i];
+    // Unmask in place; the payload is used straight from the read buffer
+    frame->payload = data + offset;
+    if (masked) {
+        for (size_t i = 0; i < payload_len; i++) {
+            frame->payload[i] ^= mask_key[i % 4];
         }
     }
-    frame->payload[payload_len] = '\0';
     frame->payload_len = payload_len;
 
     *consumed = offset + payload_len;
     return 0;
 }
 
-int ws_build_frame(uint8_t opcode, const uint8_t *payload, size_t payload_len,
-                   uint8_t *out, size_t out_size, size_t *out_len) {
-    size_t header_len;
-
-    if (payload_len < 126) {
-        header_len = 2;
-    } else if (payload_len < 65536) {
-        header_len = 4;
-    } else {
-        header_len = 10;
-    }
-
-    if (out_size < header_len + payload_len) {
-        return -1;
-    }
-
+size_t ws_build_header(uint8_t opcode, size_t payload_len, uint8_t *out) {
     size_t offset = 0;
 
     // FIN + Opcode
@@ -156,6 +137,66 @@ int ws_build_frame(uint8_t opcode, const uint8_t *payload, size_t payload_len,
         }
     }
 
+    return offset;
+}
+
+size_t ws_frame_size(const uint8_t *data, size_t data_len) {
+    if (data_len < 2) return 0;
+
+    size_t header_len = (data[1] & 0x80) ? 6 : 2;
+    size_t payload_len = data[1] & 0x7F;
+
+    if (payload_len == 126) {
+        if (data_len < 4) return 0;
+        payload_len = (data[2] << 8) | data[3];
+        header_len += 2;
+    } else if (payload_len == 127) {
+        if (data_len < 10) return 0;
+        payload_len = 0;
+        for (int i = 0; i < 8; i++) {
+            payload_len = (payload_len << 8) | data[2 + i];
+        }
+        header_len += 8;
+    }
+
+    return header_len + payload_len;
+}
+
+size_t ws_payload_bytes(const uint8_t *data, size_t data_len, uint8_t opcode) {
+    size_t total = 0;
+    size_t offset = 0;
+    while (offset < data_len) {
+        size_t size = ws_frame_size(data + offset, data_len - offset);
+        if (size == 0 || size > data_len - offset) break;
+
+        const uint8_t *frame = data + offset;
+        size_t header_len = (frame[1] & 0x80) ? 6 : 2;
+        if ((frame[1] & 0x7F) == 126) header_len += 2;
+        else if ((frame[1] & 0x7F) == 127) header_len += 8;
+        if ((frame[0] & 0x0F) == opcode) total += size - header_len;
+        offset += size;
+    }
+    return total;
+}
+
+int ws_build_frame(uint8_t opcode, const uint8_t *payload, size_t payload_len,
+                   uint8_t *out, size_t out_size, size_t *out_len) {
+    size_t header_len;
+
+    if (payload_len < 126) {
+        header_len = 2;
+    } else if (payload_len < 65536) {
+        header_len = 4;
+    } else {
+        header_len = 10;
+    }
+
+    if (out_size < header_len + payload_len) {
+        return -1;
+    }
+
+    size_t offset = ws_build_header(opcode, payload_len, out);
+
     // Copy payload
     memcpy(out + offset, payload, payload_len);
 
@@ -163,57 +204,30 @@ int ws_build_frame(uint8_t opcode, const uint8_t *payload, size_t payload_len,
     return 0;
 }
 
-int ws_send_text(int fd, const char *text, size_t len) {
-    uint8_t *frame = malloc(len + 14);
-    if (!frame) return -1;
-
-    size_t frame_len;
-    int ret = ws_build_frame(WS_OPCODE_TEXT, (const uint8_t *)text, len, frame, len + 14, &frame_len);
-    if (ret < 0) {
-        free(frame);
-        return ret;
-    }
+// Write header and payload with one syscall, without copying the payload
+static int ws_send_frame(int fd, uint8_t opcode, const uint8_t *data, size_t len) {
+    uint8_t header[WS_MAX_HEADER];
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = ws_build_header(opcode, len, header) },
+        { .iov_base = (void *)data, .iov_len = len },
+    };
 
-    ssize_t written = write(fd, frame, frame_len);
-    free(frame);
-    return (written == (ssize_t)frame_len) ? 0 : -1;
+    ssize_t written = writev(fd, iov, len > 0 ? 2 : 1);
+    return (written == (ssize_t)(iov[0].iov_len + len)) ? 0 : -1;
 }
 
-int ws_send_binary(int fd, const uint8_t *data, size_t len) {
-    uint8_t *frame = malloc(len + 14);
-    if (!frame) return -1;
-
-    size_t frame_len;
-    int ret = ws_build_frame(WS_OPCODE_BIN, data, len, frame, len + 14, &frame_len);
-    if (ret < 0) {
-        free(frame);
-        return ret;
-    }
+int ws_send_text(int fd, const char *text, size_t len) {
+    return ws_send_frame(fd, WS_OPCODE_TEXT, (const uint8_t *)text, len);
+}
 
-    ssize_t written = write(fd, frame, frame_len);
-    free(frame);
-    return (written == (ssize_t)frame_len) ? 0 : -1;
+int ws_send_binary(int fd, const uint8_t *data, size_t len) {
+    return ws_send_frame(fd, WS_OPCODE_BIN, data, len);
 }
 
 int ws_send_close(int fd) {
-    uint8_t frame[4];
-    size_t frame_len;
-    ws_build_frame(WS_OPCODE_CLOSE, NULL, 0, frame, sizeof(frame), &frame_len);
-    return write(fd, frame, frame_len) > 0 ? 0 : -1;
+    return ws_send_frame(fd, WS_OPCODE_CLOSE, NULL, 0);
 }
 
 int ws_send_pong(int fd, const uint8_t *data, size_t len) {
-    uint8_t *frame = malloc(len + 14);
-    if (!frame) return -1;
-
-    size_t frame_len;
-    int ret = ws_build_frame(WS_OPCODE_PONG, data, len, frame, len + 14, &frame_len);
-    if (ret < 0) {
-        free(frame);
-        return ret;
-    }
-
-    ssize_t written = write(fd, frame, frame_len);
-    free(frame);
-    return (written == (ssize_t)frame_len) ? 0 : -1;
+    return ws_send_frame(fd, WS_OPCODE_PONG, data, len);
 }
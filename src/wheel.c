@@ -0,0 +1,65 @@
+#include "wheel.h"
+#include <string.h>
+
+static void timer_link(wheel_timer_t **head, wheel_timer_t *timer) {
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+void wheel_init(timer_wheel_t *wheel, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now_ms / WHEEL_TICK_MS;
+}
+
+void wheel_start(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t due_ms, wheel_cb cb) {
+    wheel_stop(timer);
+
+    // Rounded up, so a timer never fires early
+    uint64_t due = (due_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (due <= wheel->now) due = wheel->now + 1;
+
+    timer->due = due;
+    timer->cb = cb;
+    timer_link(&wheel->slots[due & (WHEEL_SLOTS - 1)], timer);
+}
+
+void wheel_stop(wheel_timer_t *timer) {
+    if (!timer->pprev) return;
+
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void wheel_advance(timer_wheel_t *wheel, uint64_t now_ms) {
+    uint64_t target = now_ms / WHEEL_TICK_MS;
+    if (target <= wheel->now) return;
+
+    // After a long stall one pass over every slot catches up
+    if (target - wheel->now > WHEEL_SLOTS) wheel->now = target - WHEEL_SLOTS;
+
+    // Due timers move to a list of their own first: a callback may stop
+    // or restart any of them, which unlinks it from there
+    wheel_timer_t *fired = NULL;
+    while (wheel->now < target) {
+        wheel->now++;
+        wheel_timer_t *timer = wheel->slots[wheel->now & (WHEEL_SLOTS - 1)];
+        while (timer) {
+            wheel_timer_t *next = timer->next;
+            if (timer->due <= target) {
+                wheel_stop(timer);
+                timer_link(&fired, timer);
+            }
+            timer = next;
+        }
+    }
+
+    while (fired) {
+        wheel_timer_t *timer = fired;
+        wheel_stop(timer);
+        timer->cb(timer);
+    }
+}
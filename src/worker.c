@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+
+#include "worker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MAX_EVENTS 64
+
+uint64_t worker_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Vyukov's intrusive MPSC queue: producers only swap the head pointer,
+// the consumer walks from the tail and never takes a lock
+
+static void task_queue_init(task_queue_t *q) {
+    atomic_store(&q->stub.next, NULL);
+    atomic_store(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+static void task_queue_push(task_queue_t *q, task_t *task) {
+    atomic_store_explicit(&task->next, NULL, memory_order_relaxed);
+    task_t *prev = atomic_exchange_explicit(&q->head, task, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, task, memory_order_release);
+}
+
+// Returns NULL when empty, or when a producer is midway through a push;
+// that producer wakes the worker again afterwards
+static task_t *task_queue_pop(task_queue_t *q) {
+    task_t *tail = q->tail;
+    task_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+
+    task_queue_push(q, &q->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void run_tasks(worker_t *worker) {
+    task_t *task;
+    while ((task = task_queue_pop(&worker->tasks)) != NULL) {
+        task->fn(worker, task->arg);
+        free(task);
+    }
+}
+
+static void run_deferred(worker_t *worker) {
+    while (worker->deferred) {
+        task_t *task = worker->deferred;
+        worker->deferred = atomic_load_explicit(&task->next, memory_order_relaxed);
+        task->fn(worker, task->arg);
+        free(task);
+    }
+}
+
+static void wakeup_cb(watcher_t *watcher, uint32_t events) {
+    (void)events;
+    worker_t *worker = watcher->worker;
+
+    uint64_t count;
+    if (read(worker->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+
+    // Re-arm before draining so a push racing with us wakes us again
+    atomic_store(&worker->wakeup_pending, 0);
+    run_tasks(worker);
+}
+
+int worker_init(worker_t *worker, int id) {
+    memset(worker, 0, sizeof(*worker));
+    worker->id = id;
+    worker->cpu = -1;
+    task_queue_init(&worker->tasks);
+    wheel_init(&worker->timers, worker_now_ms());
+
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->event_fd < 0) {
+        perror("eventfd");
+        close(worker->epoll_fd);
+        return -1;
+    }
+
+    if (worker_watch(worker, &worker->wakeup, worker->event_fd, EPOLLIN, wakeup_cb) < 0) {
+        close(worker->event_fd);
+        close(worker->epoll_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    worker->last_tick = worker_now_ms();
+
+    while (worker->running) {
+        int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, WORKER_TICK_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            watcher_t *watcher = events[i].data.ptr;
+            // Skip watchers removed by an earlier callback in this batch
+            if (watcher->worker) watcher->cb(watcher, events[i].events);
+        }
+
+        // The loop wakes at least every tick, often enough for the wheel
+        uint64_t now = worker_now_ms();
+        wheel_advance(&worker->timers, now);
+        run_deferred(worker);
+
+        if (worker->tick && now - worker->last_tick >= WORKER_TICK_MS) {
+            worker->last_tick = now;
+            worker->tick(worker);
+        }
+    }
+
+    return NULL;
+}
+
+int worker_start(worker_t *worker, int cpu) {
+    worker->running = 1;
+
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+        perror("pthread_create");
+        worker->running = 0;
+        return -1;
+    }
+    worker->started = 1;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(worker->thread, sizeof(set), &set) == 0) {
+            worker->cpu = cpu;
+        }
+    }
+
+    return 0;
+}
+
+static void stop_task(worker_t *worker, void *arg) {
+    (void)arg;
+    worker->running = 0;
+}
+
+int worker_stop(worker_t *worker) {
+    return worker_post(worker, stop_task, NULL);
+}
+
+void worker_destroy(worker_t *worker) {
+    if (worker->started) {
+        pthread_join(worker->thread, NULL);
+    }
+
+    // Tasks posted after the stop run here, so whatever they carry is
+    // freed; the loop is gone, and they find its objects closed
+    run_tasks(worker);
+    run_deferred(worker);
+
+    close(worker->event_fd);
+    close(worker->epoll_fd);
+}
+
+int worker_watch(worker_t *worker, watcher_t *watcher, int fd, uint32_t events, watcher_cb cb) {
+    watcher->fd = fd;
+    watcher->events = events;
+    watcher->cb = cb;
+    watcher->worker = worker;
+
+    struct epoll_event ev = { .events = events, .data.ptr = watcher };
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl add");
+        return -1;
+    }
+    return 0;
+}
+
+int worker_modify(watcher_t *watcher, uint32_t events) {
+    if (!watcher->worker || watcher->events == events) return 0;
+
+    struct epoll_event ev = { .events = events, .data.ptr = watcher };
+    if (epoll_ctl(watcher->worker->epoll_fd, EPOLL_CTL_MOD, watcher->fd, &ev) < 0) {
+        return -1;
+    }
+    watcher->events = events;
+    return 0;
+}
+
+void worker_unwatch(watcher_t *watcher) {
+    if (!watcher->worker) return;
+    epoll_ctl(watcher->worker->epoll_fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+    watcher->worker = NULL;
+}
+
+int worker_post(worker_t *worker, void (*fn)(worker_t *worker, void *arg), void *arg) {
+    task_t *task = malloc(sizeof(*task));
+    if (!task) return -1;
+    task->fn = fn;
+    task->arg = arg;
+
+    task_queue_push(&worker->tasks, task);
+
+    // One eventfd write per batch of tasks is enough
+    if (!atomic_exchange(&worker->wakeup_pending, 1)) {
+        uint64_t one = 1;
+        if (write(worker->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write");
+        }
+    }
+    return 0;
+}
+
+int worker_defer(worker_t *worker, void (*fn)(worker_t *worker, void *arg), void *arg) {
+    task_t *task = malloc(sizeof(*task));
+    if (!task) return -1;
+    task->fn = fn;
+    task->arg = arg;
+    atomic_store_explicit(&task->next, worker->deferred, memory_order_relaxed);
+    worker->deferred = task;
+    return 0;
+}